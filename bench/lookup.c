@@ -0,0 +1,126 @@
+// Measures throughput of instruction lookups by mnemonic and by opcode. Old linear scans of instruction array are
+// kept here as baseline, so that both are measured on the same machine.
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "assembler.h"
+#include "instruction.h"
+
+#define BENCH_ROUNDS 2000000    // Number of passes over words array.
+
+// Words as they appear at line starts of typical source: mnemonics mixed with labels and data directives.
+static const char* words[] = {
+    "L", "LOOP", "AR", "S", "C", "JP", "ST", "RES", "LA", "DC", "MR", "A", "D", "N", "DR", "J", "JZ", "NOP",
+    "ZERO", "JN", "CR", "SR", "M", "LR", "DS", "ONE", "INTEGER", "END"
+};
+
+#define NUM_WORDS (sizeof(words) / sizeof(words[0]))
+
+static double bench_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// Lookup by mnemonic as assembler did it before, comparing token with every mnemonic.
+static const struct instruction* linear_find(const char* name, uint32_t length)
+{
+    for(int i = 0; i < NUM_INSTRUCTIONS; ++i)
+    {
+        if(strncmp(instructions[i].mnemonic, name, length) == 0 && instructions[i].mnemonic[length] == '\0')
+            return &instructions[i];
+    }
+
+    return NULL;
+}
+
+static const struct instruction* linear_opcode(uint32_t opcode)
+{
+    for(int i = 0; i < NUM_INSTRUCTIONS; ++i)
+    {
+        if(instructions[i].opcode == opcode)
+            return &instructions[i];
+    }
+
+    return NULL;
+}
+
+// Runs lookup over all words BENCH_ROUNDS times and prints millions of lookups per second.
+static void bench_mnemonics(const char* name, const struct instruction* (*find)(const char*, uint32_t))
+{
+    uint32_t lengths[NUM_WORDS];
+    for(size_t i = 0; i < NUM_WORDS; ++i)
+        lengths[i] = strlen(words[i]);
+
+    // Result is accumulated, so that compiler can't drop lookups.
+    volatile uintptr_t sink = 0;
+    double start = bench_time();
+    for(int round = 0; round < BENCH_ROUNDS; ++round)
+    {
+        uintptr_t acc = 0;
+        for(size_t i = 0; i < NUM_WORDS; ++i)
+            acc += (uintptr_t) find(words[i], lengths[i]);
+        sink += acc;
+    }
+    double elapsed = bench_time() - start;
+
+    printf("%-24s %8.1f M lookups/s\n", name, (double) BENCH_ROUNDS * NUM_WORDS / elapsed / 1e6);
+}
+
+static void bench_opcodes(const char* name, const struct instruction* (*find)(uint32_t))
+{
+    volatile uintptr_t sink = 0;
+    double start = bench_time();
+    for(int round = 0; round < BENCH_ROUNDS / 8; ++round)
+    {
+        uintptr_t acc = 0;
+        for(uint32_t opcode = 0; opcode < 256; ++opcode)
+            acc += (uintptr_t) find(opcode);
+        sink += acc;
+    }
+    double elapsed = bench_time() - start;
+
+    printf("%-24s %8.1f M lookups/s\n", name, (double) BENCH_ROUNDS / 8 * 256 / elapsed / 1e6);
+}
+
+int main(void)
+{
+    // Results must agree before speed is worth comparing.
+    for(size_t i = 0; i < NUM_WORDS; ++i)
+    {
+        if(find_inst(words[i], strlen(words[i])) != linear_find(words[i], strlen(words[i])))
+        {
+            fprintf(stderr, "Lookups disagree on %s!\n", words[i]);
+            return 1;
+        }
+    }
+    for(uint32_t opcode = 0; opcode < 256; ++opcode)
+    {
+        if(get_inst_opcode(opcode) != linear_opcode(opcode))
+        {
+            fprintf(stderr, "Lookups disagree on opcode 0x%02x!\n", opcode);
+            return 1;
+        }
+    }
+
+    bench_mnemonics("mnemonic, linear scan", linear_find);
+    bench_mnemonics("mnemonic, hash table", find_inst);
+    bench_opcodes("opcode, linear scan", linear_opcode);
+    bench_opcodes("opcode, direct table", get_inst_opcode);
+
+    return 0;
+}
@@ -2,21 +2,100 @@
 
 #include "common.h"
 #include "instruction.h"
+#include "object.h"
+#include "source_file.h"
+
+// Position in source file, counting from 1.
+struct asm_location
+{
+    uint32_t line;
+    uint32_t column;
+};
 
 // Parses input file and truns code into bytecode to be executed on virtual machine.
+// File is read once from start to end, so it may be a pipe. Filename "-" means standard input.
 int hasm_assemble(const char* filename, struct program* program);
 
+// Same as hasm_assemble, but on failure also stores position of offending token in location, unless it's NULL.
+int hasm_assemble_located(const char* filename, struct program* program, struct asm_location* location);
+
+// Same as hasm_assemble_located, but large files are split into chunks assembled on given number of threads
+// (0 means one per processor). Result is identical to serial assembling.
+int hasm_assemble_threads(const char* filename, struct program* program, struct asm_location* location, uint32_t threads);
+
+// Same as hasm_assemble_threads, but source is already opened file.
+int hasm_assemble_source(const struct source_file* file, struct program* program, struct asm_location* location,
+    uint32_t threads);
+
+// Sets smallest part of file hasm_assemble_source assembles on its own thread, 0 restores the default of 1 MiB. Lets
+// tests split small files into chunks. Mustn't be called while any file is being assembled.
+void hasm_set_min_chunk_size(size_t size);
+
+// Assembles source into object unit, to be linked with other units by object_link. Labels listed by "EXPORT" directive
+// can be used by other units, labels listed by "IMPORT" are defined by one of them. Using label that is neither defined
+// nor imported is an error, just like in hasm_assemble. Object must be freed with object_free.
+int hasm_assemble_object(const struct source_file* file, struct object* object, struct asm_location* location);
+
+// Flags describing what source line holds, kept by incremental assembling.
+#define ASM_LINE_LABEL 1        // Line defines label.
+#define ASM_LINE_REFERENCE 2    // Line holds instruction with label operand.
+#define ASM_LINE_CODE 4         // Line holds instruction (rather than data).
+
+// Label operand of assembled instruction.
+struct asm_reference
+{
+    uint16_t addr;      // Address of instruction.
+    const char* label;  // Name of label, interned in asm_incremental.names.
+};
+
+// State kept between incremental re-assemblies of the same program.
+struct asm_incremental
+{
+    uint8_t* line_flags;            // ASM_LINE_* flags of each source line.
+    uint32_t num_lines;
+    struct asm_reference* refs;     // Label operands in order of address.
+    uint32_t num_refs;
+    struct sym_table* names;        // Only interns label names of refs, addresses in it are meaningless.
+};
+
+// Describes how incremental re-assembly changed program.
+struct asm_change
+{
+    uint16_t first;     // Range of memory [first, end) that was rewritten.
+    uint16_t end;
+    bool layout;        // Code moved, so program's memory was reallocated and symbols and addresses changed.
+};
+
+// Assembles program just like hasm_assemble_source, keeping state needed to re-assemble it incrementally later.
+int hasm_incremental_init(struct asm_incremental* inc, const struct source_file* file, struct program* program,
+    struct asm_location* location);
+
+// Brings program up to date with new version of its source. Only lines between first and last changed line are
+// assembled again. If layout didn't change, program's memory is updated in place, so virtual machine running it only
+// has to decode changed range again, including instructions that start up to 3 bytes before it (as long as program
+// didn't write to its memory). Otherwise the rest of the program is shifted and every label operand patched again,
+// which takes time linear in program size. On failure program and state stay as they were.
+int hasm_incremental_update(struct asm_incremental* inc, const struct source_file* file, struct program* program,
+    struct asm_location* location, struct asm_change* change);
+
+void hasm_incremental_free(struct asm_incremental* inc);
+
 // Puts 32-bit value inside program memory at specfied address.
-void mem_place_value(uint8_t* mem, int16_t addr, uint32_t value);
+void mem_place_value(uint8_t* mem, uint16_t addr, uint32_t value);
+
+// Puts 32-bit value inside program memory count times in a row, starting at specified address.
+void mem_fill_value(uint8_t* mem, uint32_t addr, uint32_t value, uint32_t count);
 
-// Searches instruction array for an instruction of desired mnemonic. Returns NULL if failed.
+// Searches instruction set for an instruction of desired mnemonic. Returns NULL if failed. Takes constant time.
 const struct instruction* get_inst(const char* mnemonic);
 
-// Searches instruction array for an instruction of desired opcode. Returns NULL if failed.
+// Searches instruction set for an instruction of desired opcode. Returns NULL if failed. Takes constant time.
 const struct instruction* get_inst_opcode(uint32_t opcode);
 
 // Following functions handle turning instructions into opcodes (assembling). They return UINT32_MAX on failure.
-uint32_t assemble_nop(const struct instruction* self, const char* args, const struct sym_table* sym_table);
-uint32_t assemble_reg_and_reg(const struct instruction* self, const char* args, const struct sym_table* sym_table);
-uint32_t assemble_mem_and_reg(const struct instruction* self, const char* args, const struct sym_table* sym_table);
-uint32_t assemble_jump(const struct instruction* self, const char* args, const struct sym_table* sym_table);
+// They read operands from lexer. If address operand is a label, its token is stored in label and address field is left 0.
+uint32_t assemble_nop(const struct instruction* self, struct lexer* lexer, struct token* label);
+uint32_t assemble_reg_and_reg(const struct instruction* self, struct lexer* lexer, struct token* label);
+uint32_t assemble_mem_and_reg(const struct instruction* self, struct lexer* lexer, struct token* label);
+uint32_t assemble_imm_and_reg(const struct instruction* self, struct lexer* lexer, struct token* label);
+uint32_t assemble_jump(const struct instruction* self, struct lexer* lexer, struct token* label);
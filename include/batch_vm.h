@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+// Runs many instances (lanes) of one program in lock-step. Every lane has its own registers, flags and memory.
+// Lanes sharing the same address execute each instruction together, using AVX2 where host supports it.
+// Lanes that diverge at conditional jumps are split and execute separately until they meet again.
+// Addresses past the program behave just like in virtual machine: each lane has its own sparse paged memory there,
+// reading as zeros until the lane writes to it. Words overlapping the end of the program or wrapping around the
+// address space are split between both. Lanes only fail where virtual machine would, e.g. when no memory is left.
+struct batch_vm
+{
+    uint32_t lanes;         // Number of program instances.
+    uint32_t padded_lanes;  // Number of lanes rounded up to full vectors. Extra lanes never run.
+    uint32_t mem_sz;        // Size of each lane's memory.
+    uint32_t stride;        // Distance between memories of consecutive lanes.
+    uint8_t* memory;        // Memories of all lanes.
+    int32_t* lane_offsets;  // Offset of each lane's memory within memory.
+    int32_t* regs;          // Registers stored structure-of-arrays, register r of lane l is regs[r * padded_lanes + l].
+    int64_t* flags_result;  // Flags of each lane, see virtual_machine.flags_result.
+    uint32_t* pc;           // Address of next instruction of each lane.
+    int32_t* exit_codes;    // Code each lane exited with (same as vm_run), 0 while lane is running.
+    int32_t* selected;      // -1 for lanes executing current instruction, 0 for others.
+    struct paged_memory** paged;    // Memory past the program of each lane, NULL until lane writes there.
+    bool use_avx2;          // Whether host supports AVX2 and lane offsets fit 32-bit gathers.
+};
+
+// Prepares lanes instances of program. Every lane starts with its own copy of program's memory,
+// program itself isn't modified nor freed.
+int batch_init(struct program program, uint32_t lanes, struct batch_vm* batch);
+
+// Returns memory of given lane, so that its data can be set up before running. Only the program's mem_sz bytes are
+// there, memory past them is in batch->paged.
+uint8_t* batch_lane_memory(struct batch_vm* batch, uint32_t lane);
+
+// Returns value of register of given lane.
+int32_t batch_get_reg(const struct batch_vm* batch, uint32_t lane, uint8_t reg);
+
+// Sets value of register of given lane.
+void batch_set_reg(struct batch_vm* batch, uint32_t lane, uint8_t reg, int32_t value);
+
+// Returns flags of given lane, same values as vm_get_flags.
+int32_t batch_get_flags(const struct batch_vm* batch, uint32_t lane);
+
+// Runs all lanes until each of them exits. Exit codes are stored in batch->exit_codes.
+void batch_run(struct batch_vm* batch);
+
+// Deallocates memory used by batch.
+void batch_finalize(struct batch_vm* batch);
@@ -1,13 +1,26 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "source_code.h"
+#include "sym_table.h"
 
 #define UNUSED(x) (void)(x)
 
-#define NUM_HANDLERS 32
+#define NUM_HANDLERS 64
+
+// Value of flags_result after division by zero. It lies outside of int32_t range, so it's neither zero,
+// positive within int32_t, nor negative.
+#define VM_FLAGS_INVALID ((int64_t) 1 << 32)
+
+// Divides a by non-zero b the way every engine does. INT32_MIN / -1 wraps around to INT32_MIN like any other
+// overflow, instead of trapping on the host.
+static inline int32_t vm_quotient(int32_t a, int32_t b)
+{
+    return b == -1 ? (int32_t) (0u - (uint32_t) a) : a / b;
+}
 
 // Stores information about program to be executed by virtual machine.
 struct program
@@ -16,16 +29,74 @@ struct program
     uint16_t entry_addr;        // Address of first instruction to be executed.
     uint8_t* mem_ptr;           // Pointer to block of mem_sz bytes where program code is stored.
     struct source_code* source; // Program's source code.
+    struct sym_table* symbols;  // Labels defined in program, kept as debug info.
+};
+
+struct virtual_machine;
+
+// Pairs of instructions that virtual machine executes as single superinstruction.
+enum vm_fusion
+{
+    VM_FUSION_NONE,
+    VM_FUSION_C_JZ,
+    VM_FUSION_C_JP,
+    VM_FUSION_C_JN,
+    VM_FUSION_CR_JZ,
+    VM_FUSION_CR_JP,
+    VM_FUSION_CR_JN,
+    VM_FUSION_CI_JZ,
+    VM_FUSION_CI_JP,
+    VM_FUSION_CI_JN,
+    VM_FUSION_L_A,
+    VM_FUSION_L_S,
+    VM_FUSION_L_M,
+    VM_FUSION_LA_L,
+    VM_FUSION_COUNT
+};
+
+// Execution engines available in virtual machine.
+enum vm_engine
+{
+    VM_ENGINE_HANDLERS,     // Calls handler function of every instruction through function pointer.
+    VM_ENGINE_THREADED,     // Jumps directly between inlined instruction bodies (direct-threaded code).
+    VM_ENGINE_JIT,          // Compiles basic blocks into native code.
+};
+
+// Instruction decoded ahead of execution, so that interpreter doesn't need to parse bytecode every cycle.
+struct vm_op
+{
+    bool (*handler)(struct virtual_machine*, const struct vm_op*);  // Handler function performing the instruction.
+    uint8_t opcode;     // Instruction's opcode.
+    uint8_t reg;        // Destination register (first register in register-register instructions).
+    uint8_t addr_reg;   // Address register (second register in register-register instructions).
+    uint8_t fusion;     // Kind of superinstruction formed with the following instruction, VM_FUSION_NONE if there is none.
+    uint16_t addr;      // Address displacement.
+    uint32_t next_pc;   // Address of the instruction that follows this one.
+    int32_t imm;        // Operand of immediate instruction, also of memory instruction whose constant operand was folded.
+    bool (*fused)(struct virtual_machine*, const struct vm_op*);   // Handler performing both fused instructions, NULL if not fused.
+    const void* target; // Address of instruction's body in threaded engine.
 };
 
 // Stores whole state of virtual machine.
 struct virtual_machine
 {
     uint32_t pc;        // Address of next instruction to be executed.
-    int32_t flags;      // State flags register.
+    int64_t flags_result;   // Result of last instruction affecting flags, or VM_FLAGS_INVALID. Use vm_get_flags to read flags.
     int32_t* regs;      // 16 general-purpose registers.
     uint8_t* memory;    // Address of allocated memory for virtual machine.
     uint32_t mem_sz;    // Size of allocated memory.
+    struct paged_memory* paged; // Rest of 32-bit address space, past memory holding program.
+    struct vm_op* ops;  // Decoded instruction starting at each address in memory.
+    enum vm_engine engine;  // Engine used by vm_run and vm_forward.
+    struct jit* jit;    // JIT compiler state, NULL unless VM_ENGINE_JIT is used.
+    uint64_t fusion_counts[VM_FUSION_COUNT];    // Number of times each superinstruction was executed.
+    uint64_t retired;   // Number of cycles executed successfully so far, see VM_VECTOR_CHUNK.
+    size_t mapped_sz;   // Size of snapshot mapping holding memory and ops, 0 if they are allocated with malloc.
+    struct profiler* profiler;  // Profiler counting executed instructions, NULL if profiling is off.
+    uint8_t* verified;  // Verifier's VERIFIER_* flags of each address, NULL if program isn't verified.
+    uint32_t vector_pc;     // Address of vector instruction interrupted after processing vector_done elements.
+    uint32_t vector_done;   // Elements interrupted vector instruction has processed so far, 0 if there is none.
+    int32_t vector_result;  // Result interrupted reduction has accumulated so far.
 
-    bool (*handlers[NUM_HANDLERS])(struct virtual_machine*, uint32_t);    // Array of handler functions for each assembler instruction.
+    bool (*handlers[NUM_HANDLERS])(struct virtual_machine*, const struct vm_op*);  // Array of handler functions for each assembler instruction.
 };
@@ -8,10 +8,12 @@
 
 #define CODE_BLOCK_WIDTH 88
 #define MEM_BLOCK_HEIGHT 31
+#define MEM_VIEW_SZ (27 * 16)   // Number of memory bytes visible at once.
 
 #define DEFAULT_COLOR (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
 #define HIGHLIGHT_COLOR (BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE)
 #define CHANGE_COLOR (FOREGROUND_RED | FOREGROUND_INTENSITY)
+#define OPERAND_COLOR (DEFAULT_COLOR | BACKGROUND_BLUE)     // Arrays next vector instruction works on.
 
 #define ARROW_UP_KEY 72
 #define ARROW_DOWN_KEY 80
@@ -23,7 +25,9 @@ struct display
 {
     void* console_handle;   // Windows (WinAPI) console handle.
     int32_t* vm_regs;       // Copy of previously displayed values in registers.
-    uint8_t* vm_memory;     // Copy of previously displayed values in memory.
+    uint8_t* vm_memory;     // Copy of previously displayed values in visible part of memory.
+    uint32_t vm_memory_addr;    // Address vm_memory was copied from.
+    uint32_t vm_memory_sz;
     uint32_t mem_scroll;
     uint32_t mem_max_scroll;
     uint32_t code_scroll;
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+#include "source_file.h"
+
+// Version of .hbc format. Must be increased whenever layout of file or encoding of instructions changes.
+#define HBC_VERSION 2
+
+// Memory image is stored as chunks, each starting with 32-bit tag. Tag holding HBC_RUN_FLAG is followed by single
+// 32-bit value, repeated as many times as the rest of tag says. Otherwise tag is number of bytes copied as they are.
+#define HBC_RUN_FLAG 0x80000000u
+#define HBC_MIN_RUN 4   // Shortest run of repeated words worth its own chunk.
+
+// Header of .hbc file. It's followed by sections, in order: memory image (image_sz bytes of chunks, mem_sz bytes
+// once decoded), symbols, symbol names, lines, line texts. All numbers are little-endian.
+struct hbc_header
+{
+    char magic[4];          // "HBC" followed by '\0'.
+    uint32_t version;       // HBC_VERSION of program that wrote the file.
+    uint64_t source_hash;   // Hash of source file program was assembled from.
+    uint64_t source_size;   // Size of that source file.
+    uint32_t mem_sz;
+    uint32_t entry_addr;
+    uint32_t num_symbols;
+    uint32_t names_sz;      // Size of symbol names section. Names are terminated with '\0'.
+    uint32_t num_lines;
+    uint32_t image_sz;      // Size of encoded memory image.
+    uint64_t text_sz;       // Size of line texts section. Texts are terminated with '\0'.
+};
+
+struct hbc_symbol
+{
+    uint32_t name;  // Offset of name within symbol names section.
+    uint32_t addr;
+};
+
+struct hbc_line
+{
+    uint32_t text;  // Offset of text within line texts section.
+    uint16_t addr;
+    uint8_t empty;
+    uint8_t reserved;
+};
+
+// Header of .hbo file, holding object unit. It's followed by sections, in order: unit's code (encoded just like memory
+// image of .hbc file), symbols, exports, imports (all three made of hbc_symbol records), relocations (object_reloc
+// records), names of symbols, exports and imports, lines, line texts. Version is shared with .hbc format.
+struct hbo_header
+{
+    char magic[4];          // "HBO" followed by '\0'.
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t source_size;
+    uint32_t mem_sz;
+    uint32_t entry_addr;    // UINT32_MAX if unit has no instructions.
+    uint32_t num_symbols;
+    uint32_t num_exports;
+    uint32_t num_imports;
+    uint32_t num_relocs;
+    uint32_t names_sz;
+    uint32_t num_lines;
+    uint32_t image_sz;
+    uint32_t reserved;
+    uint64_t text_sz;
+};
+
+// Returns hash of source file, used to tell whether cached program is still up to date.
+uint64_t hbc_hash(const struct source_file* source);
+
+// Writes program to .hbc file, recording hash and size of its source. Returns 0 on success.
+int hbc_save(const struct program* program, const struct source_file* source, const char* filename);
+
+// Reads program from .hbc file. Program must be freed just like one returned by hasm_assemble. If source isn't NULL,
+// file must have been written for that source. Returns 0 on success.
+int hbc_load(const char* filename, const struct source_file* source, struct program* program);
+
+// Same as hbc_save, but writes object unit to .hbo file.
+int hbc_save_object(const struct object* object, const struct source_file* source, const char* filename);
+
+// Same as hbc_load, but reads object unit from .hbo file. Object must be freed with object_free.
+int hbc_load_object(const char* filename, const struct source_file* source, struct object* object);
+
+// Loads program assembled from source out of cache directory. Returns 0 on success, nonzero if it isn't cached.
+int hbc_cache_load(const char* cache_dir, const struct source_file* source, struct program* program);
+
+// Stores program assembled from source in cache directory, creating directory if needed. Returns 0 on success.
+int hbc_cache_store(const char* cache_dir, const struct source_file* source, const struct program* program);
+
+// Same as hbc_cache_load, but loads object unit assembled from source.
+int hbc_cache_load_object(const char* cache_dir, const struct source_file* source, struct object* object);
+
+// Same as hbc_cache_store, but stores object unit assembled from source.
+int hbc_cache_store_object(const char* cache_dir, const struct source_file* source, const struct object* object);
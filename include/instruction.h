@@ -1,15 +1,103 @@
 #pragma once
 
 #include "common.h"
-#include "sym_table.h"
+#include "lexer.h"
+
+// Instruction set of virtual machine, the only place where instructions are listed. Every entry is
+// X(name, opcode, width, kind, assemble function) and the list is expanded wherever tables indexed by instruction or
+// opcode are needed: assembler's instruction array, mnemonic and opcode lookup, decoder's widths and kinds and VM's
+// dispatch tables. Kind tells which operand address refers to, see enum instruction_kind.
+// Immediate instructions (AI, SI, ...) keep signed 16-bit value where others keep address displacement.
+// Vector instructions (VA, VS, ...) work on arrays whose length is held in register following the first one (r15 is
+// followed by r0). VA, VS, VM and VC take first array's address from the first register, reductions accumulate there.
+#define INSTRUCTION_SET(X) \
+    X(NOP, 0x00, 4, OTHER,  assemble_nop)           /* Perform no operation. */ \
+    X(A,   0x02, 4, MEMORY, assemble_mem_and_reg)   /* Add value in memory to value in a register. */ \
+    X(AR,  0x03, 2, OTHER,  assemble_reg_and_reg)   /* Add value in a register to value in another one. */ \
+    X(S,   0x04, 4, MEMORY, assemble_mem_and_reg)   /* Substract value in memory from value in a register. */ \
+    X(SR,  0x05, 2, OTHER,  assemble_reg_and_reg)   /* Substract value in a register from value in another one. */ \
+    X(M,   0x06, 4, MEMORY, assemble_mem_and_reg)   /* Multiply value in memory with value in a register. */ \
+    X(MR,  0x07, 2, OTHER,  assemble_reg_and_reg)   /* Multiply value in a register with value in another one. */ \
+    X(D,   0x08, 4, MEMORY, assemble_mem_and_reg)   /* Divide value in a register by value in memory. */ \
+    X(DR,  0x09, 2, OTHER,  assemble_reg_and_reg)   /* Divide value in a register by value in another one. */ \
+    X(C,   0x0a, 4, MEMORY, assemble_mem_and_reg)   /* Compare value in memory to value in a regsiter. */ \
+    X(CR,  0x0b, 2, OTHER,  assemble_reg_and_reg)   /* Compare value in register to value in another one. */ \
+    X(J,   0x0c, 4, JUMP,   assemble_jump)          /* Perform unconditional jump. */ \
+    X(JP,  0x0d, 4, JUMP,   assemble_jump)          /* Perform jump if the result of previous instruction was positive. */ \
+    X(JN,  0x0e, 4, JUMP,   assemble_jump)          /* Perform jump if the result of previous instruction was negative. */ \
+    X(JZ,  0x0f, 4, JUMP,   assemble_jump)          /* Perform jump if the result of previous instruction was zero. */ \
+    X(L,   0x10, 4, MEMORY, assemble_mem_and_reg)   /* Load value in memory into a register. */ \
+    X(LR,  0x11, 2, OTHER,  assemble_reg_and_reg)   /* Load value in a register into another one. */ \
+    X(ST,  0x12, 4, MEMORY, assemble_mem_and_reg)   /* Store in memory value in a register. */ \
+    X(LA,  0x14, 4, OTHER,  assemble_mem_and_reg)   /* Load address in memory into a register. */ \
+    X(AI,  0x16, 4, OTHER,  assemble_imm_and_reg)   /* Add immediate value to value in a register. */ \
+    X(SI,  0x18, 4, OTHER,  assemble_imm_and_reg)   /* Substract immediate value from value in a register. */ \
+    X(MI,  0x1a, 4, OTHER,  assemble_imm_and_reg)   /* Multiply value in a register with immediate value. */ \
+    X(DI,  0x1c, 4, OTHER,  assemble_imm_and_reg)   /* Divide value in a register by immediate value. */ \
+    X(CI,  0x1e, 4, OTHER,  assemble_imm_and_reg)   /* Compare immediate value to value in a register. */ \
+    X(LI,  0x20, 4, OTHER,  assemble_imm_and_reg)   /* Load immediate value into a register. */ \
+    X(VA,  0x22, 4, VECTOR, assemble_mem_and_reg)   /* Add elements of array in memory to elements of another one. */ \
+    X(VS,  0x24, 4, VECTOR, assemble_mem_and_reg)   /* Substract elements of array in memory from elements of another one. */ \
+    X(VM,  0x26, 4, VECTOR, assemble_mem_and_reg)   /* Multiply elements of array with elements of array in memory. */ \
+    X(VC,  0x28, 4, VECTOR, assemble_mem_and_reg)   /* Compare array in memory to another one, element by element. */ \
+    X(VSUM, 0x2a, 4, VECTOR, assemble_mem_and_reg)  /* Add sum of elements of array in memory to a register. */ \
+    X(VMIN, 0x2c, 4, VECTOR, assemble_mem_and_reg)  /* Load into a register minimum of its value and elements of array in memory. */ \
+    X(VMAX, 0x2e, 4, VECTOR, assemble_mem_and_reg)  /* Load into a register maximum of its value and elements of array in memory. */
+
+// Index of each instruction in instructions array, e.g. INST_AR.
+#define INSTRUCTION_INDEX(name, opcode, width, kind, assemble_func) INST_##name,
+enum instruction_index
+{
+    INSTRUCTION_SET(INSTRUCTION_INDEX)
+    NUM_INSTRUCTIONS
+};
+#undef INSTRUCTION_INDEX
+
+// Opcode of each instruction, e.g. OPCODE_AR.
+#define INSTRUCTION_OPCODE_NAME(name, opcode, width, kind, assemble_func) OPCODE_##name = opcode,
+enum instruction_opcode
+{
+    INSTRUCTION_SET(INSTRUCTION_OPCODE_NAME)
+};
+#undef INSTRUCTION_OPCODE_NAME
+
+// What address operand of instruction refers to.
+enum instruction_kind
+{
+    INSTRUCTION_OTHER,      // Nothing in memory: register, immediate value or address that is only loaded.
+    INSTRUCTION_MEMORY,     // Word read or written.
+    INSTRUCTION_JUMP,       // Jump target.
+    INSTRUCTION_VECTOR,     // Array read, and written unless instruction is a reduction.
+};
 
 struct instruction
 {
     const char* mnemonic;   // Instruction's mnemonic, e.g. "A", "AR", "DC".
     const uint32_t opcode;  // Instruction's opcode, eg. 0x02, 0x03.
     const uint8_t width;    // Width of the instruction (2 or 4 bytes).
-    uint32_t (*assemble_func)(const struct instruction*, const char*, const struct sym_table*);
+    const uint8_t kind;     // One of enum instruction_kind.
+    uint32_t (*assemble_func)(const struct instruction*, struct lexer*, struct token*);
 };
 
+// All supported instructions, in order of INSTRUCTION_SET.
+extern const struct instruction instructions[NUM_INSTRUCTIONS];
+
+// Width of instruction of each opcode, 0 for opcodes that aren't part of instruction set.
+extern const uint8_t instruction_widths[256];
+
+// Kind of instruction of each opcode, INSTRUCTION_OTHER for opcodes that aren't part of instruction set.
+extern const uint8_t instruction_kinds[256];
+
+// Returns true if instruction of given opcode reads or writes memory at its address operand, either a word or array.
+static inline bool instruction_accesses_memory(uint8_t opcode)
+{
+    return instruction_kinds[opcode] == INSTRUCTION_MEMORY || instruction_kinds[opcode] == INSTRUCTION_VECTOR;
+}
+
 // Assembles instruction using associated function.
-uint32_t assemble(const struct instruction* inst, const char* args, const struct sym_table* sym_table);
+// Label used as address operand is stored in label, resolving it is left to the caller.
+uint32_t assemble(const struct instruction* inst, struct lexer* lexer, struct token* label);
+
+// Searches instruction set for an instruction of mnemonic given by length characters of name. Returns NULL if failed.
+// Takes constant time, mnemonics are kept in hash table.
+const struct instruction* find_inst(const char* name, uint32_t length);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "common.h"
+
+// JIT compiler translates basic blocks of bytecode into native x86-64 code.
+// Blocks end at jump instructions and are chained directly to each other once their successors are compiled.
+
+// Prepares JIT compiler for virtual machine. Returns NULL if host can't execute generated code.
+struct jit* jit_create(struct virtual_machine* vm);
+
+// Executes at most budget instructions using compiled code. Returns the same codes as vm_forward.
+int jit_run(struct virtual_machine* vm, uint64_t budget);
+
+// Discards all compiled blocks and picks up current address of virtual machine's memory.
+void jit_flush(struct jit* jit);
+
+// Deallocates JIT compiler and its code buffer.
+void jit_free(struct jit* jit);
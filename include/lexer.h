@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum token_type
+{
+    TOKEN_END,      // End of line. Comments, starting with '#', end line as well.
+    TOKEN_WORD,     // Mnemonic, label or keyword, e.g. "LA", "loop", "INTEGER".
+    TOKEN_NUMBER,   // Decimal integer, optionally signed.
+    TOKEN_COMMA,
+    TOKEN_LPAREN,
+    TOKEN_RPAREN,
+    TOKEN_STAR,
+};
+
+// Token is a view into lexer's input, its text isn't terminated with '\0'.
+struct token
+{
+    enum token_type type;
+    const char* text;
+    uint32_t length;
+    uint32_t column;    // Column of token's first character, counting from 1.
+    int64_t value;      // Value of TOKEN_NUMBER. Saturates outside of 48-bit range.
+};
+
+// Lexer splits input into lines and lines into tokens. Lines have no length limit.
+struct lexer
+{
+    const char* pos;        // Next character to be read in current line.
+    const char* end;        // End of whole input.
+    const char* line_start; // Start of current line.
+    const char* line_end;   // End of current line, excluding line break.
+    const char* next_line;  // Start of line that follows current one.
+    uint32_t line;          // Number of current line, counting from 1. 0 before first line is read.
+    uint32_t column;        // Column of token returned most recently.
+};
+
+void lexer_init(struct lexer* lexer, const char* data, size_t size);
+
+// Moves to next line of input. Returns false if there are no more lines.
+bool lexer_next_line(struct lexer* lexer);
+
+// Returns next token in current line. Once line is over, TOKEN_END is returned.
+struct token lexer_next(struct lexer* lexer);
+
+// Checks if token is word of given text.
+bool token_is_word(const struct token* token, const char* word);
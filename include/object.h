@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+
+// Label operand of object unit, whose address field is filled in when unit is linked.
+struct object_reloc
+{
+    uint16_t addr;      // Address of instruction within unit.
+    uint16_t reserved;
+    uint32_t symbol;    // Index of label among unit's symbols, or number of symbols plus index among its imports.
+};
+
+// Separately assembled unit of program. Addresses are relative to start of unit.
+struct object
+{
+    uint16_t mem_sz;            // Size of unit's code.
+    bool code_block;            // Whether unit holds any instruction.
+    uint16_t entry_addr;        // Address of first instruction, if there is any.
+    uint8_t* mem_ptr;           // Unit's code followed by 4 spare bytes. Label operands are left 0.
+    struct sym_table* symbols;  // Labels defined in unit.
+    struct sym_table* exports;  // Labels other units can use, with the same addresses as in symbols.
+    struct sym_table* imports;  // Labels defined by other units. Addresses in it are meaningless.
+    struct object_reloc* relocs;
+    uint32_t num_relocs;
+    struct source_code* source; // Unit's source code.
+};
+
+// Tells which unit and label made linking fail.
+struct link_error
+{
+    uint32_t unit;      // Index of unit.
+    const char* label;  // Name of label, NULL if error isn't about any. Valid as long as units are.
+};
+
+// Links units into program. First unit is always linked, others only if units already linked import any label they
+// export, so that unused units of a library are dropped. Linked units are placed one after another in given order
+// and program starts at first instruction among them. Labels local to units that clash are kept in program's symbols
+// as "label@unit", with units counted from 1. Returns 0 on success, 1 if there are no units, 4 if imported label isn't
+// exported by any unit, 5 if label is exported by more than one unit or 6 if program doesn't fit in memory. On failure
+// error is filled in, unless it's NULL.
+int object_link(const struct object* objects, uint32_t num_objects, struct program* program, struct link_error* error);
+
+// Deallocates everything unit holds.
+void object_free(struct object* object);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define PAGED_PAGE_BITS 12
+#define PAGED_PAGE_SZ (1u << PAGED_PAGE_BITS)
+#define PAGED_TABLE_BITS 10     // Address bits selecting page within its table.
+#define PAGED_TABLE_SZ (1u << PAGED_TABLE_BITS)
+#define PAGED_DIR_SZ (1u << (32 - PAGED_TABLE_BITS - PAGED_PAGE_BITS))
+
+// Sparse 32-bit address space. Two-level table maps every address to its page. Pages and tables are allocated
+// when first written to, so memory use follows pages program actually touched. Memory never written reads as zeros.
+struct paged_memory
+{
+    uint8_t** tables[PAGED_DIR_SZ]; // Page tables, NULL if none of their pages were allocated.
+    uint32_t num_pages;             // Number of pages mapped.
+    const uint8_t* borrowed;        // Pages inside [borrowed, borrowed + borrowed_sz) belong to someone else, e.g.
+    size_t borrowed_sz;             // snapshot mapping, and aren't freed.
+};
+
+// Creates empty address space. Returns NULL if there is no memory left.
+struct paged_memory* paged_memory_create(void);
+
+// Returns page holding given address, or NULL if it isn't allocated.
+static inline uint8_t* paged_memory_page(const struct paged_memory* paged, uint32_t addr)
+{
+    uint8_t** table = paged->tables[addr >> (PAGED_TABLE_BITS + PAGED_PAGE_BITS)];
+    return table != NULL ? table[(addr >> PAGED_PAGE_BITS) & (PAGED_TABLE_SZ - 1)] : NULL;
+}
+
+// Maps given page at address, replacing page that was there. Page isn't copied. Returns false if there is no
+// memory left for page table.
+bool paged_memory_map(struct paged_memory* paged, uint32_t addr, uint8_t* page);
+
+uint8_t paged_memory_read_byte(const struct paged_memory* paged, uint32_t addr);
+
+// Writes byte at given address, allocating its page if needed. Returns false if there is no memory left.
+bool paged_memory_write_byte(struct paged_memory* paged, uint32_t addr, uint8_t value);
+
+// Reads 32-bit value at given address. Value may span two pages, address wraps around at the end of address space.
+uint32_t paged_memory_read(const struct paged_memory* paged, uint32_t addr);
+
+// Writes 32-bit value at given address, allocating pages as needed. Returns false if there is no memory left.
+bool paged_memory_write(struct paged_memory* paged, uint32_t addr, uint32_t value);
+
+// Unmaps all pages, leaving address space empty.
+void paged_memory_clear(struct paged_memory* paged);
+
+void paged_memory_free(struct paged_memory* paged);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Profiler counts how many times each instruction was executed and how often conditional jumps were taken.
+// Virtual machine with profiler attached runs every instruction through plain handlers, regardless of its engine.
+struct profiler
+{
+    uint32_t mem_sz;
+    uint64_t* counts;   // Number of executions of instruction at each address.
+    uint64_t* taken;    // Number of times jump at each address was taken.
+    uint8_t* opcodes;   // Opcode last executed at each address.
+    uint64_t opcode_counts[256];    // Number of executions of each opcode.
+};
+
+// Prepares profiler for virtual machine and attaches it. Returns 0 on success.
+int profiler_init(struct profiler* profiler, struct virtual_machine* vm);
+
+// Executes at most budget instructions, counting them. Returns the same codes as vm_forward.
+int profiler_run(struct profiler* profiler, struct virtual_machine* vm, uint64_t budget);
+
+// Writes report of the hottest labels, source lines and opcodes.
+void profiler_report(const struct profiler* profiler, const struct program* program, FILE* out);
+
+// Writes execution counts in folded stack format ("label;line count") used by flame graph tools.
+void profiler_folded(const struct profiler* profiler, const struct program* program, FILE* out);
+
+// Deallocates profiler's counters.
+void profiler_free(struct profiler* profiler);
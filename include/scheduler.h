@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+
+// Scheduler runs many virtual machines on a pool of worker threads.
+// Each machine runs in slices of fixed instruction budget, so that a program which never ends can't starve others.
+// Machine which used its slice goes to the back of its worker's queue, idle workers steal machines from busy ones.
+
+// Called on worker thread once machine exits, with the same code vm_run would return, or once it reaches its limit,
+// with code 0.
+typedef void (*scheduler_callback)(struct virtual_machine* vm, int exit_code, void* user_data);
+
+// Starts given number of worker threads (0 means one per processor), running machines slice instructions at a time.
+// Returns NULL if threads couldn't be started.
+struct scheduler* scheduler_create(uint32_t workers, int slice);
+
+// Queues machine to be run until it retires max_steps instructions in total or runs for max_time seconds, 0 means
+// no limit. Machine must be initialized and can't be touched until its callback is called. Returns 0 on success.
+int scheduler_submit(struct scheduler* scheduler, struct virtual_machine* vm, uint64_t max_steps, double max_time,
+    scheduler_callback callback, void* user_data);
+
+// Waits until every submitted machine exits.
+void scheduler_wait(struct scheduler* scheduler);
+
+// Returns number of times worker took machine from another worker's queue.
+uint32_t scheduler_stolen(struct scheduler* scheduler);
+
+// Waits for submitted machines, stops worker threads and deallocates scheduler.
+void scheduler_destroy(struct scheduler* scheduler);
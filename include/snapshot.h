@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Snapshot keeps state of virtual machine at some point of execution. Its memory, decoded instructions and pages of
+// paged memory live in shared memory object, which machines created from snapshot map copy-on-write. Forking is
+// therefore cheap no matter how large memory is, and each child only pays for pages it writes to.
+struct snapshot
+{
+    struct virtual_machine vm;  // Copy of machine's state. Pointers to memory, registers, ops, JIT and profiler are not kept.
+    int32_t regs[16];
+    size_t size;        // Size of shared memory object.
+    size_t ops_offset;  // Offset of decoded instructions within shared memory object, memory is at its start.
+    size_t pages_offset;    // Offset of pages of paged memory within shared memory object.
+    uint32_t* page_addrs;   // Address of each page stored in shared memory object.
+    uint32_t num_pages;
+    uint8_t* verified;  // Verifier's flags that decoded instructions were made with, NULL if machine wasn't verified.
+    intptr_t handle;    // File descriptor of shared memory object, or its HANDLE on Windows.
+};
+
+// Takes snapshot of virtual machine's current state. Machine itself isn't changed. Returns 0 on success.
+int snapshot_take(const struct virtual_machine* vm, struct snapshot* snapshot);
+
+// Creates new virtual machine in state stored by snapshot. Machine must be finalized with vm_finalize.
+// Returns 0 on success.
+int snapshot_fork(const struct snapshot* snapshot, struct virtual_machine* vm);
+
+// Brings virtual machine back to state stored by snapshot, discarding all changes it made since then.
+// Machine must have the same memory size as the one snapshot was taken of. Returns 0 on success.
+int snapshot_restore(const struct snapshot* snapshot, struct virtual_machine* vm);
+
+// Unmaps memory of virtual machine created by snapshot_fork or snapshot_restore. Called by vm_finalize.
+void snapshot_release(struct virtual_machine* vm);
+
+// Deallocates snapshot. Machines forked from it remain valid.
+void snapshot_free(struct snapshot* snapshot);
@@ -1,17 +1,54 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-// Source code structure is implemented as a linked list.
+// Single line of source code.
+struct source_line
+{
+    uint32_t text;  // Offset of line's text within source_code.text.
+    uint16_t addr;  // Address of the first byte assembled from the line.
+    bool empty;     // Line holds neither instruction nor data, e.g. it's blank or a comment.
+};
+
+// Source code is stored as array of lines, whose texts are kept one after another in single buffer.
+// Non-empty lines are additionally indexed by address, which never decreases along the file.
 struct source_code
 {
-    bool empty;
-    uint16_t addr;
+    struct source_line* lines;
+    uint32_t num_lines;
+    uint32_t lines_capacity;
     char* text;
-    struct source_code* next;
+    size_t text_sz;
+    size_t text_capacity;
+    uint32_t* code_lines;   // Indices of non-empty lines, sorted by address.
+    uint32_t num_code_lines;
 };
 
-void source_code_push_back(struct source_code** source_code, uint16_t addr, const char* text);
+// Appends line of given length to source code, creating source code if it's NULL. Trailing line break is dropped.
+// Returns false if there is no memory left, source code isn't changed then.
+bool source_code_push_back(struct source_code** source_code, uint16_t addr, const char* text, size_t text_len);
+
+// Appends all lines of other source code, moving their addresses by addr_offset.
+// Creates source code if it's NULL. Returns false if there is no memory left.
+bool source_code_append(struct source_code** source_code, const struct source_code* other, uint16_t addr_offset);
+
+// Same as source_code_append, but only count lines starting at first are appended.
+bool source_code_append_range(struct source_code** source_code, const struct source_code* other, uint32_t first,
+    uint32_t count, uint16_t addr_offset);
+
+// Returns number of lines.
+uint32_t source_code_size(const struct source_code* source_code);
+
+// Returns line of given index, counting from 0. Index must be smaller than source_code_size.
+const struct source_line* source_code_line(const struct source_code* source_code, uint32_t index);
+
+// Returns text of line of given index. Pointer is valid until next line is appended.
+const char* source_code_text(const struct source_code* source_code, uint32_t index);
+
+// Returns index of non-empty line at given address, or UINT32_MAX if there is none.
+// If more lines share the address (e.g. empty data block followed by instruction), the last one is returned.
+uint32_t source_code_find(const struct source_code* source_code, uint16_t addr);
 
 void source_code_free(struct source_code** source_code);
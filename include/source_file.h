@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Contents of input file. Regular files are memory-mapped, other inputs (pipes, terminals) are read into memory.
+struct source_file
+{
+    const char* data;   // Contents of file, not terminated with '\0'. NULL if file is empty.
+    size_t size;
+    bool mapped;        // Whether data is a mapping rather than a block allocated with malloc.
+};
+
+// Opens file and makes its contents available. Filename "-" means standard input. Returns 0 on success.
+int source_file_open(struct source_file* file, const char* filename);
+
+// Releases contents of file.
+void source_file_close(struct source_file* file);
@@ -3,20 +3,64 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-// Symbol table is implemented as singly linked list.
-struct sym_table
+// Single symbol (label) and address it points to.
+struct symbol
 {
-    char* name;
+    const char* name;
+    uint32_t hash;
     uint16_t addr;
-    struct sym_table* next;
+};
+
+// Block of memory holding symbol names. Names never move, so pointers to them stay valid until table is freed.
+struct sym_arena
+{
+    struct sym_arena* next;
+    uint32_t used;
+    uint32_t size;
+    char data[];
+};
+
+// Symbol table is implemented as open addressing hash table over array of symbols kept in order of insertion.
+struct sym_table
+{
+    struct symbol* symbols;     // Symbols in order of insertion.
+    uint32_t count;
+    uint32_t capacity;          // Number of symbols that fit in symbols array.
+    uint32_t* slots;            // Hash table of indices into symbols increased by one, 0 marks empty slot.
+    uint32_t num_slots;         // Always power of two.
+    struct sym_arena* arena;    // Most recent arena block, older ones are linked through next.
 };
 
 // Returns value of symbol in symbol table.
 // If there is no such value, returns UINT16_MAX.
 uint16_t sym_table_get(const struct sym_table* sym_table, const char* name);
 
-// Inserts new value at the end of symbol table.
-void sym_table_push_back(struct sym_table** sym_table, const char* name, uint16_t addr);
+// Same as sym_table_get, but name is given by its length rather than terminated with '\0'.
+uint16_t sym_table_get_n(const struct sym_table* sym_table, const char* name, uint32_t length);
+
+// Returns symbol of given name, or NULL if there is no such symbol. Pointer is valid until next symbol is inserted,
+// but symbol's name stays valid until table is freed.
+const struct symbol* sym_table_find_n(const struct sym_table* sym_table, const char* name, uint32_t length);
+
+// Results of inserting symbol. Table isn't changed unless symbol was added.
+enum sym_result
+{
+    SYM_ADDED,
+    SYM_DUPLICATE,      // Symbol of the same name already exists, or name is NULL.
+    SYM_NO_MEMORY,
+};
+
+// Inserts new symbol, creating symbol table if it's NULL.
+enum sym_result sym_table_push_back(struct sym_table** sym_table, const char* name, uint16_t addr);
+
+// Same as sym_table_push_back, but name is given by its length rather than terminated with '\0'.
+enum sym_result sym_table_push_back_n(struct sym_table** sym_table, const char* name, uint32_t length, uint16_t addr);
+
+// Returns number of symbols in symbol table.
+uint32_t sym_table_size(const struct sym_table* sym_table);
+
+// Returns symbol inserted as index-th one. Index must be smaller than sym_table_size.
+const struct symbol* sym_table_at(const struct sym_table* sym_table, uint32_t index);
 
 // Deallocates whole symbol table.
 void sym_table_free(struct sym_table** sym_table);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "common.h"
+
+// Host kernels performing vector instructions (VA, VS, ...) over arrays of 32-bit elements. Each kernel uses the
+// widest instruction set host supports: AVX2, SSE4.1, or plain C for the rest. Arrays are given as bytes, as they
+// needn't be aligned, and elements wrap around on overflow just like registers do.
+
+// Operation applied to pairs of elements.
+enum vector_op
+{
+    VECTOR_ADD,
+    VECTOR_SUB,
+    VECTOR_MUL,
+    VECTOR_MIN,
+    VECTOR_MAX,
+};
+
+// Performs dest[i] = dest[i] op src[i] for n elements, op being VECTOR_ADD, VECTOR_SUB or VECTOR_MUL.
+// Arrays have to be either the same or not overlap at all.
+void vector_apply(enum vector_op op, uint8_t* dest, const uint8_t* src, uint32_t n);
+
+// Compares n elements of arrays in order. Returns -1 or 1 if first element of a that differs from its counterpart
+// in b is smaller or greater, 0 if arrays are equal.
+int32_t vector_compare(const uint8_t* a, const uint8_t* b, uint32_t n);
+
+// Combines init with n elements of src using op, which is VECTOR_ADD, VECTOR_MIN or VECTOR_MAX.
+int32_t vector_reduce(enum vector_op op, const uint8_t* src, uint32_t n, int32_t init);
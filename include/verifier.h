@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+
+#define VERIFIER_SAFE 0x01  // Instruction's memory operand or jump target provably stays inside program's memory.
+#define VERIFIER_CODE 0x02  // Byte belongs to instruction execution can reach.
+#define VERIFIER_FOLDED 0x04    // Instruction always reads the same constant word at its displacement, see below.
+#define VERIFIER_CONST 0x08     // Byte belongs to constant word some instruction reads.
+
+// Static verifier. Follows every path execution can take through program and tracks values registers may hold,
+// to find instructions whose memory operand or jump target provably stays inside program's memory. Virtual machine
+// runs such instructions without bounds checks, see vm_verify.
+//
+// Proofs hold as long as program doesn't modify its code. Stores that provably don't are marked safe as well,
+// the rest have to be watched by the caller. Program jumping to addresses that can't be narrowed down to few
+// isn't verified at all.
+//
+// Words loads read through address register holding zero, e.g. DC constants referred to by label, are assumed
+// constant unless some store with known address may write them. Such loads are marked folded, their operand can
+// be read once ahead of execution. Writing constant bytes voids proofs just like writing code.
+
+// Verifies program stored in memory, whose execution continues at entry with given 16 registers. Sets VERIFIER_*
+// flags of each address, flags has to hold mem_sz zeroed bytes. Returns 0 on success, 1 if program can't be verified
+// (no flags are set then) and 2 if there is no memory left.
+int verifier_run(const uint8_t* memory, uint32_t mem_sz, uint32_t entry, const int32_t* regs, uint8_t* flags);
@@ -1,10 +1,19 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "common.h"
 
+#define VM_DECODE_PAGE 256  // Number of addresses decoded at once when execution first reaches one of them.
+#define VM_VECTOR_CHUNK 64  // Elements vector instruction processes per cycle, longer arrays take several cycles.
+
 // Initializes virtual machine
 int vm_init(struct program program, struct virtual_machine* vm);
 
+// Initializes virtual machine that executes code using selected engine.
+// Falls back to VM_ENGINE_HANDLERS if compiler doesn't support requested engine.
+int vm_init_engine(struct program program, struct virtual_machine* vm, enum vm_engine engine);
+
 // Starts executing code.
 int vm_run(struct virtual_machine* vm);
 
@@ -17,26 +26,123 @@ int vm_forward(struct virtual_machine* vm, int n);
 // Does some clenup after virtual machine.
 void vm_finalize(struct virtual_machine* vm);
 
+// Decodes instruction starting at given address and stores it in vm->ops.
+void vm_decode(struct virtual_machine* vm, uint32_t addr);
+
+// Decodes again instructions starting at addresses in range [from, to), e.g. after program wrote there.
+// Addresses in pages that haven't been decoded yet are skipped.
+void vm_decode_range(struct virtual_machine* vm, uint32_t from, uint32_t to);
+
+// Decodes whole page of ops holding given address. Execution does it when it reaches op whose handler is NULL.
+void vm_decode_page(struct virtual_machine* vm, uint32_t addr);
+
+// Checks if page of ops holding given address was decoded.
+bool vm_page_decoded(const struct virtual_machine* vm, uint32_t addr);
+
+// Runs static verifier on program, assuming execution continues from current pc and registers. From now on,
+// instructions proven to stay inside program's memory are decoded to handlers without bounds checks, so registers
+// mustn't be changed from outside anymore. Returns result of verifier_run, machine runs unverified unless it's 0.
+int vm_verify(struct virtual_machine* vm);
+
+// Drops verifier's results, e.g. after program modified its code. All instructions are decoded checked again.
+void vm_unverify(struct virtual_machine* vm);
+
+// Reads 32-bit value at given address. Addresses past program's memory are read from paged memory.
+int32_t vm_read_memory(const struct virtual_machine* vm, uint32_t addr);
+
+// Writes 32-bit value at given address, decoding again instructions it overlaps. Addresses past program's memory
+// go to paged memory. Returns false if there is no memory left for new page.
+bool vm_write_memory(struct virtual_machine* vm, uint32_t addr, int32_t value);
+
+// Returns opcode of immediate instruction performing the same operation as memory instruction of given opcode,
+// 0 if it has none. Loads verifier marked VERIFIER_FOLDED run as their immediate form.
+uint8_t vm_immediate_form(uint8_t opcode);
+
+// Finds arrays vector instruction works on. First array starts at address held in instruction's register (reductions
+// don't use it), second one at its memory operand, both have count elements. Returns false if length is negative.
+bool vm_vector_arrays(const struct virtual_machine* vm, const struct vm_op* op, uint32_t* first, uint32_t* second,
+    uint32_t* count);
+
+// Picks elements vector instruction processes in the current cycle, [*begin, *end) of its count elements. Instruction
+// continues where previous cycle left it, unless this is its first cycle.
+void vm_vector_chunk(const struct virtual_machine* vm, const struct vm_op* op, uint32_t count, uint32_t* begin,
+    uint32_t* end);
+
+// Looks for superinstruction formed by instructions at given address and the one following it.
+void vm_fuse(struct virtual_machine* vm, uint32_t addr);
+
+// Prints how many times each superinstruction was executed.
+void vm_fusion_report(const struct virtual_machine* vm, FILE* out);
+
+// Returns value of flags register: 0 - last result was zero, 1 - positive, 2 - negative, 3 - division by zero.
+int32_t vm_get_flags(const struct virtual_machine* vm);
+
+// Sets flags register to one of the values returned by vm_get_flags.
+void vm_set_flags(struct virtual_machine* vm, int32_t flags);
+
 // Helper function that updates flags register after instruction execution.
+// Flags are evaluated lazily, so only the result is recorded here.
 void vm_update_flags(struct virtual_machine* vm, int32_t value);
 
 // Following functions handle performing each instruction.
-bool handle_NOP(struct virtual_machine* vm, uint32_t args);
-bool handle_A(struct virtual_machine* vm, uint32_t args);
-bool handle_AR(struct virtual_machine* vm, uint32_t args);
-bool handle_S(struct virtual_machine* vm, uint32_t args);
-bool handle_SR(struct virtual_machine* vm, uint32_t args);
-bool handle_M(struct virtual_machine* vm, uint32_t args);
-bool handle_MR(struct virtual_machine* vm, uint32_t args);
-bool handle_D(struct virtual_machine* vm, uint32_t args);
-bool handle_DR(struct virtual_machine* vm, uint32_t args);
-bool handle_C(struct virtual_machine* vm, uint32_t args);
-bool handle_CR(struct virtual_machine* vm, uint32_t args);
-bool handle_J(struct virtual_machine* vm, uint32_t args);
-bool handle_JP(struct virtual_machine* vm, uint32_t args);
-bool handle_JN(struct virtual_machine* vm, uint32_t args);
-bool handle_JZ(struct virtual_machine* vm, uint32_t args);
-bool handle_L(struct virtual_machine* vm, uint32_t args);
-bool handle_LR(struct virtual_machine* vm, uint32_t args);
-bool handle_ST(struct virtual_machine* vm, uint32_t args);
-bool handle_LA(struct virtual_machine* vm, uint32_t args);
+bool handle_invalid(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_NOP(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_A(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_AR(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_S(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_SR(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_M(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_MR(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_D(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_DR(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_C(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CR(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_J(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_JP(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_JN(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_JZ(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_L(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_LR(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_ST(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_LA(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_AI(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_SI(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_MI(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_DI(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CI(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_LI(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_VA(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_VS(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_VM(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_VC(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_VSUM(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_VMIN(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_VMAX(struct virtual_machine* vm, const struct vm_op* op);
+
+// Following functions perform instructions proven by verifier to stay inside memory, without bounds checks.
+bool handle_A_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_S_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_M_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_D_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_C_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_J_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_JP_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_JN_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_JZ_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_L_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_ST_unchecked(struct virtual_machine* vm, const struct vm_op* op);
+
+// Following functions handle performing fused pairs of instructions.
+bool handle_C_JZ(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_C_JP(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_C_JN(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CR_JZ(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CR_JP(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CR_JN(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CI_JZ(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CI_JP(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_CI_JN(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_L_A(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_L_S(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_L_M(struct virtual_machine* vm, const struct vm_op* op);
+bool handle_LA_L(struct virtual_machine* vm, const struct vm_op* op);
@@ -1,261 +1,1212 @@
 #include "assembler.h"
 
-#include <limits.h>
-#include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "object.h"
+#include "source_file.h"
 #include "sym_table.h"
 
-#define NUM_INSTRUCTIONS 19
-#define MAX_TOKEN_LENGTH 64
-#define MAX_LINE_LENGTH 256
-
-// List of all supported instructions.
-const struct instruction instructions[NUM_INSTRUCTIONS] = {
-    {"NOP", 0x00, 4, &assemble_nop},                  // Perform no operation.
-    {"A",  0x02, 4, &assemble_mem_and_reg},   // Add value in memory to value in a register.
-    {"AR", 0x03, 2, &assemble_reg_and_reg},   // Add value in a register to value in another one.
-    {"S",  0x04, 4, &assemble_mem_and_reg},   // Substract value in memory from value in a register.
-    {"SR", 0x05, 2, &assemble_reg_and_reg,},   // Substract value in a register from value in another one.
-    {"M",  0x06, 4, &assemble_mem_and_reg,},   // Multiply value in memory with value in a register.
-    {"MR", 0x07, 2, &assemble_reg_and_reg,},   // Multiply value in a register with value in another one.
-    {"D",  0x08, 4, &assemble_mem_and_reg,},   // Divide value in a register by value in memory.
-    {"DR", 0x09, 2, &assemble_reg_and_reg,},   // Divide value in a register by value in another one.
-    {"C",  0x0a, 4, &assemble_mem_and_reg,},   // Compare value in memory to value in a regsiter.
-    {"CR", 0x0b, 2, &assemble_reg_and_reg,},   // Compare value in register to value in another one.
-    {"J",  0x0c, 4, &assemble_jump,},                 // Perform unconditional jump.
-    {"JP", 0x0d, 4, &assemble_jump,},                 // Perform jump if the result of previous instruction was positive.
-    {"JN", 0x0e, 4, &assemble_jump,},                 // Perform jump if the result of previous instruction was negative.
-    {"JZ", 0x0f, 4, &assemble_jump,},                 // Perform jump if the result of previous instruction was zero.
-    {"L",  0x10, 4, &assemble_mem_and_reg,},   // Load value in memory into a register.
-    {"LR", 0x11, 2, &assemble_reg_and_reg,},   // Load value in a register into another one.
-    {"ST", 0x12, 4, &assemble_mem_and_reg,},   // Store in memory value in a register.
-    {"LA", 0x14, 4, &assemble_mem_and_reg,},   // Load address in memory into a register.
+#define ASM_INITIAL_MEMORY 1024   // Initial size of output buffer.
+#define ASM_INITIAL_FIXUPS 64     // Initial capacity of fixup array.
+#define ASM_MIN_CHUNK_SIZE (1 << 20)    // Default smallest part of file assembled on its own thread.
+#define ASM_INITIAL_LINES 1024    // Initial capacity of line flags array.
+#define ASM_INITIAL_DECLARATIONS 16   // Initial capacity of EXPORT and IMPORT declaration array.
+
+// Label operand that wasn't defined yet when its instruction was assembled.
+struct fixup
+{
+    uint16_t addr;          // Address of the instruction, whose address field is to be patched.
+    struct token label;     // Points into source file, which stays open until fixups are patched.
+    uint32_t line;
 };
 
-int hasm_assemble(const char* filename, struct program* program)
+// Label named by EXPORT or IMPORT directive of object unit.
+struct declaration
 {
-    if(filename == NULL || program == NULL)
-        return 1;
+    struct token label;
+    uint32_t line;
+    bool export;            // Declared by EXPORT rather than IMPORT.
+};
 
-    FILE* file = fopen(filename, "r");
-    if(file == NULL)
-        return 2;
+// State of assembling single file, or single chunk of it in parallel mode.
+struct assembler
+{
+    const char* data;       // Source text to be assembled.
+    size_t size;
+    bool relocatable;       // Every label operand becomes a fixup, because chunk doesn't know where it's placed.
+    uint8_t* mem;
+    uint32_t mem_capacity;
+    uint32_t curr_addr;     // Wider than address space, so that overflowing it can be detected.
+    bool code_block;        // Whether any instruction was assembled yet.
+    uint16_t entry_addr;
+    struct fixup* fixups;
+    uint32_t num_fixups;
+    uint32_t fixups_capacity;
+    struct sym_table* sym_table;
+    struct source_code* source_code;
+    struct asm_location location;   // Position of error, if assembling failed.
+    int result;             // Error code of assembling done on worker thread.
+    bool track_lines;       // Whether ASM_LINE_* flags of each line are recorded, as incremental assembling needs.
+    uint8_t* line_flags;
+    uint32_t num_lines;
+    uint32_t line_flags_capacity;
+    bool object;            // Whether EXPORT and IMPORT directives are recorded, as object units need.
+    struct declaration* declarations;
+    uint32_t num_declarations;
+    uint32_t declarations_capacity;
+};
 
-    char line[MAX_LINE_LENGTH];
-    char token[MAX_TOKEN_LENGTH];
-    uint16_t curr_addr = 0;
-    struct sym_table* sym_table = NULL;
-    struct source_code* source_code = NULL;
+// Stores position of error and returns given error code.
+static int asm_error(struct assembler* as, int code, uint32_t line, uint32_t column)
+{
+    as->location.line = line;
+    as->location.column = column;
 
-    // First pass over file collects symbols (labels) and stores addresses they point to.
-    // Also source_code structure is created here.
-    while(fgets(line, MAX_LINE_LENGTH, file))
+    return code;
+}
+
+// Returns error code of symbol that couldn't be added: 5 if label is defined more than once, 6 if there is no memory.
+static int asm_symbol_error(enum sym_result added)
+{
+    return added == SYM_DUPLICATE ? 5 : 6;
+}
+
+// Frees everything assembler allocated.
+static void asm_free(struct assembler* as)
+{
+    free(as->mem);
+    free(as->fixups);
+    free(as->line_flags);
+    free(as->declarations);
+    sym_table_free(&as->sym_table);
+    source_code_free(&as->source_code);
+}
+
+// Makes sure that size bytes past current address fit in output buffer.
+// Buffer is kept 4 bytes longer than program, as 2-byte instructions are written as whole words.
+static bool asm_reserve(struct assembler* as, uint32_t size)
+{
+    uint32_t needed = as->curr_addr + size + 4;
+    if(needed <= as->mem_capacity)
+        return true;
+
+    uint32_t capacity = as->mem_capacity != 0 ? as->mem_capacity : ASM_INITIAL_MEMORY;
+    while(capacity < needed)
+        capacity *= 2;
+
+    uint8_t* mem = realloc(as->mem, capacity);
+    if(mem == NULL)
+        return false;
+
+    memset(mem + as->mem_capacity, 0, capacity - as->mem_capacity);
+    as->mem = mem;
+    as->mem_capacity = capacity;
+
+    return true;
+}
+
+static bool asm_add_fixup(struct assembler* as, const struct token* label, uint32_t line)
+{
+    if(as->num_fixups == as->fixups_capacity)
     {
-        source_code_push_back(&source_code, curr_addr, line);
+        uint32_t capacity = as->fixups_capacity != 0 ? as->fixups_capacity * 2 : ASM_INITIAL_FIXUPS;
+        struct fixup* fixups = realloc(as->fixups, capacity * sizeof(struct fixup));
+        if(fixups == NULL)
+            return false;
 
-        if(line[0] == '\n' || line[0] == '\r' || line[0] == '#')
-            continue;
+        as->fixups = fixups;
+        as->fixups_capacity = capacity;
+    }
 
-        uint32_t offset = 0;
-        int32_t chars_read = 0;
+    struct fixup* fixup = &as->fixups[as->num_fixups++];
+    fixup->addr = as->curr_addr;
+    fixup->label = *label;
+    fixup->line = line;
 
-        if(sscanf(line, "%63s %n", token, &chars_read) == 0)
-        {
-            sym_table_free(&sym_table);
-            return 3;
-        }
-        offset += chars_read;
+    return true;
+}
+
+static bool asm_add_declaration(struct assembler* as, const struct token* label, uint32_t line, bool export)
+{
+    if(as->num_declarations == as->declarations_capacity)
+    {
+        uint32_t capacity = as->declarations_capacity != 0 ? as->declarations_capacity * 2 : ASM_INITIAL_DECLARATIONS;
+        struct declaration* declarations = realloc(as->declarations, capacity * sizeof(struct declaration));
+        if(declarations == NULL)
+            return false;
+
+        as->declarations = declarations;
+        as->declarations_capacity = capacity;
+    }
+
+    struct declaration* declaration = &as->declarations[as->num_declarations++];
+    declaration->label = *label;
+    declaration->line = line;
+    declaration->export = export;
+
+    return true;
+}
+
+// Records flags of line that begins. They are filled in while line is assembled.
+static bool asm_track_line(struct assembler* as)
+{
+    if(as->num_lines == as->line_flags_capacity)
+    {
+        uint32_t capacity = as->line_flags_capacity != 0 ? as->line_flags_capacity * 2 : ASM_INITIAL_LINES;
+        uint8_t* line_flags = realloc(as->line_flags, capacity);
+        if(line_flags == NULL)
+            return false;
+
+        as->line_flags = line_flags;
+        as->line_flags_capacity = capacity;
+    }
+
+    as->line_flags[as->num_lines++] = 0;
+    return true;
+}
+
+// Searches instruction set for an instruction of mnemonic given by token.
+static const struct instruction* asm_find_inst(const struct token* token)
+{
+    if(token->type != TOKEN_WORD)
+        return NULL;
+
+    return find_inst(token->text, token->length);
+}
 
-        const struct instruction* inst = get_inst(token);
-        if(inst != NULL) // If the token is an instruction, it's not a label.
+// Parses arguments of "DS"/"DC", i.e. "INTEGER", "INTEGER(value)", "count*INTEGER" or "count*INTEGER(value)".
+// No arguments at all mean single zero word. Returns false if arguments are malformed.
+static bool asm_parse_data(struct lexer* lexer, uint32_t* count, uint32_t* value)
+{
+    *count = 1;
+    *value = 0;
+
+    struct token token = lexer_next(lexer);
+    if(token.type == TOKEN_END)
+        return true;
+
+    if(token.type == TOKEN_NUMBER)
+    {
+        if(token.value < 0 || token.value > UINT16_MAX)
+            return false;
+        *count = token.value;
+
+        if(lexer_next(lexer).type != TOKEN_STAR)
+            return false;
+        token = lexer_next(lexer);
+    }
+
+    if(!token_is_word(&token, "INTEGER"))
+        return false;
+
+    token = lexer_next(lexer);
+    if(token.type == TOKEN_LPAREN)
+    {
+        token = lexer_next(lexer);
+        if(token.type != TOKEN_NUMBER || token.value < INT32_MIN || token.value > UINT32_MAX)
+            return false;
+        *value = (uint32_t) token.value;
+
+        if(lexer_next(lexer).type != TOKEN_RPAREN)
+            return false;
+        token = lexer_next(lexer);
+    }
+
+    return token.type == TOKEN_END;
+}
+
+// Parses arguments of "EXPORT"/"IMPORT", i.e. comma separated list of labels. Labels are recorded only when
+// assembling object unit, single file program has no other units to share them with. Returns 0 on success.
+static int asm_parse_declaration(struct assembler* as, struct lexer* lexer, bool export)
+{
+    struct token token;
+    do
+    {
+        token = lexer_next(lexer);
+        if(token.type != TOKEN_WORD)
+            return asm_error(as, 3, lexer->line, token.column);
+        if(as->object && !asm_add_declaration(as, &token, lexer->line, export))
+            return asm_error(as, 6, lexer->line, token.column);
+
+        token = lexer_next(lexer);
+    }
+    while(token.type == TOKEN_COMMA);
+
+    if(token.type != TOKEN_END)
+        return asm_error(as, 3, lexer->line, token.column);
+
+    return 0;
+}
+
+// Assembles source text in single pass. Labels used before they are defined get address 0 and are left as fixups.
+// Returns 0 on success or error code, in which case assembler still has to be freed.
+static int asm_run(struct assembler* as)
+{
+    struct lexer lexer;
+    lexer_init(&lexer, as->data, as->size);
+
+    while(lexer_next_line(&lexer))
+    {
+        if(!source_code_push_back(&as->source_code, as->curr_addr, lexer.line_start, lexer.line_end - lexer.line_start)
+            || (as->track_lines && !asm_track_line(as)))
+            return asm_error(as, 6, lexer.line, 1);
+        uint8_t flags = 0;
+
+        struct token token = lexer_next(&lexer);
+        if(token.type == TOKEN_END)     // Empty line or comment.
+            continue;
+
+        if(token_is_word(&token, "EXPORT") || token_is_word(&token, "IMPORT"))
         {
-            curr_addr += inst->width;
+            int result = asm_parse_declaration(as, &lexer, token_is_word(&token, "EXPORT"));
+            if(result != 0)
+                return result;
+            continue;
         }
-        else if(strcmp(token, "DS") == 0 || strcmp(token, "DC") == 0)   // If the token is "DS"/"DC", it's not a label as well.
+
+        const struct instruction* inst = asm_find_inst(&token);
+        bool data = token_is_word(&token, "DS") || token_is_word(&token, "DC");
+
+        if(inst == NULL && !data)   // The token is a label, instruction follows it.
         {
-            uint32_t count = 0;
-            if(sscanf(line + offset, "%u*INTEGER", &count) == 1)
-                curr_addr += count * 4;
-            else
-                curr_addr += 4;
+            if(token.type != TOKEN_WORD)
+                return asm_error(as, 3, lexer.line, token.column);
+
+            enum sym_result added = sym_table_push_back_n(&as->sym_table, token.text, token.length, as->curr_addr);
+            if(added != SYM_ADDED)
+                return asm_error(as, asm_symbol_error(added), lexer.line, token.column);
+            flags |= ASM_LINE_LABEL;
+
+            token = lexer_next(&lexer);
+            if(token.type == TOKEN_END)     // Label must be followed by instruction.
+                return asm_error(as, 3, lexer.line, token.column);
+
+            inst = asm_find_inst(&token);
+            data = token_is_word(&token, "DS") || token_is_word(&token, "DC");
+            if(inst == NULL && !data)   // Unrecognized instruction mnemonic.
+                return asm_error(as, 4, lexer.line, token.column);
         }
-        else    // The token is definitely a label.
+
+        if(inst != NULL)    // Instructions can be assembled using associated assemble function.
         {
-            sym_table_push_back(&sym_table, token, curr_addr);
+            if(as->curr_addr + inst->width > UINT16_MAX)  // Program doesn't fit in address space.
+                return asm_error(as, 6, lexer.line, token.column);
+            if(!asm_reserve(as, inst->width))
+                return asm_error(as, 6, lexer.line, token.column);
 
-            // We saved the label, so we can now read instruction to know if it's 2- or 4-bytes long.
-            if(sscanf(line + offset, "%63s %n", token, &chars_read) == 0)
-            {
-                sym_table_free(&sym_table);
-                return 3;
-            }
-            offset += chars_read;
+            struct token label = {0};
+            uint32_t bytecode = assemble(inst, &lexer, &label);
+            if(bytecode == UINT32_MAX || lexer_next(&lexer).type != TOKEN_END)
+                return asm_error(as, 4, lexer.line, lexer.column);
 
-            // "DS"/"DC" must be handled differently than usual instrucions.
-            if(strcmp(token, "DS") == 0 || strcmp(token, "DC") == 0)
+            if(label.type == TOKEN_WORD)
             {
-                uint32_t count = 0;
-                if(sscanf(line + offset, "%u*INTEGER", &count) == 1)
-                    curr_addr += count * 4;
+                uint16_t addr = as->relocatable ? UINT16_MAX : sym_table_get_n(as->sym_table, label.text, label.length);
+                if(addr != UINT16_MAX)
+                    bytecode |= (uint32_t) addr << 16;
+                else if(!asm_add_fixup(as, &label, lexer.line))
+                    return asm_error(as, 6, lexer.line, label.column);
                 else
-                    curr_addr += 4;
+                    flags |= ASM_LINE_REFERENCE;
             }
-            else
+
+            flags |= ASM_LINE_CODE;
+
+            mem_place_value(as->mem, as->curr_addr, bytecode);
+
+            // First instruction to appear starts code block. This will be entry point in assemled program.
+            if(!as->code_block)
             {
-                const struct instruction* inst = get_inst(token);
-                if(inst == NULL)    // Unrecognized instruction mnemonic.
-                {
-                    sym_table_free(&sym_table);
-                    return 4;
-                }
-
-                curr_addr += inst->width;
+                as->entry_addr = as->curr_addr;
+                as->code_block = true;
             }
+
+            as->curr_addr += inst->width;
+        }
+        else
+        {
+            uint32_t count, value;
+            if(!asm_parse_data(&lexer, &count, &value))
+                return asm_error(as, 4, lexer.line, lexer.column);
+
+            if(count > (UINT16_MAX - as->curr_addr) / 4)
+                return asm_error(as, 6, lexer.line, token.column);
+            if(!asm_reserve(as, count * 4))
+                return asm_error(as, 6, lexer.line, token.column);
+
+            // Reserved memory is already zeroed, so DS and zero DC cost nothing beyond reserving.
+            if(value != 0)
+                mem_fill_value(as->mem, as->curr_addr, value, count);
+
+            as->curr_addr += count * 4;
         }
+
+        if(as->track_lines)
+            as->line_flags[as->num_lines - 1] = flags;
+    }
+
+    return 0;
+}
+
+// Resolves fixups of assembler using given symbol table. Assembled code is placed at base address of mem.
+static int asm_patch(struct assembler* as, const struct sym_table* sym_table, uint8_t* mem, uint32_t base)
+{
+    for(uint32_t i = 0; i < as->num_fixups; ++i)
+    {
+        const struct fixup* fixup = &as->fixups[i];
+        uint16_t addr = sym_table_get_n(sym_table, fixup->label.text, fixup->label.length);
+        if(addr == UINT16_MAX)  // Label is never defined.
+            return asm_error(as, 4, fixup->line, fixup->label.column);
+
+        memcpy(mem + base + fixup->addr + 2, &addr, sizeof(addr));
     }
 
-    // print_sym_table(sym_table);
+    return 0;
+}
+
+static void* asm_thread_main(void* arg)
+{
+    struct assembler* as = arg;
+    as->result = asm_run(as);
+    return NULL;
+}
+
+static size_t asm_min_chunk_size = ASM_MIN_CHUNK_SIZE;   // Smallest part of file assembled on its own thread.
+
+static uint32_t asm_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t) count : 1;
+#endif
+}
+
+static int asm_serial(const struct source_file* file, struct program* program, struct asm_location* location)
+{
+    struct assembler as = {0};
+    as.data = file->data;
+    as.size = file->size;
+
+    int result = asm_run(&as);
+    if(result == 0)     // All labels are known now, so forward references can be resolved.
+        result = asm_patch(&as, as.sym_table, as.mem, 0);
+
+    if(result != 0)
+    {
+        if(location != NULL)
+            *location = as.location;
+        asm_free(&as);
+        return result;
+    }
+
+    free(as.fixups);
+
+    program->mem_sz = as.curr_addr;
+    program->entry_addr = as.entry_addr;
+    program->mem_ptr = as.mem;
+    program->source = as.source_code;
+    program->symbols = as.sym_table;
 
-    rewind(file);
+    return 0;
+}
+
+// Joins chunks assembled in parallel into program. Returns 0 on success.
+static int asm_merge(struct assembler* parts, uint32_t num_parts, struct program* program)
+{
+    // Chunk starts where previous one ends, so addresses are prefix sums of chunk sizes.
+    uint32_t total = 0;
+    for(uint32_t i = 0; i < num_parts; ++i)
+        total += parts[i].curr_addr;
+    if(total > UINT16_MAX)
+        return 6;
+
+    struct sym_table* sym_table = NULL;
+    struct source_code* source_code = NULL;
+    uint8_t* mem = calloc(total + 4, 1);
     bool code_block = false;
     uint16_t entry_addr = 0;
-    uint16_t mem_sz = curr_addr;
-    uint8_t* mem = malloc(mem_sz);
-    curr_addr = 0;
+    int result = mem != NULL ? 0 : 6;
 
-    // Second pass is where proper assembling happens.
-    while(fgets(line, MAX_LINE_LENGTH, file))
+    // Symbols are inserted in file order, so that table looks just like one built by serial pass.
+    uint32_t base = 0;
+    for(uint32_t i = 0; i < num_parts && result == 0; ++i)
     {
-        if(line[0] == '\n' || line[0] == '\r' || line[0] == '#')
-            continue;
+        struct assembler* part = &parts[i];
+        for(uint32_t j = 0; j < sym_table_size(part->sym_table) && result == 0; ++j)
+        {
+            const struct symbol* symbol = sym_table_at(part->sym_table, j);
+            enum sym_result added = sym_table_push_back(&sym_table, symbol->name, base + symbol->addr);
+            if(added != SYM_ADDED)
+                result = asm_symbol_error(added);
+        }
 
-        uint32_t offset = 0;
-        int32_t chars_read = 0;
+        // Next chunk overwrites spare bytes of this one, just like serial pass does.
+        if(part->mem != NULL)
+            memcpy(mem + base, part->mem, part->curr_addr + 4);
 
-        if(sscanf(line, "%63s %n", token, &chars_read) == 0)
+        if(part->code_block && !code_block)
         {
-            sym_table_free(&sym_table);
-            return 3;
+            entry_addr = base + part->entry_addr;
+            code_block = true;
         }
-        offset += chars_read;
 
-        const struct instruction* inst = get_inst(token);
+        if(result == 0 && !source_code_append(&source_code, part->source_code, base))
+            result = 6;
+
+        base += part->curr_addr;
+    }
+
+    base = 0;
+    for(uint32_t i = 0; i < num_parts && result == 0; ++i)
+    {
+        result = asm_patch(&parts[i], sym_table, mem, base);
+        base += parts[i].curr_addr;
+    }
 
-        // If the first token isn't an instruction, nor is it "DS"/"DC", then it's a label. We can skip it now.
-        if(inst == NULL && strcmp(token, "DS") != 0 && strcmp(token, "DC") != 0)
+    if(result != 0)
+    {
+        free(mem);
+        sym_table_free(&sym_table);
+        source_code_free(&source_code);
+        return result;
+    }
+
+    program->mem_sz = total;
+    program->entry_addr = entry_addr;
+    program->mem_ptr = mem;
+    program->source = source_code;
+    program->symbols = sym_table;
+
+    return 0;
+}
+
+// Splits file into chunks at line breaks and assembles them on separate threads. Returns 0 on success.
+static int asm_parallel(const struct source_file* file, struct program* program, uint32_t num_parts)
+{
+    struct assembler* parts = calloc(num_parts, sizeof(struct assembler));
+    pthread_t* threads = calloc(num_parts, sizeof(pthread_t));
+    bool* started = calloc(num_parts, sizeof(bool));
+    if(parts == NULL || threads == NULL || started == NULL)
+    {
+        free(parts);
+        free(threads);
+        free(started);
+        return 6;
+    }
+
+    const char* start = file->data;
+    const char* end = file->data + file->size;
+    for(uint32_t i = 0; i < num_parts; ++i)
+    {
+        const char* split = end;
+        if(i + 1 < num_parts)
         {
-            if(sscanf(line + offset, "%63s %n", token, &chars_read) == 0)
-            {
-                sym_table_free(&sym_table);
-                return 3;
-            }
-            offset += chars_read;
+            split = file->data + file->size / num_parts * (i + 1);
+            if(split < start)
+                split = start;
 
-            inst = get_inst(token);
+            const char* line_break = memchr(split, '\n', end - split);
+            split = line_break != NULL ? line_break + 1 : end;
         }
 
-        if(inst != NULL)    // Instructions can be assembled using associated assemble function.
-        {
-            if(sscanf(line + offset, "%63[^\t\r\n]", token) == 0)
-            {
-                sym_table_free(&sym_table);
-                return 3;
-            }
+        parts[i].data = start;
+        parts[i].size = split - start;
+        parts[i].relocatable = true;
+        start = split;
+    }
 
-            uint32_t bytecode = assemble(inst, token, sym_table);
-            if(bytecode == UINT32_MAX)
-            {
-                sym_table_free(&sym_table);
-                return 4;
-            }
+    // First chunk is assembled on calling thread. Chunks whose thread couldn't be started are done here as well.
+    for(uint32_t i = 1; i < num_parts; ++i)
+        started[i] = pthread_create(&threads[i], NULL, asm_thread_main, &parts[i]) == 0;
 
-            mem_place_value(mem, curr_addr, bytecode);
+    for(uint32_t i = 0; i < num_parts; ++i)
+    {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+        else
+            asm_thread_main(&parts[i]);
+    }
 
-            // First instruction to appear starts code block. This will be entry point in assemled program.
-            if(!code_block)
-            {
-                entry_addr = curr_addr;
-                code_block = true;
-            }
+    int result = 0;
+    for(uint32_t i = 0; i < num_parts && result == 0; ++i)
+        result = parts[i].result;
+
+    if(result == 0)
+        result = asm_merge(parts, num_parts, program);
+
+    for(uint32_t i = 0; i < num_parts; ++i)
+        asm_free(&parts[i]);
+    free(parts);
+    free(threads);
+    free(started);
+
+    return result;
+}
+
+int hasm_assemble(const char* filename, struct program* program)
+{
+    return hasm_assemble_threads(filename, program, NULL, 1);
+}
+
+int hasm_assemble_located(const char* filename, struct program* program, struct asm_location* location)
+{
+    return hasm_assemble_threads(filename, program, location, 1);
+}
+
+int hasm_assemble_threads(const char* filename, struct program* program, struct asm_location* location, uint32_t threads)
+{
+    if(filename == NULL || program == NULL)
+        return 1;
+
+    // "-" stands for standard input, so the assembler can be fed through a pipe.
+    struct source_file file;
+    if(source_file_open(&file, filename) != 0)
+        return 2;
+
+    int result = hasm_assemble_source(&file, program, location, threads);
+    source_file_close(&file);
+
+    return result;
+}
+
+int hasm_assemble_source(const struct source_file* file, struct program* program, struct asm_location* location,
+    uint32_t threads)
+{
+    if(threads == 0)
+        threads = asm_cpu_count();
+
+    // Chunks too small aren't worth a thread.
+    size_t max_parts = file->size / asm_min_chunk_size;
+    if(threads > max_parts)
+        threads = max_parts > 0 ? (uint32_t) max_parts : 1;
+
+    // Any error is reported by serial pass, so that it's always the first one in the file.
+    int result = -1;
+    if(threads > 1)
+        result = asm_parallel(file, program, threads);
+    if(result != 0)
+        result = asm_serial(file, program, location);
+
+    return result;
+}
+
+void hasm_set_min_chunk_size(size_t size)
+{
+    asm_min_chunk_size = size > 0 ? size : ASM_MIN_CHUNK_SIZE;
+}
+
+// Fills in exports and imports of object unit from its EXPORT and IMPORT directives. Returns 0 on success.
+static int asm_declare(struct assembler* as, struct object* object)
+{
+    for(uint32_t i = 0; i < as->num_declarations; ++i)
+    {
+        const struct declaration* declaration = &as->declarations[i];
+        const struct token* label = &declaration->label;
+        const struct symbol* symbol = sym_table_find_n(as->sym_table, label->text, label->length);
+        struct sym_table** table = declaration->export ? &object->exports : &object->imports;
+
+        if(declaration->export && symbol == NULL)   // Exported label is never defined.
+            return asm_error(as, 4, declaration->line, label->column);
+        if(!declaration->export && symbol != NULL)  // Imported label is defined in unit as well.
+            return asm_error(as, 5, declaration->line, label->column);
 
-            curr_addr += inst->width;
+        // Label may be declared more than once.
+        if(sym_table_find_n(*table, label->text, label->length) != NULL)
+            continue;
+        if(sym_table_push_back_n(table, label->text, label->length, symbol != NULL ? symbol->addr : 0) != SYM_ADDED)
+            return asm_error(as, 6, declaration->line, label->column);
+    }
+
+    return 0;
+}
+
+// Turns fixups of object unit into relocations, which refer to labels by index. Returns 0 on success.
+static int asm_relocate(struct assembler* as, struct object* object)
+{
+    if(as->num_fixups == 0)
+        return 0;
+
+    object->relocs = malloc(as->num_fixups * sizeof(struct object_reloc));
+    if(object->relocs == NULL)
+        return asm_error(as, 6, 0, 0);
+
+    uint32_t num_symbols = sym_table_size(as->sym_table);
+    for(uint32_t i = 0; i < as->num_fixups; ++i)
+    {
+        const struct fixup* fixup = &as->fixups[i];
+        const struct symbol* symbol = sym_table_find_n(as->sym_table, fixup->label.text, fixup->label.length);
+        uint32_t index;
+        if(symbol != NULL)
+            index = symbol - as->sym_table->symbols;
+        else
+        {
+            symbol = sym_table_find_n(object->imports, fixup->label.text, fixup->label.length);
+            if(symbol == NULL)  // Label is neither defined nor imported.
+                return asm_error(as, 4, fixup->line, fixup->label.column);
+            index = num_symbols + (symbol - object->imports->symbols);
         }
-        else if(strcmp(token, "DS") == 0 || strcmp(token, "DC") == 0)
+
+        object->relocs[object->num_relocs++] = (struct object_reloc) {fixup->addr, 0, index};
+    }
+
+    return 0;
+}
+
+int hasm_assemble_object(const struct source_file* file, struct object* object, struct asm_location* location)
+{
+    // Unit doesn't know where it will be placed, so every label operand is left to linker.
+    struct assembler as = {0};
+    as.data = file->data;
+    as.size = file->size;
+    as.relocatable = true;
+    as.object = true;
+
+    struct object result_object = {0};
+    int result = asm_run(&as);
+    if(result == 0)
+        result = asm_declare(&as, &result_object);
+    if(result == 0)
+        result = asm_relocate(&as, &result_object);
+
+    if(result != 0)
+    {
+        if(location != NULL)
+            *location = as.location;
+        asm_free(&as);
+        object_free(&result_object);
+        return result;
+    }
+
+    free(as.fixups);
+    free(as.declarations);
+
+    result_object.mem_sz = as.curr_addr;
+    result_object.code_block = as.code_block;
+    result_object.entry_addr = as.entry_addr;
+    result_object.mem_ptr = as.mem;
+    result_object.symbols = as.sym_table;
+    result_object.source = as.source_code;
+    *object = result_object;
+
+    return 0;
+}
+
+// Returns copy of label name interned in state, or NULL if there is no memory left.
+static const char* asm_intern(struct asm_incremental* inc, const char* name, uint32_t length)
+{
+    const struct symbol* symbol = sym_table_find_n(inc->names, name, length);
+    if(symbol == NULL)
+    {
+        if(sym_table_push_back_n(&inc->names, name, length, 0) != SYM_ADDED)
+            return NULL;
+        symbol = sym_table_find_n(inc->names, name, length);
+    }
+
+    return symbol->name;
+}
+
+// Returns address of first instruction, which is program's entry point.
+static uint16_t asm_entry_addr(const uint8_t* line_flags, uint32_t num_lines, const struct source_code* source_code)
+{
+    for(uint32_t i = 0; i < num_lines; ++i)
+    {
+        if(line_flags[i] & ASM_LINE_CODE)
+            return source_code_line(source_code, i)->addr;
+    }
+
+    return 0;
+}
+
+// Checks if line of old source has the same text as new line, whose line break is already cut off.
+static bool asm_line_equal(const struct source_code* source_code, uint32_t index, const char* start, const char* end)
+{
+    // Source code drops all trailing line break characters.
+    while(end > start && (end[-1] == '\r' || end[-1] == '\n'))
+        --end;
+
+    const struct source_line* line = source_code_line(source_code, index);
+    size_t text_end = index + 1 < source_code->num_lines ? source_code->lines[index + 1].text : source_code->text_sz;
+    size_t length = text_end - line->text - 1;
+
+    return length == (size_t) (end - start) && memcmp(source_code->text + line->text, start, length) == 0;
+}
+
+int hasm_incremental_init(struct asm_incremental* inc, const struct source_file* file, struct program* program,
+    struct asm_location* location)
+{
+    *inc = (struct asm_incremental) {0};
+
+    // All label operands are kept as fixups, so that they can be patched again once labels move.
+    struct assembler as = {0};
+    as.data = file->data;
+    as.size = file->size;
+    as.relocatable = true;
+    as.track_lines = true;
+
+    int result = asm_run(&as);
+    if(result == 0)
+        result = asm_patch(&as, as.sym_table, as.mem, 0);
+    if(result == 0 && source_code_size(as.source_code) != as.num_lines)
+        result = asm_error(&as, 6, 0, 0);
+
+    if(result == 0 && as.num_fixups != 0)
+    {
+        inc->refs = malloc(as.num_fixups * sizeof(struct asm_reference));
+        for(uint32_t i = 0; i < as.num_fixups && inc->refs != NULL; ++i)
         {
-            uint32_t count = 0, value = 0;
-            if(sscanf(line + offset, "%u*INTEGER(%u)", &count, &value) == 2)
-            {
-                for(uint32_t i = 0; i < count; ++i)
-                    mem_place_value(mem, curr_addr + i * 4, value);
+            const struct fixup* fixup = &as.fixups[i];
+            inc->refs[i] = (struct asm_reference) {fixup->addr, asm_intern(inc, fixup->label.text, fixup->label.length)};
+            if(inc->refs[i].label == NULL)
+                break;
+            inc->num_refs = i + 1;
+        }
 
-                curr_addr += count * 4;
-            }
-            else if(sscanf(line + offset, "%u*INTEGER", &count) == 1)
-            {
-                for(uint32_t i = 0; i < count; ++i)
-                    mem_place_value(mem, curr_addr + i * 4, 0);
+        if(inc->num_refs != as.num_fixups)
+            result = asm_error(&as, 6, 0, 0);
+    }
 
-                curr_addr += count * 4;
-            }
-            else if(sscanf(line + offset, "INTEGER(%u)", &value) == 1)
-            {
-                mem_place_value(mem, curr_addr, value);
-                curr_addr += 4;
-            }
+    if(result != 0)
+    {
+        if(location != NULL)
+            *location = as.location;
+        asm_free(&as);
+        hasm_incremental_free(inc);
+        return result;
+    }
+
+    inc->line_flags = as.line_flags;
+    inc->num_lines = as.num_lines;
+    free(as.fixups);
+
+    program->mem_sz = as.curr_addr;
+    program->entry_addr = as.entry_addr;
+    program->mem_ptr = as.mem;
+    program->source = as.source_code;
+    program->symbols = as.sym_table;
+
+    return 0;
+}
+
+// Edit found by comparing old and new source line by line. Lines [first, old_end) of old source were replaced by
+// lines [first, new_end) of new source, which were assembled into chunk.
+struct asm_edit
+{
+    uint32_t first;
+    uint32_t old_end;
+    uint32_t new_end;
+    uint16_t addr;          // Address where replaced lines start.
+    uint16_t old_size;      // Size of code assembled from replaced lines.
+    uint32_t first_symbol;  // Index of first symbol defined by replaced lines.
+    uint32_t num_symbols;   // Number of symbols defined by replaced lines.
+    uint32_t first_ref;     // Index of first label operand in replaced lines.
+    uint32_t num_refs;      // Number of label operands in replaced lines.
+    struct assembler chunk;
+};
+
+// Builds line flags, references and line table of program after edit, moving code that follows edit by delta.
+// State and program aren't changed. Returns false if there is no memory left.
+static bool asm_splice(struct asm_incremental* inc, const struct program* program, const struct asm_edit* edit,
+    uint16_t delta, struct asm_incremental* next, struct source_code** next_source)
+{
+    const struct assembler* chunk = &edit->chunk;
+    uint32_t tail_lines = inc->num_lines - edit->old_end;
+    uint32_t tail_refs = inc->num_refs - edit->first_ref - edit->num_refs;
+
+    next->num_lines = edit->first + chunk->num_lines + tail_lines;
+    next->num_refs = edit->first_ref + chunk->num_fixups + tail_refs;
+    next->line_flags = malloc(next->num_lines + 1);
+    next->refs = malloc((next->num_refs + 1) * sizeof(struct asm_reference));
+    next->names = NULL;
+    *next_source = NULL;
+    if(next->line_flags == NULL || next->refs == NULL)
+        return false;
+
+    // Arrays may be NULL when they are empty, which memcpy doesn't allow.
+    if(edit->first != 0)
+        memcpy(next->line_flags, inc->line_flags, edit->first);
+    if(chunk->num_lines != 0)
+        memcpy(next->line_flags + edit->first, chunk->line_flags, chunk->num_lines);
+    if(tail_lines != 0)
+        memcpy(next->line_flags + edit->first + chunk->num_lines, inc->line_flags + edit->old_end, tail_lines);
+
+    if(edit->first_ref != 0)
+        memcpy(next->refs, inc->refs, edit->first_ref * sizeof(struct asm_reference));
+    struct asm_reference* refs = next->refs + edit->first_ref;
+    for(uint32_t i = 0; i < chunk->num_fixups; ++i)
+    {
+        const struct fixup* fixup = &chunk->fixups[i];
+        refs[i].addr = edit->addr + fixup->addr;
+        refs[i].label = asm_intern(inc, fixup->label.text, fixup->label.length);
+        if(refs[i].label == NULL)
+            return false;
+    }
+
+    refs += chunk->num_fixups;
+    for(uint32_t i = 0; i < tail_refs; ++i)
+    {
+        refs[i] = inc->refs[edit->first_ref + edit->num_refs + i];
+        refs[i].addr += delta;
+    }
+
+    return source_code_append_range(next_source, program->source, 0, edit->first, 0)
+        && source_code_append(next_source, chunk->source_code, edit->addr)
+        && source_code_append_range(next_source, program->source, edit->old_end, tail_lines, delta);
+}
+
+// Replaces state and line table with ones built by asm_splice.
+static void asm_commit(struct asm_incremental* inc, struct program* program, struct asm_incremental* next,
+    struct source_code* next_source)
+{
+    free(inc->line_flags);
+    free(inc->refs);
+    inc->line_flags = next->line_flags;
+    inc->num_lines = next->num_lines;
+    inc->refs = next->refs;
+    inc->num_refs = next->num_refs;
+
+    source_code_free(&program->source);
+    program->source = next_source;
+    program->entry_addr = asm_entry_addr(inc->line_flags, inc->num_lines, program->source);
+}
+
+// Applies edit which doesn't move any code or label. Memory is rewritten in place. Returns 0 on success.
+static int asm_update_in_place(struct asm_incremental* inc, struct program* program, struct asm_edit* edit,
+    struct asm_change* change)
+{
+    struct assembler* chunk = &edit->chunk;
+    if(asm_patch(chunk, program->symbols, chunk->mem, 0) != 0)
+        return 4;
+
+    struct asm_incremental next;
+    struct source_code* next_source;
+    if(!asm_splice(inc, program, edit, 0, &next, &next_source))
+    {
+        free(next.line_flags);
+        free(next.refs);
+        source_code_free(&next_source);
+        return 6;
+    }
+
+    if(chunk->curr_addr != 0)
+        memcpy(program->mem_ptr + edit->addr, chunk->mem, chunk->curr_addr);
+    asm_commit(inc, program, &next, next_source);
+
+    change->first = edit->addr;
+    change->end = edit->addr + chunk->curr_addr;
+    change->layout = false;
+
+    return 0;
+}
+
+// Applies edit which moves code following it. Program gets new memory and symbol table. Returns 0 on success.
+// Unlike edits that keep layout, this takes time linear in size of the whole program rather than of the edit: symbol
+// table is rebuilt, code following the edit is copied and every label operand is patched again. Keeping referrers of
+// each label wouldn't help much, as the tail has to be copied and symbols after the edit moved anyway.
+static int asm_update_layout(struct asm_incremental* inc, struct program* program, struct asm_edit* edit,
+    struct asm_change* change)
+{
+    const struct assembler* chunk = &edit->chunk;
+    uint32_t new_sz = program->mem_sz - edit->old_size + chunk->curr_addr;
+    if(new_sz > UINT16_MAX)
+        return 6;
+
+    uint16_t delta = chunk->curr_addr - edit->old_size;     // Wraps around when code shrinks.
+    uint32_t tail_addr = edit->addr + edit->old_size;
+    int result = 0;
+
+    // Symbols stay in file order, symbols defined after edit move by delta.
+    struct sym_table* sym_table = NULL;
+    for(uint32_t i = 0; i < edit->first_symbol && result == 0; ++i)
+    {
+        const struct symbol* symbol = sym_table_at(program->symbols, i);
+        enum sym_result added = sym_table_push_back(&sym_table, symbol->name, symbol->addr);
+        if(added != SYM_ADDED)
+            result = asm_symbol_error(added);
+    }
+
+    for(uint32_t i = 0; i < sym_table_size(chunk->sym_table) && result == 0; ++i)
+    {
+        const struct symbol* symbol = sym_table_at(chunk->sym_table, i);
+        enum sym_result added = sym_table_push_back(&sym_table, symbol->name, edit->addr + symbol->addr);
+        if(added != SYM_ADDED)
+            result = asm_symbol_error(added);
+    }
+
+    for(uint32_t i = edit->first_symbol + edit->num_symbols; i < sym_table_size(program->symbols) && result == 0; ++i)
+    {
+        const struct symbol* symbol = sym_table_at(program->symbols, i);
+        enum sym_result added = sym_table_push_back(&sym_table, symbol->name, symbol->addr + delta);
+        if(added != SYM_ADDED)
+            result = asm_symbol_error(added);
+    }
+
+    uint8_t* mem = result == 0 ? calloc(new_sz + 4, 1) : NULL;
+    if(result == 0 && mem == NULL)
+        result = 6;
+
+    struct asm_incremental next = {0};
+    struct source_code* next_source = NULL;
+    if(result == 0 && !asm_splice(inc, program, edit, delta, &next, &next_source))
+        result = 6;
+
+    if(result == 0)
+    {
+        if(edit->addr != 0)
+            memcpy(mem, program->mem_ptr, edit->addr);
+        if(chunk->curr_addr != 0)
+            memcpy(mem + edit->addr, chunk->mem, chunk->curr_addr);
+        if(program->mem_sz > tail_addr)
+            memcpy(mem + edit->addr + chunk->curr_addr, program->mem_ptr + tail_addr, program->mem_sz - tail_addr);
+
+        // Any label could have moved, so every label operand is patched again, not just those after the edit.
+        for(uint32_t i = 0; i < next.num_refs && result == 0; ++i)
+        {
+            uint16_t addr = sym_table_get(sym_table, next.refs[i].label);
+            if(addr == UINT16_MAX)
+                result = 4;
             else
+                memcpy(mem + next.refs[i].addr + 2, &addr, sizeof(addr));
+        }
+    }
+
+    if(result != 0)
+    {
+        free(mem);
+        sym_table_free(&sym_table);
+        free(next.line_flags);
+        free(next.refs);
+        source_code_free(&next_source);
+        return result;
+    }
+
+    free(program->mem_ptr);
+    sym_table_free(&program->symbols);
+    program->mem_ptr = mem;
+    program->mem_sz = new_sz;
+    program->symbols = sym_table;
+    asm_commit(inc, program, &next, next_source);
+
+    change->first = edit->addr;
+    change->end = new_sz;
+    change->layout = true;
+
+    return 0;
+}
+
+// Assembles new source from scratch, replacing program and state only if it succeeds.
+static int asm_update_full(struct asm_incremental* inc, const struct source_file* file, struct program* program,
+    struct asm_location* location, struct asm_change* change)
+{
+    struct asm_incremental next;
+    struct program next_program;
+    int result = hasm_incremental_init(&next, file, &next_program, location);
+    if(result != 0)
+        return result;
+
+    hasm_incremental_free(inc);
+    free(program->mem_ptr);
+    sym_table_free(&program->symbols);
+    source_code_free(&program->source);
+
+    *inc = next;
+    *program = next_program;
+
+    change->first = 0;
+    change->end = program->mem_sz;
+    change->layout = true;
+
+    return 0;
+}
+
+int hasm_incremental_update(struct asm_incremental* inc, const struct source_file* file, struct program* program,
+    struct asm_location* location, struct asm_change* change)
+{
+    // Split new source into lines, just like lexer does.
+    struct lexer lexer;
+    lexer_init(&lexer, file->data, file->size);
+
+    uint32_t num_lines = 0, lines_capacity = 0;
+    const char** lines = NULL;     // Start and end of each line.
+    while(lexer_next_line(&lexer))
+    {
+        if(num_lines == lines_capacity)
+        {
+            lines_capacity = lines_capacity != 0 ? lines_capacity * 2 : ASM_INITIAL_LINES;
+            const char** new_lines = realloc(lines, 2 * lines_capacity * sizeof(const char*));
+            if(new_lines == NULL)
             {
-                mem_place_value(mem, curr_addr, 0);
-                curr_addr += 4;
+                free(lines);
+                return asm_update_full(inc, file, program, location, change);
             }
+            lines = new_lines;
         }
+
+        lines[2 * num_lines] = lexer.line_start;
+        lines[2 * num_lines + 1] = lexer.line_end;
+        num_lines += 1;
     }
 
-    program->mem_sz = mem_sz;
-    program->entry_addr = entry_addr;
-    program->mem_ptr = mem;
-    program->source = source_code;
+    // Edited lines are those between common prefix and common suffix of both versions.
+    struct asm_edit edit = {0};
+    uint32_t old_lines = inc->num_lines;
+    while(edit.first < old_lines && edit.first < num_lines
+        && asm_line_equal(program->source, edit.first, lines[2 * edit.first], lines[2 * edit.first + 1]))
+        edit.first += 1;
+
+    uint32_t suffix = 0;
+    while(suffix < old_lines - edit.first && suffix < num_lines - edit.first
+        && asm_line_equal(program->source, old_lines - 1 - suffix, lines[2 * (num_lines - 1 - suffix)],
+            lines[2 * (num_lines - 1 - suffix) + 1]))
+        suffix += 1;
+
+    edit.old_end = old_lines - suffix;
+    edit.new_end = num_lines - suffix;
+
+    const char* chunk_start = edit.first < num_lines ? lines[2 * edit.first] : file->data + file->size;
+    const char* chunk_end = edit.new_end < num_lines ? lines[2 * edit.new_end] : file->data + file->size;
+    free(lines);
+
+    if(edit.first == old_lines && edit.first == num_lines)  // Nothing changed.
+    {
+        *change = (struct asm_change) {0, 0, false};
+        return 0;
+    }
+
+    const struct source_code* source_code = program->source;
+    edit.addr = edit.first < old_lines ? source_code_line(source_code, edit.first)->addr : program->mem_sz;
+    uint16_t end_addr = edit.old_end < old_lines ? source_code_line(source_code, edit.old_end)->addr : program->mem_sz;
+    edit.old_size = end_addr - edit.addr;
+
+    for(uint32_t i = 0; i < edit.old_end; ++i)
+    {
+        uint32_t* symbols = i < edit.first ? &edit.first_symbol : &edit.num_symbols;
+        uint32_t* refs = i < edit.first ? &edit.first_ref : &edit.num_refs;
+        *symbols += (inc->line_flags[i] & ASM_LINE_LABEL) != 0;
+        *refs += (inc->line_flags[i] & ASM_LINE_REFERENCE) != 0;
+    }
+
+    // Edited lines are assembled on their own, like chunk in parallel mode.
+    struct assembler* chunk = &edit.chunk;
+    chunk->data = chunk_start;
+    chunk->size = chunk_end - chunk_start;
+    chunk->relocatable = true;
+    chunk->track_lines = true;
+
+    int result = asm_run(chunk);
+    if(result == 0 && (chunk->num_lines != edit.new_end - edit.first
+        || source_code_size(chunk->source_code) != chunk->num_lines))
+        result = 6;
+
+    // Layout stays the same if edited lines take the same space and define the same labels at the same places.
+    bool same_layout = result == 0 && chunk->curr_addr == edit.old_size
+        && sym_table_size(chunk->sym_table) == edit.num_symbols;
+    for(uint32_t i = 0; i < edit.num_symbols && same_layout; ++i)
+    {
+        const struct symbol* symbol = sym_table_at(chunk->sym_table, i);
+        const struct symbol* old_symbol = sym_table_at(program->symbols, edit.first_symbol + i);
+        same_layout = strcmp(symbol->name, old_symbol->name) == 0 && edit.addr + symbol->addr == old_symbol->addr;
+    }
+
+    if(result == 0)
+    {
+        if(same_layout)
+            result = asm_update_in_place(inc, program, &edit, change);
+        else
+            result = asm_update_layout(inc, program, &edit, change);
+    }
+
+    asm_free(chunk);
+
+    // Errors are left to full assembling, so that they are reported exactly as hasm_assemble would report them.
+    if(result != 0)
+        return asm_update_full(inc, file, program, location, change);
 
-    sym_table_free(&sym_table);
     return 0;
 }
 
-void mem_place_value(uint8_t* mem, int16_t addr, uint32_t value)
+void hasm_incremental_free(struct asm_incremental* inc)
+{
+    free(inc->line_flags);
+    free(inc->refs);
+    sym_table_free(&inc->names);
+
+    inc->line_flags = NULL;
+    inc->num_lines = 0;
+    inc->refs = NULL;
+    inc->num_refs = 0;
+}
+
+void mem_place_value(uint8_t* mem, uint16_t addr, uint32_t value)
 {
-    *((uint32_t*)(mem + addr)) = value;
+    memcpy(mem + addr, &value, sizeof(value));     // Instructions are only 2-byte aligned.
 }
 
-const struct instruction* get_inst(const char* mnemonic)
+void mem_fill_value(uint8_t* mem, uint32_t addr, uint32_t value, uint32_t count)
 {
-    const struct instruction* inst;
-    for(int i = 0; i < NUM_INSTRUCTIONS; ++i)
+    if(count == 0)
+        return;
+
+    uint32_t size = count * 4;
+    if(value == (value & 0xff) * 0x01010101u)  // All bytes alike, e.g. -1.
     {
-        inst = &instructions[i];
-        if(strcmp(mnemonic, inst->mnemonic) == 0)
-            return inst;
+        memset(mem + addr, value & 0xff, size);
+        return;
     }
 
-    return NULL;
+    // Filled part is copied over the rest, doubling each time.
+    memcpy(mem + addr, &value, sizeof(value));
+    for(uint32_t filled = 4; filled < size; filled *= 2)
+        memcpy(mem + addr + filled, mem + addr, filled < size - filled ? filled : size - filled);
 }
 
-const struct instruction* get_inst_opcode(uint32_t opcode)
+// Reads register number, which must be between 0 and 15.
+static bool asm_parse_register(struct lexer* lexer, uint16_t* reg)
 {
-    const struct instruction* inst;
-    for(int i = 0; i < NUM_INSTRUCTIONS; ++i)
+    struct token token = lexer_next(lexer);
+    if(token.type != TOKEN_NUMBER || token.value < 0 || token.value > 15)
+        return false;
+
+    *reg = token.value;
+    return true;
+}
+
+// Reads address operand, which is either "displacement(register)" or a label.
+static bool asm_parse_address(struct lexer* lexer, uint16_t* addr, uint16_t* addr_reg, struct token* label)
+{
+    struct token token = lexer_next(lexer);
+    if(token.type == TOKEN_WORD)
     {
-        inst = &instructions[i];
-        if(inst->opcode == opcode)
-            return inst;
+        *label = token;
+        *addr = 0;      // Filled in by the caller.
+        *addr_reg = 14; // r14 is default address register.
+        return true;
     }
 
-    return NULL;
+    // Negative displacements wrap around, just like addresses computed by virtual machine.
+    if(token.type != TOKEN_NUMBER || token.value < INT16_MIN || token.value > UINT16_MAX)
+        return false;
+    *addr = (uint16_t) token.value;
+
+    return lexer_next(lexer).type == TOKEN_LPAREN && asm_parse_register(lexer, addr_reg)
+        && lexer_next(lexer).type == TOKEN_RPAREN;
 }
 
-uint32_t assemble_nop(const struct instruction* self, const char* args, const struct sym_table* sym_table)
+uint32_t assemble_nop(const struct instruction* self, struct lexer* lexer, struct token* label)
 {
-    UNUSED(args);
-    UNUSED(sym_table);
+    UNUSED(lexer);
+    UNUSED(label);
 
     uint32_t bytecode = 0;
 
@@ -264,14 +1215,15 @@ uint32_t assemble_nop(const struct instruction* self, const char* args, const st
     return bytecode;
 }
 
-uint32_t assemble_reg_and_reg(const struct instruction* self, const char* args, const struct sym_table* sym_table)
+uint32_t assemble_reg_and_reg(const struct instruction* self, struct lexer* lexer, struct token* label)
 {
-    UNUSED(sym_table);
+    UNUSED(label);
 
     uint32_t bytecode = 0;
 
     uint16_t dest_reg, src_reg;
-    if(sscanf(args, "%hu , %hu", &dest_reg, &src_reg) != 2)
+    if(!asm_parse_register(lexer, &dest_reg) || lexer_next(lexer).type != TOKEN_COMMA
+        || !asm_parse_register(lexer, &src_reg))
         return UINT32_MAX;
 
     bytecode |= self->opcode;
@@ -281,26 +1233,14 @@ uint32_t assemble_reg_and_reg(const struct instruction* self, const char* args,
     return bytecode;
 }
 
-uint32_t assemble_mem_and_reg(const struct instruction* self, const char* args, const struct sym_table* sym_table)
+uint32_t assemble_mem_and_reg(const struct instruction* self, struct lexer* lexer, struct token* label)
 {
     uint32_t bytecode = 0;
 
     uint16_t dest_reg, addr_reg, addr;
-    char label[MAX_TOKEN_LENGTH] = {0};
-    if(sscanf(args, "%hu , %hu ( %hu )", &dest_reg, &addr, &addr_reg) != 3)
-    {
-        if(sscanf(args, "%hu , %s", &dest_reg, label) == 2)
-        {
-            addr = sym_table_get(sym_table, label);
-            if(addr == UINT16_MAX)
-                return UINT32_MAX;
-            addr_reg = 14;  // r14 is default address register.
-        }
-        else
-        {
-            return UINT32_MAX;
-        }
-    }
+    if(!asm_parse_register(lexer, &dest_reg) || lexer_next(lexer).type != TOKEN_COMMA
+        || !asm_parse_address(lexer, &addr, &addr_reg, label))
+        return UINT32_MAX;
 
     bytecode |= self->opcode;
     bytecode |= dest_reg << 8;
@@ -310,26 +1250,35 @@ uint32_t assemble_mem_and_reg(const struct instruction* self, const char* args,
     return bytecode;
 }
 
-uint32_t assemble_jump(const struct instruction* self, const char* args, const struct sym_table* sym_table)
+uint32_t assemble_imm_and_reg(const struct instruction* self, struct lexer* lexer, struct token* label)
+{
+    UNUSED(label);
+
+    uint32_t bytecode = 0;
+
+    uint16_t dest_reg;
+    if(!asm_parse_register(lexer, &dest_reg) || lexer_next(lexer).type != TOKEN_COMMA)
+        return UINT32_MAX;
+
+    // Immediate is sign-extended when executed, so it has to fit in signed 16 bits.
+    struct token token = lexer_next(lexer);
+    if(token.type != TOKEN_NUMBER || token.value < INT16_MIN || token.value > INT16_MAX)
+        return UINT32_MAX;
+
+    bytecode |= self->opcode;
+    bytecode |= dest_reg << 8;
+    bytecode |= (uint32_t) (uint16_t) token.value << 16;
+
+    return bytecode;
+}
+
+uint32_t assemble_jump(const struct instruction* self, struct lexer* lexer, struct token* label)
 {
     uint32_t bytecode = 0;
 
     uint16_t addr_reg, addr;
-    char label[MAX_TOKEN_LENGTH] = {0};
-    if(sscanf(args, "%hu ( %hu )", &addr, &addr_reg) != 2)
-    {
-        if(sscanf(args, "%s" , label) == 1)
-        {
-            addr = sym_table_get(sym_table, label);
-            if(addr == UINT16_MAX)
-                return UINT32_MAX;
-            addr_reg = 14;  // r14 is default address register.
-        }
-        else
-        {
-            return UINT32_MAX;
-        }
-    }
+    if(!asm_parse_address(lexer, &addr, &addr_reg, label))
+        return UINT32_MAX;
 
     bytecode |= self->opcode;
     bytecode |= addr_reg << 12;
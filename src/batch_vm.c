@@ -0,0 +1,743 @@
+#include "batch_vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "paged_memory.h"
+#include "vector.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+#define BATCH_VECTOR_LANES 8    // Number of 32-bit lanes in AVX2 register.
+
+// Instruction executed by currently selected lanes.
+struct batch_inst
+{
+    uint8_t opcode;
+    uint8_t reg;
+    uint8_t addr_reg;
+    uint16_t addr;
+    int32_t imm;        // Operand of immediate instruction.
+    uint32_t next_pc;
+    bool valid;
+    bool memory;        // Whether instruction reads or writes memory at its address operand.
+    bool vector;        // Whether instruction works on arrays, see batch_exec_vector.
+};
+
+static bool batch_select(struct batch_vm* batch, uint32_t* pc);
+static void batch_decode(const struct batch_vm* batch, uint32_t lane, uint32_t pc, struct batch_inst* inst);
+static bool batch_vectorizable(const struct batch_vm* batch, const struct batch_inst* inst);
+static void batch_exec_lane(struct batch_vm* batch, const struct batch_inst* inst, uint32_t lane);
+
+#ifdef HAS_AVX2_KERNELS
+static bool batch_select_avx2(struct batch_vm* batch, uint32_t* pc);
+static void batch_exec_avx2(struct batch_vm* batch, const struct batch_inst* inst);
+#endif
+
+int batch_init(struct program program, uint32_t lanes, struct batch_vm* batch)
+{
+    if(program.mem_ptr == NULL || program.mem_sz == 0)
+        return 1;
+
+    if(program.entry_addr >= program.mem_sz)
+        return 2;
+
+    if(lanes == 0)
+        return 3;
+
+    batch->lanes = lanes;
+    batch->padded_lanes = (lanes + BATCH_VECTOR_LANES - 1) / BATCH_VECTOR_LANES * BATCH_VECTOR_LANES;
+    batch->mem_sz = program.mem_sz;
+    batch->stride = (program.mem_sz + 63) & ~63u;   // Keep lanes cache line aligned.
+
+    uint32_t n = batch->padded_lanes;
+    batch->memory = calloc((size_t) n, batch->stride);
+    batch->lane_offsets = malloc(n * sizeof(int32_t));
+    batch->regs = calloc((size_t) 16 * n, sizeof(int32_t));
+    batch->flags_result = calloc(n, sizeof(int64_t));
+    batch->pc = malloc(n * sizeof(uint32_t));
+    batch->exit_codes = malloc(n * sizeof(int32_t));
+    batch->selected = calloc(n, sizeof(int32_t));
+    batch->paged = calloc(n, sizeof(struct paged_memory*));
+
+    if(batch->memory == NULL || batch->lane_offsets == NULL || batch->regs == NULL || batch->flags_result == NULL
+        || batch->pc == NULL || batch->exit_codes == NULL || batch->selected == NULL || batch->paged == NULL)
+    {
+        batch_finalize(batch);
+        return 4;
+    }
+
+    for(uint32_t lane = 0; lane < n; ++lane)
+    {
+        memcpy(batch->memory + (size_t) lane * batch->stride, program.mem_ptr, program.mem_sz);
+        batch->lane_offsets[lane] = (int32_t) ((size_t) lane * batch->stride);
+        batch->pc[lane] = program.entry_addr;
+        batch->exit_codes[lane] = lane < lanes ? 0 : -1;    // Padding lanes are never running.
+    }
+
+    batch->use_avx2 = false;
+#ifdef HAS_AVX2_KERNELS
+    // Gathers address lanes with 32-bit offsets, so whole batch memory must fit in them.
+    if((uint64_t) n * batch->stride + UINT16_MAX < INT32_MAX)
+        batch->use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    return 0;
+}
+
+uint8_t* batch_lane_memory(struct batch_vm* batch, uint32_t lane)
+{
+    return batch->memory + (size_t) lane * batch->stride;
+}
+
+int32_t batch_get_reg(const struct batch_vm* batch, uint32_t lane, uint8_t reg)
+{
+    return batch->regs[reg * batch->padded_lanes + lane];
+}
+
+void batch_set_reg(struct batch_vm* batch, uint32_t lane, uint8_t reg, int32_t value)
+{
+    batch->regs[reg * batch->padded_lanes + lane] = value;
+}
+
+int32_t batch_get_flags(const struct batch_vm* batch, uint32_t lane)
+{
+    int64_t result = batch->flags_result[lane];
+
+    if(result == VM_FLAGS_INVALID)
+        return 3;
+    else if(result == 0)
+        return 0;
+    else if(result > 0)
+        return 1;
+    else
+        return 2;
+}
+
+void batch_run(struct batch_vm* batch)
+{
+    uint32_t pc;
+    struct batch_inst inst;
+
+    for(;;)
+    {
+#ifdef HAS_AVX2_KERNELS
+        bool running = batch->use_avx2 ? batch_select_avx2(batch, &pc) : batch_select(batch, &pc);
+#else
+        bool running = batch_select(batch, &pc);
+#endif
+        if(!running)
+            break;
+
+        uint32_t leader = 0;
+        while(batch->selected[leader] == 0)
+            ++leader;
+
+        batch_decode(batch, leader, pc, &inst);
+
+#ifdef HAS_AVX2_KERNELS
+        if(batch->use_avx2 && batch_vectorizable(batch, &inst))
+        {
+            batch_exec_avx2(batch, &inst);
+            continue;
+        }
+#endif
+
+        for(uint32_t lane = leader; lane < batch->lanes; ++lane)
+        {
+            if(batch->selected[lane] != 0)
+                batch_exec_lane(batch, &inst, lane);
+        }
+    }
+}
+
+void batch_finalize(struct batch_vm* batch)
+{
+    free(batch->memory);
+    free(batch->lane_offsets);
+    free(batch->regs);
+    free(batch->flags_result);
+    free(batch->pc);
+    free(batch->exit_codes);
+    free(batch->selected);
+
+    for(uint32_t lane = 0; batch->paged != NULL && lane < batch->padded_lanes; ++lane)
+        paged_memory_free(batch->paged[lane]);
+    free(batch->paged);
+
+    batch->memory = NULL;
+    batch->lane_offsets = NULL;
+    batch->regs = NULL;
+    batch->flags_result = NULL;
+    batch->pc = NULL;
+    batch->exit_codes = NULL;
+    batch->selected = NULL;
+    batch->paged = NULL;
+}
+
+// Reads 4 bytes at given address of lane's memory the way vm_read_memory does. Addresses past the program lie in
+// lane's paged memory, which reads as zeros until lane writes there.
+static int32_t batch_read_memory(const struct batch_vm* batch, uint32_t lane, uint32_t addr)
+{
+    const uint8_t* memory = batch->memory + (size_t) lane * batch->stride;
+    const struct paged_memory* paged = batch->paged[lane];
+
+    if((uint64_t) addr + 4 <= batch->mem_sz)
+        return *(int32_t*) (memory + addr);
+    if(addr >= batch->mem_sz && addr <= UINT32_MAX - 3)
+        return paged != NULL ? (int32_t) paged_memory_read(paged, addr) : 0;
+
+    // Value overlaps end of program's memory, or wraps around to its start.
+    uint8_t bytes[4];
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        uint32_t byte_addr = addr + i;
+        if(byte_addr < batch->mem_sz)
+            bytes[i] = memory[byte_addr];
+        else
+            bytes[i] = paged != NULL ? paged_memory_read_byte(paged, byte_addr) : 0;
+    }
+
+    int32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Writes 4 bytes at given address of lane's memory the way vm_write_memory does, creating lane's paged memory
+// when it first writes past the program. Returns false if there is no memory left.
+static bool batch_write_memory(struct batch_vm* batch, uint32_t lane, uint32_t addr, int32_t value)
+{
+    uint8_t* memory = batch->memory + (size_t) lane * batch->stride;
+
+    if((uint64_t) addr + 4 <= batch->mem_sz)
+    {
+        *(int32_t*) (memory + addr) = value;
+        return true;
+    }
+
+    if(batch->paged[lane] == NULL && (batch->paged[lane] = paged_memory_create()) == NULL)
+        return false;
+    if(addr >= batch->mem_sz && addr <= UINT32_MAX - 3)
+        return paged_memory_write(batch->paged[lane], addr, value);
+
+    uint8_t bytes[4];
+    memcpy(bytes, &value, sizeof(value));
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        uint32_t byte_addr = addr + i;
+        if(byte_addr < batch->mem_sz)
+            memory[byte_addr] = bytes[i];
+        else if(!paged_memory_write_byte(batch->paged[lane], byte_addr, bytes[i]))
+            return false;
+    }
+
+    return true;
+}
+
+// Reads 4 bytes at pc of given lane the way vm_decode does, bytes past the end of memory are zeros.
+static uint32_t batch_fetch(const struct batch_vm* batch, uint32_t lane, uint32_t pc)
+{
+    const uint8_t* memory = batch->memory + (size_t) lane * batch->stride;
+    uint32_t word = 0;
+
+    for(uint32_t i = 0; i < 4 && pc + i < batch->mem_sz; ++i)
+        word |= (uint32_t) memory[pc + i] << (i * 8);
+
+    return word;
+}
+
+// Selects lanes which execute next instruction. Lanes at the lowest address go first, so that lanes split by a
+// jump wait for each other where their paths meet. Among them only lanes holding the same bytes as the first one
+// are selected, others follow in later steps. Returns false when no lane is running anymore.
+static bool batch_select(struct batch_vm* batch, uint32_t* pc)
+{
+    uint32_t min_pc = UINT32_MAX;
+
+    for(uint32_t lane = 0; lane < batch->lanes; ++lane)
+    {
+        if(batch->exit_codes[lane] != 0)
+            continue;
+
+        if(batch->pc[lane] >= batch->mem_sz)    // Lane ran past its program.
+        {
+            batch->exit_codes[lane] = 1;
+            continue;
+        }
+
+        if(batch->pc[lane] < min_pc)
+            min_pc = batch->pc[lane];
+    }
+
+    if(min_pc == UINT32_MAX)
+        return false;
+
+    uint32_t word = 0;
+    bool found = false;
+
+    for(uint32_t lane = 0; lane < batch->lanes; ++lane)
+    {
+        batch->selected[lane] = 0;
+        if(batch->exit_codes[lane] != 0 || batch->pc[lane] != min_pc)
+            continue;
+
+        uint32_t lane_word = batch_fetch(batch, lane, min_pc);
+        if(!found)
+        {
+            word = lane_word;
+            found = true;
+        }
+
+        if(lane_word == word)
+            batch->selected[lane] = -1;
+    }
+
+    *pc = min_pc;
+    return true;
+}
+
+static void batch_decode(const struct batch_vm* batch, uint32_t lane, uint32_t pc, struct batch_inst* inst)
+{
+    uint32_t word = batch_fetch(batch, lane, pc);
+
+    uint8_t opcode = word & 0xff;
+    bool reg_inst = instruction_widths[opcode] == 2;
+    if(instruction_widths[opcode] == 0)
+        reg_inst = (opcode & 1) != 0;   // Unknown opcodes follow the rule: even ones work with memory, odd ones with 2 registers.
+
+    inst->opcode = opcode;
+    inst->reg = (word >> 8) & 0xf;
+    inst->addr_reg = (word >> 12) & 0xf;
+    inst->addr = reg_inst ? 0 : word >> 16;
+    inst->imm = (int16_t) inst->addr;
+    inst->next_pc = pc + (reg_inst ? 2 : 4);
+    inst->valid = instruction_widths[opcode] != 0;
+    inst->memory = opcode == 0x02 || opcode == 0x04 || opcode == 0x06 || opcode == 0x08 || opcode == 0x0a
+        || opcode == 0x10 || opcode == 0x12;
+    inst->vector = opcode >= 0x22 && opcode <= 0x2e;
+
+    // Same as in virtual machine, displacement past the program makes instruction fail in every lane.
+    if((inst->memory || inst->vector) && inst->addr >= batch->mem_sz)
+        inst->valid = false;
+}
+
+// Tells whether instruction has AVX2 kernel. Division, stores and jumps are executed lane by lane, so are memory
+// instructions of program too small to hold a whole word.
+static bool batch_vectorizable(const struct batch_vm* batch, const struct batch_inst* inst)
+{
+    if(!inst->valid || (inst->memory && batch->mem_sz < 4))
+        return false;
+
+    switch(inst->opcode)
+    {
+        case 0x02: case 0x04: case 0x06: case 0x0a: case 0x10:     // Lanes reaching past the program go one by one.
+        case 0x03: case 0x05: case 0x07: case 0x0b: case 0x11: case 0x14:
+        case 0x16: case 0x18: case 0x1a: case 0x1e: case 0x20:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Executes vector instruction in single lane, mirroring handlers of virtual machine. Arrays inside the program are
+// handed to host kernels, others are processed element by element.
+static void batch_exec_vector(struct batch_vm* batch, const struct batch_inst* inst, uint32_t lane)
+{
+    uint32_t n = batch->padded_lanes;
+    int32_t* reg = &batch->regs[inst->reg * n + lane];
+    int32_t count = batch->regs[((inst->reg + 1) & 0xf) * n + lane];
+    uint32_t first = (uint32_t) *reg;
+    uint32_t second = inst->addr + (uint32_t) batch->regs[inst->addr_reg * n + lane];
+    uint8_t* memory = batch->memory + (size_t) lane * batch->stride;
+
+    if(count < 0)
+    {
+        batch->exit_codes[lane] = 2;
+        return;
+    }
+
+    uint64_t size = (uint64_t) count * 4;
+    bool first_inside = first + size <= batch->mem_sz;
+    bool second_inside = second + size <= batch->mem_sz;
+
+    switch(inst->opcode)
+    {
+        case 0x22:
+        case 0x24:
+        case 0x26:
+        {
+            enum vector_op op = inst->opcode == 0x22 ? VECTOR_ADD : inst->opcode == 0x24 ? VECTOR_SUB : VECTOR_MUL;
+            bool overlap = first != second && first < second + size && second < first + size;
+            if(first_inside && second_inside && !overlap)
+            {
+                vector_apply(op, memory + first, memory + second, count);
+                break;
+            }
+
+            // Arrays partially overlapping or reaching past the program are processed in order, the same way as in
+            // virtual machine.
+            for(uint32_t i = 0; i < (uint32_t) count; ++i)
+            {
+                int32_t a = batch_read_memory(batch, lane, first + 4 * i);
+                int32_t b = batch_read_memory(batch, lane, second + 4 * i);
+                vector_apply(op, (uint8_t*) &a, (const uint8_t*) &b, 1);
+                if(!batch_write_memory(batch, lane, first + 4 * i, a))
+                {
+                    batch->exit_codes[lane] = 2;
+                    return;
+                }
+            }
+            break;
+        }
+
+        case 0x28:
+        {
+            int32_t result = 0;
+            if(first_inside && second_inside)
+                result = vector_compare(memory + first, memory + second, count);
+            else
+            {
+                for(uint32_t i = 0; i < (uint32_t) count && result == 0; ++i)
+                {
+                    int32_t a = batch_read_memory(batch, lane, first + 4 * i);
+                    int32_t b = batch_read_memory(batch, lane, second + 4 * i);
+                    result = vector_compare((const uint8_t*) &a, (const uint8_t*) &b, 1);
+                }
+            }
+
+            batch->flags_result[lane] = result;
+            break;
+        }
+
+        default:
+        {
+            enum vector_op op = inst->opcode == 0x2a ? VECTOR_ADD : inst->opcode == 0x2c ? VECTOR_MIN : VECTOR_MAX;
+            if(second_inside)
+                *reg = vector_reduce(op, memory + second, count, *reg);
+            else
+            {
+                for(uint32_t i = 0; i < (uint32_t) count; ++i)
+                {
+                    int32_t value = batch_read_memory(batch, lane, second + 4 * i);
+                    *reg = vector_reduce(op, (const uint8_t*) &value, 1, *reg);
+                }
+            }
+
+            batch->flags_result[lane] = *reg;
+            break;
+        }
+    }
+}
+
+// Executes instruction in single lane, mirroring handlers of virtual machine.
+static void batch_exec_lane(struct batch_vm* batch, const struct batch_inst* inst, uint32_t lane)
+{
+    uint32_t n = batch->padded_lanes;
+    int32_t* reg = &batch->regs[inst->reg * n + lane];
+    int32_t addr_reg = batch->regs[inst->addr_reg * n + lane];
+    int64_t* flags_result = &batch->flags_result[lane];
+
+    batch->pc[lane] = inst->next_pc;
+
+    if(!inst->valid)
+    {
+        batch->exit_codes[lane] = 2;
+        return;
+    }
+
+    if(inst->vector)
+    {
+        batch_exec_vector(batch, inst, lane);
+        return;
+    }
+
+    int32_t value = addr_reg;   // Register-register instructions use second register as operand.
+    uint32_t ea = inst->addr + (uint32_t) addr_reg;
+
+    if(inst->memory && inst->opcode != 0x12)
+        value = batch_read_memory(batch, lane, ea);
+    else if(inst->opcode >= 0x16)   // Immediate instructions.
+        value = inst->imm;
+
+    switch(inst->opcode)
+    {
+        case 0x00:
+            break;
+
+        case 0x02:
+        case 0x03:
+        case 0x16:
+            *reg += value;
+            *flags_result = *reg;
+            break;
+
+        case 0x04:
+        case 0x05:
+        case 0x18:
+            *reg -= value;
+            *flags_result = *reg;
+            break;
+
+        case 0x06:
+        case 0x07:
+        case 0x1a:
+            *reg *= value;
+            *flags_result = *reg;
+            break;
+
+        case 0x08:
+        case 0x09:
+        case 0x1c:
+            if(value == 0)  // Division by zero is an invalid operation.
+            {
+                *flags_result = VM_FLAGS_INVALID;
+                break;
+            }
+            *reg = vm_quotient(*reg, value);
+            *flags_result = *reg;
+            break;
+
+        case 0x0a:
+        case 0x0b:
+        case 0x1e:
+            *flags_result = (int32_t) (*reg - value);
+            break;
+
+        case 0x0c:
+        case 0x0d:
+        case 0x0e:
+        case 0x0f:
+        {
+            uint16_t target = inst->addr + addr_reg;
+            if(target >= batch->mem_sz)
+            {
+                batch->exit_codes[lane] = 2;
+                return;
+            }
+
+            bool taken = inst->opcode == 0x0c
+                || (inst->opcode == 0x0d && *flags_result > 0 && *flags_result <= INT32_MAX)
+                || (inst->opcode == 0x0e && *flags_result < 0)
+                || (inst->opcode == 0x0f && *flags_result == 0);
+
+            if(taken)
+                batch->pc[lane] = target;
+            break;
+        }
+
+        case 0x10:
+        case 0x11:
+        case 0x20:
+            *reg = value;
+            break;
+
+        case 0x12:
+            if(!batch_write_memory(batch, lane, ea, *reg))
+                batch->exit_codes[lane] = 2;
+            break;
+
+        case 0x14:
+            *reg = inst->addr + addr_reg;
+            break;
+    }
+}
+
+#ifdef HAS_AVX2_KERNELS
+
+// Same as batch_select, comparing 8 lanes at once.
+__attribute__((target("avx2")))
+static bool batch_select_avx2(struct batch_vm* batch, uint32_t* pc)
+{
+    uint32_t n = batch->padded_lanes;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last_addr = _mm256_set1_epi32(batch->mem_sz - 1);
+    __m256i min_pc = _mm256_set1_epi32(-1);
+
+    for(uint32_t lane = 0; lane < n; lane += BATCH_VECTOR_LANES)
+    {
+        __m256i running = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (batch->exit_codes + lane)), zero);
+        __m256i lane_pc = _mm256_loadu_si256((const __m256i*) (batch->pc + lane));
+
+        // Lane's pc is past its program (pc >= mem_sz) when min(pc, last_addr) isn't pc.
+        __m256i finished = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(lane_pc, last_addr), lane_pc), running);
+        if(!_mm256_testz_si256(finished, finished))
+        {
+            __m256i codes = _mm256_loadu_si256((const __m256i*) (batch->exit_codes + lane));
+            codes = _mm256_blendv_epi8(codes, _mm256_set1_epi32(1), finished);
+            _mm256_storeu_si256((__m256i*) (batch->exit_codes + lane), codes);
+            running = _mm256_andnot_si256(finished, running);
+        }
+
+        min_pc = _mm256_min_epu32(min_pc, _mm256_or_si256(lane_pc, _mm256_andnot_si256(running, _mm256_set1_epi32(-1))));
+    }
+
+    __m128i min128 = _mm_min_epu32(_mm256_castsi256_si128(min_pc), _mm256_extracti128_si256(min_pc, 1));
+    min128 = _mm_min_epu32(min128, _mm_shuffle_epi32(min128, _MM_SHUFFLE(1, 0, 3, 2)));
+    min128 = _mm_min_epu32(min128, _mm_shuffle_epi32(min128, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t lowest = (uint32_t) _mm_cvtsi128_si32(min128);
+
+    if(lowest == UINT32_MAX)
+        return false;
+
+    uint32_t word = 0;
+    bool found = false;
+    const __m256i target = _mm256_set1_epi32(lowest);
+    const __m256i addr = _mm256_set1_epi32(lowest);
+    bool whole_word = lowest + 4 <= batch->mem_sz;
+
+    for(uint32_t lane = 0; lane < n; lane += BATCH_VECTOR_LANES)
+    {
+        __m256i running = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (batch->exit_codes + lane)), zero);
+        __m256i at_pc = _mm256_and_si256(running,
+            _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (batch->pc + lane)), target));
+
+        if(_mm256_testz_si256(at_pc, at_pc))
+        {
+            _mm256_storeu_si256((__m256i*) (batch->selected + lane), zero);
+            continue;
+        }
+
+        if(!found)
+        {
+            uint32_t first = lane + __builtin_ctz(_mm256_movemask_ps(_mm256_castsi256_ps(at_pc)));
+            word = batch_fetch(batch, first, lowest);
+            found = true;
+        }
+
+        if(whole_word)
+        {
+            __m256i offsets = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*) (batch->lane_offsets + lane)), addr);
+            __m256i words = _mm256_mask_i32gather_epi32(zero, (const int*) batch->memory, offsets, at_pc, 1);
+            at_pc = _mm256_and_si256(at_pc, _mm256_cmpeq_epi32(words, _mm256_set1_epi32(word)));
+        }
+        else    // Instruction overlaps the end of memory, so only few lanes can be affected.
+        {
+            int32_t mask[BATCH_VECTOR_LANES];
+            _mm256_storeu_si256((__m256i*) mask, at_pc);
+            for(uint32_t i = 0; i < BATCH_VECTOR_LANES; ++i)
+            {
+                if(mask[i] != 0 && batch_fetch(batch, lane + i, lowest) != word)
+                    mask[i] = 0;
+            }
+            at_pc = _mm256_loadu_si256((const __m256i*) mask);
+        }
+
+        _mm256_storeu_si256((__m256i*) (batch->selected + lane), at_pc);
+    }
+
+    *pc = lowest;
+    return true;
+}
+
+// Executes arithmetic, comparison and load instructions in all selected lanes, 8 lanes at once.
+__attribute__((target("avx2")))
+static void batch_exec_avx2(struct batch_vm* batch, const struct batch_inst* inst)
+{
+    uint32_t n = batch->padded_lanes;
+    int32_t* reg = batch->regs + inst->reg * n;
+    const int32_t* addr_reg = batch->regs + inst->addr_reg * n;
+    const __m256i addr = _mm256_set1_epi32(inst->addr);
+    const __m256i next_pc = _mm256_set1_epi32(inst->next_pc);
+    const __m256i last_word = _mm256_set1_epi32(batch->mem_sz - 4);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for(uint32_t lane = 0; lane < n; lane += BATCH_VECTOR_LANES)
+    {
+        __m256i mask = _mm256_loadu_si256((const __m256i*) (batch->selected + lane));
+        if(_mm256_testz_si256(mask, mask))
+            continue;
+
+        __m256i a = _mm256_loadu_si256((const __m256i*) (reg + lane));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (addr_reg + lane));
+        __m256i value;
+
+        if(inst->memory)
+        {
+            // Lanes whose word isn't wholly inside the program reach their paged memory, so they go one by one
+            // and the rest go on without them.
+            __m256i ea = _mm256_add_epi32(addr, b);
+            __m256i outside = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(ea, last_word), ea), mask);
+            if(!_mm256_testz_si256(outside, outside))
+            {
+                int32_t slow[BATCH_VECTOR_LANES];
+                _mm256_storeu_si256((__m256i*) slow, outside);
+                for(uint32_t i = 0; i < BATCH_VECTOR_LANES; ++i)
+                {
+                    if(slow[i] != 0)
+                        batch_exec_lane(batch, inst, lane + i);
+                }
+                mask = _mm256_andnot_si256(outside, mask);
+            }
+
+            __m256i offsets = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*) (batch->lane_offsets + lane)), ea);
+            value = _mm256_mask_i32gather_epi32(zero, (const int*) batch->memory, offsets, mask, 1);
+        }
+        else if(inst->opcode >= 0x16)   // Immediate instructions.
+            value = _mm256_set1_epi32(inst->imm);
+        else
+            value = b;
+
+        __m256i result;
+        bool writes_reg = true;
+        bool writes_flags = true;
+
+        switch(inst->opcode)
+        {
+            case 0x02:
+            case 0x03:
+            case 0x16:
+                result = _mm256_add_epi32(a, value);
+                break;
+
+            case 0x04:
+            case 0x05:
+            case 0x18:
+                result = _mm256_sub_epi32(a, value);
+                break;
+
+            case 0x06:
+            case 0x07:
+            case 0x1a:
+                result = _mm256_mullo_epi32(a, value);
+                break;
+
+            case 0x0a:
+            case 0x0b:
+            case 0x1e:
+                result = _mm256_sub_epi32(a, value);
+                writes_reg = false;
+                break;
+
+            case 0x14:
+                result = _mm256_add_epi32(addr, value);
+                writes_flags = false;
+                break;
+
+            default:    // Loads.
+                result = value;
+                writes_flags = false;
+                break;
+        }
+
+        if(writes_reg)
+            _mm256_maskstore_epi32(reg + lane, mask, result);
+
+        if(writes_flags)    // Flags keep sign-extended result.
+        {
+            __m256i low_mask = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(mask));
+            __m256i high_mask = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(mask, 1));
+            __m256i low = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(result));
+            __m256i high = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(result, 1));
+            _mm256_maskstore_epi64((long long*) (batch->flags_result + lane), low_mask, low);
+            _mm256_maskstore_epi64((long long*) (batch->flags_result + lane + 4), high_mask, high);
+        }
+
+        _mm256_maskstore_epi32((int*) (batch->pc + lane), mask, next_pc);
+    }
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include "display.h"
 
+#ifdef _WIN32     // Console interface is built on WinAPI, other systems only have headless mode.
+
 #include <conio.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -14,7 +16,7 @@ int disp_init(struct virtual_machine* vm, struct program* program)
     UNUSED(program);
 
     display.vm_regs = malloc(16 * 4);
-    display.vm_memory = malloc(vm->mem_sz);
+    display.vm_memory = malloc(MEM_VIEW_SZ);
     display.status = malloc(DISPLAY_WIDTH - 40);
     display.mem_scroll = 0;
     display.mem_max_scroll = vm->mem_sz > 27 * 16 ? vm->mem_sz / 16 - 25 : 1;
@@ -131,7 +133,16 @@ int disp_update(struct virtual_machine* vm, struct program* program)
 void update_internal_vm(struct virtual_machine* vm)
 {
     memcpy(display.vm_regs, vm->regs, 16 * 4);
-    memcpy(display.vm_memory, vm->memory, vm->mem_sz);
+
+    // Only visible memory is remembered, so that stepping through program with large data doesn't copy all of it.
+    display.vm_memory_addr = display.mem_scroll * 16;
+    display.vm_memory_sz = 0;
+    if(display.vm_memory_addr < vm->mem_sz)
+    {
+        uint32_t left = vm->mem_sz - display.vm_memory_addr;
+        display.vm_memory_sz = left < MEM_VIEW_SZ ? left : MEM_VIEW_SZ;
+    }
+    memcpy(display.vm_memory, vm->memory + display.vm_memory_addr, display.vm_memory_sz);
 }
 
 void print_grid()
@@ -203,8 +214,35 @@ void print_regs(struct virtual_machine* vm)
     }
 }
 
+// Finds arrays vector instruction at pc works on, as ranges of bytes. Ranges are empty if there is no such instruction.
+static void disp_vector_arrays(struct virtual_machine* vm, uint32_t* first, uint64_t* first_sz, uint32_t* second,
+    uint64_t* second_sz)
+{
+    *first = *second = 0;
+    *first_sz = *second_sz = 0;
+    if(vm->pc >= vm->mem_sz)
+        return;
+
+    if(vm->ops[vm->pc].handler == NULL)
+        vm_decode_page(vm, vm->pc);
+
+    const struct vm_op* op = &vm->ops[vm->pc];
+    uint32_t count;
+    if(op->opcode < 0x22 || op->opcode > 0x2e || op->handler == handle_invalid
+        || !vm_vector_arrays(vm, op, first, second, &count))
+        return;
+
+    *second_sz = (uint64_t) count * 4;
+    if(op->opcode < 0x2a)   // Reductions don't use first array.
+        *first_sz = *second_sz;
+}
+
 void print_mem(struct virtual_machine* vm)
 {
+    uint32_t first, second;
+    uint64_t first_sz, second_sz;
+    disp_vector_arrays(vm, &first, &first_sz, &second, &second_sz);
+
     // Horizontal labels.
     for(int i = 0; i < 16; ++i)
     {
@@ -221,7 +259,7 @@ void print_mem(struct virtual_machine* vm)
     }
 
     // Memory contents.
-    for(int i = 0; i < 27 * 16; ++i)
+    for(int i = 0; i < MEM_VIEW_SZ; ++i)
     {
         int x = i % 16;
         int y = i / 16;
@@ -230,8 +268,12 @@ void print_mem(struct virtual_machine* vm)
         disp_cursor(CODE_BLOCK_WIDTH + 3 * x + 11, y + 3);
         if(idx < vm->mem_sz)
         {
-            if(vm->memory[idx] != display.vm_memory[idx])
+            uint32_t offset = idx - display.vm_memory_addr;
+            if(idx >= display.vm_memory_addr && offset < display.vm_memory_sz
+                && vm->memory[idx] != display.vm_memory[offset])
                 disp_color(CHANGE_COLOR);
+            else if((uint32_t) (idx - first) < first_sz || (uint32_t) (idx - second) < second_sz)
+                disp_color(OPERAND_COLOR);
             printf("%02X", vm->memory[idx]);
             disp_color(DEFAULT_COLOR);
         }
@@ -244,9 +286,7 @@ void print_mem(struct virtual_machine* vm)
 
 void print_code(struct virtual_machine* vm, struct program* program)
 {
-    struct source_code* curr_line = program->source;
-    for(unsigned int i = 0; i < display.code_scroll && curr_line != NULL; ++i)
-        curr_line = curr_line->next;
+    uint32_t num_lines = source_code_size(program->source);
 
     for(unsigned int line = display.code_scroll; line < DISPLAY_HEIGHT + display.code_scroll - 1; ++line)
     {
@@ -254,21 +294,20 @@ void print_code(struct virtual_machine* vm, struct program* program)
         printf("%4u", line + 1);
         putchar(179);
 
-        if(curr_line == NULL)
+        if(line >= num_lines)
         {
             printf("%-70s", "");
             continue;
         }
 
+        const struct source_line* curr_line = source_code_line(program->source, line);
         if(curr_line->addr == vm->pc && !curr_line->empty)
             disp_color(HIGHLIGHT_COLOR);
 
         printf(" 0x%04x ", curr_line->addr);
-        printf("%-70s", curr_line->text);
+        printf("%-70s", source_code_text(program->source, line));
 
         disp_color(DEFAULT_COLOR);
-
-        curr_line = curr_line->next;
     }
 }
 
@@ -297,3 +336,5 @@ void disp_color(int color)
 {
     SetConsoleTextAttribute(display.console_handle, color);
 }
+
+#endif
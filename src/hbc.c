@@ -0,0 +1,636 @@
+#include "hbc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "assembler.h"
+
+static const char hbc_magic[4] = {'H', 'B', 'C', '\0'};
+static const char hbo_magic[4] = {'H', 'B', 'O', '\0'};
+
+uint64_t hbc_hash(const struct source_file* source)
+{
+    // FNV-1a over 64-bit words, with trailing bytes and size folded in at the end. Not cryptographic, it only
+    // has to tell apart versions of the same file.
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for(; i + 8 <= source->size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, source->data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+
+    for(; i < source->size; ++i)
+        hash = (hash ^ (uint8_t) source->data[i]) * 1099511628211ull;
+
+    hash = (hash ^ source->size) * 1099511628211ull;
+    return hash ^ (hash >> 32);
+}
+
+// Returns size of names of all symbols in table, including terminating '\0's.
+static uint32_t hbc_names_size(const struct sym_table* sym_table)
+{
+    uint32_t names_sz = 0;
+    for(uint32_t i = 0; i < sym_table_size(sym_table); ++i)
+        names_sz += strlen(sym_table_at(sym_table, i)->name) + 1;
+
+    return names_sz;
+}
+
+// Writes symbol records of table. Names are numbered from name_offset on, which is moved past them.
+static bool hbc_write_symbols(FILE* file, const struct sym_table* sym_table, uint32_t* name_offset)
+{
+    for(uint32_t i = 0; i < sym_table_size(sym_table); ++i)
+    {
+        const struct symbol* symbol = sym_table_at(sym_table, i);
+        struct hbc_symbol record = {*name_offset, symbol->addr};
+        if(fwrite(&record, sizeof(record), 1, file) != 1)
+            return false;
+        *name_offset += strlen(symbol->name) + 1;
+    }
+
+    return true;
+}
+
+static bool hbc_write_names(FILE* file, const struct sym_table* sym_table)
+{
+    for(uint32_t i = 0; i < sym_table_size(sym_table); ++i)
+    {
+        const char* name = sym_table_at(sym_table, i)->name;
+        if(fwrite(name, strlen(name) + 1, 1, file) != 1)
+            return false;
+    }
+
+    return true;
+}
+
+// Appends chunk tag to encoded image.
+static void hbc_put_tag(uint8_t* image, uint32_t* image_sz, uint32_t tag)
+{
+    memcpy(image + *image_sz, &tag, sizeof(tag));
+    *image_sz += sizeof(tag);
+}
+
+// Appends chunk of bytes copied as they are, unless there are none.
+static void hbc_put_literal(uint8_t* image, uint32_t* image_sz, const uint8_t* mem, uint32_t size)
+{
+    if(size == 0)
+        return;
+
+    hbc_put_tag(image, image_sz, size);
+    memcpy(image + *image_sz, mem, size);
+    *image_sz += size;
+}
+
+// Encodes memory image, replacing runs of repeated words (e.g. DS and DC data) with single value. Returns buffer
+// that has to be freed, or NULL if there is no memory left.
+static uint8_t* hbc_encode_image(const uint8_t* mem, uint32_t mem_sz, uint32_t* image_sz)
+{
+    // Run chunk always takes less than words it replaces, so image grows by one tag at most.
+    uint8_t* image = malloc(mem_sz + 8);
+    if(image == NULL)
+        return NULL;
+
+    *image_sz = 0;
+    uint32_t literal = 0;   // Start of bytes not written yet.
+    uint32_t addr = 0;
+    while(addr + 4 <= mem_sz)
+    {
+        uint32_t end = addr + 4;
+        while(end + 4 <= mem_sz && memcmp(mem + end, mem + addr, 4) == 0)
+            end += 4;
+
+        uint32_t count = (end - addr) / 4;
+        if(count < HBC_MIN_RUN)
+        {
+            addr += 2;  // Instructions and data are 2-byte aligned, so runs can start at any even address.
+            continue;
+        }
+
+        hbc_put_literal(image, image_sz, mem + literal, addr - literal);
+        hbc_put_tag(image, image_sz, HBC_RUN_FLAG | count);
+        memcpy(image + *image_sz, mem + addr, 4);
+        *image_sz += 4;
+        addr = literal = end;
+    }
+
+    hbc_put_literal(image, image_sz, mem + literal, mem_sz - literal);
+    return image;
+}
+
+// Decodes memory image into zeroed memory of mem_sz bytes. Returns false if chunks don't add up to exactly mem_sz.
+static bool hbc_decode_image(const uint8_t* image, uint32_t image_sz, uint8_t* mem, uint32_t mem_sz)
+{
+    uint32_t offset = 0, addr = 0;
+    while(offset < image_sz)
+    {
+        uint32_t tag;
+        if(image_sz - offset < sizeof(tag))
+            return false;
+        memcpy(&tag, image + offset, sizeof(tag));
+        offset += sizeof(tag);
+
+        uint32_t size = (tag & ~HBC_RUN_FLAG) * ((tag & HBC_RUN_FLAG) != 0 ? 4 : 1);
+        if(size == 0 || (tag & ~HBC_RUN_FLAG) > mem_sz || size > mem_sz - addr)
+            return false;
+
+        if(tag & HBC_RUN_FLAG)
+        {
+            uint32_t value;
+            if(image_sz - offset < sizeof(value))
+                return false;
+            memcpy(&value, image + offset, sizeof(value));
+            offset += sizeof(value);
+
+            // Memory is zeroed already, so runs of zeros are only skipped.
+            if(value != 0)
+                mem_fill_value(mem, addr, value, size / 4);
+        }
+        else
+        {
+            if(image_sz - offset < size)
+                return false;
+            memcpy(mem + addr, image + offset, size);
+            offset += size;
+        }
+
+        addr += size;
+    }
+
+    return addr == mem_sz;
+}
+
+// Writes line records followed by line texts.
+static bool hbc_write_source(FILE* file, const struct source_code* source_code)
+{
+    bool ok = true;
+    for(uint32_t i = 0; i < source_code_size(source_code) && ok; ++i)
+    {
+        const struct source_line* line = source_code_line(source_code, i);
+        struct hbc_line record = {line->text, line->addr, line->empty, 0};
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+
+    // Line texts are already stored one after another, so whole buffer is written as it is.
+    if(source_code != NULL && source_code->text_sz != 0)
+        ok = ok && fwrite(source_code->text, source_code->text_sz, 1, file) == 1;
+
+    return ok;
+}
+
+// Closes file written by hbc_save or hbc_save_object, removing it if anything failed. Returns 0 on success.
+static int hbc_close(FILE* file, const char* filename, bool ok)
+{
+    if(fclose(file) != 0)
+        ok = false;
+
+    if(!ok)
+    {
+        remove(filename);
+        return 2;
+    }
+
+    return 0;
+}
+
+int hbc_save(const struct program* program, const struct source_file* source, const char* filename)
+{
+    const struct sym_table* sym_table = program->symbols;
+    const struct source_code* source_code = program->source;
+
+    struct hbc_header header = {0};
+    memcpy(header.magic, hbc_magic, sizeof(hbc_magic));
+    header.version = HBC_VERSION;
+    header.source_hash = source != NULL ? hbc_hash(source) : 0;
+    header.source_size = source != NULL ? source->size : 0;
+    header.mem_sz = program->mem_sz;
+    header.entry_addr = program->entry_addr;
+    header.num_symbols = sym_table_size(sym_table);
+    header.names_sz = hbc_names_size(sym_table);
+    header.num_lines = source_code_size(source_code);
+    header.text_sz = source_code != NULL ? source_code->text_sz : 0;
+
+    uint8_t* image = hbc_encode_image(program->mem_ptr, header.mem_sz, &header.image_sz);
+    if(image == NULL)
+        return 2;
+
+    FILE* file = fopen(filename, "wb");
+    if(file == NULL)
+    {
+        free(image);
+        return 1;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if(header.image_sz != 0)
+        ok = ok && fwrite(image, header.image_sz, 1, file) == 1;
+    free(image);
+
+    uint32_t name_offset = 0;
+    ok = ok && hbc_write_symbols(file, sym_table, &name_offset);
+    ok = ok && hbc_write_names(file, sym_table);
+    ok = ok && hbc_write_source(file, source_code);
+
+    return hbc_close(file, filename, ok);
+}
+
+int hbc_save_object(const struct object* object, const struct source_file* source, const char* filename)
+{
+    struct hbo_header header = {0};
+    memcpy(header.magic, hbo_magic, sizeof(hbo_magic));
+    header.version = HBC_VERSION;
+    header.source_hash = source != NULL ? hbc_hash(source) : 0;
+    header.source_size = source != NULL ? source->size : 0;
+    header.mem_sz = object->mem_sz;
+    header.entry_addr = object->code_block ? object->entry_addr : UINT32_MAX;
+    header.num_symbols = sym_table_size(object->symbols);
+    header.num_exports = sym_table_size(object->exports);
+    header.num_imports = sym_table_size(object->imports);
+    header.num_relocs = object->num_relocs;
+    header.names_sz = hbc_names_size(object->symbols) + hbc_names_size(object->exports)
+        + hbc_names_size(object->imports);
+    header.num_lines = source_code_size(object->source);
+    header.text_sz = object->source != NULL ? object->source->text_sz : 0;
+
+    uint8_t* image = hbc_encode_image(object->mem_ptr, header.mem_sz, &header.image_sz);
+    if(image == NULL)
+        return 2;
+
+    FILE* file = fopen(filename, "wb");
+    if(file == NULL)
+    {
+        free(image);
+        return 1;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if(header.image_sz != 0)
+        ok = ok && fwrite(image, header.image_sz, 1, file) == 1;
+    free(image);
+
+    uint32_t name_offset = 0;
+    ok = ok && hbc_write_symbols(file, object->symbols, &name_offset);
+    ok = ok && hbc_write_symbols(file, object->exports, &name_offset);
+    ok = ok && hbc_write_symbols(file, object->imports, &name_offset);
+    if(header.num_relocs != 0)
+        ok = ok && fwrite(object->relocs, header.num_relocs * sizeof(struct object_reloc), 1, file) == 1;
+    ok = ok && hbc_write_names(file, object->symbols);
+    ok = ok && hbc_write_names(file, object->exports);
+    ok = ok && hbc_write_names(file, object->imports);
+    ok = ok && hbc_write_source(file, object->source);
+
+    return hbc_close(file, filename, ok);
+}
+
+// Checks that every offset points inside section and that section ends with '\0', so all strings are terminated.
+static bool hbc_strings_valid(const char* section, uint64_t section_sz, const uint32_t* offsets, uint32_t count,
+    size_t stride)
+{
+    if(count == 0)
+        return true;
+
+    if(section_sz == 0 || section[section_sz - 1] != '\0')
+        return false;
+
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t offset;
+        memcpy(&offset, (const char*) offsets + i * stride, sizeof(offset));
+        if(offset >= section_sz)
+            return false;
+    }
+
+    return true;
+}
+
+// Reads symbol records into table. Addresses can't exceed max_addr. Returns 0 on success, or 2 if records are invalid
+// (or there is no memory left to tell).
+static int hbc_read_symbols(const char* records, uint32_t count, const char* names, uint32_t max_addr,
+    struct sym_table** sym_table)
+{
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        struct hbc_symbol record;
+        memcpy(&record, records + i * sizeof(record), sizeof(record));
+        if(record.addr > max_addr || sym_table_push_back(sym_table, names + record.name, record.addr) != SYM_ADDED)
+            return 2;
+    }
+
+    return 0;
+}
+
+// Reads line records and texts into source code, which is left NULL if there are no lines. Returns 0 on success
+// or 4 if there is no memory left.
+static int hbc_read_source(const char* records, uint32_t num_lines, const char* text, uint64_t text_sz,
+    struct source_code** source_code)
+{
+    if(num_lines == 0)
+        return 0;
+
+    // Line texts are stored the way source_code keeps them, so whole text buffer is copied at once.
+    struct source_code* source = calloc(1, sizeof(struct source_code));
+    *source_code = source;
+    if(source == NULL)
+        return 4;
+
+    source->lines = malloc(num_lines * sizeof(struct source_line));
+    source->code_lines = malloc(num_lines * sizeof(uint32_t));
+    source->text = malloc(text_sz);
+    if(source->lines == NULL || source->code_lines == NULL || source->text == NULL)
+        return 4;
+
+    memcpy(source->text, text, text_sz);
+    source->text_sz = source->text_capacity = text_sz;
+    source->num_lines = source->lines_capacity = num_lines;
+
+    for(uint32_t i = 0; i < num_lines; ++i)
+    {
+        struct hbc_line record;
+        memcpy(&record, records + i * sizeof(record), sizeof(record));
+        source->lines[i] = (struct source_line) {record.text, record.addr, record.empty != 0};
+        if(!record.empty)
+            source->code_lines[source->num_code_lines++] = i;
+    }
+
+    return 0;
+}
+
+int hbc_load(const char* filename, const struct source_file* source, struct program* program)
+{
+    struct source_file file;
+    if(source_file_open(&file, filename) != 0)
+        return 1;
+
+    int result = 0;
+    struct hbc_header header = {0};
+    if(file.size < sizeof(header))
+        result = 2;
+    else
+    {
+        memcpy(&header, file.data, sizeof(header));
+        if(memcmp(header.magic, hbc_magic, sizeof(hbc_magic)) != 0 || header.version != HBC_VERSION)
+            result = 2;
+        else if(source != NULL && (header.source_size != source->size || header.source_hash != hbc_hash(source)))
+            result = 3;     // File was written for another version of source.
+    }
+
+    // Sizes are checked in 64 bits, so that corrupted header can't make them wrap around.
+    uint64_t symbols_offset = sizeof(header) + (uint64_t) header.image_sz;
+    uint64_t names_offset = symbols_offset + (uint64_t) header.num_symbols * sizeof(struct hbc_symbol);
+    uint64_t lines_offset = names_offset + header.names_sz;
+    uint64_t text_offset = lines_offset + (uint64_t) header.num_lines * sizeof(struct hbc_line);
+    if(result == 0 && (header.mem_sz == 0 || header.mem_sz > UINT16_MAX || header.entry_addr >= header.mem_sz
+        || header.text_sz > file.size || text_offset + header.text_sz != file.size))
+        result = 2;
+
+    const char* names = file.data + names_offset;
+    const char* text = file.data + text_offset;
+    if(result == 0 && (!hbc_strings_valid(names, header.names_sz, (const uint32_t*) (file.data + symbols_offset),
+        header.num_symbols, sizeof(struct hbc_symbol)) || !hbc_strings_valid(text, header.text_sz,
+        (const uint32_t*) (file.data + lines_offset), header.num_lines, sizeof(struct hbc_line))))
+        result = 2;
+
+    if(result != 0)
+    {
+        source_file_close(&file);
+        return result;
+    }
+
+    // Image is copied, as virtual machine writes to it. Spare bytes match those left by assembler.
+    uint8_t* mem = calloc(header.mem_sz + 4, 1);
+    struct sym_table* sym_table = NULL;
+    struct source_code* source_code = NULL;
+    if(mem == NULL)
+        result = 4;
+    else if(!hbc_decode_image((const uint8_t*) file.data + sizeof(header), header.image_sz, mem, header.mem_sz))
+        result = 2;
+
+    if(result == 0)
+        result = hbc_read_symbols(file.data + symbols_offset, header.num_symbols, names, UINT16_MAX, &sym_table);
+    if(result == 0)
+        result = hbc_read_source(file.data + lines_offset, header.num_lines, text, header.text_sz, &source_code);
+
+    source_file_close(&file);
+
+    if(result != 0)
+    {
+        free(mem);
+        sym_table_free(&sym_table);
+        source_code_free(&source_code);
+        return result;
+    }
+
+    program->mem_sz = header.mem_sz;
+    program->entry_addr = header.entry_addr;
+    program->mem_ptr = mem;
+    program->source = source_code;
+    program->symbols = sym_table;
+
+    return 0;
+}
+
+int hbc_load_object(const char* filename, const struct source_file* source, struct object* object)
+{
+    struct source_file file;
+    if(source_file_open(&file, filename) != 0)
+        return 1;
+
+    int result = 0;
+    struct hbo_header header = {0};
+    if(file.size < sizeof(header))
+        result = 2;
+    else
+    {
+        memcpy(&header, file.data, sizeof(header));
+        if(memcmp(header.magic, hbo_magic, sizeof(hbo_magic)) != 0 || header.version != HBC_VERSION)
+            result = 2;
+        else if(source != NULL && (header.source_size != source->size || header.source_hash != hbc_hash(source)))
+            result = 3;     // File was written for another version of source.
+    }
+
+    uint64_t symbols_offset = sizeof(header) + (uint64_t) header.image_sz;
+    uint64_t exports_offset = symbols_offset + (uint64_t) header.num_symbols * sizeof(struct hbc_symbol);
+    uint64_t imports_offset = exports_offset + (uint64_t) header.num_exports * sizeof(struct hbc_symbol);
+    uint64_t relocs_offset = imports_offset + (uint64_t) header.num_imports * sizeof(struct hbc_symbol);
+    uint64_t names_offset = relocs_offset + (uint64_t) header.num_relocs * sizeof(struct object_reloc);
+    uint64_t lines_offset = names_offset + header.names_sz;
+    uint64_t text_offset = lines_offset + (uint64_t) header.num_lines * sizeof(struct hbc_line);
+    if(result == 0 && (header.mem_sz > UINT16_MAX || (header.entry_addr != UINT32_MAX
+        && header.entry_addr >= header.mem_sz) || header.text_sz > file.size
+        || text_offset + header.text_sz != file.size))
+        result = 2;
+
+    // Symbols, exports and imports share names section.
+    const char* names = file.data + names_offset;
+    const char* text = file.data + text_offset;
+    if(result == 0 && (!hbc_strings_valid(names, header.names_sz, (const uint32_t*) (file.data + symbols_offset),
+        header.num_symbols + header.num_exports + header.num_imports, sizeof(struct hbc_symbol))
+        || !hbc_strings_valid(text, header.text_sz, (const uint32_t*) (file.data + lines_offset), header.num_lines,
+        sizeof(struct hbc_line))))
+        result = 2;
+
+    // Linker writes address field of every relocated instruction, so it has to lie within unit.
+    for(uint32_t i = 0; i < header.num_relocs && result == 0; ++i)
+    {
+        struct object_reloc reloc;
+        memcpy(&reloc, file.data + relocs_offset + i * sizeof(reloc), sizeof(reloc));
+        if((uint32_t) reloc.addr + 4 > header.mem_sz
+            || (uint64_t) reloc.symbol >= (uint64_t) header.num_symbols + header.num_imports)
+            result = 2;
+    }
+
+    if(result != 0)
+    {
+        source_file_close(&file);
+        return result;
+    }
+
+    struct object result_object = {0};
+    result_object.mem_sz = header.mem_sz;
+    result_object.code_block = header.entry_addr != UINT32_MAX;
+    result_object.entry_addr = result_object.code_block ? header.entry_addr : 0;
+    result_object.mem_ptr = calloc(header.mem_sz + 4, 1);
+    if(header.num_relocs != 0)
+        result_object.relocs = malloc(header.num_relocs * sizeof(struct object_reloc));
+    if(result_object.mem_ptr == NULL || (header.num_relocs != 0 && result_object.relocs == NULL))
+        result = 4;
+    else if(!hbc_decode_image((const uint8_t*) file.data + sizeof(header), header.image_sz, result_object.mem_ptr,
+        header.mem_sz))
+        result = 2;
+    else
+    {
+        if(header.num_relocs != 0)
+            memcpy(result_object.relocs, file.data + relocs_offset, header.num_relocs * sizeof(struct object_reloc));
+        result_object.num_relocs = header.num_relocs;
+    }
+
+    // Labels may lie right past the end of unit, e.g. when followed by empty data block only.
+    if(result == 0)
+        result = hbc_read_symbols(file.data + symbols_offset, header.num_symbols, names, header.mem_sz,
+            &result_object.symbols);
+    if(result == 0)
+        result = hbc_read_symbols(file.data + exports_offset, header.num_exports, names, header.mem_sz,
+            &result_object.exports);
+    if(result == 0)
+        result = hbc_read_symbols(file.data + imports_offset, header.num_imports, names, UINT16_MAX,
+            &result_object.imports);
+    if(result == 0)
+        result = hbc_read_source(file.data + lines_offset, header.num_lines, text, header.text_sz,
+            &result_object.source);
+
+    source_file_close(&file);
+
+    if(result != 0)
+    {
+        object_free(&result_object);
+        return result;
+    }
+
+    *object = result_object;
+    return 0;
+}
+
+// Builds path of cached file made from source. Returns false if it doesn't fit in path buffer.
+static bool hbc_cache_path(const char* cache_dir, const struct source_file* source, const char* extension, char* path,
+    size_t path_sz)
+{
+    int length = snprintf(path, path_sz, "%s/%016llx%s", cache_dir, (unsigned long long) hbc_hash(source), extension);
+    return length > 0 && (size_t) length < path_sz;
+}
+
+// Creates cache directory if needed and builds temporary path, under which cached file is written. Returns 0 on success.
+static int hbc_cache_prepare(const char* cache_dir, const char* path, char* temp_path, size_t temp_path_sz)
+{
+#ifdef _WIN32
+    if(!CreateDirectoryA(cache_dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+        return 2;
+    snprintf(temp_path, temp_path_sz, "%s.%lu.tmp", path, (unsigned long) GetCurrentProcessId());
+#else
+    if(mkdir(cache_dir, 0777) != 0 && errno != EEXIST)
+        return 2;
+    snprintf(temp_path, temp_path_sz, "%s.%ld.tmp", path, (long) getpid());
+#endif
+
+    return 0;
+}
+
+// Moves file written under temporary name into place, so that concurrent runs never see it half-written.
+// Returns 0 on success.
+static int hbc_cache_commit(const char* temp_path, const char* path)
+{
+#ifdef _WIN32
+    bool renamed = MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    bool renamed = rename(temp_path, path) == 0;
+#endif
+    if(!renamed)
+    {
+        remove(temp_path);
+        return 3;
+    }
+
+    return 0;
+}
+
+int hbc_cache_load(const char* cache_dir, const struct source_file* source, struct program* program)
+{
+    char path[4096];
+    if(!hbc_cache_path(cache_dir, source, ".hbc", path, sizeof(path)))
+        return 1;
+
+    return hbc_load(path, source, program);
+}
+
+int hbc_cache_store(const char* cache_dir, const struct source_file* source, const struct program* program)
+{
+    char path[4096];
+    char temp_path[4096 + 32];
+    if(!hbc_cache_path(cache_dir, source, ".hbc", path, sizeof(path)))
+        return 1;
+
+    int result = hbc_cache_prepare(cache_dir, path, temp_path, sizeof(temp_path));
+    if(result != 0)
+        return result;
+
+    if(hbc_save(program, source, temp_path) != 0)
+        return 3;
+
+    return hbc_cache_commit(temp_path, path);
+}
+
+int hbc_cache_load_object(const char* cache_dir, const struct source_file* source, struct object* object)
+{
+    char path[4096];
+    if(!hbc_cache_path(cache_dir, source, ".hbo", path, sizeof(path)))
+        return 1;
+
+    return hbc_load_object(path, source, object);
+}
+
+int hbc_cache_store_object(const char* cache_dir, const struct source_file* source, const struct object* object)
+{
+    char path[4096];
+    char temp_path[4096 + 32];
+    if(!hbc_cache_path(cache_dir, source, ".hbo", path, sizeof(path)))
+        return 1;
+
+    int result = hbc_cache_prepare(cache_dir, path, temp_path, sizeof(temp_path));
+    if(result != 0)
+        return result;
+
+    if(hbc_save_object(object, source, temp_path) != 0)
+        return 3;
+
+    return hbc_cache_commit(temp_path, path);
+}
@@ -1,6 +1,104 @@
 #include "instruction.h"
 
-uint32_t assemble(const struct instruction* inst, const char* args, const struct sym_table* sym_table)
+#include <pthread.h>
+#include <string.h>
+
+#include "assembler.h"
+
+#define INST_HASH_BITS 7    // Hash table has 2^INST_HASH_BITS slots, at least twice as many as instructions.
+#define INST_MAX_MNEMONIC 4 // Mnemonics are packed into 32-bit keys, so they can't be longer.
+
+#define INSTRUCTION_ENTRY(name, opcode, width, kind, assemble_func) \
+    {#name, opcode, width, INSTRUCTION_##kind, &assemble_func},
+const struct instruction instructions[NUM_INSTRUCTIONS] = {
+    INSTRUCTION_SET(INSTRUCTION_ENTRY)
+};
+#undef INSTRUCTION_ENTRY
+
+#define INSTRUCTION_WIDTH(name, opcode, width, kind, assemble_func) [opcode] = width,
+const uint8_t instruction_widths[256] = {
+    INSTRUCTION_SET(INSTRUCTION_WIDTH)
+};
+#undef INSTRUCTION_WIDTH
+
+#define INSTRUCTION_KIND(name, opcode, width, kind, assemble_func) [opcode] = INSTRUCTION_##kind,
+const uint8_t instruction_kinds[256] = {
+    INSTRUCTION_SET(INSTRUCTION_KIND)
+};
+#undef INSTRUCTION_KIND
+
+// Instructions indexed by opcode, NULL for opcodes that aren't part of instruction set.
+#define INSTRUCTION_OPCODE(name, opcode, width, kind, assemble_func) [opcode] = &instructions[INST_##name],
+static const struct instruction* const inst_by_opcode[256] = {
+    INSTRUCTION_SET(INSTRUCTION_OPCODE)
+};
+#undef INSTRUCTION_OPCODE
+
+_Static_assert(NUM_INSTRUCTIONS * 2 <= 1 << INST_HASH_BITS, "Mnemonic hash table is too small.");
+
+// Hash table of mnemonics. Slot holds packed mnemonic and index of its instruction increased by one, 0 marks empty slot.
+// C can't read characters of string literal at compile time, so table is filled from instructions array on first use.
+static uint32_t inst_keys[1 << INST_HASH_BITS];
+static uint8_t inst_slots[1 << INST_HASH_BITS];
+static pthread_once_t inst_table_once = PTHREAD_ONCE_INIT;
+
+// Packs up to 4 characters into single word, so that mnemonics are compared with one instruction.
+static uint32_t inst_key(const char* name, uint32_t length)
+{
+    uint32_t key = 0;
+    memcpy(&key, name, length);
+    return key;
+}
+
+static uint32_t inst_hash(uint32_t key)
+{
+    return (key * 2654435761u) >> (32 - INST_HASH_BITS);
+}
+
+static void inst_table_init(void)
+{
+    uint32_t mask = (1 << INST_HASH_BITS) - 1;
+    for(int i = 0; i < NUM_INSTRUCTIONS; ++i)
+    {
+        uint32_t key = inst_key(instructions[i].mnemonic, strlen(instructions[i].mnemonic));
+        uint32_t slot = inst_hash(key);
+        while(inst_slots[slot] != 0)
+            slot = (slot + 1) & mask;
+
+        inst_keys[slot] = key;
+        inst_slots[slot] = i + 1;
+    }
+}
+
+uint32_t assemble(const struct instruction* inst, struct lexer* lexer, struct token* label)
+{
+    return inst->assemble_func(inst, lexer, label);
+}
+
+const struct instruction* find_inst(const char* name, uint32_t length)
+{
+    if(length == 0 || length > INST_MAX_MNEMONIC)
+        return NULL;
+
+    pthread_once(&inst_table_once, inst_table_init);
+
+    uint32_t mask = (1 << INST_HASH_BITS) - 1;
+    uint32_t key = inst_key(name, length);
+    for(uint32_t slot = inst_hash(key); inst_slots[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if(inst_keys[slot] == key)
+            return &instructions[inst_slots[slot] - 1];
+    }
+
+    return NULL;
+}
+
+const struct instruction* get_inst(const char* mnemonic)
+{
+    return find_inst(mnemonic, strlen(mnemonic));
+}
+
+const struct instruction* get_inst_opcode(uint32_t opcode)
 {
-    return inst->assemble_func(inst, args, sym_table);
+    return opcode < 256 ? inst_by_opcode[opcode] : NULL;
 }
@@ -0,0 +1,1015 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "paged_memory.h"
+#include "verifier.h"
+#include "virtual_machine.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAS_JIT
+#endif
+
+#ifdef HAS_JIT
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define JIT_CODE_SIZE (4 * 1024 * 1024)    // Size of buffer for generated code.
+#define JIT_BLOCK_SLACK (32 * 1024)         // Free space in code buffer needed to compile another block.
+#define JIT_MAX_BLOCK 64                    // Maximum number of instructions in one block.
+
+// Reasons for leaving generated code.
+enum jit_exit
+{
+    JIT_EXIT_DISPATCH,  // Continue at jit->pc.
+    JIT_EXIT_CHAIN,     // Continue at jit->pc, exit stub at jit->stub can be patched to jump there directly.
+    JIT_EXIT_FAIL,      // Instruction failed, virtual machine stops with code 2.
+    JIT_EXIT_SMC,       // Program has written into compiled code.
+    JIT_EXIT_BUDGET,    // Remaining budget is smaller than the block at jit->pc.
+    JIT_EXIT_PAGED,     // Instruction at jit->pc accesses page of paged memory that isn't allocated, or spans two pages.
+};
+
+struct jit
+{
+    // Fields below are accessed by generated code.
+    int32_t regs[16];   // Copy of virtual machine's registers. Ones not kept in host registers live here.
+    uint32_t pc;        // Address of next instruction after leaving generated code.
+    int64_t flags_result;   // Copy of virtual machine's flags_result.
+    uint64_t budget;    // Number of instructions that can still be executed.
+    uint8_t* memory;    // Virtual machine's memory.
+    uint8_t* stub;      // Exit stub that requested chaining.
+    uint8_t dirty;      // Set when program writes into its memory image, so decoded ops need refreshing.
+
+    struct virtual_machine* vm;
+    uint8_t* code;              // Executable buffer for generated code.
+    uint32_t code_used;         // Bytes of code buffer already taken.
+    uint32_t prologue_sz;       // Bytes of code buffer taken by entry trampoline and common exit path.
+    uint32_t generation;        // Incremented on every flush, so that stale stubs aren't patched.
+    int (*enter)(struct jit*, const void*); // Trampoline loading state into host registers and jumping into a block.
+    uint8_t* exit;              // Common exit path storing state back and returning from trampoline.
+    void** entries;             // Native entry of block starting at each address, NULL if not compiled.
+    uint8_t* code_map;          // Non-zero for bytes of memory covered by compiled instructions. Padded with 4 bytes on each side.
+};
+
+// Host registers.
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Registers with fixed meaning inside generated code. RAX, RCX and RDX are scratch registers.
+#define CTX R14     // Pointer to struct jit.
+#define MEM R15     // Virtual machine's memory.
+#define FLAGS R13   // Virtual machine's flags_result.
+#define BUDGET R12  // Remaining budget.
+
+// Host register holding each virtual machine register, -1 if it lives in struct jit.
+// r14 is default address register, so it gets one too.
+static const int8_t host_regs[16] = {RBX, RBP, RSI, RDI, R8, R9, R10, -1, -1, -1, -1, -1, -1, -1, R11, -1};
+
+// Register or memory operand of x86-64 instruction.
+struct operand
+{
+    bool mem;       // If set, operand is [base + index * scale + disp], otherwise it's register reg.
+    int8_t reg;
+    int8_t base;
+    int8_t index;   // -1 if there is no index.
+    uint8_t scale;
+    int32_t disp;
+};
+
+// Instruction read from memory while forming a block.
+struct jit_inst
+{
+    uint8_t opcode;
+    uint8_t reg;
+    uint8_t addr_reg;
+    uint16_t addr;
+    int32_t imm;        // Operand of immediate instruction.
+    uint32_t pc;
+    uint32_t next_pc;
+};
+
+// Access to paged memory, emitted after block's body. Generated code walks page tables itself and leaves the rest
+// to interpreter.
+struct jit_paged
+{
+    uint8_t* jump;          // End of jump instruction leading to the access.
+    uint8_t* resume;        // Code following the access.
+    const struct jit_inst* inst;
+    uint32_t refund;        // Budget taken by block's instructions that won't be executed, including this one.
+};
+
+// Exit taken from the middle of a block, emitted after block's body.
+struct jit_pending
+{
+    uint8_t* jump;          // End of jump instruction leading to the exit.
+    enum jit_exit reason;
+    uint32_t pc;
+    uint32_t refund;        // Budget taken by block's instructions that won't be executed.
+};
+
+static struct operand reg_op(int reg)
+{
+    struct operand op = {false, reg, 0, -1, 1, 0};
+    return op;
+}
+
+static struct operand mem_op(int base, int index, int scale, int32_t disp)
+{
+    struct operand op = {true, 0, base, index, scale, disp};
+    return op;
+}
+
+// Operand where virtual machine register is kept.
+static struct operand guest(int reg)
+{
+    if(host_regs[reg] >= 0)
+        return reg_op(host_regs[reg]);
+
+    return mem_op(CTX, -1, 1, offsetof(struct jit, regs) + 4 * reg);
+}
+
+static void emit8(uint8_t** code, uint8_t byte)
+{
+    *(*code)++ = byte;
+}
+
+static void emit32(uint8_t** code, uint32_t value)
+{
+    memcpy(*code, &value, 4);
+    *code += 4;
+}
+
+static void emit64(uint8_t** code, uint64_t value)
+{
+    memcpy(*code, &value, 8);
+    *code += 8;
+}
+
+// Emits instruction with ModRM operand. Opcodes above 0xff are two-byte opcodes.
+static void emit_insn(uint8_t** code, bool wide, uint32_t opcode, int reg, struct operand rm)
+{
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0);
+    if(rm.mem)
+    {
+        if(rm.index >= 0 && (rm.index & 8))
+            rex |= 2;
+        if(rm.base & 8)
+            rex |= 1;
+    }
+    else if(rm.reg & 8)
+    {
+        rex |= 1;
+    }
+
+    if(rex != 0x40)
+        emit8(code, rex);
+    if(opcode > 0xff)
+        emit8(code, opcode >> 8);
+    emit8(code, opcode & 0xff);
+
+    if(!rm.mem)
+    {
+        emit8(code, 0xc0 | (reg & 7) << 3 | (rm.reg & 7));
+        return;
+    }
+
+    int base = rm.base & 7;
+    bool sib = rm.index >= 0 || base == RSP;
+    int mod = rm.disp == 0 && base != RBP ? 0 : (rm.disp >= -128 && rm.disp <= 127 ? 1 : 2);
+    emit8(code, mod << 6 | (reg & 7) << 3 | (sib ? 4 : base));
+    if(sib)
+    {
+        int scale = rm.scale == 8 ? 3 : (rm.scale == 4 ? 2 : (rm.scale == 2 ? 1 : 0));
+        emit8(code, scale << 6 | (rm.index >= 0 ? rm.index & 7 : 4) << 3 | base);
+    }
+
+    if(mod == 1)
+        emit8(code, rm.disp);
+    else if(mod == 2)
+        emit32(code, rm.disp);
+}
+
+static void emit_mov_load(uint8_t** code, int reg, struct operand rm)
+{
+    emit_insn(code, false, 0x8b, reg, rm);
+}
+
+static void emit_mov_store(uint8_t** code, struct operand rm, int reg)
+{
+    emit_insn(code, false, 0x89, reg, rm);
+}
+
+static void emit_mov_imm(uint8_t** code, struct operand rm, uint32_t imm)
+{
+    emit_insn(code, false, 0xc7, 0, rm);
+    emit32(code, imm);
+}
+
+static void emit_mov_imm64(uint8_t** code, int reg, uint64_t imm)
+{
+    emit8(code, 0x48 | (reg & 8 ? 1 : 0));
+    emit8(code, 0xb8 + (reg & 7));
+    emit64(code, imm);
+}
+
+// Group 1 arithmetic with 32-bit immediate: 0 - add, 5 - sub, 7 - cmp.
+static void emit_alu_imm(uint8_t** code, bool wide, int ext, struct operand rm, uint32_t imm)
+{
+    emit_insn(code, wide, 0x81, ext, rm);
+    emit32(code, imm);
+}
+
+// Emits conditional jump with unresolved target and returns end of the instruction.
+static uint8_t* emit_jcc(uint8_t** code, uint8_t cond)
+{
+    emit8(code, 0x0f);
+    emit8(code, 0x80 | cond);
+    emit32(code, 0);
+    return *code;
+}
+
+// Emits unconditional jump with unresolved target and returns end of the instruction.
+static uint8_t* emit_jmp(uint8_t** code)
+{
+    emit8(code, 0xe9);
+    emit32(code, 0);
+    return *code;
+}
+
+// Points jump ending at given address to the target.
+static void patch_jump(uint8_t* jump, const uint8_t* target)
+{
+    int32_t rel = target - jump;
+    memcpy(jump - 4, &rel, 4);
+}
+
+#define COND_B 0x2
+#define COND_AE 0x3
+#define COND_E 0x4
+#define COND_NE 0x5
+#define COND_A 0x7
+#define COND_NS 0x9
+
+// Records result in operand as virtual machine's flags_result.
+static void emit_flags(uint8_t** code, struct operand value)
+{
+    emit_insn(code, true, 0x63, FLAGS, value);         // movsxd flags, value
+}
+
+// Checks if verifier proved that instruction at given address stays inside program's memory.
+static bool jit_verified(const struct jit* jit, uint32_t pc)
+{
+    return jit->vm->verified != NULL && (jit->vm->verified[pc] & VERIFIER_SAFE) != 0;
+}
+
+// Computes address of memory operand into RAX and returns operand referring to it. Addresses not inside program's
+// memory jump to paged access, which has to be completed by the caller. Verified instructions pass NULL paged
+// and get no check at all.
+static struct operand emit_address(struct jit* jit, uint8_t** code, const struct jit_inst* inst, struct jit_paged* paged)
+{
+    uint32_t mem_sz = jit->vm->mem_sz;
+
+    emit_mov_load(code, RAX, guest(inst->addr_reg));
+    emit_alu_imm(code, false, 0, reg_op(RAX), inst->addr);     // add eax, addr
+    if(paged == NULL)
+        return mem_op(MEM, RAX, 1, 0);
+
+    emit_alu_imm(code, false, 7, reg_op(RAX), mem_sz >= 4 ? mem_sz - 3 : 0);
+    paged->jump = emit_jcc(code, COND_AE);
+    paged->inst = inst;
+    return mem_op(MEM, RAX, 1, 0);
+}
+
+// Returns operand with value of virtual machine register, loading it into RAX if it lives in memory.
+static struct operand emit_source(uint8_t** code, int reg)
+{
+    struct operand src = guest(reg);
+    if(!src.mem)
+        return src;
+
+    emit_mov_load(code, RAX, src);
+    return reg_op(RAX);
+}
+
+// Divides register by value in RCX, invalidating flags on division by zero. Division by -1 is negation, so that
+// INT32_MIN / -1 wraps around as in vm_quotient instead of raising #DE.
+static void emit_divide(uint8_t** code, int reg)
+{
+    struct operand dest = guest(reg);
+
+    emit_insn(code, false, 0x85, RCX, reg_op(RCX));    // test ecx, ecx
+    uint8_t* nonzero = emit_jcc(code, COND_NE);
+    emit_mov_imm64(code, FLAGS, VM_FLAGS_INVALID);
+    uint8_t* done = emit_jmp(code);
+
+    patch_jump(nonzero, *code);
+    emit_mov_load(code, RAX, dest);
+    emit_alu_imm(code, false, 7, reg_op(RCX), (uint32_t) -1);  // cmp ecx, -1
+    uint8_t* divisor = emit_jcc(code, COND_NE);
+    emit_insn(code, false, 0xf7, 3, reg_op(RAX));      // neg eax
+    uint8_t* negated = emit_jmp(code);
+
+    patch_jump(divisor, *code);
+    emit8(code, 0x99);                                  // cdq
+    emit_insn(code, false, 0xf7, 7, reg_op(RCX));      // idiv ecx
+
+    patch_jump(negated, *code);
+    emit_mov_store(code, dest, RAX);
+    emit_flags(code, dest);
+
+    patch_jump(done, *code);
+}
+
+// Emits exit from generated code continuing at constant address.
+static void emit_exit(struct jit* jit, uint8_t** code, enum jit_exit reason, uint32_t pc, uint32_t refund)
+{
+    emit_mov_imm(code, mem_op(CTX, -1, 1, offsetof(struct jit, pc)), pc);
+    if(refund != 0)
+        emit_alu_imm(code, true, 0, reg_op(BUDGET), refund);
+    emit8(code, 0xb8 + RAX);
+    emit32(code, reason);
+    patch_jump(emit_jmp(code), jit->exit);
+}
+
+// Emits access to paged memory. Loads continue with RAX set so that memory operand points into the page,
+// stores write the value themselves.
+static void emit_paged(struct jit* jit, uint8_t** code, const struct jit_paged* paged)
+{
+    const struct jit_inst* inst = paged->inst;
+    patch_jump(paged->jump, *code);
+
+    // Values overlapping end of program's memory are put together by interpreter.
+    emit_alu_imm(code, false, 7, reg_op(RAX), jit->vm->mem_sz);
+    uint8_t* slow[4];
+    slow[0] = emit_jcc(code, COND_B);
+
+    emit_insn(code, false, 0x89, RAX, reg_op(RCX));                // mov ecx, eax
+    emit_insn(code, false, 0xc1, 5, reg_op(RCX));                  // shr ecx, table and page bits
+    emit8(code, PAGED_TABLE_BITS + PAGED_PAGE_BITS);
+    emit_mov_imm64(code, RDX, (uintptr_t) jit->vm->paged->tables);
+    emit_insn(code, true, 0x8b, RDX, mem_op(RDX, RCX, 8, 0));      // mov rdx, [rdx + rcx * 8]
+    emit_insn(code, true, 0x85, RDX, reg_op(RDX));                 // test rdx, rdx
+    slow[1] = emit_jcc(code, COND_E);
+
+    emit_insn(code, false, 0x89, RAX, reg_op(RCX));                // mov ecx, eax
+    emit_insn(code, false, 0xc1, 5, reg_op(RCX));                  // shr ecx, page bits
+    emit8(code, PAGED_PAGE_BITS);
+    emit_alu_imm(code, false, 4, reg_op(RCX), PAGED_TABLE_SZ - 1);
+    emit_insn(code, true, 0x8b, RDX, mem_op(RDX, RCX, 8, 0));      // mov rdx, [rdx + rcx * 8]
+    emit_insn(code, true, 0x85, RDX, reg_op(RDX));                 // test rdx, rdx
+    slow[2] = emit_jcc(code, COND_E);
+
+    emit_alu_imm(code, false, 4, reg_op(RAX), PAGED_PAGE_SZ - 1);
+    emit_alu_imm(code, false, 7, reg_op(RAX), PAGED_PAGE_SZ - 4);
+    slow[3] = emit_jcc(code, COND_A);
+    emit_insn(code, true, 0x8d, RAX, mem_op(RDX, RAX, 1, 0));      // lea rax, [rdx + rax]
+
+    if(inst->opcode == 0x12)    // ST
+    {
+        struct operand src = guest(inst->reg);
+        if(src.mem)
+        {
+            emit_mov_load(code, RCX, src);
+            src = reg_op(RCX);
+        }
+        emit_mov_store(code, mem_op(RAX, -1, 1, 0), src.reg);
+    }
+    else
+    {
+        emit_insn(code, true, 0x29, MEM, reg_op(RAX));             // sub rax, mem
+    }
+    patch_jump(emit_jmp(code), paged->resume);
+
+    for(int i = 0; i < 4; ++i)
+        patch_jump(slow[i], *code);
+    emit_exit(jit, code, JIT_EXIT_PAGED, inst->pc, paged->refund);
+}
+
+// Emits exit to block at given address. Once that block is compiled, stub is patched to jump there directly.
+static void emit_chain(struct jit* jit, uint8_t** code, uint32_t pc)
+{
+    if(pc >= jit->vm->mem_sz)
+    {
+        emit_exit(jit, code, JIT_EXIT_DISPATCH, pc, 0);
+        return;
+    }
+
+    uint8_t* stub = *code;
+    emit_mov_imm(code, mem_op(CTX, -1, 1, offsetof(struct jit, pc)), pc);
+    emit8(code, 0xb8 + RAX);
+    emit32(code, JIT_EXIT_CHAIN);
+    emit8(code, 0x48);                                  // lea rdx, [rip + stub]
+    emit8(code, 0x8d);
+    emit8(code, 0x15);
+    emit32(code, stub - (*code + 4));
+    patch_jump(emit_jmp(code), jit->exit);
+}
+
+// Emits jump to address in RAX. Target is checked against compiled blocks at run time.
+static void emit_indirect(struct jit* jit, uint8_t** code)
+{
+    emit_mov_imm64(code, RCX, (uintptr_t) jit->entries);
+    emit_insn(code, true, 0x8b, RCX, mem_op(RCX, RAX, 8, 0));  // mov rcx, [rcx + rax * 8]
+    emit_insn(code, true, 0x85, RCX, reg_op(RCX));             // test rcx, rcx
+    uint8_t* missing = emit_jcc(code, COND_E);
+    emit_insn(code, false, 0xff, 4, reg_op(RCX));              // jmp rcx
+
+    patch_jump(missing, *code);
+    emit_mov_store(code, mem_op(CTX, -1, 1, offsetof(struct jit, pc)), RAX);
+    emit8(code, 0xb8 + RAX);
+    emit32(code, JIT_EXIT_DISPATCH);
+    patch_jump(emit_jmp(code), jit->exit);
+}
+
+// Emits trampoline entering generated code and common exit path at the start of code buffer.
+static void emit_prologue(struct jit* jit)
+{
+    static const int8_t saved[] = {RBX, RBP, RSI, RDI, R12, R13, R14, R15};
+    uint8_t* code = jit->code;
+    uint8_t* enter = code;
+
+    for(unsigned i = 0; i < sizeof(saved); ++i)
+    {
+        if(saved[i] & 8)
+            emit8(&code, 0x41);
+        emit8(&code, 0x50 + (saved[i] & 7));
+    }
+
+#ifdef _WIN32
+    emit_insn(&code, true, 0x89, RCX, reg_op(CTX));    // mov r14, rcx
+    emit_insn(&code, true, 0x89, RDX, reg_op(RAX));    // mov rax, rdx
+#else
+    emit_insn(&code, true, 0x89, RDI, reg_op(CTX));    // mov r14, rdi
+    emit_insn(&code, true, 0x89, RSI, reg_op(RAX));    // mov rax, rsi
+#endif
+    emit_insn(&code, true, 0x8b, MEM, mem_op(CTX, -1, 1, offsetof(struct jit, memory)));
+    emit_insn(&code, true, 0x8b, BUDGET, mem_op(CTX, -1, 1, offsetof(struct jit, budget)));
+    emit_insn(&code, true, 0x8b, FLAGS, mem_op(CTX, -1, 1, offsetof(struct jit, flags_result)));
+    for(int i = 0; i < 16; ++i)
+    {
+        if(host_regs[i] >= 0)
+            emit_mov_load(&code, host_regs[i], mem_op(CTX, -1, 1, offsetof(struct jit, regs) + 4 * i));
+    }
+    emit_insn(&code, false, 0xff, 4, reg_op(RAX));     // jmp rax
+
+    jit->exit = code;
+    for(int i = 0; i < 16; ++i)
+    {
+        if(host_regs[i] >= 0)
+            emit_mov_store(&code, mem_op(CTX, -1, 1, offsetof(struct jit, regs) + 4 * i), host_regs[i]);
+    }
+    emit_insn(&code, true, 0x89, FLAGS, mem_op(CTX, -1, 1, offsetof(struct jit, flags_result)));
+    emit_insn(&code, true, 0x89, BUDGET, mem_op(CTX, -1, 1, offsetof(struct jit, budget)));
+    emit_insn(&code, true, 0x89, RDX, mem_op(CTX, -1, 1, offsetof(struct jit, stub)));
+
+    for(int i = sizeof(saved) - 1; i >= 0; --i)
+    {
+        if(saved[i] & 8)
+            emit8(&code, 0x41);
+        emit8(&code, 0x58 + (saved[i] & 7));
+    }
+    emit8(&code, 0xc3);                                 // ret
+
+    memcpy(&jit->enter, &enter, sizeof(enter));
+    jit->prologue_sz = code - jit->code;
+    jit->code_used = jit->prologue_sz;
+}
+
+// Reads instruction at given address the same way as vm_decode. Returns false if it can't be compiled.
+static bool jit_read(struct jit* jit, uint32_t pc, struct jit_inst* inst)
+{
+    struct virtual_machine* vm = jit->vm;
+
+    uint8_t bytes[4] = {0};
+    for(uint32_t i = 0; i < 4 && pc + i < vm->mem_sz; ++i)
+        bytes[i] = vm->memory[pc + i];
+
+    uint8_t opcode = bytes[0];
+    if(opcode >= NUM_HANDLERS || vm->handlers[opcode] == NULL)
+        return false;
+
+    // Vector instructions are left to interpreter, whose host kernels process whole arrays in one go anyway.
+    if(opcode >= 0x22 && opcode <= 0x2e)
+        return false;
+
+    bool reg_inst = instruction_widths[opcode] == 2;
+
+    inst->opcode = opcode;
+    inst->reg = bytes[1] & 0xf;
+    inst->addr_reg = bytes[1] >> 4;
+    inst->addr = reg_inst ? 0 : bytes[2] | bytes[3] << 8;
+    inst->imm = (int16_t) inst->addr;
+    inst->pc = pc;
+    inst->next_pc = pc + (reg_inst ? 2 : 4);
+
+    // Load of constant is compiled as its immediate form, just like vm_decode does.
+    if(vm->verified != NULL && (vm->verified[pc] & VERIFIER_FOLDED) && vm_immediate_form(opcode) != 0)
+    {
+        inst->opcode = vm_immediate_form(opcode);
+        memcpy(&inst->imm, vm->memory + inst->addr, sizeof(inst->imm));
+    }
+
+    return true;
+}
+
+// Emits code of conditional or unconditional jump ending the block.
+static void emit_jump(struct jit* jit, uint8_t** code, const struct jit_inst* inst, struct jit_pending* pending, int* num_pending)
+{
+    uint32_t mem_sz = jit->vm->mem_sz;
+
+    emit_mov_load(code, RAX, guest(inst->addr_reg));
+    emit_alu_imm(code, false, 0, reg_op(RAX), inst->addr);
+    emit_insn(code, false, 0x0fb7, RAX, reg_op(RAX));  // movzx eax, ax
+    if(!jit_verified(jit, inst->pc))
+    {
+        emit_alu_imm(code, false, 7, reg_op(RAX), mem_sz);
+        pending[(*num_pending)++] = (struct jit_pending) {emit_jcc(code, COND_AE), JIT_EXIT_FAIL, inst->next_pc, 0};
+    }
+
+    uint8_t* not_taken = NULL;
+    // Flags are materialized only here, from the recorded result.
+    if(inst->opcode == 0x0d)        // JP: result in range [1, INT32_MAX].
+    {
+        emit_insn(code, true, 0x8d, RCX, mem_op(FLAGS, -1, 1, -1));   // lea rcx, [flags - 1]
+        emit_alu_imm(code, true, 7, reg_op(RCX), INT32_MAX);
+        not_taken = emit_jcc(code, COND_AE);
+    }
+    else if(inst->opcode == 0x0e)   // JN: negative result.
+    {
+        emit_insn(code, true, 0x85, FLAGS, reg_op(FLAGS));
+        not_taken = emit_jcc(code, COND_NS);
+    }
+    else if(inst->opcode == 0x0f)   // JZ: zero result.
+    {
+        emit_insn(code, true, 0x85, FLAGS, reg_op(FLAGS));
+        not_taken = emit_jcc(code, COND_NE);
+    }
+
+    // Most jumps go to a label with unchanged address register, so the target seen now is chained directly.
+    uint16_t expected = inst->addr + jit->regs[inst->addr_reg];
+    if(expected < mem_sz)
+    {
+        emit_alu_imm(code, false, 7, reg_op(RAX), expected);
+        uint8_t* other = emit_jcc(code, COND_NE);
+        emit_chain(jit, code, expected);
+        patch_jump(other, *code);
+    }
+    emit_indirect(jit, code);
+
+    if(not_taken != NULL)
+    {
+        patch_jump(not_taken, *code);
+        emit_chain(jit, code, inst->next_pc);
+    }
+}
+
+// Compiles block starting at given address. Returns its entry or NULL if first instruction can't be compiled.
+static void* jit_compile(struct jit* jit, uint32_t start)
+{
+    struct virtual_machine* vm = jit->vm;
+
+    struct jit_inst insts[JIT_MAX_BLOCK];
+    int num_insts = 0;
+    uint32_t pc = start;
+    while(num_insts < JIT_MAX_BLOCK && pc < vm->mem_sz && jit_read(jit, pc, &insts[num_insts]))
+    {
+        uint8_t opcode = insts[num_insts].opcode;
+        pc = insts[num_insts++].next_pc;
+        if(opcode >= 0x0c && opcode <= 0x0f)   // Jumps end the block.
+            break;
+    }
+
+    if(num_insts == 0)
+        return NULL;
+
+    if(JIT_CODE_SIZE - jit->code_used < JIT_BLOCK_SLACK)
+        jit_flush(jit);
+
+    struct jit_pending pending[2 * JIT_MAX_BLOCK + 1];
+    int num_pending = 0;
+    struct jit_paged paged[JIT_MAX_BLOCK];
+    int num_paged = 0;
+    uint8_t* entry = jit->code + jit->code_used;
+    uint8_t* code = entry;
+    bool ended = false;
+
+    // Whole block is paid for up front and unexecuted part is refunded on early exits.
+    emit_alu_imm(&code, true, 7, reg_op(BUDGET), num_insts);
+    pending[num_pending++] = (struct jit_pending) {emit_jcc(&code, COND_B), JIT_EXIT_BUDGET, start, 0};
+    emit_alu_imm(&code, true, 5, reg_op(BUDGET), num_insts);
+
+    for(int i = 0; i < num_insts && !ended; ++i)
+    {
+        const struct jit_inst* inst = &insts[i];
+        uint32_t refund = num_insts - i - 1;
+        struct operand dest = guest(inst->reg);
+        struct operand src, mem;
+        struct jit_paged* access = NULL;
+
+        bool mem_inst = (inst->opcode & 1) == 0 && inst->opcode >= 0x02 && inst->opcode <= 0x12 && !(inst->opcode >= 0x0c && inst->opcode <= 0x0f);
+        if(mem_inst)
+        {
+            if(inst->addr >= vm->mem_sz)    // Handler would fail no matter what.
+            {
+                emit_exit(jit, &code, JIT_EXIT_FAIL, inst->next_pc, refund);
+                ended = true;
+                break;
+            }
+            if(jit_verified(jit, inst->pc))
+                mem = emit_address(jit, &code, inst, NULL);
+            else
+            {
+                access = &paged[num_paged++];
+                access->refund = refund + 1;
+                mem = emit_address(jit, &code, inst, access);
+                access->resume = code;
+            }
+        }
+
+        for(uint32_t addr = inst->pc; addr < inst->next_pc && addr < vm->mem_sz; ++addr)
+            jit->code_map[addr + 4] = 1;
+
+        switch(inst->opcode)
+        {
+            case 0x00:  // NOP
+                break;
+            case 0x02:  // A
+            case 0x04:  // S
+                emit_mov_load(&code, RAX, mem);
+                emit_insn(&code, false, inst->opcode == 0x02 ? 0x01 : 0x29, RAX, dest);
+                emit_flags(&code, dest);
+                break;
+            case 0x03:  // AR
+            case 0x05:  // SR
+                src = emit_source(&code, inst->addr_reg);
+                emit_insn(&code, false, inst->opcode == 0x03 ? 0x01 : 0x29, src.reg, dest);
+                emit_flags(&code, dest);
+                break;
+            case 0x06:  // M
+            case 0x07:  // MR
+                if(inst->opcode == 0x06)
+                {
+                    emit_mov_load(&code, RAX, mem);
+                    src = reg_op(RAX);
+                }
+                else
+                {
+                    src = emit_source(&code, inst->addr_reg);
+                }
+                emit_mov_load(&code, RCX, dest);
+                emit_insn(&code, false, 0x0faf, RCX, src);     // imul ecx, src
+                emit_mov_store(&code, dest, RCX);
+                emit_flags(&code, dest);
+                break;
+            case 0x08:  // D
+                emit_mov_load(&code, RCX, mem);
+                emit_divide(&code, inst->reg);
+                break;
+            case 0x09:  // DR
+                emit_mov_load(&code, RCX, guest(inst->addr_reg));
+                emit_divide(&code, inst->reg);
+                break;
+            case 0x0a:  // C
+            case 0x0b:  // CR
+                if(inst->opcode == 0x0a)
+                {
+                    emit_mov_load(&code, RAX, mem);
+                    src = reg_op(RAX);
+                }
+                else
+                {
+                    src = emit_source(&code, inst->addr_reg);
+                }
+                emit_mov_load(&code, RCX, dest);
+                emit_insn(&code, false, 0x29, src.reg, reg_op(RCX));  // sub ecx, src
+                emit_flags(&code, reg_op(RCX));
+                break;
+            case 0x0c:  // J
+            case 0x0d:  // JP
+            case 0x0e:  // JN
+            case 0x0f:  // JZ
+                emit_jump(jit, &code, inst, pending, &num_pending);
+                ended = true;
+                break;
+            case 0x10:  // L
+                emit_mov_load(&code, RCX, mem);
+                emit_mov_store(&code, dest, RCX);
+                break;
+            case 0x11:  // LR
+                src = emit_source(&code, inst->addr_reg);
+                emit_mov_store(&code, dest, src.reg);
+                break;
+            case 0x12:  // ST
+            {
+                if(dest.mem)
+                {
+                    emit_mov_load(&code, RCX, dest);
+                    dest = reg_op(RCX);
+                }
+                emit_mov_store(&code, mem, dest.reg);
+                if(access == NULL)  // Verified store never reaches code.
+                    break;
+
+                // Stores inside memory image invalidate decoded ops, stores over compiled code invalidate blocks.
+                // Stores to paged memory skip both.
+                emit_insn(&code, false, 0xc6, 0, mem_op(CTX, -1, 1, offsetof(struct jit, dirty)));
+                emit8(&code, 1);
+                emit_mov_imm64(&code, RCX, (uintptr_t) (jit->code_map + 4));
+                emit_mov_load(&code, RCX, mem_op(RCX, RAX, 1, 0));
+                emit_insn(&code, false, 0x85, RCX, reg_op(RCX));
+                pending[num_pending++] = (struct jit_pending) {emit_jcc(&code, COND_NE), JIT_EXIT_SMC, inst->next_pc, refund};
+                access->resume = code;
+                break;
+            }
+            case 0x14:  // LA
+                emit_mov_load(&code, RAX, guest(inst->addr_reg));
+                emit_alu_imm(&code, false, 0, reg_op(RAX), inst->addr);
+                emit_mov_store(&code, dest, RAX);
+                break;
+            case 0x16:  // AI
+            case 0x18:  // SI
+                emit_alu_imm(&code, false, inst->opcode == 0x16 ? 0 : 5, dest, inst->imm);
+                emit_flags(&code, dest);
+                break;
+            case 0x1a:  // MI
+                emit_mov_load(&code, RCX, dest);
+                emit_insn(&code, false, 0x69, RCX, reg_op(RCX));   // imul ecx, ecx, imm
+                emit32(&code, inst->imm);
+                emit_mov_store(&code, dest, RCX);
+                emit_flags(&code, dest);
+                break;
+            case 0x1c:  // DI
+                emit_mov_imm(&code, reg_op(RCX), inst->imm);
+                emit_divide(&code, inst->reg);
+                break;
+            case 0x1e:  // CI
+                emit_mov_load(&code, RCX, dest);
+                emit_alu_imm(&code, false, 5, reg_op(RCX), inst->imm);    // sub ecx, imm
+                emit_flags(&code, reg_op(RCX));
+                break;
+            case 0x20:  // LI
+                emit_mov_imm(&code, dest, inst->imm);
+                break;
+        }
+    }
+
+    if(!ended)
+        emit_chain(jit, &code, pc);
+
+    for(int i = 0; i < num_pending; ++i)
+    {
+        patch_jump(pending[i].jump, code);
+        emit_exit(jit, &code, pending[i].reason, pending[i].pc, pending[i].refund);
+    }
+
+    for(int i = 0; i < num_paged; ++i)
+        emit_paged(jit, &code, &paged[i]);
+
+    jit->code_used = code - jit->code;
+    jit->entries[start] = entry;
+    return entry;
+}
+
+// Marks code verifier followed and constants it folded in code map, so that generated stores leave when they write
+// there. Proofs don't hold anymore then, see vm_unverify.
+static void jit_map_verified(struct jit* jit)
+{
+    const struct virtual_machine* vm = jit->vm;
+    for(uint32_t addr = 0; vm->verified != NULL && addr < vm->mem_sz; ++addr)
+        jit->code_map[addr + 4] |= (vm->verified[addr] & (VERIFIER_CODE | VERIFIER_CONST)) != 0;
+}
+
+struct jit* jit_create(struct virtual_machine* vm)
+{
+#ifdef _WIN32
+    uint8_t* code = VirtualAlloc(NULL, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    if(code == NULL)
+        return NULL;
+#else
+    uint8_t* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED)
+        return NULL;
+#endif
+
+    struct jit* jit = calloc(1, sizeof(struct jit));
+    jit->vm = vm;
+    jit->memory = vm->memory;
+    jit->code = code;
+    jit->entries = calloc(vm->mem_sz, sizeof(void*));
+    jit->code_map = calloc(vm->mem_sz + 8, 1);
+    jit_map_verified(jit);
+
+    emit_prologue(jit);
+    return jit;
+}
+
+void jit_flush(struct jit* jit)
+{
+    memset(jit->entries, 0, jit->vm->mem_sz * sizeof(void*));
+    memset(jit->code_map, 0, jit->vm->mem_sz + 8);
+    jit_map_verified(jit);
+    jit->code_used = jit->prologue_sz;
+    jit->generation += 1;
+    jit->memory = jit->vm->memory;  // Memory might have been replaced, e.g. by snapshot_restore.
+}
+
+void jit_free(struct jit* jit)
+{
+    if(jit == NULL)
+        return;
+
+#ifdef _WIN32
+    VirtualFree(jit->code, 0, MEM_RELEASE);
+#else
+    munmap(jit->code, JIT_CODE_SIZE);
+#endif
+    free(jit->entries);
+    free(jit->code_map);
+    free(jit);
+}
+
+// Checks if interpreted vector instruction is going to write into compiled code.
+static bool jit_vector_hits_code(const struct jit* jit, const struct vm_op* op)
+{
+    const struct virtual_machine* vm = jit->vm;
+    if(op->handler != handle_VA && op->handler != handle_VS && op->handler != handle_VM)
+        return false;
+
+    uint32_t dest, src, count, begin, end;
+    if(!vm_vector_arrays(vm, op, &dest, &src, &count))
+        return false;
+
+    // Only the chunk handler processes in this cycle is written.
+    vm_vector_chunk(vm, op, count, &begin, &end);
+    dest += 4 * begin;
+    for(uint32_t offset = 0; offset < (end - begin) * 4; ++offset)
+    {
+        uint32_t addr = dest + offset;
+        if(addr < vm->mem_sz && jit->code_map[addr + 4])
+            return true;
+    }
+
+    return false;
+}
+
+// Executes single instruction with interpreter, for cases generated code can't handle.
+static int jit_interpret(struct jit* jit, uint64_t* budget)
+{
+    struct virtual_machine* vm = jit->vm;
+
+    if(jit->dirty)
+    {
+        vm_decode_range(vm, 0, vm->mem_sz + 4);
+        jit->dirty = 0;
+    }
+
+    memcpy(vm->regs, jit->regs, sizeof(jit->regs));
+    vm->flags_result = jit->flags_result;
+    vm->pc = jit->pc;
+
+    if(vm->ops[vm->pc].handler == NULL)
+        vm_decode_page(vm, vm->pc);
+
+    // Interpreted store might overwrite compiled code, which only generated stores check for. Stores to paged memory
+    // can't, as code is only compiled from program's memory.
+    const struct vm_op* op = &vm->ops[vm->pc];
+    uint32_t target = op->addr + (uint32_t) vm->regs[op->addr_reg];
+    if((op->handler == handle_ST && (target < vm->mem_sz || target > UINT32_MAX - 3)) || jit_vector_hits_code(jit, op))
+        jit_flush(jit);
+
+    if(vm->pc >= vm->mem_sz)
+        return 1;
+
+    // Handler is called directly, retired instructions are counted by jit_run.
+    vm->pc = op->next_pc;
+    int result = op->handler(vm, op) ? 0 : 2;
+    if(result == 0)
+        *budget -= 1;
+
+    memcpy(jit->regs, vm->regs, sizeof(jit->regs));
+    jit->flags_result = vm->flags_result;
+    jit->pc = vm->pc;
+    return result;
+}
+
+int jit_run(struct virtual_machine* vm, uint64_t budget)
+{
+    struct jit* jit = vm->jit;
+
+    memcpy(jit->regs, vm->regs, sizeof(jit->regs));
+    jit->flags_result = vm->flags_result;
+    jit->pc = vm->pc;
+
+    uint64_t start = budget;
+    int result = 0;
+    while(budget > 0 && result == 0)
+    {
+        if(jit->pc >= vm->mem_sz)   // No more instructions to perform.
+        {
+            result = 1;
+            break;
+        }
+
+        void* entry = jit->entries[jit->pc];
+        if(entry == NULL)
+            entry = jit_compile(jit, jit->pc);
+
+        if(entry == NULL)
+        {
+            result = jit_interpret(jit, &budget);
+            continue;
+        }
+
+        jit->budget = budget;
+        enum jit_exit reason = jit->enter(jit, entry);
+        budget = jit->budget;
+
+        switch(reason)
+        {
+            case JIT_EXIT_DISPATCH:
+                break;
+            case JIT_EXIT_CHAIN:
+                if(jit->pc < vm->mem_sz)
+                {
+                    uint32_t generation = jit->generation;
+                    uint8_t* stub = jit->stub;
+                    uint8_t* target = jit->entries[jit->pc];
+                    if(target == NULL)
+                        target = jit_compile(jit, jit->pc);
+
+                    if(target != NULL && generation == jit->generation)
+                    {
+                        uint8_t* jump = stub;
+                        patch_jump(emit_jmp(&jump), target);
+                    }
+                }
+                break;
+            case JIT_EXIT_FAIL:
+                budget += 1;    // Failed instruction was paid for, but doesn't retire.
+                result = 2;
+                break;
+            case JIT_EXIT_SMC:
+                vm_unverify(vm);    // Compiled code is code verifier followed too, if program is verified.
+                jit_flush(jit);
+                break;
+            case JIT_EXIT_BUDGET:
+                if(budget > 0)  // Blocks entered through chaining might find budget already used up.
+                    result = jit_interpret(jit, &budget);
+                break;
+            case JIT_EXIT_PAGED:
+                result = jit_interpret(jit, &budget);
+                break;
+        }
+    }
+
+    memcpy(vm->regs, jit->regs, sizeof(jit->regs));
+    vm->flags_result = jit->flags_result;
+    vm->pc = jit->pc;
+    vm->retired += start - budget;
+
+    if(jit->dirty)
+    {
+        vm_decode_range(vm, 0, vm->mem_sz + 4);
+        jit->dirty = 0;
+    }
+
+    return result;
+}
+
+#else
+
+struct jit* jit_create(struct virtual_machine* vm)
+{
+    UNUSED(vm);
+
+    return NULL;
+}
+
+int jit_run(struct virtual_machine* vm, uint64_t budget)
+{
+    UNUSED(vm);
+    UNUSED(budget);
+
+    return 2;
+}
+
+void jit_flush(struct jit* jit)
+{
+    UNUSED(jit);
+}
+
+void jit_free(struct jit* jit)
+{
+    UNUSED(jit);
+}
+
+#endif
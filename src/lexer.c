@@ -0,0 +1,117 @@
+#include "lexer.h"
+
+#include <string.h>
+
+#define LEXER_NUMBER_LIMIT ((int64_t) 1 << 48)  // Absolute value at which numbers stop growing.
+
+// Characters that end a word. '\0' is a delimiter as well, so that words stop at stray null bytes.
+static bool lexer_is_delimiter(char c)
+{
+    switch(c)
+    {
+        case ' ': case '\t': case '\r': case '\v': case '\f': case '\0':
+        case ',': case '(': case ')': case '*': case '#':
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Reads value of word if it's a number, i.e. optional sign followed by digits only.
+static bool lexer_parse_number(const char* text, uint32_t length, int64_t* value)
+{
+    uint32_t i = 0;
+    bool negative = false;
+    if(length > 1 && (text[0] == '-' || text[0] == '+'))
+    {
+        negative = text[0] == '-';
+        i = 1;
+    }
+
+    int64_t result = 0;
+    for(; i < length; ++i)
+    {
+        if(text[i] < '0' || text[i] > '9')
+            return false;
+
+        if(result < LEXER_NUMBER_LIMIT)
+            result = result * 10 + (text[i] - '0');
+    }
+
+    *value = negative ? -result : result;
+    return true;
+}
+
+void lexer_init(struct lexer* lexer, const char* data, size_t size)
+{
+    lexer->pos = data;
+    lexer->end = data + size;
+    lexer->line_start = data;
+    lexer->line_end = data;
+    lexer->next_line = data;
+    lexer->line = 0;
+    lexer->column = 0;
+}
+
+bool lexer_next_line(struct lexer* lexer)
+{
+    if(lexer->next_line == NULL || lexer->next_line >= lexer->end)
+        return false;
+
+    const char* start = lexer->next_line;
+    const char* line_break = memchr(start, '\n', lexer->end - start);
+
+    lexer->line_start = start;
+    lexer->line_end = line_break != NULL ? line_break : lexer->end;
+    lexer->next_line = line_break != NULL ? line_break + 1 : lexer->end;
+    lexer->pos = start;
+    lexer->line += 1;
+    lexer->column = 1;
+
+    // Line break of Windows files is "\r\n".
+    if(lexer->line_end > start && lexer->line_end[-1] == '\r')
+        lexer->line_end -= 1;
+
+    return true;
+}
+
+struct token lexer_next(struct lexer* lexer)
+{
+    const char* pos = lexer->pos;
+    const char* end = lexer->line_end;
+
+    while(pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\v' || *pos == '\f'))
+        ++pos;
+
+    struct token token = {TOKEN_END, pos, 0, (uint32_t) (pos - lexer->line_start) + 1, 0};
+
+    if(pos == end || *pos == '#')
+        pos = end;
+    else
+    {
+        token.length = 1;
+        switch(*pos)
+        {
+            case ',': token.type = TOKEN_COMMA; break;
+            case '(': token.type = TOKEN_LPAREN; break;
+            case ')': token.type = TOKEN_RPAREN; break;
+            case '*': token.type = TOKEN_STAR; break;
+            default:
+                while(pos + token.length < end && !lexer_is_delimiter(pos[token.length]))
+                    ++token.length;
+                token.type = lexer_parse_number(pos, token.length, &token.value) ? TOKEN_NUMBER : TOKEN_WORD;
+                break;
+        }
+        pos += token.length;
+    }
+
+    lexer->pos = pos;
+    lexer->column = token.column;
+
+    return token;
+}
+
+bool token_is_word(const struct token* token, const char* word)
+{
+    return token->type == TOKEN_WORD && strncmp(token->text, word, token->length) == 0 && word[token->length] == '\0';
+}
@@ -1,48 +1,409 @@
-#include <conio.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <conio.h>
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #include "assembler.h"
-#include "display.h"
+#include "hbc.h"
+#include "object.h"
+#include "paged_memory.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "verifier.h"
 #include "virtual_machine.h"
 
-int main(int argc, char* argv[])
+#ifdef _WIN32
+#include "display.h"
+#endif
+
+#define HEADLESS_SLICE (1 << 14)    // Cycles executed between checks of time limit, at most a million vector elements.
+
+// Returns seconds elapsed since some fixed point in the past.
+static double wall_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// Prints string as JSON string literal.
+static void print_json_string(FILE* out, const char* str)
 {
-    if(argc != 2)
+    fputc('"', out);
+    for(; *str != '\0'; ++str)
     {
-        fprintf(stderr, "Wrong number of arguments. Use: hasm <file.hasm>\n");
-        return -1;
+        unsigned char c = *str;
+        if(c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if(c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// Prints final state of virtual machine as JSON object, without newline after it. Machine that didn't exit was
+// stopped by step limit if it retired max_steps instructions, by time limit otherwise.
+static void print_headless(const char* filename, const struct virtual_machine* vm, int result, uint64_t max_steps,
+    double elapsed)
+{
+    const char* status;
+    if(result == 1)
+        status = "finished";
+    else if(result == 2)
+        status = "failed";
+    else if(max_steps != 0 && vm->retired >= max_steps)
+        status = "step_limit";
+    else
+        status = "time_limit";
+
+    printf("{\n  \"file\": ");
+    print_json_string(stdout, filename);
+    printf(",\n  \"status\": \"%s\",\n", status);
+    printf("  \"exit_code\": %d,\n", result);
+    printf("  \"pc\": %u,\n", vm->pc);
+    printf("  \"flags\": %d,\n", vm_get_flags(vm));
+    printf("  \"registers\": [");
+    for(int i = 0; i < 16; ++i)
+        printf(i == 0 ? "%d" : ", %d", vm->regs[i]);
+    printf("],\n");
+    printf("  \"paged_bytes\": %llu,\n", (unsigned long long) vm->paged->num_pages * PAGED_PAGE_SZ);
+
+    uint32_t verified = 0;  // Instructions running without bounds checks.
+    uint32_t folded = 0;    // Loads running as immediate instructions.
+    for(uint32_t addr = 0; vm->verified != NULL && addr < vm->mem_sz; ++addr)
+    {
+        verified += (vm->verified[addr] & VERIFIER_SAFE) != 0;
+        folded += (vm->verified[addr] & VERIFIER_FOLDED) != 0;
+    }
+    printf("  \"verified\": %u,\n", verified);
+    printf("  \"folded\": %u,\n", folded);
+    printf("  \"retired\": %llu,\n", (unsigned long long) vm->retired);
+    printf("  \"wall_time\": %.9f\n}", elapsed);
+}
+
+// Runs program at full speed without any interface and prints final state of virtual machine as JSON.
+// max_steps and max_time of 0 mean no limit.
+static int run_headless(const char* filename, struct virtual_machine* vm, uint64_t max_steps, double max_time)
+{
+    int result = 0;
+    double start = wall_time();
+
+    if(max_steps == 0 && max_time == 0)
+        result = vm_run(vm);
+    else
+    {
+        while(result == 0)
+        {
+            uint64_t left = max_steps != 0 ? max_steps - vm->retired : UINT64_MAX;
+            if(left == 0)
+                break;
+
+            if(max_time != 0 && wall_time() - start >= max_time)
+                break;
+
+            uint64_t slice = max_time != 0 ? HEADLESS_SLICE : INT32_MAX;
+            result = vm_forward(vm, left < slice ? (int) left : (int) slice);
+        }
     }
 
+    print_headless(filename, vm, result, max_steps, wall_time() - start);
+    printf("\n");
+    return result;
+}
+
+// One of machines run by run_instances.
+struct headless_instance
+{
+    struct virtual_machine vm;
     int result;
+    double start;       // Time all instances were started at.
+    double elapsed;     // Time from start until the instance exited or reached its limit.
+};
 
-    struct program program;
-    const char* filename = argv[1];
+static void instance_done(struct virtual_machine* vm, int exit_code, void* user_data)
+{
+    UNUSED(vm);
+    struct headless_instance* instance = user_data;
+    instance->result = exit_code;
+    instance->elapsed = wall_time() - instance->start;
+}
 
-    printf("Assembling %s...\n", filename);
-    result = hasm_assemble(filename, &program);
-    if(result != 0)
+// Runs given number of instances of program in parallel, each forked from virtual machine's current state, and
+// prints JSON array of their final states in order. Limits apply to every instance separately, time limit counts only
+// time instance was actually running. Returns 0 if all instances were run.
+static int run_instances(const char* filename, struct virtual_machine* vm, uint32_t num_instances, uint64_t max_steps,
+    double max_time)
+{
+    struct snapshot snapshot;
+    if(snapshot_take(vm, &snapshot) != 0)
+    {
+        fprintf(stderr, "Error while taking snapshot of virtual machine!\n");
+        return -1;
+    }
+
+    struct headless_instance* instances = calloc(num_instances, sizeof(struct headless_instance));
+    struct scheduler* scheduler = instances != NULL ? scheduler_create(0, HEADLESS_SLICE) : NULL;
+    if(scheduler == NULL)
+    {
+        fprintf(stderr, "Error while starting scheduler!\n");
+        free(instances);
+        snapshot_free(&snapshot);
+        return -1;
+    }
+
+    double start = wall_time();
+    uint32_t started = 0;
+    for(; started < num_instances; ++started)
     {
-        fprintf(stderr, "Error while assembling %s! Error code: %d\n", filename, result);
+        struct headless_instance* instance = &instances[started];
+        instance->start = start;
+        if(snapshot_fork(&snapshot, &instance->vm) != 0)
+            break;
+
+        if(scheduler_submit(scheduler, &instance->vm, max_steps, max_time, instance_done, instance) != 0)
+        {
+            vm_finalize(&instance->vm);
+            break;
+        }
+    }
+
+    scheduler_destroy(scheduler);
+    snapshot_free(&snapshot);
+    if(started < num_instances)
+        fprintf(stderr, "Error while starting instance %u!\n", started);
+
+    printf("[\n");
+    for(uint32_t i = 0; i < started; ++i)
+    {
+        print_headless(filename, &instances[i].vm, instances[i].result, max_steps, instances[i].elapsed);
+        printf(i + 1 < started ? ",\n" : "\n");
+        vm_finalize(&instances[i].vm);
+    }
+    printf("]\n");
+
+    free(instances);
+    return started == num_instances ? 0 : -1;
+}
+
+// Writes profile to file using given writer. Nothing is written if filename is NULL.
+static void write_profile(const char* filename, const struct profiler* profiler, const struct program* program,
+    void (*writer)(const struct profiler*, const struct program*, FILE*))
+{
+    if(filename == NULL)
+        return;
+
+    FILE* file = fopen(filename, "w");
+    if(file == NULL)
+    {
+        fprintf(stderr, "Couldn't open %s for writing profile!\n", filename);
+        return;
+    }
+
+    writer(profiler, program, file);
+    fclose(file);
+}
+
+// Returns whether file name ends with given extension.
+static bool has_extension(const char* filename, const char* extension)
+{
+    size_t length = strlen(filename), extension_length = strlen(extension);
+    return length >= extension_length && strcmp(filename + length - extension_length, extension) == 0;
+}
+
+// Loads program from .hbc file, from cache or by assembling source. Assembled program is also saved to emit_file
+// and cache, unless they are NULL. Errors are printed here. Returns 0 on success.
+static int load_program(const char* filename, const char* cache_dir, const char* emit_file, uint32_t asm_threads,
+    struct program* program, FILE* log)
+{
+    int result;
+
+    if(has_extension(filename, ".hbc"))
+    {
+        fprintf(log, "Loading %s...\n", filename);
+        result = hbc_load(filename, NULL, program);
+        if(result != 0)
+            fprintf(stderr, "Error while loading %s! Error code: %d\n", filename, result);
         return result;
     }
 
-    struct virtual_machine vm;
+    struct source_file source;
+    if(source_file_open(&source, filename) != 0)
+    {
+        fprintf(stderr, "Error while assembling %s! Error code: %d\n", filename, 2);
+        return 2;
+    }
 
-    printf("Initializing virtual machine...\n");
-    result = vm_init(program, &vm);
-    if(result != 0)
+    if(cache_dir != NULL && hbc_cache_load(cache_dir, &source, program) == 0)
+        fprintf(log, "Loaded %s from cache.\n", filename);
+    else
     {
-        fprintf(stderr, "Error while initializing virtual machine! Error code: %d\n", result);
+        struct asm_location location = {0, 0};
+
+        fprintf(log, "Assembling %s...\n", filename);
+        result = hasm_assemble_source(&source, program, &location, asm_threads);
+        if(result != 0)
+        {
+            if(location.line != 0)
+                fprintf(stderr, "Error while assembling %s at line %u, column %u! Error code: %d\n", filename,
+                    location.line, location.column, result);
+            else
+                fprintf(stderr, "Error while assembling %s! Error code: %d\n", filename, result);
+
+            source_file_close(&source);
+            return result;
+        }
+
+        if(cache_dir != NULL && hbc_cache_store(cache_dir, &source, program) != 0)
+            fprintf(stderr, "Couldn't store %s in cache %s!\n", filename, cache_dir);
+    }
+
+    if(emit_file != NULL && hbc_save(program, &source, emit_file) != 0)
+        fprintf(stderr, "Couldn't write %s!\n", emit_file);
+
+    source_file_close(&source);
+    return 0;
+}
+
+// Loads object unit from .hbo file, from cache or by assembling source. If compile is set, unit assembled from source
+// is also saved next to it, as file of the same name with .hbo extension. Errors are printed here. Returns 0 on success.
+static int load_object(const char* filename, const char* cache_dir, bool compile, struct object* object, FILE* log)
+{
+    int result;
+
+    if(has_extension(filename, ".hbo"))
+    {
+        fprintf(log, "Loading %s...\n", filename);
+        result = hbc_load_object(filename, NULL, object);
+        if(result != 0)
+            fprintf(stderr, "Error while loading %s! Error code: %d\n", filename, result);
         return result;
     }
 
+    struct source_file source;
+    if(source_file_open(&source, filename) != 0)
+    {
+        fprintf(stderr, "Error while assembling %s! Error code: %d\n", filename, 2);
+        return 2;
+    }
+
+    if(cache_dir != NULL && hbc_cache_load_object(cache_dir, &source, object) == 0)
+        fprintf(log, "Loaded %s from cache.\n", filename);
+    else
+    {
+        struct asm_location location = {0, 0};
+
+        fprintf(log, "Assembling %s...\n", filename);
+        result = hasm_assemble_object(&source, object, &location);
+        if(result != 0)
+        {
+            if(location.line != 0)
+                fprintf(stderr, "Error while assembling %s at line %u, column %u! Error code: %d\n", filename,
+                    location.line, location.column, result);
+            else
+                fprintf(stderr, "Error while assembling %s! Error code: %d\n", filename, result);
+
+            source_file_close(&source);
+            return result;
+        }
+
+        if(cache_dir != NULL && hbc_cache_store_object(cache_dir, &source, object) != 0)
+            fprintf(stderr, "Couldn't store %s in cache %s!\n", filename, cache_dir);
+    }
+
+    if(compile)
+    {
+        // "unit.hasm" becomes "unit.hbo", other names just get extension appended.
+        size_t length = strlen(filename);
+        if(has_extension(filename, ".hasm"))
+            length -= 5;
+
+        char* object_file = malloc(length + 5);
+        if(object_file != NULL)
+        {
+            memcpy(object_file, filename, length);
+            strcpy(object_file + length, ".hbo");
+        }
+
+        if(object_file == NULL || hbc_save_object(object, &source, object_file) != 0)
+            fprintf(stderr, "Couldn't write object of %s!\n", filename);
+        else
+            fprintf(log, "Written %s.\n", object_file);
+        free(object_file);
+    }
+
+    source_file_close(&source);
+    return 0;
+}
+
+// Loads object units from files and links them into program, which is also saved to emit_file unless it's NULL.
+// Errors are printed here. Returns 0 on success.
+static int link_program(const char** filenames, uint32_t num_files, const char* cache_dir, const char* emit_file,
+    struct program* program, FILE* log)
+{
+    struct object* objects = calloc(num_files, sizeof(struct object));
+    if(objects == NULL)
+    {
+        fprintf(stderr, "Error while linking! Error code: %d\n", 6);
+        return 6;
+    }
+
+    int result = 0;
+    for(uint32_t i = 0; i < num_files && result == 0; ++i)
+        result = load_object(filenames[i], cache_dir, false, &objects[i], log);
+
+    if(result == 0)
+    {
+        struct link_error error = {0, NULL};
+
+        fprintf(log, "Linking...\n");
+        result = object_link(objects, num_files, program, &error);
+        if(result != 0)
+        {
+            if(error.label != NULL)
+                fprintf(stderr, "Error while linking %s, label %s! Error code: %d\n", filenames[error.unit],
+                    error.label, result);
+            else
+                fprintf(stderr, "Error while linking! Error code: %d\n", result);
+        }
+        else if(emit_file != NULL && hbc_save(program, NULL, emit_file) != 0)
+            fprintf(stderr, "Couldn't write %s!\n", emit_file);
+    }
+
+    for(uint32_t i = 0; i < num_files; ++i)
+        object_free(&objects[i]);
+    free(objects);
+
+    return result;
+}
+
+#ifdef _WIN32
+// Runs program step by step in console window, as user requests.
+static int run_interactive(const char* filename, struct virtual_machine* vm, struct program* program)
+{
+    int result;
+
     printf("Initializing console window...\n");
-    result = disp_init(&vm, &program);
+    result = disp_init(vm, program);
     if(result != 0)
     {
         fprintf(stderr, "Error while initializing console window! Error code: %d\n", result);
-        return result;
+        return -1;
     }
 
     char status[100];
@@ -52,7 +413,7 @@ int main(int argc, char* argv[])
         sprintf(status, "File: %s", filename);
         disp_status(status);
 
-        action = disp_update(&vm, &program);
+        action = disp_update(vm, program);
 
         sprintf(status, "Executing...");
         disp_status(status);
@@ -62,23 +423,198 @@ int main(int argc, char* argv[])
                 result = 1;
                 break;
             case 1:
-                result = vm_step(&vm);
+                result = vm_step(vm);
                 break;
             case 2:
-                result = vm_run(&vm);
+                result = vm_run(vm);
                 break;
         }
     }
 
     sprintf(status, "Program exited with code 0x%02x. Press any key to quit...", result);
     disp_status(status);
-    disp_update(&vm, &program);
+    disp_update(vm, program);
     disp_clear();
+    disp_finilize();
+
+    return result;
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    const char** filenames = calloc(argc, sizeof(const char*));
+    uint32_t num_files = 0;
+    bool compile = false;
+    enum vm_engine engine = VM_ENGINE_HANDLERS;
+    bool fusion_report = false;
+    bool verify = true;
+#ifdef _WIN32
+    bool headless = false;
+#else
+    bool headless = true;   // Console interface needs WinAPI.
+#endif
+    uint64_t max_steps = 0;
+    double max_time = 0;
+    const char* profile_file = NULL;
+    const char* folded_file = NULL;
+    uint32_t asm_threads = 1;
+    uint32_t instances = 1;
+    const char* cache_dir = NULL;
+    const char* emit_file = NULL;
+    bool valid = filenames != NULL;
+    for(int i = 1; i < argc && valid; ++i)
+    {
+        char* end;
+        if(strcmp(argv[i], "--engine=handlers") == 0)
+            engine = VM_ENGINE_HANDLERS;
+        else if(strcmp(argv[i], "--engine=threaded") == 0)
+            engine = VM_ENGINE_THREADED;
+        else if(strcmp(argv[i], "--engine=jit") == 0)
+            engine = VM_ENGINE_JIT;
+        else if(strcmp(argv[i], "--fusion-report") == 0)
+            fusion_report = true;
+        else if(strcmp(argv[i], "--no-verify") == 0)
+            verify = false;
+        else if(strcmp(argv[i], "--compile") == 0)
+            compile = true;
+        else if(strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if(strncmp(argv[i], "--max-steps=", 12) == 0)
+        {
+            max_steps = strtoull(argv[i] + 12, &end, 10);
+            valid = argv[i][12] != '\0' && *end == '\0';
+        }
+        else if(strncmp(argv[i], "--max-time=", 11) == 0)
+        {
+            max_time = strtod(argv[i] + 11, &end);
+            valid = argv[i][11] != '\0' && *end == '\0' && max_time >= 0;
+        }
+        else if(strncmp(argv[i], "--asm-threads=", 14) == 0)
+        {
+            asm_threads = strtoul(argv[i] + 14, &end, 10);
+            valid = argv[i][14] != '\0' && *end == '\0';
+        }
+        else if(strncmp(argv[i], "--instances=", 12) == 0)
+        {
+            instances = strtoul(argv[i] + 12, &end, 10);
+            valid = argv[i][12] != '\0' && *end == '\0' && instances > 0;
+        }
+        else if(strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8] != '\0')
+            cache_dir = argv[i] + 8;
+        else if(strncmp(argv[i], "--emit=", 7) == 0 && argv[i][7] != '\0')
+            emit_file = argv[i] + 7;
+        else if(strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10] != '\0')
+            profile_file = argv[i] + 10;
+        else if(strncmp(argv[i], "--folded=", 9) == 0 && argv[i][9] != '\0')
+            folded_file = argv[i] + 9;
+        else if(argv[i][0] != '-' || strcmp(argv[i], "-") == 0)
+            filenames[num_files++] = argv[i];   // "-" reads program from standard input.
+        else
+            valid = false;  // Unknown option.
+    }
+
+    // Instances run in parallel only in headless mode, and profiler can't count instructions of all of them at once.
+    bool profiling = profile_file != NULL || folded_file != NULL;
+    if(instances > 1 && (!headless || profiling))
+        valid = false;
+
+    if(!valid || num_files == 0)
+    {
+        fprintf(stderr, "Wrong arguments. Use: hasm [--engine=handlers|threaded|jit] [--asm-threads=<n>] [--cache=<dir>] "
+            "[--emit=<file.hbc>] [--fusion-report] [--no-verify] [--headless [--max-steps=<n>] [--max-time=<seconds>] [--instances=<n>]] [--profile=<report file>] [--folded=<stacks file>] <file.hasm | file.hbc | -> [<unit.hasm | unit.hbo>...]\n"
+            "       hasm --compile [--cache=<dir>] <unit.hasm>...\n");
+        free(filenames);
+        return -1;
+    }
+
+    const char* filename = filenames[0];
+
+    // Headless output is meant for other programs, so progress messages go to stderr there.
+    FILE* log = headless ? stderr : stdout;
+    int result;
+
+    // Units are only assembled into .hbo files, nothing is run.
+    if(compile)
+    {
+        result = 0;
+        for(uint32_t i = 0; i < num_files && result == 0; ++i)
+        {
+            struct object object = {0};
+            result = load_object(filenames[i], cache_dir, true, &object, log);
+            object_free(&object);
+        }
+
+        free(filenames);
+        return result;
+    }
+
+    struct program program;
+
+    // More files are units linked together into single program.
+    if(num_files > 1)
+        result = link_program(filenames, num_files, cache_dir, emit_file, &program, log);
+    else
+        result = load_program(filename, cache_dir, emit_file, asm_threads, &program, log);
+    free(filenames);
+    if(result != 0)
+        return result;
+
+    struct virtual_machine vm;
+
+    fprintf(log, "Initializing virtual machine...\n");
+    result = vm_init_engine(program, &vm, engine);
+    if(result != 0)
+    {
+        fprintf(stderr, "Error while initializing virtual machine! Error code: %d\n", result);
+        return result;
+    }
+
+    // Program that can't be verified simply runs with all bounds checks.
+    if(verify)
+    {
+        fprintf(log, "Verifying program...\n");
+        vm_verify(&vm);
+    }
+
+    struct profiler profiler;
+    if(profiling && profiler_init(&profiler, &vm) != 0)
+    {
+        fprintf(stderr, "Error while initializing profiler!\n");
+        return -1;
+    }
+
+#ifdef _WIN32
+    if(instances > 1)
+        result = run_instances(filename, &vm, instances, max_steps, max_time);
+    else if(headless)
+        result = run_headless(filename, &vm, max_steps, max_time);
+    else
+        result = run_interactive(filename, &vm, &program);
+#else
+    if(instances > 1)
+        result = run_instances(filename, &vm, instances, max_steps, max_time);
+    else
+        result = run_headless(filename, &vm, max_steps, max_time);
+#endif
+
+    if(fusion_report)
+        vm_fusion_report(&vm, log);
+
+    if(profiling)
+    {
+        write_profile(profile_file, &profiler, &program, profiler_report);
+        write_profile(folded_file, &profiler, &program, profiler_folded);
+        profiler_free(&profiler);
+    }
 
     vm_finalize(&vm);
     source_code_free(&program.source);
-    disp_finilize();
+    sym_table_free(&program.symbols);
+
+    if(result < 0)
+        return result;
 
-    printf("Goodbye.\n");
+    fprintf(log, "Goodbye.\n");
     return 0;
 }
@@ -0,0 +1,202 @@
+#include "object.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stores cause of error and returns given error code.
+static int object_error(struct link_error* error, int code, uint32_t unit, const char* label)
+{
+    if(error != NULL)
+    {
+        error->unit = unit;
+        error->label = label;
+    }
+
+    return code;
+}
+
+// Adds label of linked unit to program's symbols. Label that is already there gets number of its unit appended.
+// Returns false if there is no memory left.
+static bool object_add_symbol(struct sym_table** sym_table, const char* name, uint32_t unit, uint16_t addr)
+{
+    if(sym_table_find_n(*sym_table, name, strlen(name)) == NULL)
+        return sym_table_push_back(sym_table, name, addr) == SYM_ADDED;
+
+    size_t length = strlen(name) + 12;
+    char* qualified = malloc(length);
+    if(qualified == NULL)
+        return false;
+
+    snprintf(qualified, length, "%s@%u", name, unit + 1);
+
+    // Source label may look just like qualified one. Symbols are only debug info, so such label is left out.
+    bool added = sym_table_find_n(*sym_table, qualified, strlen(qualified)) != NULL
+        || sym_table_push_back(sym_table, qualified, addr) == SYM_ADDED;
+    free(qualified);
+
+    return added;
+}
+
+int object_link(const struct object* objects, uint32_t num_objects, struct program* program, struct link_error* error)
+{
+    if(objects == NULL || num_objects == 0 || program == NULL)
+        return object_error(error, 1, 0, NULL);
+
+    // Exporters table maps label to index of unit exporting it, so units have to be indexable by address.
+    if(num_objects >= UINT16_MAX)
+        return object_error(error, 6, 0, NULL);
+
+    struct sym_table* exporters = NULL;
+    struct sym_table* sym_table = NULL;
+    struct source_code* source_code = NULL;
+    uint8_t* mem = NULL;
+    uint32_t* bases = malloc(num_objects * sizeof(uint32_t));
+    uint32_t* queue = malloc(num_objects * sizeof(uint32_t));
+    bool* linked = calloc(num_objects, sizeof(bool));
+    uint16_t* imports = NULL;   // Resolved addresses of labels imported by unit being relocated.
+    int result = bases != NULL && queue != NULL && linked != NULL ? 0 : object_error(error, 6, 0, NULL);
+
+    // Every unit's exports are checked, even of those that won't be linked.
+    uint32_t max_imports = 0;
+    for(uint32_t i = 0; i < num_objects && result == 0; ++i)
+    {
+        const struct sym_table* exports = objects[i].exports;
+        for(uint32_t j = 0; j < sym_table_size(exports) && result == 0; ++j)
+        {
+            const char* name = sym_table_at(exports, j)->name;
+            if(sym_table_find_n(exporters, name, strlen(name)) != NULL)
+                result = object_error(error, 5, i, name);
+            else if(sym_table_push_back(&exporters, name, i) != SYM_ADDED)
+                result = object_error(error, 6, i, NULL);
+        }
+
+        if(sym_table_size(objects[i].imports) > max_imports)
+            max_imports = sym_table_size(objects[i].imports);
+    }
+
+    // Units are linked starting from the first one, following imports to units that export them.
+    uint32_t queue_head = 0, queue_tail = 0;
+    if(result == 0)
+    {
+        linked[0] = true;
+        queue[queue_tail++] = 0;
+    }
+
+    while(queue_head < queue_tail && result == 0)
+    {
+        uint32_t unit = queue[queue_head++];
+        const struct sym_table* unit_imports = objects[unit].imports;
+        for(uint32_t j = 0; j < sym_table_size(unit_imports) && result == 0; ++j)
+        {
+            const char* name = sym_table_at(unit_imports, j)->name;
+            uint16_t exporter = sym_table_get(exporters, name);
+            if(exporter == UINT16_MAX)  // No unit exports the label.
+                result = object_error(error, 4, unit, name);
+            else if(!linked[exporter])
+            {
+                linked[exporter] = true;
+                queue[queue_tail++] = exporter;
+            }
+        }
+    }
+
+    uint32_t total = 0;
+    for(uint32_t i = 0; i < num_objects && result == 0; ++i)
+    {
+        bases[i] = total;
+        if(linked[i])
+            total += objects[i].mem_sz;
+    }
+    if(result == 0 && total > UINT16_MAX)
+        result = object_error(error, 6, 0, NULL);
+
+    if(result == 0)
+    {
+        mem = calloc(total + 4, 1);
+        imports = malloc((max_imports + 1) * sizeof(uint16_t));
+        if(mem == NULL || imports == NULL)
+            result = object_error(error, 6, 0, NULL);
+    }
+
+    bool code_block = false;
+    uint16_t entry_addr = 0;
+    for(uint32_t i = 0; i < num_objects && result == 0; ++i)
+    {
+        const struct object* object = &objects[i];
+        if(!linked[i])
+            continue;
+
+        if(object->mem_sz != 0)
+            memcpy(mem + bases[i], object->mem_ptr, object->mem_sz);
+
+        if(object->code_block && !code_block)
+        {
+            entry_addr = bases[i] + object->entry_addr;
+            code_block = true;
+        }
+
+        // Imported labels are looked up once per unit rather than once per operand.
+        for(uint32_t j = 0; j < sym_table_size(object->imports); ++j)
+        {
+            const char* name = sym_table_at(object->imports, j)->name;
+            uint16_t exporter = sym_table_get(exporters, name);
+            imports[j] = bases[exporter] + sym_table_get(objects[exporter].exports, name);
+        }
+
+        uint32_t num_symbols = sym_table_size(object->symbols);
+        for(uint32_t j = 0; j < object->num_relocs; ++j)
+        {
+            const struct object_reloc* reloc = &object->relocs[j];
+            uint16_t addr = reloc->symbol < num_symbols
+                ? bases[i] + sym_table_at(object->symbols, reloc->symbol)->addr
+                : imports[reloc->symbol - num_symbols];
+
+            memcpy(mem + bases[i] + reloc->addr + 2, &addr, sizeof(addr));
+        }
+
+        for(uint32_t j = 0; j < num_symbols && result == 0; ++j)
+        {
+            const struct symbol* symbol = sym_table_at(object->symbols, j);
+            if(!object_add_symbol(&sym_table, symbol->name, i, bases[i] + symbol->addr))
+                result = object_error(error, 6, i, NULL);
+        }
+
+        if(result == 0 && !source_code_append(&source_code, object->source, bases[i]))
+            result = object_error(error, 6, i, NULL);
+    }
+
+    sym_table_free(&exporters);
+    free(bases);
+    free(queue);
+    free(linked);
+    free(imports);
+
+    if(result != 0)
+    {
+        free(mem);
+        sym_table_free(&sym_table);
+        source_code_free(&source_code);
+        return result;
+    }
+
+    program->mem_sz = total;
+    program->entry_addr = entry_addr;
+    program->mem_ptr = mem;
+    program->source = source_code;
+    program->symbols = sym_table;
+
+    return 0;
+}
+
+void object_free(struct object* object)
+{
+    free(object->mem_ptr);
+    free(object->relocs);
+    sym_table_free(&object->symbols);
+    sym_table_free(&object->exports);
+    sym_table_free(&object->imports);
+    source_code_free(&object->source);
+
+    *object = (struct object) {0};
+}
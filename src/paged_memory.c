@@ -0,0 +1,140 @@
+#include "paged_memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct paged_memory* paged_memory_create(void)
+{
+    return calloc(1, sizeof(struct paged_memory));
+}
+
+bool paged_memory_map(struct paged_memory* paged, uint32_t addr, uint8_t* page)
+{
+    uint8_t*** table = &paged->tables[addr >> (PAGED_TABLE_BITS + PAGED_PAGE_BITS)];
+    if(*table == NULL)
+    {
+        *table = calloc(PAGED_TABLE_SZ, sizeof(uint8_t*));
+        if(*table == NULL)
+            return false;
+    }
+
+    uint8_t** entry = &(*table)[(addr >> PAGED_PAGE_BITS) & (PAGED_TABLE_SZ - 1)];
+    if(*entry == NULL)
+        paged->num_pages += 1;
+    *entry = page;
+
+    return true;
+}
+
+// Returns page holding given address, allocating zeroed one if needed. Returns NULL if there is no memory left.
+static uint8_t* paged_memory_touch(struct paged_memory* paged, uint32_t addr)
+{
+    uint8_t* page = paged_memory_page(paged, addr);
+    if(page != NULL)
+        return page;
+
+    page = calloc(1, PAGED_PAGE_SZ);
+    if(page == NULL || !paged_memory_map(paged, addr, page))
+    {
+        free(page);
+        return NULL;
+    }
+
+    return page;
+}
+
+uint8_t paged_memory_read_byte(const struct paged_memory* paged, uint32_t addr)
+{
+    const uint8_t* page = paged_memory_page(paged, addr);
+    return page != NULL ? page[addr & (PAGED_PAGE_SZ - 1)] : 0;
+}
+
+bool paged_memory_write_byte(struct paged_memory* paged, uint32_t addr, uint8_t value)
+{
+    uint8_t* page = paged_memory_touch(paged, addr);
+    if(page == NULL)
+        return false;
+
+    page[addr & (PAGED_PAGE_SZ - 1)] = value;
+    return true;
+}
+
+uint32_t paged_memory_read(const struct paged_memory* paged, uint32_t addr)
+{
+    uint32_t offset = addr & (PAGED_PAGE_SZ - 1);
+    uint32_t value = 0;
+    if(offset <= PAGED_PAGE_SZ - 4)
+    {
+        const uint8_t* page = paged_memory_page(paged, addr);
+        if(page != NULL)
+            memcpy(&value, page + offset, sizeof(value));
+        return value;
+    }
+
+    // Value spans two pages, so it's put together byte by byte.
+    uint8_t bytes[4];
+    for(uint32_t i = 0; i < 4; ++i)
+        bytes[i] = paged_memory_read_byte(paged, addr + i);
+
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+bool paged_memory_write(struct paged_memory* paged, uint32_t addr, uint32_t value)
+{
+    uint32_t offset = addr & (PAGED_PAGE_SZ - 1);
+    if(offset <= PAGED_PAGE_SZ - 4)
+    {
+        uint8_t* page = paged_memory_touch(paged, addr);
+        if(page == NULL)
+            return false;
+
+        memcpy(page + offset, &value, sizeof(value));
+        return true;
+    }
+
+    uint8_t bytes[4];
+    memcpy(bytes, &value, sizeof(value));
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        if(!paged_memory_write_byte(paged, addr + i, bytes[i]))
+            return false;
+    }
+
+    return true;
+}
+
+void paged_memory_clear(struct paged_memory* paged)
+{
+    for(uint32_t i = 0; i < PAGED_DIR_SZ; ++i)
+    {
+        uint8_t** table = paged->tables[i];
+        if(table == NULL)
+            continue;
+
+        for(uint32_t j = 0; j < PAGED_TABLE_SZ; ++j)
+        {
+            const uint8_t* page = table[j];
+            bool borrowed = paged->borrowed != NULL && page >= paged->borrowed
+                && page < paged->borrowed + paged->borrowed_sz;
+            if(!borrowed)
+                free(table[j]);
+        }
+
+        free(table);
+        paged->tables[i] = NULL;
+    }
+
+    paged->num_pages = 0;
+    paged->borrowed = NULL;
+    paged->borrowed_sz = 0;
+}
+
+void paged_memory_free(struct paged_memory* paged)
+{
+    if(paged == NULL)
+        return;
+
+    paged_memory_clear(paged);
+    free(paged);
+}
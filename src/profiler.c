@@ -0,0 +1,269 @@
+#include "profiler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "instruction.h"
+#include "virtual_machine.h"
+
+#define PROFILER_TOP_LINES 20   // Number of source lines shown in report.
+
+// Label covering addresses from addr up to the next label.
+struct profiler_label
+{
+    uint16_t addr;
+    const char* name;
+    uint64_t count;
+};
+
+// Returns true if instruction of given opcode is a conditional jump, whose taken and not taken counts are kept.
+static bool profiler_is_branch(uint8_t opcode)
+{
+    return instruction_kinds[opcode] == INSTRUCTION_JUMP && opcode != OPCODE_J;
+}
+
+int profiler_init(struct profiler* profiler, struct virtual_machine* vm)
+{
+    profiler->mem_sz = vm->mem_sz;
+    profiler->counts = calloc(vm->mem_sz, sizeof(uint64_t));
+    profiler->taken = calloc(vm->mem_sz, sizeof(uint64_t));
+    profiler->opcodes = calloc(vm->mem_sz, 1);
+    memset(profiler->opcode_counts, 0, sizeof(profiler->opcode_counts));
+
+    if(profiler->counts == NULL || profiler->taken == NULL || profiler->opcodes == NULL)
+    {
+        profiler_free(profiler);
+        return 1;
+    }
+
+    vm->profiler = profiler;
+    return 0;
+}
+
+int profiler_run(struct profiler* profiler, struct virtual_machine* vm, uint64_t budget)
+{
+    uint64_t* counts = profiler->counts;
+    uint64_t* taken = profiler->taken;
+    uint8_t* opcodes = profiler->opcodes;
+    uint64_t* opcode_counts = profiler->opcode_counts;
+    uint64_t start = budget;
+    int result = 0;
+
+    while(budget > 0)
+    {
+        uint32_t pc = vm->pc;
+        if(pc >= vm->mem_sz)    // No more instructions to perform.
+        {
+            result = 1;
+            break;
+        }
+
+        // Store may re-decode the very op being executed, so its fields are read before running it.
+        const struct vm_op* op = &vm->ops[pc];
+        if(op->handler == NULL)
+            vm_decode_page(vm, pc);
+
+        uint32_t next_pc = op->next_pc;
+        uint8_t opcode = op->opcode;
+
+        vm->pc = next_pc;
+        if(!op->handler(vm, op))
+        {
+            result = 2;
+            break;
+        }
+
+        budget -= 1;
+        counts[pc] += 1;
+        opcode_counts[opcode] += 1;
+        // Vector instruction that hasn't finished its arrays stays on itself as well, it isn't a taken jump.
+        taken[pc] += profiler_is_branch(opcode) && vm->pc != next_pc;
+        opcodes[pc] = opcode;
+    }
+
+    vm->retired += start - budget;
+    return result;
+}
+
+static int compare_label_addr(const void* a, const void* b)
+{
+    const struct profiler_label* la = a;
+    const struct profiler_label* lb = b;
+    return (la->addr > lb->addr) - (la->addr < lb->addr);
+}
+
+static int compare_label_count(const void* a, const void* b)
+{
+    const struct profiler_label* la = a;
+    const struct profiler_label* lb = b;
+    return (la->count < lb->count) - (la->count > lb->count);
+}
+
+// Returns labels sorted by address. First entry covers addresses before any label.
+static struct profiler_label* profiler_labels(const struct program* program, uint32_t* num_labels)
+{
+    uint32_t count = sym_table_size(program->symbols) + 1;
+
+    struct profiler_label* labels = malloc(count * sizeof(struct profiler_label));
+    if(labels == NULL)
+        return NULL;
+
+    labels[0] = (struct profiler_label) {0, "<start>", 0};
+    for(uint32_t i = 1; i < count; ++i)
+    {
+        const struct symbol* symbol = sym_table_at(program->symbols, i - 1);
+        labels[i] = (struct profiler_label) {symbol->addr, symbol->name, 0};
+    }
+
+    qsort(labels + 1, count - 1, sizeof(struct profiler_label), compare_label_addr);
+
+    *num_labels = count;
+    return labels;
+}
+
+// Returns index of label covering address.
+static uint32_t profiler_find_label(const struct profiler_label* labels, uint32_t num_labels, uint32_t addr)
+{
+    uint32_t low = 0, high = num_labels;    // labels[low].addr <= addr always holds, labels[0] covers everything.
+    while(high - low > 1)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if(labels[mid].addr <= addr)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+// Prints source line without leading whitespace, replacing characters which would break folded format.
+// Index of UINT32_MAX, meaning there is no line, prints nothing.
+static void print_source(FILE* out, const struct source_code* source, uint32_t index, bool folded)
+{
+    if(index == UINT32_MAX)
+        return;
+
+    const char* text = source_code_text(source, index);
+    while(*text == ' ' || *text == '\t')
+        ++text;
+
+    for(; *text != '\0'; ++text)
+        fputc(folded && *text == ';' ? ',' : *text, out);
+}
+
+void profiler_report(const struct profiler* profiler, const struct program* program, FILE* out)
+{
+    uint32_t num_labels = 0;
+    struct profiler_label* labels = profiler_labels(program, &num_labels);
+    uint32_t* hot = malloc(PROFILER_TOP_LINES * sizeof(uint32_t));
+    if(labels == NULL || hot == NULL)
+    {
+        free(labels);
+        free(hot);
+        return;
+    }
+
+    uint64_t total = 0;
+    uint32_t num_hot = 0;
+    for(uint32_t addr = 0; addr < profiler->mem_sz; ++addr)
+    {
+        uint64_t count = profiler->counts[addr];
+        if(count == 0)
+            continue;
+
+        total += count;
+        labels[profiler_find_label(labels, num_labels, addr)].count += count;
+
+        // Keep the hottest addresses sorted by insertion.
+        uint32_t i = num_hot < PROFILER_TOP_LINES ? num_hot++ : PROFILER_TOP_LINES;
+        while(i > 0 && profiler->counts[hot[i - 1]] < count)
+        {
+            if(i < PROFILER_TOP_LINES)
+                hot[i] = hot[i - 1];
+            --i;
+        }
+        if(i < PROFILER_TOP_LINES)
+            hot[i] = addr;
+    }
+
+    double share = total != 0 ? 100.0 / total : 0;
+    fprintf(out, "Executed instructions: %llu\n\n", (unsigned long long) total);
+
+    qsort(labels, num_labels, sizeof(struct profiler_label), compare_label_count);
+    fprintf(out, "Label                Executions    Share\n");
+    for(uint32_t i = 0; i < num_labels && labels[i].count != 0; ++i)
+        fprintf(out, "%-16s  %13llu  %6.2f%%\n", labels[i].name, (unsigned long long) labels[i].count, labels[i].count * share);
+
+    fprintf(out, "\nLine  Address     Executions    Share         Taken     Not taken  Source\n");
+    for(uint32_t i = 0; i < num_hot; ++i)
+    {
+        uint32_t addr = hot[i];
+        uint64_t count = profiler->counts[addr];
+        uint32_t index = source_code_find(program->source, addr);
+        fprintf(out, "%4u  0x%04x   %13llu  %6.2f%%", index + 1, addr, (unsigned long long) count, count * share);
+
+        uint8_t opcode = profiler->opcodes[addr];
+        if(profiler_is_branch(opcode))
+        {
+            uint64_t taken = profiler->taken[addr];
+            fprintf(out, "  %12llu  %12llu  ", (unsigned long long) taken, (unsigned long long) (count - taken));
+        }
+        else
+            fprintf(out, "  %12s  %12s  ", "", "");
+
+        print_source(out, program->source, index, false);
+        fputc('\n', out);
+    }
+
+    fprintf(out, "\nOpcode      Executions    Share\n");
+    for(uint32_t opcode = 0; opcode < 256; ++opcode)
+    {
+        uint64_t count = profiler->opcode_counts[opcode];
+        if(count == 0)
+            continue;
+
+        const struct instruction* inst = get_inst_opcode(opcode);
+        if(inst != NULL)
+            fprintf(out, "%-6s", inst->mnemonic);
+        else
+            fprintf(out, "0x%02x  ", opcode);
+        fprintf(out, "%16llu  %6.2f%%\n", (unsigned long long) count, count * share);
+    }
+
+    free(labels);
+    free(hot);
+}
+
+void profiler_folded(const struct profiler* profiler, const struct program* program, FILE* out)
+{
+    uint32_t num_labels = 0;
+    struct profiler_label* labels = profiler_labels(program, &num_labels);
+    if(labels == NULL)
+        return;
+
+    for(uint32_t addr = 0; addr < profiler->mem_sz; ++addr)
+    {
+        if(profiler->counts[addr] == 0)
+            continue;
+
+        // Line numbers start from 1, so missing line (UINT32_MAX) shows up as 0.
+        uint32_t index = source_code_find(program->source, addr);
+        fprintf(out, "%s;%u: ", labels[profiler_find_label(labels, num_labels, addr)].name, index + 1);
+        print_source(out, program->source, index, true);
+        fprintf(out, " %llu\n", (unsigned long long) profiler->counts[addr]);
+    }
+
+    free(labels);
+}
+
+void profiler_free(struct profiler* profiler)
+{
+    free(profiler->counts);
+    free(profiler->taken);
+    free(profiler->opcodes);
+    profiler->counts = NULL;
+    profiler->taken = NULL;
+    profiler->opcodes = NULL;
+}
@@ -0,0 +1,407 @@
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "virtual_machine.h"
+
+#define SCHEDULER_QUEUE_SIZE 64     // Initial capacity of each worker's queue.
+
+struct scheduler_task
+{
+    struct virtual_machine* vm;
+    uint64_t max_steps;     // Limit of retired instructions, 0 if there is none.
+    double max_time;        // Limit of time spent running, 0 if there is none.
+    double elapsed;         // Time machine has spent running so far, waiting in queues doesn't count.
+    scheduler_callback callback;
+    void* user_data;
+};
+
+// Queue of machines owned by one worker. Owner takes machines from the front and puts them back at the end,
+// thieves take from the end, so that owner keeps round-robin order of machines it has.
+struct scheduler_queue
+{
+    pthread_mutex_t lock;
+    struct scheduler_task** tasks;  // Circular buffer.
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+};
+
+struct scheduler_worker
+{
+    struct scheduler* scheduler;
+    struct scheduler_queue queue;
+    pthread_t thread;
+    uint32_t index;
+};
+
+struct scheduler
+{
+    struct scheduler_worker* workers;
+    uint32_t num_workers;
+    int slice;
+
+    atomic_uint next_worker;    // Worker receiving next submitted machine.
+    atomic_uint queued;         // Number of machines waiting in queues.
+    atomic_uint pending;        // Number of submitted machines which haven't exited yet.
+    atomic_uint stolen;         // Number of machines taken from another worker's queue.
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t all_done;
+    bool stopping;
+};
+
+static void* scheduler_worker_main(void* arg);
+
+static uint32_t scheduler_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t) count : 1;
+#endif
+}
+
+// Returns seconds elapsed since some fixed point in the past.
+static double scheduler_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+static bool queue_init(struct scheduler_queue* queue)
+{
+    queue->tasks = malloc(SCHEDULER_QUEUE_SIZE * sizeof(struct scheduler_task*));
+    if(queue->tasks == NULL)
+        return false;
+
+    queue->capacity = SCHEDULER_QUEUE_SIZE;
+    queue->head = queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    return true;
+}
+
+static void queue_free(struct scheduler_queue* queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->tasks);
+}
+
+static bool queue_push(struct scheduler_queue* queue, struct scheduler_task* task)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->count == queue->capacity)     // Grow buffer, unwrapping it on the way.
+    {
+        struct scheduler_task** tasks = malloc(2 * queue->capacity * sizeof(struct scheduler_task*));
+        if(tasks == NULL)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            return false;
+        }
+
+        for(uint32_t i = 0; i < queue->count; ++i)
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->capacity *= 2;
+        queue->head = 0;
+    }
+
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count += 1;
+
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+static struct scheduler_task* queue_pop_front(struct scheduler_queue* queue)
+{
+    struct scheduler_task* task = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count > 0)
+    {
+        task = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count -= 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return task;
+}
+
+static struct scheduler_task* queue_pop_back(struct scheduler_queue* queue)
+{
+    struct scheduler_task* task = NULL;
+
+    if(pthread_mutex_trylock(&queue->lock) != 0)    // Busy queue isn't worth waiting for, thief tries another one.
+        return NULL;
+
+    if(queue->count > 0)
+    {
+        queue->count -= 1;
+        task = queue->tasks[(queue->head + queue->count) % queue->capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return task;
+}
+
+struct scheduler* scheduler_create(uint32_t workers, int slice)
+{
+    if(slice <= 0)
+        return NULL;
+
+    if(workers == 0)
+        workers = scheduler_cpu_count();
+
+    struct scheduler* scheduler = malloc(sizeof(struct scheduler));
+    if(scheduler == NULL)
+        return NULL;
+
+    scheduler->workers = calloc(workers, sizeof(struct scheduler_worker));
+    if(scheduler->workers == NULL)
+    {
+        free(scheduler);
+        return NULL;
+    }
+
+    scheduler->num_workers = 0;
+    scheduler->slice = slice;
+    atomic_init(&scheduler->next_worker, 0);
+    atomic_init(&scheduler->queued, 0);
+    atomic_init(&scheduler->pending, 0);
+    atomic_init(&scheduler->stolen, 0);
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->work_available, NULL);
+    pthread_cond_init(&scheduler->all_done, NULL);
+    scheduler->stopping = false;
+
+    // Queues must all exist before any worker starts looking into them.
+    for(uint32_t i = 0; i < workers; ++i)
+    {
+        struct scheduler_worker* worker = &scheduler->workers[i];
+        worker->scheduler = scheduler;
+        worker->index = i;
+
+        if(!queue_init(&worker->queue))
+        {
+            for(uint32_t j = 0; j < i; ++j)
+                queue_free(&scheduler->workers[j].queue);
+            free(scheduler->workers);
+            free(scheduler);
+            return NULL;
+        }
+    }
+
+    // Workers wait for this lock before looking at other queues, so that num_workers is final by then.
+    pthread_mutex_lock(&scheduler->lock);
+    for(uint32_t i = 0; i < workers; ++i)
+    {
+        if(pthread_create(&scheduler->workers[i].thread, NULL, scheduler_worker_main, &scheduler->workers[i]) != 0)
+            break;
+
+        scheduler->num_workers += 1;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    if(scheduler->num_workers == 0)
+    {
+        pthread_cond_destroy(&scheduler->all_done);
+        pthread_cond_destroy(&scheduler->work_available);
+        pthread_mutex_destroy(&scheduler->lock);
+        for(uint32_t i = 0; i < workers; ++i)
+            queue_free(&scheduler->workers[i].queue);
+        free(scheduler->workers);
+        free(scheduler);
+        return NULL;
+    }
+
+    // Queues of workers which didn't start would never be emptied by their owners.
+    for(uint32_t i = scheduler->num_workers; i < workers; ++i)
+        queue_free(&scheduler->workers[i].queue);
+
+    return scheduler;
+}
+
+int scheduler_submit(struct scheduler* scheduler, struct virtual_machine* vm, uint64_t max_steps, double max_time,
+    scheduler_callback callback, void* user_data)
+{
+    struct scheduler_task* task = malloc(sizeof(struct scheduler_task));
+    if(task == NULL)
+        return 1;
+
+    task->vm = vm;
+    task->max_steps = max_steps;
+    task->max_time = max_time;
+    task->elapsed = 0;
+    task->callback = callback;
+    task->user_data = user_data;
+
+    atomic_fetch_add(&scheduler->pending, 1);
+
+    // Counter is raised before the machine is visible, so that it never drops below zero when machine is stolen.
+    atomic_fetch_add(&scheduler->queued, 1);
+
+    uint32_t index = atomic_fetch_add(&scheduler->next_worker, 1) % scheduler->num_workers;
+    if(!queue_push(&scheduler->workers[index].queue, task))
+    {
+        atomic_fetch_sub(&scheduler->queued, 1);
+        atomic_fetch_sub(&scheduler->pending, 1);
+        free(task);
+        return 2;
+    }
+
+    // Signalling under the lock makes sure a worker which is just going to sleep doesn't miss the machine.
+    pthread_mutex_lock(&scheduler->lock);
+    pthread_cond_signal(&scheduler->work_available);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return 0;
+}
+
+void scheduler_wait(struct scheduler* scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    while(atomic_load(&scheduler->pending) > 0)
+        pthread_cond_wait(&scheduler->all_done, &scheduler->lock);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+uint32_t scheduler_stolen(struct scheduler* scheduler)
+{
+    return atomic_load(&scheduler->stolen);
+}
+
+void scheduler_destroy(struct scheduler* scheduler)
+{
+    scheduler_wait(scheduler);
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&scheduler->work_available);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for(uint32_t i = 0; i < scheduler->num_workers; ++i)
+    {
+        pthread_join(scheduler->workers[i].thread, NULL);
+        queue_free(&scheduler->workers[i].queue);
+    }
+
+    pthread_cond_destroy(&scheduler->all_done);
+    pthread_cond_destroy(&scheduler->work_available);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+// Takes machine from worker's own queue, or steals one from other workers. Returns NULL if there is none.
+static struct scheduler_task* scheduler_find_task(struct scheduler_worker* worker)
+{
+    struct scheduler* scheduler = worker->scheduler;
+
+    struct scheduler_task* task = queue_pop_front(&worker->queue);
+    if(task != NULL)
+        return task;
+
+    for(uint32_t i = 1; i < scheduler->num_workers; ++i)
+    {
+        struct scheduler_worker* victim = &scheduler->workers[(worker->index + i) % scheduler->num_workers];
+        task = queue_pop_back(&victim->queue);
+        if(task != NULL)
+        {
+            atomic_fetch_add(&scheduler->stolen, 1);
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static void* scheduler_worker_main(void* arg)
+{
+    struct scheduler_worker* worker = arg;
+    struct scheduler* scheduler = worker->scheduler;
+
+    pthread_mutex_lock(&scheduler->lock);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for(;;)
+    {
+        struct scheduler_task* task = scheduler_find_task(worker);
+
+        if(task == NULL)
+        {
+            pthread_mutex_lock(&scheduler->lock);
+            while(atomic_load(&scheduler->queued) == 0 && !scheduler->stopping)
+                pthread_cond_wait(&scheduler->work_available, &scheduler->lock);
+            bool stopping = scheduler->stopping && atomic_load(&scheduler->queued) == 0;
+            pthread_mutex_unlock(&scheduler->lock);
+
+            if(stopping)
+                return NULL;
+
+            continue;   // Some queue has a machine, though another worker may take it first.
+        }
+
+        atomic_fetch_sub(&scheduler->queued, 1);
+
+        // Slice is cut short if machine is about to reach its step limit.
+        struct virtual_machine* vm = task->vm;
+        uint64_t budget = (uint64_t) scheduler->slice;
+        if(task->max_steps != 0)
+        {
+            uint64_t left = vm->retired < task->max_steps ? task->max_steps - vm->retired : 0;
+            budget = left < budget ? left : budget;
+        }
+
+        double start = scheduler_time();
+        int result = vm_forward(vm, (int) budget);
+        task->elapsed += scheduler_time() - start;
+
+        bool limited = (task->max_steps != 0 && vm->retired >= task->max_steps)
+            || (task->max_time != 0 && task->elapsed >= task->max_time);
+        if(result == 0 && !limited)     // Machine used its whole slice, others get their turn before it continues.
+        {
+            atomic_fetch_add(&scheduler->queued, 1);
+            if(queue_push(&worker->queue, task))
+                continue;
+
+            atomic_fetch_sub(&scheduler->queued, 1);
+            result = 2;     // Machine can't be queued again, report it as failed rather than losing it.
+        }
+
+        task->callback(task->vm, result, task->user_data);
+        free(task);
+
+        if(atomic_fetch_sub(&scheduler->pending, 1) == 1)
+        {
+            pthread_mutex_lock(&scheduler->lock);
+            pthread_cond_broadcast(&scheduler->all_done);
+            pthread_mutex_unlock(&scheduler->lock);
+        }
+    }
+}
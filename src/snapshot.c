@@ -0,0 +1,336 @@
+#ifdef __linux__
+#define _GNU_SOURCE     // For memfd_create.
+#endif
+
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "jit.h"
+#include "paged_memory.h"
+#include "virtual_machine.h"
+
+static size_t page_size(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Creates anonymous shared memory object of given size. Returns -1 on failure.
+static intptr_t shared_create(size_t size)
+{
+#ifdef _WIN32
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        (DWORD) ((uint64_t) size >> 32), (DWORD) size, NULL);
+    return mapping != NULL ? (intptr_t) mapping : -1;
+#else
+#ifdef __linux__
+    int fd = memfd_create("hasm-snapshot", MFD_CLOEXEC);
+#else
+    static unsigned counter = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/hasm-snapshot-%ld-%u", (long) getpid(), counter++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd >= 0)
+        shm_unlink(name);   // Object only needs to live as long as descriptor is open.
+#endif
+    if(fd < 0)
+        return -1;
+
+    if(ftruncate(fd, (off_t) size) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+#endif
+}
+
+static void shared_close(intptr_t handle)
+{
+#ifdef _WIN32
+    CloseHandle((HANDLE) handle);
+#else
+    close((int) handle);
+#endif
+}
+
+// Maps shared memory object. Private mapping is copy-on-write, writes to it are never seen by the object.
+// If address isn't NULL, mapping replaces whatever was mapped there before. Returns NULL on failure.
+static uint8_t* shared_map(intptr_t handle, size_t size, bool private, uint8_t* address)
+{
+#ifdef _WIN32
+    if(address != NULL)     // Windows can't replace mapping in place, so it's released and mapped again.
+        UnmapViewOfFile(address);
+
+    uint8_t* memory = MapViewOfFileEx((HANDLE) handle, private ? FILE_MAP_COPY : FILE_MAP_WRITE, 0, 0, size, address);
+    if(memory == NULL && address != NULL)
+        memory = MapViewOfFile((HANDLE) handle, private ? FILE_MAP_COPY : FILE_MAP_WRITE, 0, 0, size);
+    return memory;
+#else
+    int flags = (private ? MAP_PRIVATE : MAP_SHARED) | (address != NULL ? MAP_FIXED : 0);
+    uint8_t* memory = mmap(address, size, PROT_READ | PROT_WRITE, flags, (int) handle, 0);
+    return memory != MAP_FAILED ? memory : NULL;
+#endif
+}
+
+static void shared_unmap(uint8_t* memory, size_t size)
+{
+#ifdef _WIN32
+    UNUSED(size);
+    UnmapViewOfFile(memory);
+#else
+    munmap(memory, size);
+#endif
+}
+
+// Lists addresses of all pages mapped in paged memory. Returns NULL if there is no memory left.
+static uint32_t* snapshot_list_pages(const struct paged_memory* paged)
+{
+    uint32_t* addrs = malloc((paged->num_pages + 1) * sizeof(uint32_t));
+    if(addrs == NULL)
+        return NULL;
+
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < PAGED_DIR_SZ; ++i)
+    {
+        for(uint32_t j = 0; paged->tables[i] != NULL && j < PAGED_TABLE_SZ; ++j)
+        {
+            if(paged->tables[i][j] != NULL)
+                addrs[count++] = (i << PAGED_TABLE_BITS | j) << PAGED_PAGE_BITS;
+        }
+    }
+
+    return addrs;
+}
+
+// Maps pages stored in shared memory object into machine's paged memory, in place of pages it had so far.
+// Returns false if there is no memory left for page tables.
+static bool snapshot_map_pages(const struct snapshot* snapshot, struct virtual_machine* vm, uint8_t* shared)
+{
+    paged_memory_clear(vm->paged);
+    vm->paged->borrowed = shared + snapshot->pages_offset;
+    vm->paged->borrowed_sz = (size_t) snapshot->num_pages * PAGED_PAGE_SZ;
+
+    for(uint32_t i = 0; i < snapshot->num_pages; ++i)
+    {
+        uint8_t* page = shared + snapshot->pages_offset + (size_t) i * PAGED_PAGE_SZ;
+        if(!paged_memory_map(vm->paged, snapshot->page_addrs[i], page))
+            return false;
+    }
+
+    return true;
+}
+
+// Duplicates verifier's flags. Returns NULL if there are none or there is no memory left.
+static uint8_t* snapshot_copy_verified(const uint8_t* verified, uint32_t mem_sz)
+{
+    if(verified == NULL)
+        return NULL;
+
+    uint8_t* copy = malloc(mem_sz);
+    if(copy != NULL)
+        memcpy(copy, verified, mem_sz);
+
+    return copy;
+}
+
+int snapshot_take(const struct virtual_machine* vm, struct snapshot* snapshot)
+{
+    size_t page = page_size();
+    snapshot->ops_offset = (vm->mem_sz + page - 1) / page * page;
+    snapshot->pages_offset = snapshot->ops_offset + (vm->mem_sz + 4) * sizeof(struct vm_op);
+    snapshot->pages_offset = (snapshot->pages_offset + page - 1) / page * page;
+    snapshot->num_pages = vm->paged->num_pages;
+    snapshot->size = snapshot->pages_offset + (size_t) snapshot->num_pages * PAGED_PAGE_SZ;
+
+    snapshot->page_addrs = snapshot_list_pages(vm->paged);
+    if(snapshot->page_addrs == NULL)
+        return 1;
+
+    snapshot->verified = snapshot_copy_verified(vm->verified, vm->mem_sz);
+    if(vm->verified != NULL && snapshot->verified == NULL)
+    {
+        free(snapshot->page_addrs);
+        return 1;
+    }
+
+    snapshot->handle = shared_create(snapshot->size);
+    if(snapshot->handle == -1)
+    {
+        free(snapshot->page_addrs);
+        free(snapshot->verified);
+        return 1;
+    }
+
+    uint8_t* shared = shared_map(snapshot->handle, snapshot->size, false, NULL);
+    if(shared == NULL)
+    {
+        free(snapshot->page_addrs);
+        free(snapshot->verified);
+        shared_close(snapshot->handle);
+        return 2;
+    }
+
+    memcpy(shared, vm->memory, vm->mem_sz);
+
+    // Shared memory starts zeroed, so pages of ops that weren't decoded yet don't need copying.
+    struct vm_op* ops = (struct vm_op*) (shared + snapshot->ops_offset);
+    for(uint32_t addr = 0; addr < vm->mem_sz + 4; addr += VM_DECODE_PAGE)
+    {
+        if(!vm_page_decoded(vm, addr))
+            continue;
+
+        uint32_t count = vm->mem_sz + 4 - addr < VM_DECODE_PAGE ? vm->mem_sz + 4 - addr : VM_DECODE_PAGE;
+        memcpy(ops + addr, vm->ops + addr, count * sizeof(struct vm_op));
+    }
+
+    for(uint32_t i = 0; i < snapshot->num_pages; ++i)
+    {
+        memcpy(shared + snapshot->pages_offset + (size_t) i * PAGED_PAGE_SZ,
+            paged_memory_page(vm->paged, snapshot->page_addrs[i]), PAGED_PAGE_SZ);
+    }
+    shared_unmap(shared, snapshot->size);
+
+    snapshot->vm = *vm;
+    snapshot->vm.regs = NULL;
+    snapshot->vm.memory = NULL;
+    snapshot->vm.paged = NULL;
+    snapshot->vm.ops = NULL;
+    snapshot->vm.jit = NULL;
+    snapshot->vm.verified = NULL;
+    snapshot->vm.profiler = NULL;
+    snapshot->vm.mapped_sz = 0;
+    memcpy(snapshot->regs, vm->regs, sizeof(snapshot->regs));
+
+    return 0;
+}
+
+// Copies registers and other state which doesn't live in memory.
+static void snapshot_copy_state(const struct snapshot* snapshot, struct virtual_machine* vm)
+{
+    vm->pc = snapshot->vm.pc;
+    vm->flags_result = snapshot->vm.flags_result;
+    vm->retired = snapshot->vm.retired;
+    vm->vector_pc = snapshot->vm.vector_pc;
+    vm->vector_done = snapshot->vm.vector_done;
+    vm->vector_result = snapshot->vm.vector_result;
+    memcpy(vm->fusion_counts, snapshot->vm.fusion_counts, sizeof(vm->fusion_counts));
+    memcpy(vm->regs, snapshot->regs, sizeof(snapshot->regs));
+}
+
+int snapshot_fork(const struct snapshot* snapshot, struct virtual_machine* vm)
+{
+    uint8_t* shared = shared_map(snapshot->handle, snapshot->size, true, NULL);
+    if(shared == NULL)
+        return 1;
+
+    *vm = snapshot->vm;
+    vm->memory = shared;
+    vm->ops = (struct vm_op*) (shared + snapshot->ops_offset);
+    vm->mapped_sz = snapshot->size;
+    vm->regs = calloc(16, 4);
+    vm->paged = paged_memory_create();
+    vm->verified = snapshot_copy_verified(snapshot->verified, vm->mem_sz);
+    if(vm->regs == NULL || vm->paged == NULL || (snapshot->verified != NULL && vm->verified == NULL)
+        || !snapshot_map_pages(snapshot, vm, shared))
+    {
+        free(vm->regs);
+        free(vm->verified);
+        paged_memory_free(vm->paged);
+        shared_unmap(shared, snapshot->size);
+        return 2;
+    }
+    snapshot_copy_state(snapshot, vm);
+
+    if(vm->engine == VM_ENGINE_JIT)
+    {
+        vm->jit = jit_create(vm);
+        if(vm->jit == NULL)     // Decoded ops were made without threaded engine in mind, so plain handlers are used.
+            vm->engine = VM_ENGINE_HANDLERS;
+    }
+
+    return 0;
+}
+
+int snapshot_restore(const struct snapshot* snapshot, struct virtual_machine* vm)
+{
+    if(vm->mem_sz != snapshot->vm.mem_sz)
+        return 1;
+
+    // Pages of paged memory may point into old mapping, so they are dropped before it goes away.
+    paged_memory_clear(vm->paged);
+
+    // Machine already mapping snapshot of the same size gets new mapping over the old one, dropping its private pages.
+    uint8_t* address = vm->mapped_sz == snapshot->size ? vm->memory : NULL;
+    uint8_t* shared = shared_map(snapshot->handle, snapshot->size, true, address);
+    if(shared == NULL)
+        return 2;
+
+    if(address == NULL)
+    {
+        if(vm->mapped_sz != 0)
+            snapshot_release(vm);
+        else
+        {
+            free(vm->memory);
+            free(vm->ops);
+        }
+    }
+
+    vm->memory = shared;
+    vm->ops = (struct vm_op*) (shared + snapshot->ops_offset);
+    vm->mapped_sz = snapshot->size;
+    if(!snapshot_map_pages(snapshot, vm, shared))
+        return 3;
+    snapshot_copy_state(snapshot, vm);
+
+    // Decoded instructions come from snapshot, so verifier's flags they were made with have to come too.
+    // Machine that can't keep them runs unverified, with everything decoded checked again.
+    free(vm->verified);
+    vm->verified = snapshot_copy_verified(snapshot->verified, vm->mem_sz);
+    if(snapshot->verified != NULL && vm->verified == NULL)
+        vm_decode_range(vm, 0, vm->mem_sz);
+
+    if(vm->jit != NULL)
+        jit_flush(vm->jit);
+
+    return 0;
+}
+
+void snapshot_release(struct virtual_machine* vm)
+{
+    if(vm->paged != NULL)
+        paged_memory_clear(vm->paged);
+
+    shared_unmap(vm->memory, vm->mapped_sz);
+    vm->memory = NULL;
+    vm->ops = NULL;
+    vm->mapped_sz = 0;
+}
+
+void snapshot_free(struct snapshot* snapshot)
+{
+    shared_close(snapshot->handle);
+    snapshot->handle = -1;
+    free(snapshot->page_addrs);
+    snapshot->page_addrs = NULL;
+    free(snapshot->verified);
+    snapshot->verified = NULL;
+}
@@ -3,74 +3,197 @@
 #include <stdlib.h>
 #include <string.h>
 
-void source_code_push_back(struct source_code** source_code, uint16_t addr, const char* text)
+#define SOURCE_INITIAL_LINES 256    // Initial capacity of line arrays.
+#define SOURCE_INITIAL_TEXT 8192    // Initial capacity of text buffer.
+
+bool source_code_push_back(struct source_code** source_code, uint16_t addr, const char* text, size_t text_len)
 {
     if(text == NULL)
-        return;
+        return true;
 
-    if(*source_code == NULL)  // Create new entry.
+    if(*source_code == NULL)  // Create new source code.
     {
-        *source_code = malloc(sizeof(struct source_code));
-        (*source_code)->addr = addr;
-        (*source_code)->next = NULL;
-        size_t text_sz = strlen(text) + 1;
-        char* new_text = malloc(text_sz);
-        memcpy(new_text, text, text_sz);
-        if(new_text[text_sz - 2] == '\n')
-        {
-            new_text[text_sz - 2] = '\0';
-        }
-        else if(new_text[text_sz - 2] == '\r')
-        {
-            new_text[text_sz - 2] = '\0';
-            new_text[text_sz - 3] = '\0';
-        }
-        (*source_code)->text = new_text;
-        (*source_code)->empty = strlen(new_text) == 0 || new_text[0] == '#';
-
-        return;
+        *source_code = calloc(1, sizeof(struct source_code));
+        if(*source_code == NULL)
+            return false;
     }
 
-    // Append new entry.
-    struct source_code* current = *source_code;
-    while(current->next != NULL)
-        current = current->next;
-
-    struct source_code* new = malloc(sizeof(struct source_code));
-    new->addr = addr;
-    new->next = NULL;
-    size_t text_sz = strlen(text) + 1;
-    char* new_text = malloc(text_sz);
-    memcpy(new_text, text, text_sz);
-    if(new_text[text_sz - 2] == '\n')
+    struct source_code* source = *source_code;
+
+    while(text_len > 0 && (text[text_len - 1] == '\n' || text[text_len - 1] == '\r'))
+        --text_len;
+
+    if(source->text_sz + text_len + 1 > source->text_capacity)
     {
-        new_text[text_sz - 2] = '\0';
+        size_t capacity = source->text_capacity != 0 ? source->text_capacity : SOURCE_INITIAL_TEXT;
+        while(source->text_sz + text_len + 1 > capacity)
+            capacity *= 2;
+
+        char* new_text = realloc(source->text, capacity);
+        if(new_text == NULL)
+            return false;
+
+        source->text = new_text;
+        source->text_capacity = capacity;
     }
-    else if(new_text[text_sz - 2] == '\r')
+
+    if(source->num_lines == source->lines_capacity)
     {
-        new_text[text_sz - 2] = '\0';
-        new_text[text_sz - 3] = '\0';
+        uint32_t capacity = source->lines_capacity != 0 ? source->lines_capacity * 2 : SOURCE_INITIAL_LINES;
+
+        struct source_line* lines = realloc(source->lines, capacity * sizeof(struct source_line));
+        if(lines == NULL)
+            return false;
+        source->lines = lines;
+
+        uint32_t* code_lines = realloc(source->code_lines, capacity * sizeof(uint32_t));    // Code lines never outnumber lines.
+        if(code_lines == NULL)
+            return false;
+        source->code_lines = code_lines;
+
+        source->lines_capacity = capacity;
     }
-    new->text = new_text;
-    new->empty = strlen(new_text) == 0 || new_text[0] == '#';
-    current->next = new;
+
+    struct source_line* line = &source->lines[source->num_lines];
+    line->text = source->text_sz;
+    line->addr = addr;
+
+    // Comment may be indented, whitespace is skipped the same way lexer does.
+    size_t first = 0;
+    while(first < text_len && (text[first] == ' ' || text[first] == '\t' || text[first] == '\r' || text[first] == '\v'
+        || text[first] == '\f'))
+        ++first;
+    line->empty = first == text_len || text[first] == '#';
+
+    memcpy(source->text + source->text_sz, text, text_len);
+    source->text[source->text_sz + text_len] = '\0';
+    source->text_sz += text_len + 1;
+
+    if(!line->empty)
+        source->code_lines[source->num_code_lines++] = source->num_lines;
+    source->num_lines += 1;
+    return true;
 }
 
-void source_code_free(struct source_code** source_code)
+bool source_code_append(struct source_code** source_code, const struct source_code* other, uint16_t addr_offset)
+{
+    return source_code_append_range(source_code, other, 0, source_code_size(other), addr_offset);
+}
+
+bool source_code_append_range(struct source_code** source_code, const struct source_code* other, uint32_t first,
+    uint32_t count, uint16_t addr_offset)
 {
+    if(other == NULL || count == 0)
+        return true;
+
     if(*source_code == NULL)
-        return;
+    {
+        *source_code = calloc(1, sizeof(struct source_code));
+        if(*source_code == NULL)
+            return false;
+    }
 
-    struct source_code* current = *source_code;
-    struct source_code* next;
-    while(current != NULL)
+    struct source_code* source = *source_code;
+
+    // Texts of consecutive lines are consecutive in buffer.
+    size_t text_start = other->lines[first].text;
+    size_t text_end = first + count < other->num_lines ? other->lines[first + count].text : other->text_sz;
+    size_t text_sz = text_end - text_start;
+
+    if(source->text_sz + text_sz > source->text_capacity)
+    {
+        size_t capacity = source->text_sz + text_sz;
+        char* new_text = realloc(source->text, capacity);
+        if(new_text == NULL)
+            return false;
+
+        source->text = new_text;
+        source->text_capacity = capacity;
+    }
+
+    if(source->num_lines + count > source->lines_capacity)
     {
-        free(current->text);
-        next = current->next;
-        free(current);
+        uint32_t capacity = source->num_lines + count;
+
+        struct source_line* lines = realloc(source->lines, capacity * sizeof(struct source_line));
+        if(lines == NULL)
+            return false;
+        source->lines = lines;
+
+        uint32_t* code_lines = realloc(source->code_lines, capacity * sizeof(uint32_t));
+        if(code_lines == NULL)
+            return false;
+        source->code_lines = code_lines;
 
-        current = next;
+        source->lines_capacity = capacity;
     }
 
+    memcpy(source->text + source->text_sz, other->text + text_start, text_sz);
+
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        struct source_line* line = &source->lines[source->num_lines + i];
+        *line = other->lines[first + i];
+        line->text = line->text - text_start + source->text_sz;
+        line->addr += addr_offset;
+
+        if(!line->empty)
+            source->code_lines[source->num_code_lines++] = source->num_lines + i;
+    }
+
+    source->text_sz += text_sz;
+    source->num_lines += count;
+
+    return true;
+}
+
+uint32_t source_code_size(const struct source_code* source_code)
+{
+    return source_code != NULL ? source_code->num_lines : 0;
+}
+
+const struct source_line* source_code_line(const struct source_code* source_code, uint32_t index)
+{
+    return &source_code->lines[index];
+}
+
+const char* source_code_text(const struct source_code* source_code, uint32_t index)
+{
+    return source_code->text + source_code->lines[index].text;
+}
+
+uint32_t source_code_find(const struct source_code* source_code, uint16_t addr)
+{
+    if(source_code == NULL)
+        return UINT32_MAX;
+
+    // Binary search for the first code line past the address.
+    uint32_t low = 0, high = source_code->num_code_lines;
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if(source_code->lines[source_code->code_lines[mid]].addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if(low == 0)
+        return UINT32_MAX;
+
+    uint32_t index = source_code->code_lines[low - 1];
+    return source_code->lines[index].addr == addr ? index : UINT32_MAX;
+}
+
+void source_code_free(struct source_code** source_code)
+{
+    if(*source_code == NULL)
+        return;
+
+    free((*source_code)->lines);
+    free((*source_code)->code_lines);
+    free((*source_code)->text);
+    free(*source_code);
+
     *source_code = NULL;
 }
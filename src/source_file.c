@@ -0,0 +1,177 @@
+#include "source_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SOURCE_FILE_CHUNK 65536     // Size of first block read from input that can't be mapped.
+
+#ifdef _WIN32
+// Reads whole stream into memory.
+static int source_file_read(struct source_file* file, FILE* stream)
+{
+    size_t capacity = SOURCE_FILE_CHUNK, size = 0;
+    char* data = malloc(capacity);
+    if(data == NULL)
+        return 3;
+
+    size_t chars_read;
+    while((chars_read = fread(data + size, 1, capacity - size, stream)) > 0)
+    {
+        size += chars_read;
+        if(size == capacity)
+        {
+            char* new_data = realloc(data, capacity * 2);
+            if(new_data == NULL)
+            {
+                free(data);
+                return 3;
+            }
+            data = new_data;
+            capacity *= 2;
+        }
+    }
+
+    file->data = data;
+    file->size = size;
+    return 0;
+}
+#else
+// Reads whole input behind file descriptor into memory.
+static int source_file_read(struct source_file* file, int fd)
+{
+    size_t capacity = SOURCE_FILE_CHUNK, size = 0;
+    char* data = malloc(capacity);
+    if(data == NULL)
+        return 3;
+
+    ssize_t chars_read;
+    while((chars_read = read(fd, data + size, capacity - size)) != 0)
+    {
+        if(chars_read < 0)
+        {
+            free(data);
+            return 2;
+        }
+
+        size += chars_read;
+        if(size == capacity)
+        {
+            char* new_data = realloc(data, capacity * 2);
+            if(new_data == NULL)
+            {
+                free(data);
+                return 3;
+            }
+            data = new_data;
+            capacity *= 2;
+        }
+    }
+
+    file->data = data;
+    file->size = size;
+    return 0;
+}
+#endif
+
+int source_file_open(struct source_file* file, const char* filename)
+{
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = false;
+
+#ifdef _WIN32
+    if(strcmp(filename, "-") == 0)
+        return source_file_read(file, stdin);
+
+    HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(handle == INVALID_HANDLE_VALUE)
+        return 1;
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(handle, &size))
+    {
+        CloseHandle(handle);
+        return 2;
+    }
+
+    if(size.QuadPart == 0)  // Empty file can't be mapped.
+    {
+        CloseHandle(handle);
+        return 0;
+    }
+
+    // View keeps mapping alive, so both handles can be closed right away.
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+    if(mapping == NULL)
+        return 2;
+
+    file->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(file->data == NULL)
+        return 2;
+
+    file->size = (size_t) size.QuadPart;
+    file->mapped = true;
+    return 0;
+#else
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if(fd < 0)
+        return 1;
+
+    int result = 0;
+    struct stat info;
+    if(fstat(fd, &info) != 0)
+        result = 2;
+    else if(!S_ISREG(info.st_mode))     // Pipes and terminals can't be mapped.
+        result = source_file_read(file, fd);
+    else if(info.st_size > 0)
+    {
+        void* data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            madvise(data, (size_t) info.st_size, MADV_SEQUENTIAL);
+            file->data = data;
+            file->size = (size_t) info.st_size;
+            file->mapped = true;
+        }
+        else
+            result = source_file_read(file, fd);
+    }
+
+    // Mapping stays valid after descriptor is closed.
+    if(fd != STDIN_FILENO)
+        close(fd);
+
+    return result;
+#endif
+}
+
+void source_file_close(struct source_file* file)
+{
+    if(file->mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(file->data);
+#else
+        munmap((void*) file->data, file->size);
+#endif
+    }
+    else
+        free((void*) file->data);
+
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = false;
+}
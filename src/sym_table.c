@@ -4,54 +4,191 @@
 #include <stdlib.h>
 #include <string.h>
 
-uint16_t sym_table_get(const struct sym_table* sym_table, const char* name)
+#define SYM_TABLE_INITIAL_SLOTS 64      // Initial size of hash table, must be power of two.
+#define SYM_ARENA_BLOCK_SIZE 4096       // Default size of arena block. Longer names get blocks of their own.
+
+// FNV-1a hash of symbol name.
+static uint32_t sym_hash(const char* name, uint32_t length)
 {
-    if(sym_table == NULL)
-        return UINT16_MAX;
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < length; ++i)
+    {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Returns slot holding symbol of given name, or empty slot where it belongs.
+static uint32_t* sym_find_slot(const struct sym_table* sym_table, const char* name, uint32_t length, uint32_t hash)
+{
+    uint32_t mask = sym_table->num_slots - 1;
+    for(uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        uint32_t* slot = &sym_table->slots[i];
+        if(*slot == 0)
+            return slot;
+
+        const struct symbol* symbol = &sym_table->symbols[*slot - 1];
+        if(symbol->hash == hash && strncmp(symbol->name, name, length) == 0 && symbol->name[length] == '\0')
+            return slot;
+    }
+}
+
+// Doubles hash table, putting all symbols again into new slots.
+static bool sym_grow_slots(struct sym_table* sym_table)
+{
+    uint32_t num_slots = sym_table->num_slots * 2;
+    uint32_t* slots = calloc(num_slots, sizeof(uint32_t));
+    if(slots == NULL)
+        return false;
+
+    free(sym_table->slots);
+    sym_table->slots = slots;
+    sym_table->num_slots = num_slots;
+
+    for(uint32_t i = 0; i < sym_table->count; ++i)
+    {
+        const struct symbol* symbol = &sym_table->symbols[i];
+        *sym_find_slot(sym_table, symbol->name, strlen(symbol->name), symbol->hash) = i + 1;
+    }
 
-    const struct sym_table* current = sym_table;
-    while(current != NULL)
+    return true;
+}
+
+// Copies name into arena, terminating it with '\0'. Returns NULL if there is no memory left.
+static const char* sym_intern(struct sym_table* sym_table, const char* name, uint32_t length)
+{
+    uint32_t name_sz = length + 1;
+    struct sym_arena* arena = sym_table->arena;
+
+    if(arena == NULL || arena->size - arena->used < name_sz)
     {
-        if(strcmp(current->name, name) == 0)
-            return current->addr;
+        uint32_t size = name_sz > SYM_ARENA_BLOCK_SIZE ? name_sz : SYM_ARENA_BLOCK_SIZE;
+        arena = malloc(sizeof(struct sym_arena) + size);
+        if(arena == NULL)
+            return NULL;
 
-        current = current->next;
+        arena->next = sym_table->arena;
+        arena->used = 0;
+        arena->size = size;
+        sym_table->arena = arena;
     }
 
-    return UINT16_MAX;
+    char* interned = arena->data + arena->used;
+    memcpy(interned, name, length);
+    interned[length] = '\0';
+    arena->used += name_sz;
+
+    return interned;
+}
+
+static struct sym_table* sym_table_create(void)
+{
+    struct sym_table* sym_table = malloc(sizeof(struct sym_table));
+    if(sym_table == NULL)
+        return NULL;
+
+    sym_table->count = 0;
+    sym_table->capacity = SYM_TABLE_INITIAL_SLOTS / 2;
+    sym_table->num_slots = SYM_TABLE_INITIAL_SLOTS;
+    sym_table->symbols = malloc(sym_table->capacity * sizeof(struct symbol));
+    sym_table->slots = calloc(sym_table->num_slots, sizeof(uint32_t));
+    sym_table->arena = NULL;
+
+    if(sym_table->symbols == NULL || sym_table->slots == NULL)
+        sym_table_free(&sym_table);
+
+    return sym_table;
+}
+
+uint16_t sym_table_get(const struct sym_table* sym_table, const char* name)
+{
+    return sym_table_get_n(sym_table, name, strlen(name));
+}
+
+uint16_t sym_table_get_n(const struct sym_table* sym_table, const char* name, uint32_t length)
+{
+    const struct symbol* symbol = sym_table_find_n(sym_table, name, length);
+    return symbol != NULL ? symbol->addr : UINT16_MAX;
 }
 
-void sym_table_push_back(struct sym_table** sym_table, const char* name, uint16_t addr)
+const struct symbol* sym_table_find_n(const struct sym_table* sym_table, const char* name, uint32_t length)
+{
+    if(sym_table == NULL)
+        return NULL;
+
+    uint32_t slot = *sym_find_slot(sym_table, name, length, sym_hash(name, length));
+    if(slot == 0)
+        return NULL;
+
+    return &sym_table->symbols[slot - 1];
+}
+
+enum sym_result sym_table_push_back(struct sym_table** sym_table, const char* name, uint16_t addr)
 {
     if(name == NULL)
-        return;
+        return SYM_DUPLICATE;
+
+    return sym_table_push_back_n(sym_table, name, strlen(name), addr);
+}
+
+enum sym_result sym_table_push_back_n(struct sym_table** sym_table, const char* name, uint32_t length, uint16_t addr)
+{
+    if(name == NULL)
+        return SYM_DUPLICATE;
 
     if(*sym_table == NULL)  // Create new symbol table.
     {
-        *sym_table = malloc(sizeof(struct sym_table));
-        (*sym_table)->addr = addr;
-        (*sym_table)->next = NULL;
-        size_t name_sz = strlen(name) + 1;
-        char* new_name = malloc(name_sz);
-        memcpy(new_name, name, name_sz);
-        (*sym_table)->name = new_name;
+        *sym_table = sym_table_create();
+        if(*sym_table == NULL)
+            return SYM_NO_MEMORY;
+    }
+
+    struct sym_table* table = *sym_table;
+    uint32_t hash = sym_hash(name, length);
+    uint32_t* slot = sym_find_slot(table, name, length, hash);
+    if(*slot != 0)  // Labels must be unique.
+        return SYM_DUPLICATE;
+
+    // Table is kept at most half full, so that probe sequences stay short.
+    if(table->count + 1 > table->num_slots / 2)
+    {
+        if(!sym_grow_slots(table))
+            return SYM_NO_MEMORY;
+        slot = sym_find_slot(table, name, length, hash);
+    }
 
-        return;
+    if(table->count == table->capacity)
+    {
+        struct symbol* symbols = realloc(table->symbols, 2 * table->capacity * sizeof(struct symbol));
+        if(symbols == NULL)
+            return SYM_NO_MEMORY;
+
+        table->symbols = symbols;
+        table->capacity *= 2;
     }
 
-    // Append new symbol to existing table.
-    struct sym_table* current = *sym_table;
-    while(current->next != NULL)
-        current = current->next;
-
-    struct sym_table* new = malloc(sizeof(struct sym_table));
-    new->addr = addr;
-    new->next = NULL;
-    size_t name_sz = strlen(name) + 1;
-    char* new_name = malloc(name_sz);
-    memcpy(new_name, name, name_sz);
-    new->name = new_name;
-    current->next = new;
+    const char* interned = sym_intern(table, name, length);
+    if(interned == NULL)
+        return SYM_NO_MEMORY;
+
+    table->symbols[table->count] = (struct symbol) {interned, hash, addr};
+    table->count += 1;
+    *slot = table->count;
+
+    return SYM_ADDED;
+}
+
+uint32_t sym_table_size(const struct sym_table* sym_table)
+{
+    return sym_table != NULL ? sym_table->count : 0;
+}
+
+const struct symbol* sym_table_at(const struct sym_table* sym_table, uint32_t index)
+{
+    return &sym_table->symbols[index];
 }
 
 void sym_table_free(struct sym_table** sym_table)
@@ -59,16 +196,17 @@ void sym_table_free(struct sym_table** sym_table)
     if(*sym_table == NULL)
         return;
 
-    struct sym_table* current = *sym_table;
-    struct sym_table* next;
-    while(current != NULL)
+    struct sym_arena* arena = (*sym_table)->arena;
+    while(arena != NULL)
     {
-        free(current->name);
-        next = current->next;
-        free(current);
-
-        current = next;
+        struct sym_arena* next = arena->next;
+        free(arena);
+        arena = next;
     }
 
+    free((*sym_table)->symbols);
+    free((*sym_table)->slots);
+    free(*sym_table);
+
     *sym_table = NULL;
 }
@@ -0,0 +1,221 @@
+#include "vector.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAS_SIMD_KERNELS
+#include <immintrin.h>
+#endif
+
+static inline int32_t vector_load(const uint8_t* array, uint32_t i)
+{
+    int32_t value;
+    memcpy(&value, array + 4 * (size_t) i, sizeof(value));
+    return value;
+}
+
+static inline void vector_store(uint8_t* array, uint32_t i, int32_t value)
+{
+    memcpy(array + 4 * (size_t) i, &value, sizeof(value));
+}
+
+// Applies op to single pair of elements.
+static inline int32_t vector_scalar(enum vector_op op, int32_t a, int32_t b)
+{
+    switch(op)
+    {
+        case VECTOR_ADD:
+            return (int32_t) ((uint32_t) a + (uint32_t) b);
+        case VECTOR_SUB:
+            return (int32_t) ((uint32_t) a - (uint32_t) b);
+        case VECTOR_MUL:
+            return (int32_t) ((uint32_t) a * (uint32_t) b);
+        case VECTOR_MIN:
+            return a < b ? a : b;
+        default:
+            return a > b ? a : b;
+    }
+}
+
+#ifdef HAS_SIMD_KERNELS
+// Following kernels process elements as long as whole vectors fit, and return number of elements processed.
+// Remaining ones are left to the scalar loop of the caller.
+
+__attribute__((target("avx2")))
+static uint32_t vector_apply_avx2(enum vector_op op, uint8_t* dest, const uint8_t* src, uint32_t n)
+{
+    uint32_t i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i* d = (__m256i*) (dest + 4 * (size_t) i);
+        __m256i a = _mm256_loadu_si256(d);
+        __m256i b = _mm256_loadu_si256((const __m256i*) (src + 4 * (size_t) i));
+
+        if(op == VECTOR_ADD)
+            a = _mm256_add_epi32(a, b);
+        else if(op == VECTOR_SUB)
+            a = _mm256_sub_epi32(a, b);
+        else
+            a = _mm256_mullo_epi32(a, b);
+
+        _mm256_storeu_si256(d, a);
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t vector_apply_sse(enum vector_op op, uint8_t* dest, const uint8_t* src, uint32_t n)
+{
+    uint32_t i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i* d = (__m128i*) (dest + 4 * (size_t) i);
+        __m128i a = _mm_loadu_si128(d);
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + 4 * (size_t) i));
+
+        if(op == VECTOR_ADD)
+            a = _mm_add_epi32(a, b);
+        else if(op == VECTOR_SUB)
+            a = _mm_sub_epi32(a, b);
+        else
+            a = _mm_mullo_epi32(a, b);
+
+        _mm_storeu_si128(d, a);
+    }
+
+    return i;
+}
+
+// Stops at the first vector holding elements that differ, so that scalar loop finds which one it is.
+__attribute__((target("avx2")))
+static uint32_t vector_equal_avx2(const uint8_t* a, const uint8_t* b, uint32_t n)
+{
+    uint32_t i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (a + 4 * (size_t) i));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (b + 4 * (size_t) i));
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)) != -1)
+            break;
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t vector_equal_sse(const uint8_t* a, const uint8_t* b, uint32_t n)
+{
+    uint32_t i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*) (a + 4 * (size_t) i));
+        __m128i y = _mm_loadu_si128((const __m128i*) (b + 4 * (size_t) i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(x, y)) != 0xffff)
+            break;
+    }
+
+    return i;
+}
+
+// Reductions fold processed elements into *result.
+__attribute__((target("avx2")))
+static uint32_t vector_reduce_avx2(enum vector_op op, const uint8_t* src, uint32_t n, int32_t* result)
+{
+    __m256i acc = op == VECTOR_ADD ? _mm256_setzero_si256() : _mm256_set1_epi32(*result);
+    uint32_t i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (src + 4 * (size_t) i));
+        if(op == VECTOR_ADD)
+            acc = _mm256_add_epi32(acc, x);
+        else if(op == VECTOR_MIN)
+            acc = _mm256_min_epi32(acc, x);
+        else
+            acc = _mm256_max_epi32(acc, x);
+    }
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i*) lanes, acc);
+    for(int lane = 0; i > 0 && lane < 8; ++lane)
+        *result = vector_scalar(op, *result, lanes[lane]);
+
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t vector_reduce_sse(enum vector_op op, const uint8_t* src, uint32_t n, int32_t* result)
+{
+    __m128i acc = op == VECTOR_ADD ? _mm_setzero_si128() : _mm_set1_epi32(*result);
+    uint32_t i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*) (src + 4 * (size_t) i));
+        if(op == VECTOR_ADD)
+            acc = _mm_add_epi32(acc, x);
+        else if(op == VECTOR_MIN)
+            acc = _mm_min_epi32(acc, x);
+        else
+            acc = _mm_max_epi32(acc, x);
+    }
+
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i*) lanes, acc);
+    for(int lane = 0; i > 0 && lane < 4; ++lane)
+        *result = vector_scalar(op, *result, lanes[lane]);
+
+    return i;
+}
+#endif
+
+void vector_apply(enum vector_op op, uint8_t* dest, const uint8_t* src, uint32_t n)
+{
+    uint32_t i = 0;
+#ifdef HAS_SIMD_KERNELS
+    if(__builtin_cpu_supports("avx2"))
+        i = vector_apply_avx2(op, dest, src, n);
+    else if(__builtin_cpu_supports("sse4.1"))
+        i = vector_apply_sse(op, dest, src, n);
+#endif
+
+    for(; i < n; ++i)
+        vector_store(dest, i, vector_scalar(op, vector_load(dest, i), vector_load(src, i)));
+}
+
+int32_t vector_compare(const uint8_t* a, const uint8_t* b, uint32_t n)
+{
+    uint32_t i = 0;
+#ifdef HAS_SIMD_KERNELS
+    if(__builtin_cpu_supports("avx2"))
+        i = vector_equal_avx2(a, b, n);
+    else if(__builtin_cpu_supports("sse4.1"))
+        i = vector_equal_sse(a, b, n);
+#endif
+
+    for(; i < n; ++i)
+    {
+        int32_t x = vector_load(a, i);
+        int32_t y = vector_load(b, i);
+        if(x != y)
+            return x < y ? -1 : 1;
+    }
+
+    return 0;
+}
+
+int32_t vector_reduce(enum vector_op op, const uint8_t* src, uint32_t n, int32_t init)
+{
+    int32_t result = init;
+    uint32_t i = 0;
+#ifdef HAS_SIMD_KERNELS
+    if(__builtin_cpu_supports("avx2"))
+        i = vector_reduce_avx2(op, src, n, &result);
+    else if(__builtin_cpu_supports("sse4.1"))
+        i = vector_reduce_sse(op, src, n, &result);
+#endif
+
+    for(; i < n; ++i)
+        result = vector_scalar(op, result, vector_load(src, i));
+
+    return result;
+}
@@ -0,0 +1,625 @@
+#include "verifier.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "instruction.h"
+
+#define VERIFIER_MAX_VALUES 4       // Constants kept for register before they are merged into range.
+#define VERIFIER_WIDEN_AFTER 16     // Number of changes of state at one address after which growing ranges are widened.
+#define VERIFIER_MAX_PASSES 4       // Number of passes assuming constants before verifier gives up on them.
+#define VERIFIER_NO_STATE UINT32_MAX
+
+// Values register may hold: one of few constants, or any value in range.
+struct verifier_value
+{
+    int32_t min, max;
+    uint32_t count;     // Number of constants in values, 0 if register may hold any value in [min, max].
+    int32_t values[VERIFIER_MAX_VALUES];    // Sorted constants, unused ones are zero so that values can be compared.
+};
+
+// Values registers may hold whenever execution reaches some address.
+struct verifier_state
+{
+    struct verifier_value regs[16];
+    uint32_t changes;   // Number of times state grew.
+};
+
+// Instruction decoded the same way as vm_decode does.
+struct verifier_inst
+{
+    uint8_t opcode;
+    uint8_t reg;
+    uint8_t addr_reg;
+    uint16_t addr;
+    uint32_t next_pc;
+    bool valid;     // Whether instruction can succeed at all.
+};
+
+struct verifier
+{
+    const uint8_t* memory;
+    uint32_t mem_sz;
+    uint32_t* state_index;  // Index of state of each address, VERIFIER_NO_STATE if execution doesn't reach it.
+    struct verifier_state* states;
+    uint32_t num_states;
+    uint32_t max_states;    // Number of states there is room for.
+    uint32_t* worklist;     // Addresses whose state changed since they were last followed.
+    uint32_t worklist_sz;
+    bool* queued;           // Whether address is in worklist.
+    bool fold;              // Whether loads of constant words are followed with their values.
+    uint8_t* written;       // Non-zero for bytes stores with known address may write, words there aren't constant.
+};
+
+static struct verifier_value value_const(int32_t value)
+{
+    return (struct verifier_value) {value, value, 1, {value}};
+}
+
+// Returns range of values, or any value if range doesn't fit in register.
+static struct verifier_value value_range(int64_t min, int64_t max)
+{
+    if(min < INT32_MIN || max > INT32_MAX)
+        return (struct verifier_value) {INT32_MIN, INT32_MAX, 0, {0}};
+
+    return (struct verifier_value) {min, max, 0, {0}};
+}
+
+// Adds constant to values register may hold, turning them into range when there are too many.
+static void value_insert(struct verifier_value* value, int32_t constant)
+{
+    if(constant < value->min)
+        value->min = constant;
+    if(constant > value->max)
+        value->max = constant;
+
+    if(value->count == 0)
+        return;
+
+    uint32_t i = 0;
+    while(i < value->count && value->values[i] < constant)
+        ++i;
+
+    if(i < value->count && value->values[i] == constant)
+        return;
+
+    if(value->count == VERIFIER_MAX_VALUES)
+    {
+        value->count = 0;
+        memset(value->values, 0, sizeof(value->values));
+        return;
+    }
+
+    memmove(&value->values[i + 1], &value->values[i], (value->count - i) * sizeof(int32_t));
+    value->values[i] = constant;
+    value->count += 1;
+}
+
+static void value_join(struct verifier_value* value, const struct verifier_value* other)
+{
+    if(other->count != 0)
+    {
+        for(uint32_t i = 0; i < other->count; ++i)
+            value_insert(value, other->values[i]);
+        return;
+    }
+
+    *value = value_range(value->min < other->min ? value->min : other->min,
+        value->max > other->max ? value->max : other->max);
+}
+
+// Computes a + b, or a - b, for every pair of values the way machine does, wrapping around on overflow.
+static struct verifier_value value_add(const struct verifier_value* a, const struct verifier_value* b, bool subtract)
+{
+    if(a->count != 0 && b->count != 0)
+    {
+        struct verifier_value result = {0};
+        for(uint32_t i = 0; i < a->count; ++i)
+        {
+            for(uint32_t j = 0; j < b->count; ++j)
+            {
+                uint32_t sum = subtract ? (uint32_t) a->values[i] - (uint32_t) b->values[j]
+                    : (uint32_t) a->values[i] + (uint32_t) b->values[j];
+
+                if(i == 0 && j == 0)
+                    result = value_const((int32_t) sum);
+                else
+                    value_insert(&result, (int32_t) sum);
+            }
+        }
+        return result;
+    }
+
+    // Range wrapping around isn't a range anymore, value_range gives up on it.
+    if(subtract)
+        return value_range((int64_t) a->min - b->max, (int64_t) a->max - b->min);
+    return value_range((int64_t) a->min + b->min, (int64_t) a->max + b->max);
+}
+
+static int32_t verifier_word(const struct verifier* verifier, uint32_t addr)
+{
+    int32_t word;
+    memcpy(&word, verifier->memory + addr, sizeof(word));
+    return word;
+}
+
+static bool verifier_top(const struct verifier_value* value)
+{
+    return value->count == 0 && value->min == INT32_MIN && value->max == INT32_MAX;
+}
+
+static void verifier_decode(const struct verifier* verifier, uint32_t pc, struct verifier_inst* inst)
+{
+    uint8_t bytes[4] = {0};  // Bytes past the end of memory are read as zeros.
+    for(uint32_t i = 0; i < 4 && pc + i < verifier->mem_sz; ++i)
+        bytes[i] = verifier->memory[pc + i];
+
+    uint8_t opcode = bytes[0];
+    bool reg_inst = instruction_widths[opcode] == 2;
+    if(instruction_widths[opcode] == 0)
+        reg_inst = (opcode & 1) != 0;
+
+    inst->opcode = opcode;
+    inst->reg = bytes[1] & 0xf;
+    inst->addr_reg = bytes[1] >> 4;
+    inst->addr = reg_inst ? 0 : bytes[2] | bytes[3] << 8;
+    inst->next_pc = pc + (reg_inst ? 2 : 4);
+    inst->valid = instruction_widths[opcode] != 0
+        && !(instruction_accesses_memory(opcode) && inst->addr >= verifier->mem_sz);
+}
+
+// Checks if load always reads the same word of program's memory, see VERIFIER_FOLDED.
+static bool verifier_folds(const struct verifier* verifier, const struct verifier_inst* inst,
+    const struct verifier_value* base)
+{
+    if(!verifier->fold || !inst->valid || instruction_kinds[inst->opcode] != INSTRUCTION_MEMORY
+        || inst->opcode == OPCODE_ST)
+        return false;
+
+    if(base->count != 1 || base->values[0] != 0 || (uint32_t) inst->addr + 4 > verifier->mem_sz)
+        return false;
+
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        if(verifier->written[inst->addr + i])
+            return false;
+    }
+
+    return true;
+}
+
+// Updates registers the way instruction does.
+static void verifier_execute(const struct verifier* verifier, const struct verifier_inst* inst,
+    struct verifier_state* state)
+{
+    struct verifier_value* dest = &state->regs[inst->reg];
+    const struct verifier_value* src = &state->regs[inst->addr_reg];
+    struct verifier_value addr = value_const(inst->addr);
+    struct verifier_value imm = value_const((int16_t) inst->addr);
+
+    // Folded constant is known just like immediate.
+    if(verifier_folds(verifier, inst, src))
+    {
+        struct verifier_value word = value_const(verifier_word(verifier, inst->addr));
+        if(inst->opcode == OPCODE_A || inst->opcode == OPCODE_S)
+        {
+            *dest = value_add(dest, &word, inst->opcode == OPCODE_S);
+            return;
+        }
+        if(inst->opcode == OPCODE_L)
+        {
+            *dest = word;
+            return;
+        }
+    }
+
+    switch(inst->opcode)
+    {
+        case OPCODE_AR:
+        case OPCODE_SR:
+            *dest = value_add(dest, src, inst->opcode == OPCODE_SR);
+            break;
+        case OPCODE_LR:
+            *dest = *src;
+            break;
+        case OPCODE_LA:
+            *dest = value_add(&addr, src, false);
+            break;
+        case OPCODE_AI:
+        case OPCODE_SI:
+            *dest = value_add(dest, &imm, inst->opcode == OPCODE_SI);
+            break;
+        case OPCODE_LI:
+            *dest = imm;
+            break;
+        case OPCODE_A:
+        case OPCODE_S:
+        case OPCODE_M:
+        case OPCODE_MR:
+        case OPCODE_D:
+        case OPCODE_DR:
+        case OPCODE_L:
+        case OPCODE_MI:
+        case OPCODE_DI:
+        case OPCODE_VSUM:
+        case OPCODE_VMIN:
+        case OPCODE_VMAX:
+            // Values in memory aren't tracked, and neither are products and quotients.
+            *dest = value_range(INT32_MIN, INT32_MAX);
+            break;
+    }
+}
+
+// Lists addresses jump may go to, the way handlers compute them. Returns false if there are too many to follow.
+static bool verifier_targets(const struct verifier_inst* inst, const struct verifier_value* base, uint16_t* targets)
+{
+    if(base->count == 0)
+        return false;
+
+    for(uint32_t i = 0; i < base->count; ++i)
+        targets[i] = inst->addr + base->values[i];
+
+    return true;
+}
+
+// Checks if every word memory operand may refer to lies inside program's memory.
+static bool verifier_inside(const struct verifier* verifier, const struct verifier_inst* inst,
+    const struct verifier_value* base)
+{
+    if(base->count == 0)
+        return (int64_t) inst->addr + base->min >= 0 && (int64_t) inst->addr + base->max + 4 <= verifier->mem_sz;
+
+    for(uint32_t i = 0; i < base->count; ++i)
+    {
+        uint32_t ea = inst->addr + (uint32_t) base->values[i];
+        if((uint64_t) ea + 4 > verifier->mem_sz)
+            return false;
+    }
+
+    return true;
+}
+
+// Checks if store may write into code or constants. code_bytes[addr] is number of such bytes below addr.
+static bool verifier_hits_code(const struct verifier* verifier, const uint32_t* code_bytes,
+    const struct verifier_inst* inst, const struct verifier_value* base)
+{
+    if(base->count == 0)
+    {
+        // Addresses below zero wrap around to the end of address space, except for bytes of word crossing zero.
+        int64_t from = (int64_t) inst->addr + base->min;
+        int64_t to = (int64_t) inst->addr + base->max + 4;
+        from = from < 0 ? 0 : from;
+        to = to > verifier->mem_sz ? verifier->mem_sz : to;
+        return from < to && code_bytes[to] != code_bytes[from];
+    }
+
+    for(uint32_t i = 0; i < base->count; ++i)
+    {
+        uint32_t ea = inst->addr + (uint32_t) base->values[i];
+        for(uint32_t j = 0; j < 4; ++j)
+        {
+            uint32_t byte_addr = ea + j;
+            if(byte_addr < verifier->mem_sz && code_bytes[byte_addr + 1] != code_bytes[byte_addr])
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// Joins state with one already known at address, queuing address if it changed. Returns false if there is no memory left.
+static bool verifier_merge(struct verifier* verifier, uint32_t pc, const struct verifier_state* state)
+{
+    uint32_t index = verifier->state_index[pc];
+    if(index == VERIFIER_NO_STATE)
+    {
+        if(verifier->num_states == verifier->max_states)
+        {
+            uint32_t max_states = verifier->max_states * 2;
+            struct verifier_state* states = realloc(verifier->states, max_states * sizeof(struct verifier_state));
+            if(states == NULL)
+                return false;
+
+            verifier->states = states;
+            verifier->max_states = max_states;
+        }
+
+        index = verifier->num_states++;
+        verifier->states[index] = *state;
+        verifier->states[index].changes = 0;
+        verifier->state_index[pc] = index;
+    }
+    else
+    {
+        struct verifier_state* old = &verifier->states[index];
+        struct verifier_state joined = *old;
+        for(int i = 0; i < 16; ++i)
+            value_join(&joined.regs[i], &state->regs[i]);
+
+        if(memcmp(joined.regs, old->regs, sizeof(old->regs)) == 0)
+            return true;
+
+        // Loop counting in register would otherwise be followed once per value it takes.
+        if(++joined.changes > VERIFIER_WIDEN_AFTER)
+        {
+            for(int i = 0; i < 16; ++i)
+            {
+                struct verifier_value* value = &joined.regs[i];
+                if(value->count == 0 && value->min < old->regs[i].min)
+                    value->min = INT32_MIN;
+                if(value->count == 0 && value->max > old->regs[i].max)
+                    value->max = INT32_MAX;
+            }
+        }
+
+        *old = joined;
+    }
+
+    if(!verifier->queued[pc])
+    {
+        verifier->queued[pc] = true;
+        verifier->worklist[verifier->worklist_sz++] = pc;
+    }
+
+    return true;
+}
+
+// Follows every path from the entry point until states of all reached addresses stop changing.
+static int verifier_follow(struct verifier* verifier)
+{
+    while(verifier->worklist_sz > 0)
+    {
+        uint32_t pc = verifier->worklist[--verifier->worklist_sz];
+        verifier->queued[pc] = false;
+
+        struct verifier_state state = verifier->states[verifier->state_index[pc]];
+        struct verifier_inst inst;
+        verifier_decode(verifier, pc, &inst);
+        if(!inst.valid)     // Execution fails here.
+            continue;
+
+        bool falls_through = true;
+        if(instruction_kinds[inst.opcode] == INSTRUCTION_JUMP)
+        {
+            uint16_t targets[VERIFIER_MAX_VALUES];
+            const struct verifier_value* base = &state.regs[inst.addr_reg];
+            if(!verifier_targets(&inst, base, targets))
+                return 1;
+
+            // Jump fails when its target is past the program, whether it's taken or not.
+            falls_through = false;
+            for(uint32_t i = 0; i < base->count; ++i)
+            {
+                if(targets[i] >= verifier->mem_sz)
+                    continue;
+
+                if(!verifier_merge(verifier, targets[i], &state))
+                    return 2;
+                falls_through = inst.opcode != OPCODE_J;
+            }
+        }
+        else
+            verifier_execute(verifier, &inst, &state);
+
+        if(falls_through && inst.next_pc < verifier->mem_sz && !verifier_merge(verifier, inst.next_pc, &state))
+            return 2;
+    }
+
+    return 0;
+}
+
+// Follows program from the entry point again, forgetting states of previous pass.
+static int verifier_pass(struct verifier* verifier, uint32_t entry, const int32_t* regs)
+{
+    for(uint32_t addr = 0; addr < verifier->mem_sz; ++addr)
+        verifier->state_index[addr] = VERIFIER_NO_STATE;
+    verifier->num_states = 0;
+
+    struct verifier_state state = {0};
+    for(int i = 0; i < 16; ++i)
+        state.regs[i] = value_const(regs[i]);
+
+    return verifier_merge(verifier, entry, &state) ? verifier_follow(verifier) : 2;
+}
+
+// Adds bytes stores with known address may write to verifier->written and checks if constants folded by last pass
+// stay clear of them. Stores that may write anywhere are left to the caller. Returns 2 if there is no memory left.
+static int verifier_check_constants(struct verifier* verifier, bool* hold)
+{
+    uint32_t mem_sz = verifier->mem_sz;
+    int32_t* starts = calloc(mem_sz + 1, sizeof(int32_t));   // Number of written ranges starting at each byte.
+    if(starts == NULL)
+        return 2;
+
+    struct verifier_inst inst;
+    for(uint32_t pc = 0; pc < mem_sz; ++pc)
+    {
+        uint32_t index = verifier->state_index[pc];
+        if(index == VERIFIER_NO_STATE)
+            continue;
+
+        verifier_decode(verifier, pc, &inst);
+        const struct verifier_value* base = &verifier->states[index].regs[inst.addr_reg];
+        if(inst.opcode != OPCODE_ST || !inst.valid || verifier_top(base))
+            continue;
+
+        if(base->count == 0)    // Range is clamped the same way as in verifier_hits_code.
+        {
+            int64_t from = (int64_t) inst.addr + base->min;
+            int64_t to = (int64_t) inst.addr + base->max + 4;
+            from = from < 0 ? 0 : from;
+            to = to > mem_sz ? mem_sz : to;
+            if(from < to)
+            {
+                starts[from] += 1;
+                starts[to] -= 1;
+            }
+            continue;
+        }
+
+        for(uint32_t i = 0; i < base->count; ++i)
+        {
+            uint32_t ea = inst.addr + (uint32_t) base->values[i];
+            for(uint32_t j = 0; j < 4; ++j)
+            {
+                uint32_t byte_addr = ea + j;
+                if(byte_addr < mem_sz)
+                {
+                    starts[byte_addr] += 1;
+                    starts[byte_addr + 1] -= 1;
+                }
+            }
+        }
+    }
+
+    // Turns starts into number of ranges covering each byte.
+    for(uint32_t addr = 1; addr < mem_sz; ++addr)
+        starts[addr] += starts[addr - 1];
+
+    // Constants are checked before written bytes are updated, as folding looked at bytes written so far.
+    *hold = true;
+    for(uint32_t pc = 0; pc < mem_sz && *hold; ++pc)
+    {
+        uint32_t index = verifier->state_index[pc];
+        if(index == VERIFIER_NO_STATE)
+            continue;
+
+        verifier_decode(verifier, pc, &inst);
+        if(!verifier_folds(verifier, &inst, &verifier->states[index].regs[inst.addr_reg]))
+            continue;
+
+        for(uint32_t i = 0; i < 4; ++i)
+            *hold = *hold && starts[inst.addr + i] == 0;
+    }
+
+    for(uint32_t addr = 0; addr < mem_sz; ++addr)
+        verifier->written[addr] |= starts[addr] > 0;
+
+    free(starts);
+    return 0;
+}
+
+// Marks code, constants and instructions proven safe. Stores are safe only if they can't modify code or constants
+// proofs rely on.
+static int verifier_mark(struct verifier* verifier, uint8_t* flags)
+{
+    uint32_t mem_sz = verifier->mem_sz;
+    uint32_t* code_bytes = calloc(mem_sz + 1, sizeof(uint32_t));
+    if(code_bytes == NULL)
+        return 2;
+
+    // Every reached instruction is code, including ones that fail. Storing there could make them succeed.
+    struct verifier_inst inst;
+    for(uint32_t pc = 0; pc < mem_sz; ++pc)
+    {
+        if(verifier->state_index[pc] == VERIFIER_NO_STATE)
+            continue;
+
+        verifier_decode(verifier, pc, &inst);
+        for(uint32_t addr = pc; addr < inst.next_pc && addr < mem_sz; ++addr)
+            flags[addr] |= VERIFIER_CODE;
+    }
+
+    // Constants loads were followed with are relied on just like code.
+    for(uint32_t pc = 0; pc < mem_sz; ++pc)
+    {
+        uint32_t index = verifier->state_index[pc];
+        if(index == VERIFIER_NO_STATE)
+            continue;
+
+        verifier_decode(verifier, pc, &inst);
+        if(!verifier_folds(verifier, &inst, &verifier->states[index].regs[inst.addr_reg]))
+            continue;
+
+        flags[pc] |= VERIFIER_FOLDED;
+        for(uint32_t i = 0; i < 4; ++i)
+            flags[inst.addr + i] |= VERIFIER_CONST;
+    }
+
+    for(uint32_t addr = 0; addr < mem_sz; ++addr)
+        code_bytes[addr + 1] = code_bytes[addr] + ((flags[addr] & (VERIFIER_CODE | VERIFIER_CONST)) != 0);
+
+    for(uint32_t pc = 0; pc < mem_sz; ++pc)
+    {
+        uint32_t index = verifier->state_index[pc];
+        if(index == VERIFIER_NO_STATE)
+            continue;
+
+        verifier_decode(verifier, pc, &inst);
+        const struct verifier_value* base = &verifier->states[index].regs[inst.addr_reg];
+        bool safe = false;
+        if(!inst.valid)     // Instruction fails no matter what, checked handler takes care of it.
+            continue;
+
+        // Vector instructions write arrays whose address isn't tracked, like stores the caller has to watch.
+        if(inst.opcode == OPCODE_ST)
+            safe = verifier_inside(verifier, &inst, base) && !verifier_hits_code(verifier, code_bytes, &inst, base);
+        else if(instruction_kinds[inst.opcode] == INSTRUCTION_MEMORY)
+            safe = verifier_inside(verifier, &inst, base);
+        else if(instruction_kinds[inst.opcode] == INSTRUCTION_JUMP)
+        {
+            uint16_t targets[VERIFIER_MAX_VALUES];
+            safe = verifier_targets(&inst, base, targets);
+            for(uint32_t i = 0; i < base->count; ++i)
+                safe = safe && targets[i] < mem_sz;
+        }
+
+        if(safe)
+            flags[pc] |= VERIFIER_SAFE;
+    }
+
+    free(code_bytes);
+    return 0;
+}
+
+int verifier_run(const uint8_t* memory, uint32_t mem_sz, uint32_t entry, const int32_t* regs, uint8_t* flags)
+{
+    if(entry >= mem_sz)     // Nothing gets executed.
+        return 0;
+
+    struct verifier verifier = {0};
+    verifier.memory = memory;
+    verifier.mem_sz = mem_sz;
+    verifier.state_index = malloc(mem_sz * sizeof(uint32_t));
+    verifier.max_states = 64;
+    verifier.states = malloc(verifier.max_states * sizeof(struct verifier_state));
+    verifier.worklist = malloc(mem_sz * sizeof(uint32_t));
+    verifier.queued = calloc(mem_sz, sizeof(bool));
+    verifier.fold = true;
+    verifier.written = calloc(mem_sz, 1);
+
+    int result = 2;
+    if(verifier.state_index != NULL && verifier.states != NULL && verifier.worklist != NULL && verifier.queued != NULL
+        && verifier.written != NULL)
+    {
+        // Constants are first assumed to be never written. Pass which finds stores writing some of them is repeated
+        // without them, until assumptions hold.
+        bool hold = false;
+        for(uint32_t pass = 0; !hold; ++pass)
+        {
+            if(pass == VERIFIER_MAX_PASSES)
+                verifier.fold = false;
+
+            result = verifier_pass(&verifier, entry, regs);
+            if(result != 0)
+                break;
+
+            hold = !verifier.fold;
+            if(verifier.fold && (result = verifier_check_constants(&verifier, &hold)) != 0)
+                break;
+        }
+
+        if(result == 0)
+            result = verifier_mark(&verifier, flags);
+    }
+
+    if(result != 0)
+        memset(flags, 0, mem_sz);
+
+    free(verifier.state_index);
+    free(verifier.states);
+    free(verifier.worklist);
+    free(verifier.queued);
+    free(verifier.written);
+    return result;
+}
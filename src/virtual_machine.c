@@ -1,11 +1,91 @@
 #include "virtual_machine.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "jit.h"
+#include "paged_memory.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "vector.h"
+#include "verifier.h"
+
+#if defined(__GNUC__)
+#define HAS_THREADED_ENGINE
+#endif
+
+#define THREADED_INVALID NUM_HANDLERS       // Index of body handling unknown opcodes in threaded labels table.
+#define THREADED_END (NUM_HANDLERS + 1)     // Index of body handling end of program in threaded labels table.
+#define THREADED_FUSED (NUM_HANDLERS + 2)   // Index of first superinstruction body in threaded labels table.
+#define THREADED_UNCHECKED (THREADED_FUSED + VM_FUSION_COUNT)   // Index of unchecked bodies, indexed by opcode.
+
+// Every opcode of instruction set has to fit in handlers table.
+#define VM_OPCODE_CHECK(name, opcode, width, kind, assemble_func) \
+    _Static_assert(opcode < NUM_HANDLERS, "Opcode of " #name " doesn't fit in handlers table.");
+INSTRUCTION_SET(VM_OPCODE_CHECK)
+#undef VM_OPCODE_CHECK
+
+// Names and handlers of superinstructions, indexed by enum vm_fusion.
+static const char* fusion_names[VM_FUSION_COUNT] = {
+    NULL, "C+JZ", "C+JP", "C+JN", "CR+JZ", "CR+JP", "CR+JN", "CI+JZ", "CI+JP", "CI+JN", "L+A", "L+S", "L+M", "LA+L"
+};
+
+static bool (*const fused_handlers[VM_FUSION_COUNT])(struct virtual_machine*, const struct vm_op*) = {
+    NULL, handle_C_JZ, handle_C_JP, handle_C_JN, handle_CR_JZ, handle_CR_JP, handle_CR_JN,
+    handle_CI_JZ, handle_CI_JP, handle_CI_JN, handle_L_A, handle_L_S, handle_L_M, handle_LA_L
+};
+
+// Handlers of instructions verifier proved to stay inside memory, indexed by opcode. NULL for instructions
+// that have no bounds checks to skip.
+static bool (*const unchecked_handlers[NUM_HANDLERS])(struct virtual_machine*, const struct vm_op*) = {
+    [OPCODE_A] = handle_A_unchecked, [OPCODE_S] = handle_S_unchecked, [OPCODE_M] = handle_M_unchecked,
+    [OPCODE_D] = handle_D_unchecked, [OPCODE_C] = handle_C_unchecked, [OPCODE_J] = handle_J_unchecked,
+    [OPCODE_JP] = handle_JP_unchecked, [OPCODE_JN] = handle_JN_unchecked, [OPCODE_JZ] = handle_JZ_unchecked,
+    [OPCODE_L] = handle_L_unchecked, [OPCODE_ST] = handle_ST_unchecked
+};
+
+// Opcodes of immediate instructions performing the same operation as memory instruction of each opcode. Loads whose
+// operand verifier proved constant are decoded as those, 0 for instructions that have no immediate form.
+static const uint8_t immediate_forms[NUM_HANDLERS] = {
+    [OPCODE_A] = OPCODE_AI, [OPCODE_S] = OPCODE_SI, [OPCODE_M] = OPCODE_MI, [OPCODE_D] = OPCODE_DI,
+    [OPCODE_C] = OPCODE_CI, [OPCODE_L] = OPCODE_LI
+};
+
+// Addresses of instruction bodies inside threaded engine, indexed by opcode. Filled once, before the first machine is
+// initialized, because decoder reads them on every thread whatever engine machine uses. NULL without threaded engine.
+static const void** threaded_labels = NULL;
+static pthread_once_t threaded_labels_once = PTHREAD_ONCE_INIT;
+
+// Reads memory operand, staying inline for values inside program's memory.
+static inline int32_t vm_load(const struct virtual_machine* vm, uint32_t addr)
+{
+    if((uint64_t) addr + 4 <= vm->mem_sz)
+        return *(int32_t*) (vm->memory + addr);
+
+    return vm_read_memory(vm, addr);
+}
+
+static int vm_exec_handlers(struct virtual_machine* vm, uint64_t budget);
+static int vm_exec_threaded(struct virtual_machine* vm, uint64_t budget);
+
+static void vm_threaded_labels_init(void)
+{
+    vm_exec_threaded(NULL, 0);  // Called without virtual machine only fills threaded_labels.
+}
 
 int vm_init(struct program program, struct virtual_machine* vm)
 {
+    return vm_init_engine(program, vm, VM_ENGINE_HANDLERS);
+}
+
+int vm_init_engine(struct program program, struct virtual_machine* vm, enum vm_engine engine)
+{
+    pthread_once(&threaded_labels_once, vm_threaded_labels_init);
+
     vm->mem_sz = program.mem_sz;
     vm->memory = program.mem_ptr;
     vm->pc = program.entry_addr;
@@ -16,43 +96,70 @@ int vm_init(struct program program, struct virtual_machine* vm)
     if(vm->pc >= vm->mem_sz)    // Entry point must be inside
         return 2;
 
-    vm->flags = 0;
-    vm->regs = calloc(16, 4);  // Allocate vm->memory for an array of 16 32-bit registers.
-
-    vm->handlers[0x00] = handle_NOP;
-    vm->handlers[0x02] = handle_A;
-    vm->handlers[0x03] = handle_AR;
-    vm->handlers[0x04] = handle_S;
-    vm->handlers[0x05] = handle_SR;
-    vm->handlers[0x06] = handle_M;
-    vm->handlers[0x07] = handle_MR;
-    vm->handlers[0x08] = handle_D;
-    vm->handlers[0x09] = handle_DR;
-    vm->handlers[0x0a] = handle_C;
-    vm->handlers[0x0b] = handle_CR;
-    vm->handlers[0x0c] = handle_J;
-    vm->handlers[0x0d] = handle_JP;
-    vm->handlers[0x0e] = handle_JN;
-    vm->handlers[0x0f] = handle_JZ;
-    vm->handlers[0x10] = handle_L;
-    vm->handlers[0x11] = handle_LR;
-    vm->handlers[0x12] = handle_ST;
-    vm->handlers[0x14] = handle_LA;
+    vm->flags_result = 0;
+    vm->regs = calloc(16, 4);   // Allocate vm->memory for an array of 16 32-bit registers.
+    vm->retired = 0;
+    vm->mapped_sz = 0;
+    vm->profiler = NULL;
+    vm->verified = NULL;
+    vm->vector_pc = 0;
+    vm->vector_done = 0;
+    vm->vector_result = 0;
+    memset(vm->fusion_counts, 0, sizeof(vm->fusion_counts));
+
+    memset(vm->handlers, 0, sizeof(vm->handlers));
+#define VM_HANDLER(name, opcode, width, kind, assemble_func) vm->handlers[opcode] = handle_##name;
+    INSTRUCTION_SET(VM_HANDLER)
+#undef VM_HANDLER
+
+    vm->jit = NULL;
+    if(engine == VM_ENGINE_JIT)
+    {
+        vm->jit = jit_create(vm);
+        if(vm->jit == NULL)     // Host can't run generated code, threaded engine is the next best thing.
+            engine = VM_ENGINE_THREADED;
+    }
+
+#ifndef HAS_THREADED_ENGINE
+    if(engine == VM_ENGINE_THREADED)
+        engine = VM_ENGINE_HANDLERS;
+#endif
+    vm->engine = engine;
+
+    // Ops are decoded page by page once execution reaches them, so that data never executed (e.g. large arrays)
+    // costs neither decoding nor memory. Zeroed op, whose handler is NULL, marks page that isn't decoded yet.
+    // Few extra entries past the end mark where sequential execution falls off the program.
+    vm->ops = calloc(vm->mem_sz + 4, sizeof(struct vm_op));
+    vm->paged = paged_memory_create();
+    if(vm->regs == NULL || vm->ops == NULL || vm->paged == NULL)
+    {
+        // Program's memory still belongs to the caller, everything else allocated here is released.
+        jit_free(vm->jit);
+        free(vm->regs);
+        free(vm->ops);
+        paged_memory_free(vm->paged);
+        vm->jit = NULL;
+        vm->regs = NULL;
+        vm->ops = NULL;
+        vm->paged = NULL;
+        return 3;
+    }
 
     return 0;
 }
 
 int vm_run(struct virtual_machine* vm)
 {
-    int result = 0;
-    for(;;)
-    {
-        result = vm_step(vm);
-        if(result != 0)
-            return result;
-    }
+    if(vm->profiler != NULL)
+        return profiler_run(vm->profiler, vm, UINT64_MAX);
 
-    return 0;
+    if(vm->engine == VM_ENGINE_JIT)
+        return jit_run(vm, UINT64_MAX);
+
+    if(vm->engine == VM_ENGINE_THREADED)
+        return vm_exec_threaded(vm, UINT64_MAX);
+
+    return vm_exec_handlers(vm, UINT64_MAX);
 }
 
 int vm_step(struct virtual_machine* vm)
@@ -60,80 +167,785 @@ int vm_step(struct virtual_machine* vm)
     if(vm->pc >= vm->mem_sz)    // No more instructions to perform.
         return 1;
 
-    uint8_t opcode = 0;
-    uint32_t args = 0;
-    bool reg_inst = false;
+    const struct vm_op* op = &vm->ops[vm->pc];
+    if(op->handler == NULL)
+        vm_decode_page(vm, vm->pc);
+    vm->pc = op->next_pc;
+
+    if(!op->handler(vm, op))
+        return 2;
+
+    vm->retired += 1;
+    return 0;
+}
+
+int vm_forward(struct virtual_machine* vm, int n)
+{
+    if(n <= 0)
+        return 0;
 
-    opcode = *(uint8_t*) (vm->memory + vm->pc);
-    reg_inst = (opcode & 1) != 0; // Even instructions work with vm->memory, odd ones with 2 registers.
+    if(vm->profiler != NULL)
+        return profiler_run(vm->profiler, vm, n);
 
-    if(opcode >= 0x0c && opcode <= 0x0f)
-        reg_inst = false;   // Jump instructions are always 4-bytes long.
+    if(vm->engine == VM_ENGINE_JIT)
+        return jit_run(vm, n);
+
+    if(vm->engine == VM_ENGINE_THREADED)
+        return vm_exec_threaded(vm, n);
+
+    return vm_exec_handlers(vm, n);
+}
 
-    if(reg_inst)
-        args = *(vm->memory + vm->pc + 1);
+void vm_finalize(struct virtual_machine* vm)
+{
+    jit_free(vm->jit);
+    free(vm->regs);
+
+    if(vm->mapped_sz != 0)
+        snapshot_release(vm);
     else
-        args = *(uint32_t*) (vm->memory + vm->pc) >> 8;
+    {
+        free(vm->ops);
+        free(vm->memory);
+    }
 
-    vm->pc += reg_inst ? 2 : 4; /* Next instruction is 2 bytes further if current instruction is register-register,
-                                otherwise we need to skip 4 bytes (register-vm->memory instruction). */
+    paged_memory_free(vm->paged);
+    free(vm->verified);
+}
 
-    if(!vm->handlers[opcode](vm, args))
+int vm_verify(struct virtual_machine* vm)
+{
+    uint8_t* verified = calloc(vm->mem_sz, 1);
+    if(verified == NULL)
         return 2;
 
+    int result = verifier_run(vm->memory, vm->mem_sz, vm->pc, vm->regs, verified);
+    if(result != 0)
+    {
+        free(verified);
+        return result;
+    }
+
+    free(vm->verified);
+    vm->verified = verified;
+
+    // Pages decoded so far still run checked handlers.
+    vm_decode_range(vm, 0, vm->mem_sz);
+    if(vm->jit != NULL)
+        jit_flush(vm->jit);
+
     return 0;
 }
 
-int vm_forward(struct virtual_machine* vm, int n)
+void vm_unverify(struct virtual_machine* vm)
 {
-    if(n <= 0)
-        return 0;
+    if(vm->verified == NULL)
+        return;
+
+    free(vm->verified);
+    vm->verified = NULL;
 
+    vm_decode_range(vm, 0, vm->mem_sz);
+    if(vm->jit != NULL)
+        jit_flush(vm->jit);
+}
+
+void vm_fusion_report(const struct virtual_machine* vm, FILE* out)
+{
+    fprintf(out, "Superinstruction  Executions\n");
+    for(int i = VM_FUSION_NONE + 1; i < VM_FUSION_COUNT; ++i)
+    {
+        if(vm->fusion_counts[i] != 0)
+            fprintf(out, "%-16s  %llu\n", fusion_names[i], (unsigned long long) vm->fusion_counts[i]);
+    }
+}
+
+// Executes at most budget instructions using handler functions. Superinstructions are used whenever
+// whole pair fits in the budget.
+static int vm_exec_handlers(struct virtual_machine* vm, uint64_t budget)
+{
+    uint64_t start = budget;
     int result = 0;
-    for(int i = 0; i < n; ++i)
+
+    while(budget > 0)
     {
-        result = vm_step(vm);
-        if(result != 0)
-            return result;
+        if(vm->pc >= vm->mem_sz)    // No more instructions to perform.
+        {
+            result = 1;
+            break;
+        }
+
+        const struct vm_op* op = &vm->ops[vm->pc];
+        if(op->handler == NULL)
+            vm_decode_page(vm, vm->pc);
+
+        bool ok;
+        bool fused = op->fused != NULL && budget >= 2;
+        if(fused)
+        {
+            vm->pc = vm->ops[op->next_pc].next_pc;
+            ok = op->fused(vm, op);
+            budget -= 2;
+        }
+        else
+        {
+            vm->pc = op->next_pc;
+            ok = op->handler(vm, op);
+            budget -= 1;
+        }
+
+        if(!ok)
+        {
+            // Failed instruction doesn't retire. Superinstruction whose first half failed didn't run the second one.
+            budget += fused && vm->pc == op->next_pc ? 2 : 1;
+            result = 2;
+            break;
+        }
     }
 
-    return 0;
+    vm->retired += start - budget;
+    return result;
 }
 
-void vm_finalize(struct virtual_machine* vm)
+uint8_t vm_immediate_form(uint8_t opcode)
 {
-    free(vm->regs);
-    free(vm->memory);
+    return opcode < NUM_HANDLERS ? immediate_forms[opcode] : 0;
 }
 
-void vm_update_flags(struct virtual_machine* vm, int32_t value)
+// Returns body of threaded engine performing op on its own, NULL without threaded engine.
+static const void* vm_threaded_target(const struct virtual_machine* vm, const struct vm_op* op)
+{
+    if(threaded_labels == NULL)
+        return NULL;
+
+    if(op->handler == handle_invalid)
+        return threaded_labels[THREADED_INVALID];
+
+    if(op->handler == unchecked_handlers[op->opcode])
+        return threaded_labels[THREADED_UNCHECKED + op->opcode];
+
+    uint8_t immediate = immediate_forms[op->opcode];
+    if(immediate != 0 && op->handler == vm->handlers[immediate])
+        return threaded_labels[immediate];
+
+    return threaded_labels[op->opcode];
+}
+
+// Checks if op performs instruction of given handler, whether verifier proved it safe or not.
+static bool vm_op_is(const struct virtual_machine* vm, const struct vm_op* op,
+    bool (*handler)(struct virtual_machine*, const struct vm_op*))
+{
+    if(op->handler == handler)
+        return true;
+
+    return op->handler != NULL && op->handler != handle_invalid && op->handler == unchecked_handlers[op->opcode]
+        && vm->handlers[op->opcode] == handler;
+}
+
+void vm_decode(struct virtual_machine* vm, uint32_t addr)
+{
+    struct vm_op* op = &vm->ops[addr];
+    if(addr >= vm->mem_sz)  // Execution reaching this entry has run past the program.
+    {
+        op->handler = handle_invalid;
+        op->opcode = 0;
+        op->reg = op->addr_reg = 0;
+        op->addr = 0;
+        op->imm = 0;
+        op->next_pc = addr;
+        op->fusion = VM_FUSION_NONE;
+        op->fused = NULL;
+        op->target = threaded_labels != NULL ? threaded_labels[THREADED_END] : NULL;
+        return;
+    }
+
+    uint8_t bytes[4] = {0};  // Bytes past the end of memory are read as zeros.
+    for(uint32_t i = 0; i < 4 && addr + i < vm->mem_sz; ++i)
+        bytes[i] = vm->memory[addr + i];
+
+    uint8_t opcode = bytes[0];
+    bool reg_inst = instruction_widths[opcode] == 2;
+    if(instruction_widths[opcode] == 0)
+        reg_inst = (opcode & 1) != 0;   // Unknown opcodes follow the rule: even ones work with memory, odd ones with 2 registers.
+
+    op->handler = opcode < NUM_HANDLERS && vm->handlers[opcode] != NULL ? vm->handlers[opcode] : handle_invalid;
+    op->opcode = opcode;
+    op->reg = bytes[1] & 0xf;
+    op->addr_reg = bytes[1] >> 4;
+    op->addr = reg_inst ? 0 : bytes[2] | bytes[3] << 8;
+    op->imm = (int16_t) op->addr;
+    op->next_pc = addr + (reg_inst ? 2 : 4);    /* Next instruction is 2 bytes further if current instruction is register-register,
+                                                otherwise we need to skip 4 bytes (register-memory instruction). */
+    op->fusion = VM_FUSION_NONE;
+    op->fused = NULL;
+
+    // Displacement is checked once here rather than on every execution. Instruction whose displacement points past
+    // the program fails no matter what's in its address register, so handlers only deal with effective address.
+    if(!reg_inst && op->addr >= vm->mem_sz && instruction_accesses_memory(opcode))
+        op->handler = handle_invalid;
+
+    // Instructions verifier proved to stay inside memory skip bounds checks, see vm_verify. Loads of constants go
+    // further, operand is read once here and instruction runs as its immediate form.
+    uint8_t flags = vm->verified != NULL && op->handler != handle_invalid ? vm->verified[addr] : 0;
+    if((flags & VERIFIER_FOLDED) && immediate_forms[opcode] != 0)
+    {
+        op->handler = vm->handlers[immediate_forms[opcode]];
+        op->imm = *(int32_t*) (vm->memory + op->addr);
+    }
+    else if((flags & VERIFIER_SAFE) && unchecked_handlers[opcode] != NULL)
+        op->handler = unchecked_handlers[opcode];
+
+    op->target = vm_threaded_target(vm, op);
+}
+
+void vm_decode_range(struct virtual_machine* vm, uint32_t from, uint32_t to)
+{
+    if(to > vm->mem_sz + 4)
+        to = vm->mem_sz + 4;
+
+    // Pages not decoded yet will read memory once they are, so they are left alone.
+    for(uint32_t addr = from; addr < to; ++addr)
+    {
+        if(vm->ops[addr].handler != NULL)
+            vm_decode(vm, addr);
+    }
+
+    // Instructions right before the range might have been fused with the ones that just changed.
+    for(uint32_t addr = from > 4 ? from - 4 : 0; addr < to; ++addr)
+        vm_fuse(vm, addr);
+}
+
+void vm_decode_page(struct virtual_machine* vm, uint32_t addr)
+{
+    uint32_t from = addr / VM_DECODE_PAGE * VM_DECODE_PAGE;
+    uint32_t to = from + VM_DECODE_PAGE;
+    if(to > vm->mem_sz + 4)
+        to = vm->mem_sz + 4;
+
+    for(uint32_t i = from; i < to; ++i)
+        vm_decode(vm, i);
+
+    // Instructions at the end of previous page couldn't be fused with ones of this page until now.
+    for(uint32_t i = from > 4 ? from - 4 : 0; i < to; ++i)
+        vm_fuse(vm, i);
+}
+
+bool vm_page_decoded(const struct virtual_machine* vm, uint32_t addr)
+{
+    return vm->ops[addr / VM_DECODE_PAGE * VM_DECODE_PAGE].handler != NULL;
+}
+
+void vm_fuse(struct virtual_machine* vm, uint32_t addr)
+{
+    struct vm_op* op = &vm->ops[addr];
+    if(op->handler == NULL)     // Page isn't decoded yet.
+        return;
+
+    if(op->fused != NULL)   // Op that is no longer fused goes back to its own body.
+        op->target = vm_threaded_target(vm, op);
+    op->fusion = VM_FUSION_NONE;
+    op->fused = NULL;
+
+    if(addr >= vm->mem_sz || op->next_pc >= vm->mem_sz)
+        return;
+
+    const struct vm_op* next = &vm->ops[op->next_pc];
+    uint8_t fusion = VM_FUSION_NONE;
+    if(vm_op_is(vm, op, handle_C) || vm_op_is(vm, op, handle_CR) || vm_op_is(vm, op, handle_CI))
+    {
+        uint8_t base = VM_FUSION_CI_JZ;
+        if(vm_op_is(vm, op, handle_C))
+            base = VM_FUSION_C_JZ;
+        else if(vm_op_is(vm, op, handle_CR))
+            base = VM_FUSION_CR_JZ;
+        if(vm_op_is(vm, next, handle_JZ))
+            fusion = base;
+        else if(vm_op_is(vm, next, handle_JP))
+            fusion = base + 1;
+        else if(vm_op_is(vm, next, handle_JN))
+            fusion = base + 2;
+    }
+    else if(vm_op_is(vm, op, handle_L))
+    {
+        if(vm_op_is(vm, next, handle_A))
+            fusion = VM_FUSION_L_A;
+        else if(vm_op_is(vm, next, handle_S))
+            fusion = VM_FUSION_L_S;
+        else if(vm_op_is(vm, next, handle_M))
+            fusion = VM_FUSION_L_M;
+    }
+    else if(vm_op_is(vm, op, handle_LA) && vm_op_is(vm, next, handle_L))
+    {
+        fusion = VM_FUSION_LA_L;
+    }
+
+    if(fusion == VM_FUSION_NONE)
+        return;
+
+    op->fusion = fusion;
+    op->fused = fused_handlers[fusion];
+    if(threaded_labels != NULL)
+        op->target = threaded_labels[THREADED_FUSED + fusion];
+}
+
+#ifdef HAS_THREADED_ENGINE
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"   // Labels as values are GNU extension.
+
+// Direct-threaded engine. Executes at most budget instructions, jumping from body of one instruction
+// straight to body of the next one. Bodies must behave exactly like corresponding handle_* functions.
+static int vm_exec_threaded(struct virtual_machine* vm, uint64_t budget)
 {
+    static const void* labels[THREADED_UNCHECKED + NUM_HANDLERS];
+    if(vm == NULL)
+    {
+        for(int i = 0; i < THREADED_UNCHECKED + NUM_HANDLERS; ++i)
+            labels[i] = &&op_invalid;
+
+#define THREADED_LABEL(name, opcode, width, kind, assemble_func) labels[opcode] = &&op_##name;
+        INSTRUCTION_SET(THREADED_LABEL)
+#undef THREADED_LABEL
+        labels[THREADED_END] = &&op_end;
+        labels[THREADED_FUSED + VM_FUSION_C_JZ] = &&op_C_JZ;
+        labels[THREADED_FUSED + VM_FUSION_C_JP] = &&op_C_JP;
+        labels[THREADED_FUSED + VM_FUSION_C_JN] = &&op_C_JN;
+        labels[THREADED_FUSED + VM_FUSION_CR_JZ] = &&op_CR_JZ;
+        labels[THREADED_FUSED + VM_FUSION_CR_JP] = &&op_CR_JP;
+        labels[THREADED_FUSED + VM_FUSION_CR_JN] = &&op_CR_JN;
+        labels[THREADED_FUSED + VM_FUSION_CI_JZ] = &&op_CI_JZ;
+        labels[THREADED_FUSED + VM_FUSION_CI_JP] = &&op_CI_JP;
+        labels[THREADED_FUSED + VM_FUSION_CI_JN] = &&op_CI_JN;
+        labels[THREADED_FUSED + VM_FUSION_L_A] = &&op_L_A;
+        labels[THREADED_FUSED + VM_FUSION_L_S] = &&op_L_S;
+        labels[THREADED_FUSED + VM_FUSION_L_M] = &&op_L_M;
+        labels[THREADED_FUSED + VM_FUSION_LA_L] = &&op_LA_L;
+        labels[THREADED_UNCHECKED + OPCODE_A] = &&op_A_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_S] = &&op_S_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_M] = &&op_M_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_D] = &&op_D_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_C] = &&op_C_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_J] = &&op_J_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_JP] = &&op_JP_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_JN] = &&op_JN_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_JZ] = &&op_JZ_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_L] = &&op_L_unchecked;
+        labels[THREADED_UNCHECKED + OPCODE_ST] = &&op_ST_unchecked;
+
+        threaded_labels = labels;
+        return 0;
+    }
+
+    if(vm->pc >= vm->mem_sz)
+        return 1;
+
+    uint64_t start = budget;
+    const struct vm_op* ops = vm->ops;
+    const struct vm_op* op;
+    int32_t* regs = vm->regs;
+    uint8_t* memory = vm->memory;
+    uint32_t mem_sz = vm->mem_sz;
+    uint32_t pc = vm->pc;
+    int64_t flags = vm->flags_result;
+    int32_t value;
+    uint32_t ea;    // Effective address of memory operand.
+    int result;
+
+#define DISPATCH() op = &ops[pc]; pc = op->next_pc; if(op->target == NULL) goto undecoded; goto *op->target
+#define NEXT() if(--budget == 0) { result = 0; goto exit; } DISPATCH()
+#define LOAD_OPERAND() ea = op->addr + (uint32_t) regs[op->addr_reg]; \
+    value = (uint64_t) ea + 4 <= mem_sz ? *(int32_t*) (memory + ea) : vm_read_memory(vm, ea)
+#define LOAD_UNCHECKED() ea = op->addr + (uint32_t) regs[op->addr_reg]; value = *(int32_t*) (memory + ea)
+#define SET_FLAGS(x) flags = (x)
+#define JUMP_IF(cond) { uint16_t target = op->addr + regs[op->addr_reg]; if(target >= mem_sz) goto fail; if(cond) pc = target; }
+#define JUMP_UNCHECKED_IF(cond) if(cond) pc = (uint16_t) (op->addr + regs[op->addr_reg])
+#define BODY_C() LOAD_OPERAND(); value = regs[op->reg] - value; SET_FLAGS(value)
+#define BODY_CR() value = regs[op->reg] - regs[op->addr_reg]; SET_FLAGS(value)
+#define BODY_CI() value = regs[op->reg] - op->imm; SET_FLAGS(value)
+#define BODY_L() LOAD_OPERAND(); regs[op->reg] = value
+#define BODY_LA() regs[op->reg] = op->addr + regs[op->addr_reg]
+// Superinstruction runs first instruction alone when budget has room for one instruction only.
+#define FUSED(fusion, first) if(budget < 2) goto first; vm->fusion_counts[fusion] += 1
+// Moves to the second instruction of superinstruction and jumps straight to its body.
+#define THEN(second) --budget; op = &ops[pc]; pc = op->next_pc; goto second
+
+    DISPATCH();
+
+op_NOP:
+    NEXT();
+op_A_unchecked:
+    LOAD_UNCHECKED();
+    goto A_loaded;
+op_A:
+    LOAD_OPERAND();
+A_loaded:
+    regs[op->reg] += value;
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_AR:
+    regs[op->reg] += regs[op->addr_reg];
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_S_unchecked:
+    LOAD_UNCHECKED();
+    goto S_loaded;
+op_S:
+    LOAD_OPERAND();
+S_loaded:
+    regs[op->reg] -= value;
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_SR:
+    regs[op->reg] -= regs[op->addr_reg];
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_M_unchecked:
+    LOAD_UNCHECKED();
+    goto M_loaded;
+op_M:
+    LOAD_OPERAND();
+M_loaded:
+    regs[op->reg] *= value;
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_MR:
+    regs[op->reg] *= regs[op->addr_reg];
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_D_unchecked:
+    LOAD_UNCHECKED();
+    goto D_loaded;
+op_D:
+    LOAD_OPERAND();
+D_loaded:
     if(value == 0)
-        vm->flags = 0;
-    else if(value > 0)
-        vm->flags = 1;
-    else
-        vm->flags = 2;
+    {
+        flags = VM_FLAGS_INVALID;
+        NEXT();
+    }
+    regs[op->reg] = vm_quotient(regs[op->reg], value);
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_DR:
+    value = regs[op->addr_reg];
+    if(value == 0)
+    {
+        flags = VM_FLAGS_INVALID;
+        NEXT();
+    }
+    regs[op->reg] = vm_quotient(regs[op->reg], value);
+    SET_FLAGS(regs[op->reg]);
+    NEXT();
+op_C:
+    BODY_C();
+    NEXT();
+op_C_unchecked:
+    LOAD_UNCHECKED();
+    value = regs[op->reg] - value;
+    SET_FLAGS(value);
+    NEXT();
+op_CR:
+    BODY_CR();
+    NEXT();
+op_J:
+    JUMP_IF(true);
+    NEXT();
+op_JP:
+    JUMP_IF(flags > 0 && flags <= INT32_MAX);
+    NEXT();
+op_JN:
+    JUMP_IF(flags < 0);
+    NEXT();
+op_JZ:
+    JUMP_IF(flags == 0);
+    NEXT();
+op_J_unchecked:
+    JUMP_UNCHECKED_IF(true);
+    NEXT();
+op_JP_unchecked:
+    JUMP_UNCHECKED_IF(flags > 0 && flags <= INT32_MAX);
+    NEXT();
+op_JN_unchecked:
+    JUMP_UNCHECKED_IF(flags < 0);
+    NEXT();
+op_JZ_unchecked:
+    JUMP_UNCHECKED_IF(flags == 0);
+    NEXT();
+op_L:
+    BODY_L();
+    NEXT();
+op_L_unchecked:
+    LOAD_UNCHECKED();
+    regs[op->reg] = value;
+    NEXT();
+op_LR:
+    regs[op->reg] = regs[op->addr_reg];
+    NEXT();
+op_ST:
+    {
+        if(!vm_write_memory(vm, op->addr + (uint32_t) regs[op->addr_reg], regs[op->reg]))
+            goto fail;
+    }
+    NEXT();
+op_ST_unchecked:
+    ea = op->addr + (uint32_t) regs[op->addr_reg];
+    *(int32_t*) (memory + ea) = regs[op->reg];
+    NEXT();
+op_LA:
+    BODY_LA();
+    NEXT();
+op_AI:
+    value = op->imm;
+    goto A_loaded;
+op_SI:
+    value = op->imm;
+    goto S_loaded;
+op_MI:
+    value = op->imm;
+    goto M_loaded;
+op_DI:
+    value = op->imm;
+    goto D_loaded;
+op_CI:
+    BODY_CI();
+    NEXT();
+op_LI:
+    regs[op->reg] = op->imm;
+    NEXT();
+op_VA:
+op_VS:
+op_VM:
+op_VC:
+op_VSUM:
+op_VMIN:
+op_VMAX:
+    // Vector instructions loop over up to VM_VECTOR_CHUNK elements, calling their handler costs next to nothing.
+    // Handler leaves pc on the instruction until the whole array is done.
+    vm->flags_result = flags;
+    vm->pc = pc;
+    if(!op->handler(vm, op))
+        goto fail;
+    flags = vm->flags_result;
+    pc = vm->pc;
+    NEXT();
+op_C_JZ:
+    FUSED(VM_FUSION_C_JZ, op_C);
+    BODY_C();
+    THEN(op_JZ);
+op_C_JP:
+    FUSED(VM_FUSION_C_JP, op_C);
+    BODY_C();
+    THEN(op_JP);
+op_C_JN:
+    FUSED(VM_FUSION_C_JN, op_C);
+    BODY_C();
+    THEN(op_JN);
+op_CR_JZ:
+    FUSED(VM_FUSION_CR_JZ, op_CR);
+    BODY_CR();
+    THEN(op_JZ);
+op_CR_JP:
+    FUSED(VM_FUSION_CR_JP, op_CR);
+    BODY_CR();
+    THEN(op_JP);
+op_CR_JN:
+    FUSED(VM_FUSION_CR_JN, op_CR);
+    BODY_CR();
+    THEN(op_JN);
+op_CI_JZ:
+    FUSED(VM_FUSION_CI_JZ, op_CI);
+    BODY_CI();
+    THEN(op_JZ);
+op_CI_JP:
+    FUSED(VM_FUSION_CI_JP, op_CI);
+    BODY_CI();
+    THEN(op_JP);
+op_CI_JN:
+    FUSED(VM_FUSION_CI_JN, op_CI);
+    BODY_CI();
+    THEN(op_JN);
+op_L_A:
+    FUSED(VM_FUSION_L_A, op_L);
+    BODY_L();
+    THEN(op_A);
+op_L_S:
+    FUSED(VM_FUSION_L_S, op_L);
+    BODY_L();
+    THEN(op_S);
+op_L_M:
+    FUSED(VM_FUSION_L_M, op_L);
+    BODY_L();
+    THEN(op_M);
+op_LA_L:
+    FUSED(VM_FUSION_LA_L, op_LA);
+    BODY_LA();
+    THEN(op_L);
+undecoded:
+    pc = op - ops;
+    vm_decode_page(vm, pc);
+    DISPATCH();
+op_invalid:
+fail:
+    result = 2;
+    goto exit;
+op_end:
+    pc = op->next_pc;
+    result = 1;
+
+exit:
+    vm->pc = pc;
+    vm->flags_result = flags;
+    vm->retired += start - budget;
+    return result;
+
+#undef DISPATCH
+#undef NEXT
+#undef LOAD_OPERAND
+#undef LOAD_UNCHECKED
+#undef SET_FLAGS
+#undef JUMP_IF
+#undef JUMP_UNCHECKED_IF
+#undef BODY_C
+#undef BODY_CR
+#undef BODY_CI
+#undef BODY_L
+#undef BODY_LA
+#undef FUSED
+#undef THEN
 }
 
-bool handle_NOP(struct virtual_machine* vm, uint32_t args)
+#pragma GCC diagnostic pop
+#else
+static int vm_exec_threaded(struct virtual_machine* vm, uint64_t budget)
 {
     UNUSED(vm);
-    UNUSED(args);
+    UNUSED(budget);
+
+    return 2;
+}
+#endif
+
+int32_t vm_read_memory(const struct virtual_machine* vm, uint32_t addr)
+{
+    if((uint64_t) addr + 4 <= vm->mem_sz)
+        return *(int32_t*) (vm->memory + addr);
+    if(addr >= vm->mem_sz && addr <= UINT32_MAX - 3)
+        return paged_memory_read(vm->paged, addr);
+
+    // Value overlaps end of program's memory, or wraps around to its start.
+    uint8_t bytes[4];
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        uint32_t byte_addr = addr + i;
+        bytes[i] = byte_addr < vm->mem_sz ? vm->memory[byte_addr] : paged_memory_read_byte(vm->paged, byte_addr);
+    }
+
+    int32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Decodes again instructions overlapping bytes [from, to) that were just written. Writing into code verifier
+// followed, or into constants it folded, voids its proofs.
+static void vm_code_written(struct virtual_machine* vm, uint32_t from, uint32_t to)
+{
+    for(uint32_t addr = from; vm->verified != NULL && addr < to; ++addr)
+    {
+        if(vm->verified[addr] & (VERIFIER_CODE | VERIFIER_CONST))
+            vm_unverify(vm);
+    }
+
+    vm_decode_range(vm, from > 3 ? from - 3 : 0, to);
+}
+
+bool vm_write_memory(struct virtual_machine* vm, uint32_t addr, int32_t value)
+{
+    if((uint64_t) addr + 4 <= vm->mem_sz)
+    {
+        *(int32_t*) (vm->memory + addr) = value;
+
+        // Program might have modified its own code, so instructions overlapping written bytes must be decoded again.
+        vm_code_written(vm, addr, addr + 4);
+        return true;
+    }
+    if(addr >= vm->mem_sz && addr <= UINT32_MAX - 3)
+        return paged_memory_write(vm->paged, addr, value);
+
+    uint8_t bytes[4];
+    memcpy(bytes, &value, sizeof(value));
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        uint32_t byte_addr = addr + i;
+        if(byte_addr < vm->mem_sz)
+        {
+            vm->memory[byte_addr] = bytes[i];
+            vm_code_written(vm, byte_addr, byte_addr + 1);
+        }
+        else if(!paged_memory_write_byte(vm->paged, byte_addr, bytes[i]))
+            return false;
+    }
 
     return true;
 }
 
-bool handle_A(struct virtual_machine* vm, uint32_t args)
+int32_t vm_get_flags(const struct virtual_machine* vm)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
+    if(vm->flags_result == VM_FLAGS_INVALID)
+        return 3;
+    else if(vm->flags_result == 0)
+        return 0;
+    else if(vm->flags_result > 0)
+        return 1;
+    else
+        return 2;
+}
 
-    if(addr >= vm->mem_sz)
-        return false;
+void vm_set_flags(struct virtual_machine* vm, int32_t flags)
+{
+    switch(flags)
+    {
+        case 0:
+            vm->flags_result = 0;
+            break;
+        case 1:
+            vm->flags_result = 1;
+            break;
+        case 2:
+            vm->flags_result = -1;
+            break;
+        default:
+            vm->flags_result = VM_FLAGS_INVALID;
+            break;
+    }
+}
+
+void vm_update_flags(struct virtual_machine* vm, int32_t value)
+{
+    vm->flags_result = value;
+}
+
+bool handle_invalid(struct virtual_machine* vm, const struct vm_op* op)
+{
+    UNUSED(vm);
+    UNUSED(op);
 
-    int32_t value = *(int32_t*) (vm->memory + addr + vm->regs[addr_reg]);
+    return false;
+}
+
+bool handle_NOP(struct virtual_machine* vm, const struct vm_op* op)
+{
+    UNUSED(vm);
+    UNUSED(op);
+
+    return true;
+}
+
+bool handle_A(struct virtual_machine* vm, const struct vm_op* op)
+{
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
+
+    int32_t value = vm_load(vm, addr + (uint32_t) vm->regs[addr_reg]);
 
     vm->regs[reg] += value;
     vm_update_flags(vm, vm->regs[reg]);
@@ -141,10 +953,10 @@ bool handle_A(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_AR(struct virtual_machine* vm, uint32_t args)
+bool handle_AR(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t regA = args & 0xf;
-    uint8_t regB = args >> 4;
+    uint8_t regA = op->reg;
+    uint8_t regB = op->addr_reg;
 
     vm->regs[regA] += vm->regs[regB];
     vm_update_flags(vm, vm->regs[regA]);
@@ -152,16 +964,13 @@ bool handle_AR(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_S(struct virtual_machine* vm, uint32_t args)
+bool handle_S(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
 
-    if(addr >= vm->mem_sz)
-        return false;
-
-    int32_t value = *(int32_t*) (vm->memory + addr + vm->regs[addr_reg]);
+    int32_t value = vm_load(vm, addr + (uint32_t) vm->regs[addr_reg]);
 
     vm->regs[reg] -= value;
     vm_update_flags(vm, vm->regs[reg]);
@@ -169,10 +978,10 @@ bool handle_S(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_SR(struct virtual_machine* vm, uint32_t args)
+bool handle_SR(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t regA = args & 0xf;
-    uint8_t regB = args >> 4;
+    uint8_t regA = op->reg;
+    uint8_t regB = op->addr_reg;
 
     vm->regs[regA] -= vm->regs[regB];
     vm_update_flags(vm, vm->regs[regA]);
@@ -180,16 +989,13 @@ bool handle_SR(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_M(struct virtual_machine* vm, uint32_t args)
+bool handle_M(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
-
-    if(addr >= vm->mem_sz)
-        return false;
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
 
-    int32_t value = *(int32_t*) (vm->memory + addr + vm->regs[addr_reg]);
+    int32_t value = vm_load(vm, addr + (uint32_t) vm->regs[addr_reg]);
 
     vm->regs[reg] *= value;
     vm_update_flags(vm, vm->regs[reg]);
@@ -197,10 +1003,10 @@ bool handle_M(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_MR(struct virtual_machine* vm, uint32_t args)
+bool handle_MR(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t regA = args & 0xf;
-    uint8_t regB = args >> 4;
+    uint8_t regA = op->reg;
+    uint8_t regB = op->addr_reg;
 
     vm->regs[regA] *= vm->regs[regB];
     vm_update_flags(vm, vm->regs[regA]);
@@ -208,58 +1014,52 @@ bool handle_MR(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_D(struct virtual_machine* vm, uint32_t args)
+bool handle_D(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
-
-    if(addr >= vm->mem_sz)
-        return false;
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
 
-    int32_t value = *(int32_t*) (vm->memory + addr + vm->regs[addr_reg]);
+    int32_t value = vm_load(vm, addr + (uint32_t) vm->regs[addr_reg]);
 
     if(value == 0)  // Division by zero is an invalid operation.
     {
-        vm->flags = 3;
+        vm->flags_result = VM_FLAGS_INVALID;
         return true;
     }
 
-    vm->regs[reg] /= value;
+    vm->regs[reg] = vm_quotient(vm->regs[reg], value);
     vm_update_flags(vm, vm->regs[reg]);
 
     return true;
 }
 
-bool handle_DR(struct virtual_machine* vm, uint32_t args)
+bool handle_DR(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t regA = args & 0xf;
-    uint8_t regB = args >> 4;
+    uint8_t regA = op->reg;
+    uint8_t regB = op->addr_reg;
 
     int32_t value = vm->regs[regB];
 
     if(value == 0)
     {
-        vm->flags = 3;
+        vm->flags_result = VM_FLAGS_INVALID;
         return true;
     }
 
-    vm->regs[regA] /= value;
+    vm->regs[regA] = vm_quotient(vm->regs[regA], value);
     vm_update_flags(vm, vm->regs[regA]);
 
     return true;
 }
 
-bool handle_C(struct virtual_machine* vm, uint32_t args)
+bool handle_C(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
-
-    if(addr >= vm->mem_sz)
-        return false;
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
 
-    int32_t value = *(int32_t*) (vm->memory + addr + vm->regs[addr_reg]);
+    int32_t value = vm_load(vm, addr + (uint32_t) vm->regs[addr_reg]);
 
     int32_t result = vm->regs[reg] - value;
     vm_update_flags(vm, result);
@@ -267,10 +1067,10 @@ bool handle_C(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_CR(struct virtual_machine* vm, uint32_t args)
+bool handle_CR(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t regA = args & 0xf;
-    uint8_t regB = args >> 4;
+    uint8_t regA = op->reg;
+    uint8_t regB = op->addr_reg;
 
     int32_t result = vm->regs[regA] - vm->regs[regB];
     vm_update_flags(vm, result);
@@ -278,10 +1078,9 @@ bool handle_CR(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_J(struct virtual_machine* vm, uint32_t args)
+bool handle_J(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = (args >> 8) + vm->regs[addr_reg];
+    uint16_t addr = op->addr + vm->regs[op->addr_reg];
 
     if(addr >= vm->mem_sz)
         return false;
@@ -291,91 +1090,433 @@ bool handle_J(struct virtual_machine* vm, uint32_t args)
     return true;
 }
 
-bool handle_JP(struct virtual_machine* vm, uint32_t args)
+bool handle_JP(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = (args >> 8) + vm->regs[addr_reg];
+    uint16_t addr = op->addr + vm->regs[op->addr_reg];
 
     if(addr >= vm->mem_sz)
         return false;
 
-    if(vm->flags == 1)
+    if(vm->flags_result > 0 && vm->flags_result <= INT32_MAX)
         vm->pc = addr;
 
     return true;
 }
 
-bool handle_JN(struct virtual_machine* vm, uint32_t args)
+bool handle_JN(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = (args >> 8) + vm->regs[addr_reg];
+    uint16_t addr = op->addr + vm->regs[op->addr_reg];
 
     if(addr >= vm->mem_sz)
         return false;
 
-    if(vm->flags == 2)
+    if(vm->flags_result < 0)
         vm->pc = addr;
 
     return true;
 }
 
-bool handle_JZ(struct virtual_machine* vm, uint32_t args)
+bool handle_JZ(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = (args >> 8) + vm->regs[addr_reg];
+    uint16_t addr = op->addr + vm->regs[op->addr_reg];
 
     if(addr >= vm->mem_sz)
         return false;
 
-    if(vm->flags == 0)
+    if(vm->flags_result == 0)
         vm->pc = addr;
 
     return true;
 }
 
-bool handle_L(struct virtual_machine* vm, uint32_t args)
+bool handle_L(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
 
-    if(addr >= vm->mem_sz)
-        return false;
-
-    int32_t value = *(int32_t*) (vm->memory + addr + vm->regs[addr_reg]);
+    int32_t value = vm_load(vm, addr + (uint32_t) vm->regs[addr_reg]);
 
     vm->regs[reg] = value;
     return true;
 }
 
-bool handle_LR(struct virtual_machine* vm, uint32_t args)
+bool handle_LR(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t regA = args & 0xf;
-    uint8_t regB = args >> 4;
+    uint8_t regA = op->reg;
+    uint8_t regB = op->addr_reg;
 
     vm->regs[regA] = vm->regs[regB];
     return true;
 }
 
-bool handle_ST(struct virtual_machine* vm, uint32_t args)
+bool handle_ST(struct virtual_machine* vm, const struct vm_op* op)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
 
-    if(addr >= vm->mem_sz)
+    return vm_write_memory(vm, addr + (uint32_t) vm->regs[addr_reg], vm->regs[reg]);
+}
+
+bool handle_LA(struct virtual_machine* vm, const struct vm_op* op)
+{
+    uint8_t reg = op->reg;
+    uint8_t addr_reg = op->addr_reg;
+    uint16_t addr = op->addr;
+
+    vm->regs[reg] = addr + vm->regs[addr_reg];
+    return true;
+}
+
+bool handle_AI(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] += op->imm;
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_SI(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] -= op->imm;
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_MI(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] *= op->imm;
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_DI(struct virtual_machine* vm, const struct vm_op* op)
+{
+    if(op->imm == 0)    // Division by zero is an invalid operation.
+    {
+        vm->flags_result = VM_FLAGS_INVALID;
+        return true;
+    }
+
+    vm->regs[op->reg] = vm_quotient(vm->regs[op->reg], op->imm);
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_CI(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm_update_flags(vm, vm->regs[op->reg] - op->imm);
+    return true;
+}
+
+bool handle_LI(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] = op->imm;
+    return true;
+}
+
+bool vm_vector_arrays(const struct virtual_machine* vm, const struct vm_op* op, uint32_t* first, uint32_t* second,
+    uint32_t* count)
+{
+    int32_t length = vm->regs[(op->reg + 1) & 0xf];
+    if(length < 0)
         return false;
 
-    *(int32_t*) (vm->memory + addr + vm->regs[addr_reg]) = vm->regs[reg];
+    *first = (uint32_t) vm->regs[op->reg];
+    *second = op->addr + (uint32_t) vm->regs[op->addr_reg];
+    *count = (uint32_t) length;
     return true;
 }
 
-bool handle_LA(struct virtual_machine* vm, uint32_t args)
+// Checks if array of count elements at given address lies inside program's memory.
+static bool vm_array_inside(const struct virtual_machine* vm, uint32_t addr, uint32_t count)
 {
-    uint8_t reg = args & 0xf;
-    uint8_t addr_reg = (args >> 4) & 0xf;
-    uint16_t addr = args >> 8;
+    return (uint64_t) addr + (uint64_t) count * 4 <= vm->mem_sz;
+}
 
-    vm->regs[reg] = addr + vm->regs[addr_reg];
+void vm_vector_chunk(const struct virtual_machine* vm, const struct vm_op* op, uint32_t count, uint32_t* begin,
+    uint32_t* end)
+{
+    uint32_t addr = (uint32_t) (op - vm->ops);
+    *begin = vm->vector_done != 0 && vm->vector_pc == addr && vm->vector_done < count ? vm->vector_done : 0;
+    *end = count - *begin > VM_VECTOR_CHUNK ? *begin + VM_VECTOR_CHUNK : count;
+}
+
+// Ends cycle of vector instruction that processed elements up to end. Unless that was the last one, pc is left on
+// the instruction, so that the next cycle resumes it. Returns whether instruction is done.
+static bool vm_vector_yield(struct virtual_machine* vm, const struct vm_op* op, uint32_t end, uint32_t count)
+{
+    if(end == count)
+    {
+        vm->vector_done = 0;
+        return true;
+    }
+
+    vm->vector_pc = (uint32_t) (op - vm->ops);
+    vm->vector_done = end;
+    vm->pc = vm->vector_pc;
+    return false;
+}
+
+// Performs VA, VS or VM on the next chunk of elements. Arrays inside program's memory are handed to host kernel,
+// others are processed element by element, just like the same loop of scalar instructions would.
+static bool vm_vector_apply(struct virtual_machine* vm, const struct vm_op* op, enum vector_op kind)
+{
+    uint32_t first, second, count, begin, end;
+    if(!vm_vector_arrays(vm, op, &first, &second, &count))
+    {
+        vm->vector_done = 0;
+        return false;
+    }
+
+    vm_vector_chunk(vm, op, count, &begin, &end);
+    uint32_t dest = first + 4 * begin;
+    uint32_t src = second + 4 * begin;
+    uint32_t length = end - begin;
+
+    // Kernel may process several elements at once, so arrays partially overlapping take the slow path too.
+    uint64_t size = (uint64_t) length * 4;
+    bool overlap = dest != src && dest < src + size && src < dest + size;
+    if(vm_array_inside(vm, dest, length) && vm_array_inside(vm, src, length) && !overlap)
+    {
+        vector_apply(kind, vm->memory + dest, vm->memory + src, length);
+        vm_code_written(vm, dest, dest + size);
+    }
+    else
+    {
+        for(uint32_t i = 0; i < length; ++i)
+        {
+            int32_t a = vm_read_memory(vm, dest + 4 * i);
+            int32_t b = vm_read_memory(vm, src + 4 * i);
+            vector_apply(kind, (uint8_t*) &a, (const uint8_t*) &b, 1);
+            if(!vm_write_memory(vm, dest + 4 * i, a))
+            {
+                vm->vector_done = 0;
+                return false;
+            }
+        }
+    }
+
+    vm_vector_yield(vm, op, end, count);
     return true;
 }
+
+// Performs VSUM, VMIN or VMAX on the next chunk of elements, folding them into instruction's register once all of
+// them are done. Until then the result is kept aside, as register may be the one addressing the array.
+static bool vm_vector_reduce(struct virtual_machine* vm, const struct vm_op* op, enum vector_op kind)
+{
+    uint32_t first, second, count, begin, end;
+    if(!vm_vector_arrays(vm, op, &first, &second, &count))
+    {
+        vm->vector_done = 0;
+        return false;
+    }
+
+    vm_vector_chunk(vm, op, count, &begin, &end);
+    uint32_t src = second + 4 * begin;
+    uint32_t length = end - begin;
+
+    int32_t result = begin != 0 ? vm->vector_result : vm->regs[op->reg];
+    if(vm_array_inside(vm, src, length))
+        result = vector_reduce(kind, vm->memory + src, length, result);
+    else
+    {
+        for(uint32_t i = 0; i < length; ++i)
+        {
+            int32_t value = vm_read_memory(vm, src + 4 * i);
+            result = vector_reduce(kind, (const uint8_t*) &value, 1, result);
+        }
+    }
+
+    vm->vector_result = result;
+    if(vm_vector_yield(vm, op, end, count))
+    {
+        vm->regs[op->reg] = result;
+        vm_update_flags(vm, result);
+    }
+
+    return true;
+}
+
+bool handle_VA(struct virtual_machine* vm, const struct vm_op* op)
+{
+    return vm_vector_apply(vm, op, VECTOR_ADD);
+}
+
+bool handle_VS(struct virtual_machine* vm, const struct vm_op* op)
+{
+    return vm_vector_apply(vm, op, VECTOR_SUB);
+}
+
+bool handle_VM(struct virtual_machine* vm, const struct vm_op* op)
+{
+    return vm_vector_apply(vm, op, VECTOR_MUL);
+}
+
+// Compares the next chunk of elements. Instruction is done as soon as elements differ, flags are set only then.
+bool handle_VC(struct virtual_machine* vm, const struct vm_op* op)
+{
+    uint32_t first, second, count, begin, end;
+    if(!vm_vector_arrays(vm, op, &first, &second, &count))
+    {
+        vm->vector_done = 0;
+        return false;
+    }
+
+    vm_vector_chunk(vm, op, count, &begin, &end);
+    first += 4 * begin;
+    second += 4 * begin;
+    uint32_t length = end - begin;
+
+    int32_t result = 0;
+    if(vm_array_inside(vm, first, length) && vm_array_inside(vm, second, length))
+        result = vector_compare(vm->memory + first, vm->memory + second, length);
+    else
+    {
+        for(uint32_t i = 0; i < length && result == 0; ++i)
+        {
+            int32_t a = vm_read_memory(vm, first + 4 * i);
+            int32_t b = vm_read_memory(vm, second + 4 * i);
+            result = vector_compare((const uint8_t*) &a, (const uint8_t*) &b, 1);
+        }
+    }
+
+    if(result != 0 || vm_vector_yield(vm, op, end, count))
+    {
+        vm->vector_done = 0;
+        vm_update_flags(vm, result);
+    }
+
+    return true;
+}
+
+bool handle_VSUM(struct virtual_machine* vm, const struct vm_op* op)
+{
+    return vm_vector_reduce(vm, op, VECTOR_ADD);
+}
+
+bool handle_VMIN(struct virtual_machine* vm, const struct vm_op* op)
+{
+    return vm_vector_reduce(vm, op, VECTOR_MIN);
+}
+
+bool handle_VMAX(struct virtual_machine* vm, const struct vm_op* op)
+{
+    return vm_vector_reduce(vm, op, VECTOR_MAX);
+}
+
+// Reads memory operand verifier proved to lie inside program's memory.
+static inline int32_t vm_load_unchecked(const struct virtual_machine* vm, const struct vm_op* op)
+{
+    uint32_t addr = op->addr + (uint32_t) vm->regs[op->addr_reg];
+    return *(int32_t*) (vm->memory + addr);
+}
+
+bool handle_A_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] += vm_load_unchecked(vm, op);
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_S_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] -= vm_load_unchecked(vm, op);
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_M_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] *= vm_load_unchecked(vm, op);
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_D_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    int32_t value = vm_load_unchecked(vm, op);
+    if(value == 0)
+    {
+        vm->flags_result = VM_FLAGS_INVALID;
+        return true;
+    }
+
+    vm->regs[op->reg] = vm_quotient(vm->regs[op->reg], value);
+    vm_update_flags(vm, vm->regs[op->reg]);
+    return true;
+}
+
+bool handle_C_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm_update_flags(vm, vm->regs[op->reg] - vm_load_unchecked(vm, op));
+    return true;
+}
+
+bool handle_J_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->pc = (uint16_t) (op->addr + vm->regs[op->addr_reg]);
+    return true;
+}
+
+bool handle_JP_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    if(vm->flags_result > 0 && vm->flags_result <= INT32_MAX)
+        vm->pc = (uint16_t) (op->addr + vm->regs[op->addr_reg]);
+    return true;
+}
+
+bool handle_JN_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    if(vm->flags_result < 0)
+        vm->pc = (uint16_t) (op->addr + vm->regs[op->addr_reg]);
+    return true;
+}
+
+bool handle_JZ_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    if(vm->flags_result == 0)
+        vm->pc = (uint16_t) (op->addr + vm->regs[op->addr_reg]);
+    return true;
+}
+
+bool handle_L_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    vm->regs[op->reg] = vm_load_unchecked(vm, op);
+    return true;
+}
+
+// Verified store never reaches code, so no instructions need decoding again.
+bool handle_ST_unchecked(struct virtual_machine* vm, const struct vm_op* op)
+{
+    uint32_t addr = op->addr + (uint32_t) vm->regs[op->addr_reg];
+    *(int32_t*) (vm->memory + addr) = vm->regs[op->reg];
+    return true;
+}
+
+// Superinstruction performs first instruction and then, if it succeeded, the one following it.
+#define FUSED_HANDLER(first, second, fusion) \
+    bool handle_##first##_##second(struct virtual_machine* vm, const struct vm_op* op) \
+    { \
+        vm->fusion_counts[fusion] += 1; \
+        if(!handle_##first(vm, op)) \
+        { \
+            vm->pc = op->next_pc; \
+            return false; \
+        } \
+        return handle_##second(vm, &vm->ops[op->next_pc]); \
+    }
+
+FUSED_HANDLER(C, JZ, VM_FUSION_C_JZ)
+FUSED_HANDLER(C, JP, VM_FUSION_C_JP)
+FUSED_HANDLER(C, JN, VM_FUSION_C_JN)
+FUSED_HANDLER(CR, JZ, VM_FUSION_CR_JZ)
+FUSED_HANDLER(CR, JP, VM_FUSION_CR_JP)
+FUSED_HANDLER(CR, JN, VM_FUSION_CR_JN)
+FUSED_HANDLER(CI, JZ, VM_FUSION_CI_JZ)
+FUSED_HANDLER(CI, JP, VM_FUSION_CI_JP)
+FUSED_HANDLER(CI, JN, VM_FUSION_CI_JN)
+FUSED_HANDLER(L, A, VM_FUSION_L_A)
+FUSED_HANDLER(L, S, VM_FUSION_L_S)
+FUSED_HANDLER(L, M, VM_FUSION_L_M)
+FUSED_HANDLER(LA, L, VM_FUSION_LA_L)
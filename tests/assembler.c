@@ -0,0 +1,154 @@
+// Checks that assembling file split into chunks on several threads gives the same program as serial pass, and that
+// errors anywhere in the file are reported just like serial pass reports them.
+#include "test.h"
+
+#define TEST_LINES 3000
+#define TEST_CHUNK 1024     // Smallest chunk, which splits generated file into dozens of them.
+#define TEST_LINE_SIZE 64
+
+// Line of generated program that's replaced with faulty one. Only comments are replaced, so that no label goes
+// missing.
+struct test_error
+{
+    uint32_t line;          // Counting from 0.
+    const char* text;
+};
+
+// Generates program whose instructions jump to and load from labels far ahead of them and far behind them, so that
+// references cross chunks both ways. Line given by error, unless it's NULL, is replaced with its text.
+static char* generate(const struct test_error* error)
+{
+    char* text = malloc(TEST_LINES * TEST_LINE_SIZE);
+    size_t size = 0;
+    for(uint32_t i = 0; i < TEST_LINES; ++i)
+    {
+        // Lines that are multiples of 50 hold data labelled with D, multiples of 13 are comments without label.
+        uint32_t target = (i + 977) % TEST_LINES;
+        while(target % 50 == 0 || target % 13 == 0)
+            target = (target + 1) % TEST_LINES;
+        uint32_t data = (i + 1500) % TEST_LINES / 50 * 50;
+
+        char* line = text + size;
+        if(error != NULL && error->line == i)
+            snprintf(line, TEST_LINE_SIZE, "%s\n", error->text);
+        else if(i % 50 == 0)
+            snprintf(line, TEST_LINE_SIZE, "D%u DC 3*INTEGER(%u)\n", i, i);
+        else if(i % 13 == 0)
+            snprintf(line, TEST_LINE_SIZE, "# Comment %u\n", i);
+        else if(i % 3 == 0)
+            snprintf(line, TEST_LINE_SIZE, "L%u JP L%u\n", i, target);
+        else if(i % 3 == 1)
+            snprintf(line, TEST_LINE_SIZE, "L%u L 1, D%u\n", i, data);
+        else
+            snprintf(line, TEST_LINE_SIZE, "L%u AI 2, %u\n", i, i);
+        size += strlen(line);
+    }
+
+    text[size] = '\0';
+    return text;
+}
+
+// Assembles text with given number of threads. Returns the same codes as hasm_assemble_source.
+static int assemble_text(const char* text, uint32_t threads, struct program* program, struct asm_location* location)
+{
+    struct source_file file = {.data = text, .size = strlen(text), .mapped = false};
+    return hasm_assemble_source(&file, program, location, threads);
+}
+
+static void test_same_as_serial(void)
+{
+    char* text = generate(NULL);
+    struct program serial;
+    struct asm_location location;
+    CHECK(assemble_text(text, 1, &serial, &location) == 0);
+    CHECK(sym_table_size(serial.symbols) > TEST_LINES / 2);
+
+    static const uint32_t threads[] = {2, 3, 5, 8, 64};
+    for(uint32_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+    {
+        struct program parallel;
+        CHECK(assemble_text(text, threads[i], &parallel, &location) == 0);
+        test_check_same_program(&serial, &parallel);
+        test_program_free(&parallel);
+    }
+
+    test_program_free(&serial);
+    free(text);
+}
+
+// Any chunk failing makes the whole file go through serial pass, which reports the first error in file order.
+static void test_errors(void)
+{
+    static const struct test_error errors[] = {
+        {2509, "    JP NOWHERE"},       // Undefined label, found only when chunks are merged.
+        {1508, "    AI 2,"},            // Syntax error in a chunk in the middle.
+        {2808, "L10 AI 2, 1"},          // Label defined by two chunks, each of which is fine on its own.
+        {208, "    FOO 1, 2"},         // Unknown mnemonic.
+    };
+
+    for(uint32_t i = 0; i < sizeof(errors) / sizeof(errors[0]); ++i)
+    {
+        char* text = generate(&errors[i]);
+        struct program program;
+        struct asm_location expected = {0}, actual = {0};
+        int serial = assemble_text(text, 1, &program, &expected);
+        CHECK(serial != 0);
+        CHECK(expected.line == errors[i].line + 1);
+
+        CHECK(assemble_text(text, 4, &program, &actual) == serial);
+        CHECK(actual.line == expected.line && actual.column == expected.column);
+        free(text);
+    }
+}
+
+// Label defined twice is reported at its second definition, both with and without parallel pass.
+static void test_duplicate_label(void)
+{
+    static const char text[] =
+        "LOOP AI 1, 1\n"
+        "    JP LOOP\n"
+        "# Comment\n"
+        "  LOOP SI 1, 1\n"
+        "    J LOOP\n";
+
+    static const uint32_t threads[] = {1, 4};
+    for(uint32_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+    {
+        struct program program;
+        struct asm_location location = {0};
+        CHECK(assemble_text(text, threads[i], &program, &location) == 5);
+        CHECK(location.line == 4 && location.column == 3);
+    }
+}
+
+// Lines holding only whitespace or indented comment are empty, they don't show up in lookup by address.
+static void test_empty_lines(void)
+{
+    static const char text[] =
+        "    LI 1, 1\n"
+        "  \t \n"
+        "\t# Indented comment\n"
+        "    LI 2, 2\n";
+
+    struct program program;
+    CHECK(test_assemble(text, &program) == 0);
+    CHECK(source_code_size(program.source) == 4);
+    CHECK(!source_code_line(program.source, 0)->empty);
+    CHECK(source_code_line(program.source, 1)->empty);
+    CHECK(source_code_line(program.source, 2)->empty);
+    CHECK(!source_code_line(program.source, 3)->empty);
+    CHECK(source_code_find(program.source, 4) == 3);
+    test_program_free(&program);
+}
+
+int main(void)
+{
+    hasm_set_min_chunk_size(TEST_CHUNK);
+    test_same_as_serial();
+    test_errors();
+    test_duplicate_label();
+    test_empty_lines();
+    hasm_set_min_chunk_size(0);
+
+    return test_failures != 0;
+}
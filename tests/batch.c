@@ -0,0 +1,170 @@
+// Checks that batch lanes end in the same state as virtual machine running the same program, on both AVX2 and
+// scalar paths of batch_vm.
+#include "test.h"
+
+#define TEST_LANES 19   // Not a multiple of vector width, so that padded lanes are present too.
+
+// Lanes loop r5 times, then store word over the last bytes of image and fall off its end through data, which
+// executes as NOP. Bytes stored past the image mustn't be executed as instructions.
+static const char* falls_off_end =
+    "    L 2, VAL\n"
+    "    LA 1, END\n"
+    "    LI 6, 0\n"
+    "LOOP AI 6, 1\n"
+    "    CR 6, 5\n"
+    "    JN LOOP\n"
+    "    ST 2, 2(1)\n"
+    "VAL DC INTEGER(2130706176)\n"
+    "END DC INTEGER(0)\n";
+
+// Lanes store into pages past the program at addresses depending on r5, then load them back, also with vector
+// instructions. Words overlapping the end of the program and wrapping around the address space are read too.
+static const char* paged_lanes =
+    "VAL DC INTEGER(7)\n"
+    "    LI 1, 1\n"
+    "    MI 1, 30000\n"
+    "    MI 1, 3\n"
+    "    LR 2, 5\n"
+    "    MI 2, 4100\n"
+    "    AR 1, 2\n"
+    "    L 3, VAL\n"
+    "    AR 3, 5\n"
+    "    ST 3, 0(1)\n"
+    "    ST 3, 4(1)\n"
+    "    LR 2, 1\n"
+    "    AI 2, 4094\n"
+    "    ST 3, 0(2)\n"
+    "    L 4, 4(1)\n"
+    "    A 4, 12(1)\n"
+    "    A 4, 0(2)\n"
+    "    LI 6, 0\n"
+    "    LI 7, 3\n"
+    "    VSUM 6, 0(1)\n"
+    "    LR 8, 1\n"
+    "    AI 8, 16\n"
+    "    LI 9, 3\n"
+    "    VA 8, 0(1)\n"
+    "    L 10, 20(1)\n"
+    "    LA 11, LAST\n"
+    "    ST 3, 2(11)\n"
+    "    L 12, 2(11)\n"
+    "    LI 13, -2\n"
+    "    L 13, 0(13)\n"
+    "LAST NOP\n";
+
+// Lanes index memory with r5, so that some of them access words inside the program, some past it, some overlapping
+// its end, and some wrap around the address space. Stores only reach operands of the last instruction.
+static const char* indexed_lanes =
+    "    LA 1, LAST\n"
+    "    LR 2, 5\n"
+    "    AR 2, 5\n"
+    "    AI 2, 1\n"
+    "    AR 1, 2\n"
+    "    L 3, 0(1)\n"
+    "    LI 4, 1\n"
+    "    MI 4, 256\n"
+    "    AR 4, 5\n"
+    "    ST 4, 0(1)\n"
+    "    A 3, 0(1)\n"
+    "    C 3, 0(1)\n"
+    "    L 6, 0(1)\n"
+    "    D 6, 4(1)\n"
+    "    LA 8, LAST\n"
+    "    SR 8, 5\n"
+    "    SR 8, 5\n"
+    "    SR 8, 5\n"
+    "    L 9, 0(8)\n"
+    "    LI 10, 0\n"
+    "    SR 10, 5\n"
+    "    L 11, 0(10)\n"
+    "    ST 4, 0(10)\n"
+    "    A 11, 0(10)\n"
+    "LAST NOP\n";
+
+// Every lane runs the loop at least once, ends past the image and keeps low bytes of VAL stored at its end.
+static void check_falls_off_end(const struct test_state* state, uint32_t lane)
+{
+    CHECK(state->exit_code == 1);
+    CHECK(state->pc == state->mem_sz);
+    CHECK(state->regs[6] == (lane > 0 ? (int32_t) lane : 1));
+    CHECK(state->memory[state->mem_sz - 2] == 0x00 && state->memory[state->mem_sz - 1] == 0xff);
+}
+
+// Paged memory is read back just as it was written, including word overlapping the end of the program. Lanes end
+// normally, reaching pages past the program doesn't fail them.
+static void check_paged_lanes(const struct test_state* state, uint32_t lane)
+{
+    int32_t value = 7 + (int32_t) lane;
+    CHECK(state->exit_code == 1);
+    CHECK(state->regs[1] == 90000 + (int32_t) lane * 4100);
+    CHECK(state->regs[3] == value);
+    CHECK(state->regs[4] == 2 * value);     // Words at 4 and 4094, word at 12 was never written.
+    CHECK(state->regs[6] == 2 * value);     // Sum of words at 0, 4 and 8.
+    CHECK(state->regs[10] == value);        // Word at 20 after VA added word at 4 to it.
+    CHECK(state->regs[12] == value);
+}
+
+// Accesses anywhere in the address space succeed, every lane runs to the end of the program.
+static void check_indexed_lanes(const struct test_state* state, uint32_t lane)
+{
+    CHECK(state->exit_code == 1);
+    CHECK(state->pc == state->mem_sz);
+    CHECK(state->regs[4] == 256 + (int32_t) lane);
+}
+
+// Runs program on batch lanes, each with r5 set to its index, and compares every lane with virtual machine. Lanes
+// are checked against check_lane as well, unless it's NULL, so that bug shared with virtual machine shows up too.
+static void test_batch_matches_vm(const char* text, bool use_avx2,
+    void (*check_lane)(const struct test_state* state, uint32_t lane))
+{
+    struct program program;
+    if(test_assemble(text, &program) != 0)
+    {
+        ++test_failures;
+        return;
+    }
+
+    struct batch_vm batch;
+    CHECK(batch_init(program, TEST_LANES, &batch) == 0);
+    if(use_avx2 && !batch.use_avx2)   // Host can't run AVX2 path, scalar one is tested separately.
+    {
+        batch_finalize(&batch);
+        test_program_free(&program);
+        return;
+    }
+
+    batch.use_avx2 = use_avx2;
+    for(uint32_t lane = 0; lane < TEST_LANES; ++lane)
+        batch_set_reg(&batch, lane, 5, (int32_t) lane);
+    batch_run(&batch);
+
+    for(uint32_t lane = 0; lane < TEST_LANES; ++lane)
+    {
+        int32_t regs[16] = {0};
+        regs[5] = (int32_t) lane;
+
+        struct test_state expected, actual;
+        test_run_vm(program, VM_ENGINE_HANDLERS, false, regs, &expected);
+        test_lane_state(&batch, lane, &actual);
+        CHECK(test_same_state(&expected, &actual));
+        if(check_lane != NULL)
+            check_lane(&actual, lane);
+        test_state_free(&expected);
+        test_state_free(&actual);
+    }
+
+    batch_finalize(&batch);
+    test_program_free(&program);
+}
+
+int main(void)
+{
+    test_batch_matches_vm(falls_off_end, true, check_falls_off_end);
+    test_batch_matches_vm(falls_off_end, false, check_falls_off_end);
+    test_batch_matches_vm(paged_lanes, true, check_paged_lanes);
+    test_batch_matches_vm(paged_lanes, false, check_paged_lanes);
+    test_batch_matches_vm(indexed_lanes, true, check_indexed_lanes);
+    test_batch_matches_vm(indexed_lanes, false, check_indexed_lanes);
+
+    return test_failures != 0;
+}
@@ -0,0 +1,99 @@
+// Checks that INT32_MIN / -1 wraps around rather than trapping on the host, and that division by zero invalidates
+// flags, on every engine.
+#include "test.h"
+
+#define TEST_LANES 9
+
+// Divides INT32_MIN by -1 with each division instruction, in a loop so that JIT runs compiled code too.
+static const char* divisions =
+    "MIN DC INTEGER(-2147483648)\n"
+    "NEG DC INTEGER(-1)\n"
+    "    LI 6, 3\n"
+    "LOOP L 1, MIN\n"
+    "    D 1, NEG\n"
+    "    L 2, MIN\n"
+    "    L 3, NEG\n"
+    "    DR 2, 3\n"
+    "    LI 5, 7\n"
+    "    DI 5, -1\n"
+    "    L 4, MIN\n"
+    "    DI 4, -1\n"
+    "    SI 6, 1\n"
+    "    JP LOOP\n"
+    "    DI 4, -1\n";
+
+// Same, followed by division by zero.
+static const char* by_zero =
+    "MIN DC INTEGER(-2147483648)\n"
+    "NEG DC INTEGER(-1)\n"
+    "    L 1, MIN\n"
+    "    D 1, NEG\n"
+    "    L 2, MIN\n"
+    "    L 3, NEG\n"
+    "    DR 2, 3\n"
+    "    LI 5, 7\n"
+    "    DI 5, -1\n"
+    "    L 4, MIN\n"
+    "    DI 4, -1\n"
+    "    LI 7, 0\n"
+    "    DR 6, 7\n";
+
+static void test_division(const char* text, int32_t flags)
+{
+    struct program program;
+    if(test_assemble(text, &program) != 0)
+    {
+        ++test_failures;
+        return;
+    }
+
+    struct test_state expected;
+    test_run_vm(program, VM_ENGINE_HANDLERS, false, NULL, &expected);
+    CHECK(expected.exit_code == 1);
+    CHECK(expected.regs[1] == INT32_MIN);
+    CHECK(expected.regs[2] == INT32_MIN);
+    CHECK(expected.regs[4] == INT32_MIN);
+    CHECK(expected.regs[5] == -7);
+    CHECK(expected.flags == flags);
+
+    static const enum vm_engine engines[] = {VM_ENGINE_HANDLERS, VM_ENGINE_THREADED, VM_ENGINE_JIT};
+    for(uint32_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+    {
+        for(int verify = 0; verify < 2; ++verify)
+        {
+            struct test_state state;
+            test_run_vm(program, engines[i], verify, NULL, &state);
+            CHECK(test_same_state(&expected, &state));
+            test_state_free(&state);
+        }
+    }
+
+    for(int use_avx2 = 0; use_avx2 < 2; ++use_avx2)
+    {
+        struct batch_vm batch;
+        CHECK(batch_init(program, TEST_LANES, &batch) == 0);
+        batch.use_avx2 = batch.use_avx2 && use_avx2;
+        batch_run(&batch);
+
+        for(uint32_t lane = 0; lane < TEST_LANES; ++lane)
+        {
+            struct test_state state;
+            test_lane_state(&batch, lane, &state);
+            CHECK(test_same_state(&expected, &state));
+            test_state_free(&state);
+        }
+
+        batch_finalize(&batch);
+    }
+
+    test_state_free(&expected);
+    test_program_free(&program);
+}
+
+int main(void)
+{
+    test_division(divisions, 2);
+    test_division(by_zero, 3);
+
+    return test_failures != 0;
+}
@@ -0,0 +1,231 @@
+// Checks that every engine leaves programs in the same state: handlers, threaded code and JIT, each with and without
+// verifier, as well as batch lanes on both of their paths. Programs read r5, which is set to index of the run, so
+// that runs and lanes take different paths.
+#include "test.h"
+
+#define TEST_RUNS 12
+
+// Loops over array with instruction pairs that are fused into superinstructions, then divides (also by zero) and
+// branches on the results.
+static const char loops[] =
+    "N DC INTEGER(10)\n"
+    "ONE DC INTEGER(1)\n"
+    "ARR DC 10*INTEGER(3)\n"
+    "SUM DS INTEGER\n"
+    "    L 1, N\n"
+    "    LI 2, 0\n"
+    "    LA 3, ARR\n"
+    "LOOP L 4, 0(3)\n"
+    "    A 4, ONE\n"
+    "    AR 2, 4\n"
+    "    AR 2, 5\n"
+    "    AI 3, 4\n"
+    "    S 1, ONE\n"
+    "    CI 1, 0\n"
+    "    JP LOOP\n"
+    "    ST 2, SUM\n"
+    "    L 6, SUM\n"
+    "    M 6, N\n"
+    "    MR 6, 5\n"
+    "    LR 7, 6\n"
+    "    D 7, N\n"
+    "    DR 6, 1\n"
+    "    JZ BAD\n"
+    "    C 7, ONE\n"
+    "    JN SMALL\n"
+    "    CR 7, 5\n"
+    "    JZ BAD\n"
+    "    LI 8, 1\n"
+    "SMALL LI 9, 2\n"
+    "    L 10, ONE\n"
+    "    S 10, N\n"
+    "    LA 11, SUM\n"
+    "    L 12, 0(11)\n"
+    "BAD NOP\n";
+
+// Overwrites instruction that was already executed, and constant that verifier folds, while looping.
+static const char self_modifying[] =
+    "PATCH DC INTEGER(6554134)\n"
+    "K DC INTEGER(5)\n"
+    "    LI 2, 0\n"
+    "    LI 1, 2\n"
+    "    LI 4, 0\n"
+    "LOOP AI 2, 1\n"
+    "    A 4, K\n"
+    "    L 3, PATCH\n"
+    "    ST 3, LOOP\n"
+    "    ST 5, K\n"
+    "    SI 1, 1\n"
+    "    JP LOOP\n";
+
+// Overwrites the second instruction of fused L and A pair, after which the pair is no longer fused. Threaded engine
+// must go back to running the first instruction's own body rather than the superinstruction.
+static const char refused[] =
+    "X DC INTEGER(5)\n"
+    "PATCH AI 4, 100\n"
+    "    LI 1, 3\n"
+    "LOOP L 2, X\n"
+    "SECOND A 2, X\n"
+    "    L 3, PATCH\n"
+    "    ST 3, SECOND\n"
+    "    SI 1, 1\n"
+    "    JP LOOP\n";
+
+// Vector instructions over arrays inside the program and in paged memory past it. Count depends on r5, which makes
+// the last runs fail on negative count.
+static const char vectors[] =
+    "ARR DC 8*INTEGER(2)\n"
+    "ARR2 DC 8*INTEGER(5)\n"
+    "    LA 1, ARR\n"
+    "    LI 2, 10\n"
+    "    SR 2, 5\n"
+    "    LI 12, 8\n"
+    "    CR 2, 12\n"
+    "    JN FITS\n"
+    "    LR 2, 12\n"
+    "FITS VA 1, ARR2\n"
+    "    VS 1, ARR2\n"
+    "    VM 1, ARR2\n"
+    "    LA 3, ARR2\n"
+    "    LR 4, 2\n"
+    "    VC 3, ARR\n"
+    "    LI 6, 0\n"
+    "    LR 7, 2\n"
+    "    VSUM 6, ARR\n"
+    "    LR 12, 5\n"
+    "    LR 13, 2\n"
+    "    VMAX 12, ARR\n"
+    "    LI 8, 1\n"
+    "    MI 8, 30000\n"
+    "    MI 8, 5\n"
+    "    LR 9, 2\n"
+    "    VA 8, ARR\n"
+    "    LI 10, 0\n"
+    "    LR 11, 2\n"
+    "    VSUM 10, 0(8)\n"
+    "    LA 3, ARR\n"
+    "    VC 3, 0(8)\n";
+
+// Vector instructions over arrays longer than VM_VECTOR_CHUNK, which take several cycles: overlapping arrays,
+// reduction whose register also addresses the array, comparison that finds difference in a later chunk.
+static const char long_vectors[] =
+    "ARR DC 300*INTEGER(2)\n"
+    "ARR2 DC 300*INTEGER(5)\n"
+    "ARR3 DC 300*INTEGER(5)\n"
+    "    LR 2, 5\n"
+    "    MI 2, 17\n"
+    "    AI 2, 100\n"
+    "    LA 1, ARR\n"
+    "    VA 1, ARR2\n"
+    "    LA 3, ARR\n"
+    "    AI 3, 4\n"
+    "    LR 4, 2\n"
+    "    VS 3, ARR\n"
+    "    LA 14, ARR3\n"
+    "    LR 15, 2\n"
+    "    VSUM 14, 0(14)\n"
+    "    LI 6, 1\n"
+    "    MI 6, 30000\n"
+    "    MI 6, 5\n"
+    "    LR 7, 2\n"
+    "    VA 6, ARR2\n"
+    "    LI 8, 0\n"
+    "    LR 9, 2\n"
+    "    VMAX 8, 0(6)\n"
+    "    LI 10, 9\n"
+    "    LA 11, ARR3\n"
+    "    ST 10, 600(11)\n"
+    "    LA 12, ARR2\n"
+    "    LR 13, 2\n"
+    "    VC 12, ARR3\n";
+
+// Jumps through register, which takes the first run to the end and the rest past the program.
+static const char jumps[] =
+    "    LR 1, 5\n"
+    "    MI 1, 1000\n"
+    "    LA 2, DONE\n"
+    "    AR 1, 2\n"
+    "    J 0(1)\n"
+    "    LI 3, 5\n"
+    "DONE LI 4, 6\n";
+
+static const char* programs[] = {loops, self_modifying, refused, vectors, long_vectors, jumps};
+
+#define NUM_PROGRAMS (sizeof(programs) / sizeof(programs[0]))
+
+// Compares every engine with handlers running without verifier.
+static void test_engines(const char* text)
+{
+    struct program program;
+    if(test_assemble(text, &program) != 0)
+    {
+        ++test_failures;
+        return;
+    }
+
+    struct test_state expected[TEST_RUNS];
+    for(uint32_t run = 0; run < TEST_RUNS; ++run)
+    {
+        int32_t regs[16] = {0};
+        regs[5] = (int32_t) run;
+        test_run_vm(program, VM_ENGINE_HANDLERS, false, regs, &expected[run]);
+    }
+
+    static const enum vm_engine engines[] = {VM_ENGINE_HANDLERS, VM_ENGINE_THREADED, VM_ENGINE_JIT};
+    for(uint32_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+    {
+        for(int verify = 0; verify < 2; ++verify)
+        {
+            for(uint32_t run = 0; run < TEST_RUNS; ++run)
+            {
+                int32_t regs[16] = {0};
+                regs[5] = (int32_t) run;
+
+                struct test_state state;
+                test_run_vm(program, engines[i], verify, regs, &state);
+                if(!test_same_state(&expected[run], &state))
+                {
+                    fprintf(stderr, "engine %d, verify %d, run %u\n", engines[i], verify, run);
+                    ++test_failures;
+                }
+                test_state_free(&state);
+            }
+        }
+    }
+
+    for(int use_avx2 = 0; use_avx2 < 2; ++use_avx2)
+    {
+        struct batch_vm batch;
+        CHECK(batch_init(program, TEST_RUNS, &batch) == 0);
+        batch.use_avx2 = batch.use_avx2 && use_avx2;
+        for(uint32_t lane = 0; lane < TEST_RUNS; ++lane)
+            batch_set_reg(&batch, lane, 5, (int32_t) lane);
+        batch_run(&batch);
+
+        for(uint32_t lane = 0; lane < TEST_RUNS; ++lane)
+        {
+            struct test_state state;
+            test_lane_state(&batch, lane, &state);
+            if(!test_same_state(&expected[lane], &state))
+            {
+                fprintf(stderr, "batch, avx2 %d, lane %u\n", use_avx2, lane);
+                ++test_failures;
+            }
+            test_state_free(&state);
+        }
+
+        batch_finalize(&batch);
+    }
+
+    for(uint32_t run = 0; run < TEST_RUNS; ++run)
+        test_state_free(&expected[run]);
+    test_program_free(&program);
+}
+
+int main(void)
+{
+    for(uint32_t i = 0; i < NUM_PROGRAMS; ++i)
+        test_engines(programs[i]);
+
+    return test_failures != 0;
+}
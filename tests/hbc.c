@@ -0,0 +1,227 @@
+// Checks that programs and object units survive being saved to .hbc and .hbo files and loaded back.
+#include "hbc.h"
+#include "test.h"
+
+#define TEST_FILE "test_hbc.tmp"
+
+static const char program_text[] =
+    "# Sums array.\n"
+    "N DC INTEGER(4)\n"
+    "ARR DC INTEGER(1)\n"
+    "    DC INTEGER(-2)\n"
+    "    DC INTEGER(300000)\n"
+    "    DC INTEGER(4)\n"
+    "\n"
+    "    L 1, N\n"
+    "    LA 2, ARR\n"
+    "    LI 3, 0\n"
+    "LOOP A 3, 0(2)\n"
+    "    AI 2, 4\n"
+    "    SI 1, 1\n"
+    "    JP LOOP\n";
+
+// Data made of runs, which .hbc file encodes as single words, mixed with data that's kept as is. Runs start at odd
+// multiples of 2 too, and the last one ends 2 bytes before end of memory.
+static const char runs_text[] =
+    "    LR 1, 2\n"
+    "BIG DC 1000*INTEGER(7)\n"
+    "ZERO DS 2000*INTEGER\n"
+    "    AR 1, 2\n"
+    "SHORT DC 3*INTEGER(-1)\n"
+    "EXACT DC 4*INTEGER(-1)\n"
+    "MIXED DC INTEGER(1)\n"
+    "    DC INTEGER(2)\n"
+    "TAIL DC 50*INTEGER(305419896)\n"
+    "    LR 3, 4\n";
+
+// Units of program, the last one isn't used by others and is dropped by linker.
+static const char main_unit[] =
+    "    EXPORT BACK\n"
+    "    IMPORT TOTAL, SUMUP, END\n"
+    "    LI 1, 5\n"
+    "    J SUMUP\n"
+    "BACK ST 3, TOTAL\n"
+    "    J END\n";
+
+static const char library_unit[] =
+    "    EXPORT TOTAL, SUMUP, END\n"
+    "    IMPORT BACK\n"
+    "TOTAL DS INTEGER\n"
+    "SUMUP LI 3, 0\n"
+    "LOOP AR 3, 1\n"
+    "    SI 1, 1\n"
+    "    JP LOOP\n"
+    "    J BACK\n"
+    "END NOP\n";
+
+static const char unused_unit[] =
+    "    EXPORT UNUSED\n"
+    "UNUSED LI 1, 1\n";
+
+static const char* units[] = {main_unit, library_unit, unused_unit};
+
+#define NUM_UNITS (sizeof(units) / sizeof(units[0]))
+
+// Checks that both units have the same code, labels, relocations and source lines.
+static void check_same_object(const struct object* a, const struct object* b)
+{
+    CHECK(a->mem_sz == b->mem_sz);
+    CHECK(a->code_block == b->code_block);
+    CHECK(!a->code_block || a->entry_addr == b->entry_addr);
+    CHECK(a->mem_sz == b->mem_sz && memcmp(a->mem_ptr, b->mem_ptr, a->mem_sz) == 0);
+    test_check_same_symbols(a->symbols, b->symbols);
+    test_check_same_symbols(a->exports, b->exports);
+    test_check_same_symbols(a->imports, b->imports);
+    CHECK(a->num_relocs == b->num_relocs);
+    CHECK(a->num_relocs == b->num_relocs && (a->num_relocs == 0
+        || memcmp(a->relocs, b->relocs, a->num_relocs * sizeof(struct object_reloc)) == 0));
+    test_check_same_source(a->source, b->source);
+}
+
+// Saves program assembled from text and checks that loading gives the same program, which runs the same way.
+static void test_program_round_trip(const char* text)
+{
+    struct source_file source = {.data = text, .size = strlen(text), .mapped = false};
+    struct program program, loaded;
+    if(test_assemble(text, &program) != 0)
+    {
+        ++test_failures;
+        return;
+    }
+
+    CHECK(hbc_save(&program, &source, TEST_FILE) == 0);
+    if(hbc_load(TEST_FILE, &source, &loaded) != 0)
+    {
+        fprintf(stderr, "loading %s failed\n", TEST_FILE);
+        ++test_failures;
+        test_program_free(&program);
+        return;
+    }
+
+    test_check_same_program(&program, &loaded);
+
+    struct test_state expected, actual;
+    test_run_vm(program, VM_ENGINE_HANDLERS, true, NULL, &expected);
+    test_run_vm(loaded, VM_ENGINE_HANDLERS, true, NULL, &actual);
+    CHECK(test_same_state(&expected, &actual));
+    test_state_free(&expected);
+    test_state_free(&actual);
+
+    // File written for different source is rejected.
+    struct source_file other = {.data = "NOP\n", .size = 4, .mapped = false};
+    struct program stale;
+    CHECK(hbc_load(TEST_FILE, &other, &stale) != 0);
+
+    test_program_free(&loaded);
+    test_program_free(&program);
+}
+
+// Reads word of program's memory.
+static int32_t program_word(const struct program* program, uint16_t label_addr, uint32_t index)
+{
+    int32_t value;
+    memcpy(&value, program->mem_ptr + label_addr + 4 * index, sizeof(value));
+    return value;
+}
+
+// Checks that runs are filled in by assembler, and encoded into image much smaller than memory.
+static void test_run_length_round_trip(void)
+{
+    struct source_file source = {.data = runs_text, .size = strlen(runs_text), .mapped = false};
+    struct program program, loaded;
+    if(test_assemble(runs_text, &program) != 0)
+    {
+        ++test_failures;
+        return;
+    }
+
+    uint16_t big = sym_table_get(program.symbols, "BIG");
+    uint16_t zero = sym_table_get(program.symbols, "ZERO");
+    uint16_t tail = sym_table_get(program.symbols, "TAIL");
+    CHECK(big % 4 == 2);
+    CHECK(program_word(&program, big, 0) == 7 && program_word(&program, big, 999) == 7);
+    CHECK(program_word(&program, zero, 0) == 0 && program_word(&program, zero, 1999) == 0);
+    CHECK(program_word(&program, tail, 49) == 305419896);
+    CHECK(tail + 50 * 4 + 2 == program.mem_sz);
+
+    CHECK(hbc_save(&program, &source, TEST_FILE) == 0);
+    FILE* file = fopen(TEST_FILE, "rb");
+    CHECK(file != NULL);
+    if(file != NULL)
+    {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fclose(file);
+
+        // Header, symbols and source lines take few hundred bytes, image itself less than a hundred.
+        CHECK(size < program.mem_sz / 10);
+    }
+
+    if(hbc_load(TEST_FILE, &source, &loaded) != 0)
+    {
+        fprintf(stderr, "loading %s failed\n", TEST_FILE);
+        ++test_failures;
+        test_program_free(&program);
+        return;
+    }
+
+    test_check_same_program(&program, &loaded);
+
+    test_program_free(&loaded);
+    test_program_free(&program);
+}
+
+// Saves every unit to .hbo file and checks that loaded units are the same, and link into the same program.
+static void test_object_round_trip(void)
+{
+    struct object objects[NUM_UNITS], loaded[NUM_UNITS];
+    for(uint32_t i = 0; i < NUM_UNITS; ++i)
+    {
+        struct source_file source = {.data = units[i], .size = strlen(units[i]), .mapped = false};
+        struct asm_location location;
+        if(hasm_assemble_object(&source, &objects[i], &location) != 0)
+        {
+            fprintf(stderr, "assembling unit %u failed at line %u:%u\n", i, location.line, location.column);
+            exit(1);
+        }
+
+        CHECK(hbc_save_object(&objects[i], &source, TEST_FILE) == 0);
+        if(hbc_load_object(TEST_FILE, &source, &loaded[i]) != 0)
+        {
+            fprintf(stderr, "loading unit %u failed\n", i);
+            exit(1);
+        }
+
+        check_same_object(&objects[i], &loaded[i]);
+    }
+
+    struct program program, linked;
+    CHECK(object_link(objects, NUM_UNITS, &program, NULL) == 0);
+    CHECK(object_link(loaded, NUM_UNITS, &linked, NULL) == 0);
+    test_check_same_program(&program, &linked);
+    CHECK(sym_table_get(program.symbols, "UNUSED") == UINT16_MAX);
+
+    struct test_state state;
+    test_run_vm(linked, VM_ENGINE_HANDLERS, true, NULL, &state);
+    CHECK(state.exit_code == 1);
+    CHECK(state.regs[3] == 15);
+    test_state_free(&state);
+
+    test_program_free(&linked);
+    test_program_free(&program);
+    for(uint32_t i = 0; i < NUM_UNITS; ++i)
+    {
+        object_free(&objects[i]);
+        object_free(&loaded[i]);
+    }
+}
+
+int main(void)
+{
+    test_program_round_trip(program_text);
+    test_object_round_trip();
+    test_run_length_round_trip();
+
+    remove(TEST_FILE);
+    return test_failures != 0;
+}
@@ -0,0 +1,256 @@
+// Checks that incremental re-assembly gives the same program as assembling every version of source from scratch,
+// for edits that keep layout, edits that move code, and labels being renamed and deleted.
+#include "test.h"
+
+// Result expected from update to next version.
+enum test_update
+{
+    TEST_IN_PLACE,      // Layout is kept, memory is rewritten in place.
+    TEST_LAYOUT,        // Code or labels move.
+    TEST_FAILS,         // Source has an error, program stays as it was.
+};
+
+struct test_version
+{
+    const char* text;
+    enum test_update update;
+};
+
+static const struct test_version versions[] = {
+    {
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "LOOP AI 2, 1\n"
+        "    AR 2, 1\n"
+        "    S 1, ONE\n"
+        "    JP LOOP\n"
+        "    J END\n"
+        "MID NOP\n"
+        "END LR 3, 2\n",
+        TEST_LAYOUT     // The first version is assembled by hasm_incremental_init.
+    },
+    {   // Different operand.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "LOOP AI 2, 5\n"
+        "    AR 2, 1\n"
+        "    S 1, ONE\n"
+        "    JP LOOP\n"
+        "    J END\n"
+        "MID NOP\n"
+        "END LR 3, 2\n",
+        TEST_IN_PLACE
+    },
+    {   // Different instruction of the same size, and different label operand.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "LOOP AI 2, 5\n"
+        "    SR 2, 1\n"
+        "    S 1, N\n"
+        "    JP LOOP\n"
+        "    J END\n"
+        "MID NOP\n"
+        "END LR 3, 2\n",
+        TEST_IN_PLACE
+    },
+    {   // Inserted line moves labels referred to from before and after it.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LI 4, 1\n"
+        "LOOP AI 2, 5\n"
+        "    SR 2, 1\n"
+        "    S 1, N\n"
+        "    JP LOOP\n"
+        "    J END\n"
+        "MID NOP\n"
+        "END LR 3, 2\n",
+        TEST_LAYOUT
+    },
+    {   // Deleted line, and instruction that got shorter.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LR 4, 1\n"
+        "LOOP AI 2, 5\n"
+        "    S 1, N\n"
+        "    JP LOOP\n"
+        "    J END\n"
+        "MID NOP\n"
+        "END LR 3, 2\n",
+        TEST_LAYOUT
+    },
+    {   // Label renamed together with its operand.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LR 4, 1\n"
+        "AGAIN AI 2, 5\n"
+        "    S 1, N\n"
+        "    JP AGAIN\n"
+        "    J END\n"
+        "MID NOP\n"
+        "END LR 3, 2\n",
+        TEST_LAYOUT
+    },
+    {   // Label renamed, but its operand wasn't.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LR 4, 1\n"
+        "AGAIN AI 2, 5\n"
+        "    S 1, N\n"
+        "    JP AGAIN\n"
+        "    J END\n"
+        "MID NOP\n"
+        "FIN LR 3, 2\n",
+        TEST_FAILS
+    },
+    {   // Label nothing refers to deleted.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LR 4, 1\n"
+        "AGAIN AI 2, 5\n"
+        "    S 1, N\n"
+        "    JP AGAIN\n"
+        "    J END\n"
+        "    NOP\n"
+        "END LR 3, 2\n",
+        TEST_LAYOUT
+    },
+    {   // Label still referred to deleted.
+        "N DC INTEGER(10)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LR 4, 1\n"
+        "    AI 2, 5\n"
+        "    S 1, N\n"
+        "    JP AGAIN\n"
+        "    J END\n"
+        "    NOP\n"
+        "END LR 3, 2\n",
+        TEST_FAILS
+    },
+    {   // The first and the last line changed.
+        "N DC INTEGER(12)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LR 4, 1\n"
+        "AGAIN AI 2, 5\n"
+        "    S 1, N\n"
+        "    JP AGAIN\n"
+        "    J END\n"
+        "    NOP\n"
+        "END LR 3, 4\n",
+        TEST_IN_PLACE
+    },
+    {   // Lines appended.
+        "N DC INTEGER(12)\n"
+        "ONE DC INTEGER(1)\n"
+        "    L 1, N\n"
+        "    LI 2, 0\n"
+        "    LR 4, 1\n"
+        "AGAIN AI 2, 5\n"
+        "    S 1, N\n"
+        "    JP AGAIN\n"
+        "    J END\n"
+        "    NOP\n"
+        "END LR 3, 4\n"
+        "TAIL LI 5, 9\n"
+        "    J AGAIN\n",
+        TEST_LAYOUT
+    },
+};
+
+#define NUM_VERSIONS (sizeof(versions) / sizeof(versions[0]))
+
+// Copies program's memory, so that it can be compared after update.
+static uint8_t* copy_memory(const struct program* program)
+{
+    uint8_t* memory = malloc(program->mem_sz);
+    memcpy(memory, program->mem_ptr, program->mem_sz);
+    return memory;
+}
+
+int main(void)
+{
+    struct source_file file = {.data = versions[0].text, .size = strlen(versions[0].text), .mapped = false};
+    struct asm_incremental inc;
+    struct program program;
+    struct asm_location location;
+    if(hasm_incremental_init(&inc, &file, &program, &location) != 0)
+    {
+        fprintf(stderr, "assembling failed at line %u:%u\n", location.line, location.column);
+        return 1;
+    }
+
+    // Version the program was last successfully updated to.
+    uint32_t current = 0;
+    for(uint32_t i = 1; i < NUM_VERSIONS; ++i)
+    {
+        uint8_t* before = copy_memory(&program);
+        uint32_t before_sz = program.mem_sz;
+
+        file = (struct source_file) {.data = versions[i].text, .size = strlen(versions[i].text), .mapped = false};
+        struct asm_change change;
+        int result = hasm_incremental_update(&inc, &file, &program, &location, &change);
+        if(versions[i].update == TEST_FAILS)
+        {
+            struct program full;
+            struct asm_location full_location;
+            CHECK(result != 0 && result == hasm_assemble_source(&file, &full, &full_location, 1));
+            CHECK(location.line == full_location.line && location.column == full_location.column);
+        }
+        else
+        {
+            CHECK(result == 0);
+            CHECK(change.layout == (versions[i].update == TEST_LAYOUT));
+            current = i;
+        }
+
+        // Memory outside changed range is kept by updates in place.
+        if(result == 0 && !change.layout)
+        {
+            CHECK(program.mem_sz == before_sz);
+            CHECK(memcmp(program.mem_ptr, before, change.first) == 0);
+            CHECK(memcmp(program.mem_ptr + change.end, before + change.end, program.mem_sz - change.end) == 0);
+        }
+        free(before);
+
+        struct program full;
+        if(test_assemble(versions[current].text, &full) != 0)
+        {
+            ++test_failures;
+            continue;
+        }
+
+        test_check_same_program(&program, &full);
+        test_program_free(&full);
+    }
+
+    // Update to the same version changes nothing.
+    struct asm_change change;
+    uint8_t* before = copy_memory(&program);
+    CHECK(hasm_incremental_update(&inc, &file, &program, &location, &change) == 0);
+    CHECK(!change.layout && change.first == change.end);
+    CHECK(memcmp(program.mem_ptr, before, program.mem_sz) == 0);
+    free(before);
+
+    hasm_incremental_free(&inc);
+    test_program_free(&program);
+    return test_failures != 0;
+}
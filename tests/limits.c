@@ -0,0 +1,82 @@
+// Checks that vector instructions over long arrays are split into cycles of VM_VECTOR_CHUNK elements on every engine,
+// so that step and time limits of headless runner stop them just like loops of scalar instructions.
+#include <time.h>
+
+#include "test.h"
+
+#define TEST_STEPS 10
+#define TEST_SLICE (1 << 14)    // Cycles executed between checks of time limit, as in headless runner.
+#define TEST_TIME 0.2           // Time limit, in seconds.
+#define TEST_SETUP 6            // Instructions preceding VA.
+
+// Adds 900 million elements into pages past the program, which would allocate gigabytes if it was done at once.
+static const char long_add[] =
+    "ARR DC 1000*INTEGER(3)\n"
+    "    LI 1, 1\n"
+    "    MI 1, 30000\n"
+    "    MI 1, 3\n"
+    "    LI 2, 1\n"
+    "    MI 2, 30000\n"
+    "    MI 2, 30000\n"
+    "LONG VA 1, ARR\n";
+
+static double wall_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+// Runs few cycles past the setup and checks that VA stopped after processing just as many chunks.
+static void test_step_limit(const struct program* program, enum vm_engine engine)
+{
+    struct virtual_machine vm;
+    test_init_vm(*program, engine, &vm);
+    uint16_t vector = sym_table_get(program->symbols, "LONG");
+
+    CHECK(vm_forward(&vm, TEST_SETUP + TEST_STEPS) == 0);
+    CHECK(vm.retired == TEST_SETUP + TEST_STEPS);
+    CHECK(vm.pc == vector);
+
+    uint32_t dest = (uint32_t) vm.regs[1];
+    CHECK(vm_read_memory(&vm, dest) == 3);
+    CHECK(vm_read_memory(&vm, dest + 4 * (TEST_STEPS * VM_VECTOR_CHUNK - 1)) == 3);
+    CHECK(vm_read_memory(&vm, dest + 4 * TEST_STEPS * VM_VECTOR_CHUNK) == 0);
+
+    vm_finalize(&vm);
+}
+
+// Runs in slices until time limit passes, as headless runner does, and checks that it isn't overshot by much.
+static void test_time_limit(const struct program* program, enum vm_engine engine)
+{
+    struct virtual_machine vm;
+    test_init_vm(*program, engine, &vm);
+
+    double start = wall_time();
+    int result = 0;
+    while(result == 0 && wall_time() - start < TEST_TIME)
+        result = vm_forward(&vm, TEST_SLICE);
+
+    CHECK(result == 0);
+    CHECK(wall_time() - start < 10 * TEST_TIME);
+    CHECK(vm.pc == sym_table_get(program->symbols, "LONG"));
+
+    vm_finalize(&vm);
+}
+
+int main(void)
+{
+    struct program program;
+    if(test_assemble(long_add, &program) != 0)
+        return 1;
+
+    static const enum vm_engine engines[] = {VM_ENGINE_HANDLERS, VM_ENGINE_THREADED, VM_ENGINE_JIT};
+    for(uint32_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+    {
+        test_step_limit(&program, engines[i]);
+        test_time_limit(&program, engines[i]);
+    }
+
+    test_program_free(&program);
+    return test_failures != 0;
+}
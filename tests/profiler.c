@@ -0,0 +1,69 @@
+// Checks that profiler counts executions of each instruction and how often conditional jumps were taken, and that
+// vector instructions split into several cycles aren't counted as taken jumps.
+#include "profiler.h"
+#include "test.h"
+
+#define TEST_LOOPS 5
+#define TEST_LENGTH 100     // Length of array summed by every iteration, which takes two cycles.
+
+static const char program_text[] =
+    "ARR DC 100*INTEGER(1)\n"
+    "    LI 1, 5\n"
+    "    LI 6, 100\n"
+    "LOOP AI 2, 1\n"
+    "VEC VSUM 5, ARR\n"
+    "    SI 1, 1\n"
+    "BRANCH JP LOOP\n"
+    "JUMP J END\n"
+    "SKIPPED NOP\n"
+    "END NOP\n";
+
+static uint64_t label_count(const struct profiler* profiler, const struct program* program, const char* label)
+{
+    return profiler->counts[sym_table_get(program->symbols, label)];
+}
+
+static uint64_t label_taken(const struct profiler* profiler, const struct program* program, const char* label)
+{
+    return profiler->taken[sym_table_get(program->symbols, label)];
+}
+
+int main(void)
+{
+    struct program program;
+    if(test_assemble(program_text, &program) != 0)
+        return 1;
+
+    struct virtual_machine vm;
+    test_init_vm(program, VM_ENGINE_HANDLERS, &vm);
+    struct profiler profiler;
+    CHECK(profiler_init(&profiler, &vm) == 0);
+    CHECK(vm_run(&vm) == 1);
+    CHECK(vm.regs[2] == TEST_LOOPS);
+    CHECK(vm.regs[5] == TEST_LOOPS * TEST_LENGTH);
+
+    uint32_t chunks = (TEST_LENGTH + VM_VECTOR_CHUNK - 1) / VM_VECTOR_CHUNK;
+    CHECK(label_count(&profiler, &program, "LOOP") == TEST_LOOPS);
+    CHECK(label_count(&profiler, &program, "VEC") == TEST_LOOPS * chunks);
+    CHECK(label_count(&profiler, &program, "BRANCH") == TEST_LOOPS);
+    CHECK(label_count(&profiler, &program, "JUMP") == 1);
+    CHECK(label_count(&profiler, &program, "SKIPPED") == 0);
+    CHECK(label_count(&profiler, &program, "END") == 1);
+
+    // The loop jumps back every time but the last. Only conditional jumps count as taken.
+    CHECK(label_taken(&profiler, &program, "BRANCH") == TEST_LOOPS - 1);
+    CHECK(label_taken(&profiler, &program, "VEC") == 0);
+    CHECK(label_taken(&profiler, &program, "JUMP") == 0);
+
+    uint64_t total = 0;
+    for(uint32_t addr = 0; addr < profiler.mem_sz; ++addr)
+        total += profiler.counts[addr];
+    CHECK(total == vm.retired);
+    CHECK(profiler.opcode_counts[OPCODE_JP] == TEST_LOOPS);
+    CHECK(profiler.opcode_counts[OPCODE_VSUM] == TEST_LOOPS * chunks);
+
+    profiler_free(&profiler);
+    vm_finalize(&vm);
+    test_program_free(&program);
+    return test_failures != 0;
+}
@@ -0,0 +1,152 @@
+// Checks that scheduler runs every submitted machine to the end exactly once, preempts machines that never end so
+// that others still make progress, stops machines at their limits, and that idle workers steal machines.
+#include <stdatomic.h>
+
+#include "scheduler.h"
+#include "test.h"
+
+#define TEST_SLICE 1000
+#define TEST_MACHINES 200
+#define TEST_WORKERS 4
+#define TEST_LONG 300000    // Loop count of every TEST_WORKERS-th machine, which all land in the first worker's queue.
+#define TEST_STEPS 12345
+
+// Adds 3 to r2 r5 times.
+static const char counting[] =
+    "    LR 1, 5\n"
+    "    LI 2, 0\n"
+    "LOOP AI 2, 3\n"
+    "    SI 1, 1\n"
+    "    JP LOOP\n";
+
+// Jumps past the program, which fails.
+static const char failing[] =
+    "    LI 1, 1\n"
+    "    MI 1, 30000\n"
+    "    J 0(1)\n";
+
+static const char endless[] =
+    "LOOP J LOOP\n";
+
+struct test_machine
+{
+    struct virtual_machine vm;
+    atomic_int calls;       // Number of times callback was called for machine.
+    int exit_code;
+    int order;              // Number of machines whose callback was called before this one.
+};
+
+static atomic_int finished;
+
+static void machine_done(struct virtual_machine* vm, int exit_code, void* user_data)
+{
+    struct test_machine* machine = user_data;
+    CHECK(vm == &machine->vm);
+    machine->exit_code = exit_code;
+    machine->order = atomic_fetch_add(&finished, 1);
+    atomic_fetch_add(&machine->calls, 1);
+}
+
+static void init_machine(struct test_machine* machine, const struct program* program, int32_t count)
+{
+    test_init_vm(*program, VM_ENGINE_THREADED, &machine->vm);
+    machine->vm.regs[5] = count;
+    atomic_init(&machine->calls, 0);
+    machine->exit_code = -1;
+    machine->order = -1;
+}
+
+// Runs many machines of different lengths on several workers, the longest ones all queued by the same worker.
+static void test_many_machines(const struct program* program)
+{
+    static struct test_machine machines[TEST_MACHINES];
+    atomic_store(&finished, 0);
+
+    struct scheduler* scheduler = scheduler_create(TEST_WORKERS, TEST_SLICE);
+    CHECK(scheduler != NULL);
+    if(scheduler == NULL)
+        return;
+
+    for(uint32_t i = 0; i < TEST_MACHINES; ++i)
+    {
+        init_machine(&machines[i], program, i % TEST_WORKERS == 0 ? TEST_LONG : (int32_t) i + 1);
+        CHECK(scheduler_submit(scheduler, &machines[i].vm, 0, 0, machine_done, &machines[i]) == 0);
+    }
+
+    scheduler_wait(scheduler);
+    CHECK(atomic_load(&finished) == TEST_MACHINES);
+    CHECK(scheduler_stolen(scheduler) > 0);
+    scheduler_destroy(scheduler);
+
+    for(uint32_t i = 0; i < TEST_MACHINES; ++i)
+    {
+        struct test_machine* machine = &machines[i];
+        CHECK(atomic_load(&machine->calls) == 1);
+        CHECK(machine->exit_code == 1);
+        CHECK(machine->vm.regs[2] == 3 * machine->vm.regs[5]);
+        vm_finalize(&machine->vm);
+    }
+}
+
+// Runs machines that never end on a single worker, submitted before machines that do. Those finish first, while
+// endless ones are stopped by their step and time limits.
+static void test_preemption(const struct program* program, const struct program* endless_program,
+    const struct program* failing_program)
+{
+    static struct test_machine machines[TEST_MACHINES];
+    atomic_store(&finished, 0);
+
+    struct scheduler* scheduler = scheduler_create(1, TEST_SLICE);
+    CHECK(scheduler != NULL);
+    if(scheduler == NULL)
+        return;
+
+    init_machine(&machines[0], endless_program, 0);
+    init_machine(&machines[1], endless_program, 0);
+    init_machine(&machines[2], failing_program, 0);
+    CHECK(scheduler_submit(scheduler, &machines[0].vm, 0, 0.2, machine_done, &machines[0]) == 0);
+    CHECK(scheduler_submit(scheduler, &machines[1].vm, TEST_STEPS, 0, machine_done, &machines[1]) == 0);
+    CHECK(scheduler_submit(scheduler, &machines[2].vm, 0, 0, machine_done, &machines[2]) == 0);
+    for(uint32_t i = 3; i < TEST_MACHINES; ++i)
+    {
+        init_machine(&machines[i], program, (int32_t) i);
+        CHECK(scheduler_submit(scheduler, &machines[i].vm, 0, 0, machine_done, &machines[i]) == 0);
+    }
+
+    scheduler_destroy(scheduler);
+    CHECK(atomic_load(&finished) == TEST_MACHINES);
+
+    CHECK(machines[0].exit_code == 0);
+    CHECK(machines[0].order == TEST_MACHINES - 1);
+    CHECK(machines[1].exit_code == 0);
+    CHECK(machines[1].vm.retired == TEST_STEPS);
+    CHECK(machines[2].exit_code == 2);
+
+    for(uint32_t i = 0; i < TEST_MACHINES; ++i)
+    {
+        struct test_machine* machine = &machines[i];
+        CHECK(atomic_load(&machine->calls) == 1);
+        if(i >= 3)
+        {
+            CHECK(machine->exit_code == 1);
+            CHECK(machine->vm.regs[2] == 3 * (int32_t) i);
+        }
+        vm_finalize(&machine->vm);
+    }
+}
+
+int main(void)
+{
+    struct program program, endless_program, failing_program;
+    if(test_assemble(counting, &program) != 0 || test_assemble(endless, &endless_program) != 0
+        || test_assemble(failing, &failing_program) != 0)
+        return 1;
+
+    test_many_machines(&program);
+    test_preemption(&program, &endless_program, &failing_program);
+
+    test_program_free(&failing_program);
+    test_program_free(&endless_program);
+    test_program_free(&program);
+    return test_failures != 0;
+}
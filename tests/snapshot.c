@@ -0,0 +1,170 @@
+// Checks that machines forked from snapshot and restored to it carry on exactly like the machine it was taken of,
+// and that copy-on-write keeps their memory, paged memory and registers apart.
+#include "profiler.h"
+#include "snapshot.h"
+#include "test.h"
+
+#define TEST_STEPS 40       // Instructions executed before snapshot is taken, partway through the loop.
+#define TEST_WORDS 20       // Words the loop stores into the program and past it.
+#define TEST_PAGED 90000    // Address of the first word stored past the program.
+#define TEST_STRIDE 4100    // Distance between words stored past the program, each lands in another page.
+
+// Stores counter into array inside the program and into pages past it, counting down from TEST_WORDS.
+static const char program_text[] =
+    "N DC INTEGER(20)\n"
+    "ARR DS 20*INTEGER\n"
+    "    L 1, N\n"
+    "    LA 2, ARR\n"
+    "    LI 3, 1\n"
+    "    MI 3, 30000\n"
+    "    MI 3, 3\n"
+    "LOOP ST 1, 0(2)\n"
+    "    ST 1, 0(3)\n"
+    "    AI 2, 4\n"
+    "    AI 3, 4100\n"
+    "    SI 1, 1\n"
+    "    JP LOOP\n";
+
+// Reads words the loop stores past the program.
+static void read_paged(const struct virtual_machine* vm, int32_t* words)
+{
+    for(uint32_t i = 0; i < TEST_WORDS; ++i)
+        words[i] = vm_read_memory(vm, TEST_PAGED + i * TEST_STRIDE);
+}
+
+// Checks that machine holds given state and paged words, without running it.
+static void check_state(const struct virtual_machine* vm, const struct test_state* state, const int32_t* words)
+{
+    struct test_state actual;
+    test_vm_state(vm, state->exit_code, &actual);
+    CHECK(test_same_state(state, &actual));
+    test_state_free(&actual);
+
+    int32_t paged[TEST_WORDS];
+    read_paged(vm, paged);
+    CHECK(memcmp(paged, words, sizeof(paged)) == 0);
+}
+
+// Runs machine until it exits and checks that it ends like uninterrupted run did.
+static void check_finishes(struct virtual_machine* vm, const struct test_state* expected)
+{
+    int32_t words[TEST_WORDS];
+    for(uint32_t i = 0; i < TEST_WORDS; ++i)
+        words[i] = TEST_WORDS - (int32_t) i;
+
+    vm_run(vm);
+    check_state(vm, expected, words);
+}
+
+static void test_snapshot(const struct program* program, enum vm_engine engine)
+{
+    struct test_state expected;
+    test_run_vm(*program, engine, false, NULL, &expected);
+    CHECK(expected.exit_code == 1);
+
+    struct virtual_machine vm;
+    test_init_vm(*program, engine, &vm);
+    CHECK(vm_forward(&vm, TEST_STEPS) == 0);
+
+    struct test_state taken;
+    int32_t taken_words[TEST_WORDS];
+    test_vm_state(&vm, 0, &taken);
+    read_paged(&vm, taken_words);
+    CHECK(taken_words[0] == TEST_WORDS && taken_words[TEST_WORDS - 1] == 0);
+
+    struct snapshot snapshot;
+    if(snapshot_take(&vm, &snapshot) != 0)
+    {
+        fprintf(stderr, "snapshot_take failed\n");
+        exit(1);
+    }
+
+    // The first fork runs to the end, the second one must not see any of its writes.
+    struct virtual_machine first, second;
+    CHECK(snapshot_fork(&snapshot, &first) == 0);
+    CHECK(snapshot_fork(&snapshot, &second) == 0);
+    check_state(&first, &taken, taken_words);
+    check_finishes(&first, &expected);
+    check_state(&second, &taken, taken_words);
+    check_state(&vm, &taken, taken_words);
+
+    // Neither does the second fork see writes of the machine snapshot was taken of, nor the other way round.
+    check_finishes(&vm, &expected);
+    check_state(&second, &taken, taken_words);
+    second.regs[1] = 1000;
+    CHECK(vm_write_memory(&second, TEST_PAGED, 1000));
+    CHECK(vm.regs[1] == expected.regs[1]);
+    CHECK(vm_read_memory(&vm, TEST_PAGED) == TEST_WORDS);
+
+    // Restoring brings back memory, pages and registers changed since snapshot, also in machine that was restored
+    // before and maps snapshot already.
+    for(int i = 0; i < 2; ++i)
+    {
+        CHECK(snapshot_restore(&snapshot, &vm) == 0);
+        check_state(&vm, &taken, taken_words);
+        check_finishes(&vm, &expected);
+    }
+
+    CHECK(snapshot_restore(&snapshot, &second) == 0);
+    check_state(&second, &taken, taken_words);
+    check_finishes(&second, &expected);
+
+    vm_finalize(&second);
+    vm_finalize(&first);
+    snapshot_free(&snapshot);
+    vm_finalize(&vm);
+    test_state_free(&taken);
+    test_state_free(&expected);
+}
+
+// Sums execution counts of all instructions.
+static uint64_t profiled(const struct profiler* profiler)
+{
+    uint64_t total = 0;
+    for(uint32_t addr = 0; addr < profiler->mem_sz; ++addr)
+        total += profiler->counts[addr];
+
+    return total;
+}
+
+// Profiler belongs to the machine it was attached to, forks mustn't run through it nor count into it.
+static void test_profiler_not_shared(const struct program* program)
+{
+    struct virtual_machine vm;
+    test_init_vm(*program, VM_ENGINE_HANDLERS, &vm);
+
+    struct profiler profiler;
+    CHECK(profiler_init(&profiler, &vm) == 0);
+    CHECK(vm_forward(&vm, TEST_STEPS) == 0);
+    CHECK(profiled(&profiler) == TEST_STEPS);
+
+    struct snapshot snapshot;
+    CHECK(snapshot_take(&vm, &snapshot) == 0);
+    CHECK(snapshot.vm.profiler == NULL);
+
+    struct virtual_machine fork;
+    CHECK(snapshot_fork(&snapshot, &fork) == 0);
+    CHECK(fork.profiler == NULL);
+    CHECK(vm_run(&fork) == 1);
+    CHECK(profiled(&profiler) == TEST_STEPS);
+
+    vm_finalize(&fork);
+    snapshot_free(&snapshot);
+    profiler_free(&profiler);
+    vm_finalize(&vm);
+}
+
+int main(void)
+{
+    struct program program;
+    if(test_assemble(program_text, &program) != 0)
+        return 1;
+
+    static const enum vm_engine engines[] = {VM_ENGINE_HANDLERS, VM_ENGINE_THREADED, VM_ENGINE_JIT};
+    for(uint32_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+        test_snapshot(&program, engines[i]);
+    test_profiler_not_shared(&program);
+
+    test_program_free(&program);
+    return test_failures != 0;
+}
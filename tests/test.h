@@ -0,0 +1,166 @@
+#pragma once
+
+// Helpers shared by tests. Each test is its own executable, which prints failed checks and exits with non-zero code
+// if there were any.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "batch_vm.h"
+#include "source_file.h"
+#include "virtual_machine.h"
+
+static int test_failures = 0;
+
+// Reports failed condition with its location, test carries on with the following checks.
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++test_failures; \
+        } \
+    } while(0)
+
+// Final state of one program instance, as left by any engine.
+struct test_state
+{
+    int exit_code;
+    uint32_t pc;
+    int32_t regs[16];
+    int32_t flags;
+    uint8_t* memory;    // Copy of memory holding the program's image, freed with test_state_free.
+    uint32_t mem_sz;
+};
+
+// Assembles source given as string. Returns 0 on success, just like hasm_assemble_source.
+static inline int test_assemble(const char* text, struct program* program)
+{
+    struct source_file file = {.data = text, .size = strlen(text), .mapped = false};
+    struct asm_location location;
+    int result = hasm_assemble_source(&file, program, &location, 1);
+    if(result != 0)
+        fprintf(stderr, "assembling failed at line %u:%u\n", location.line, location.column);
+
+    return result;
+}
+
+// Releases program assembled by test_assemble.
+static inline void test_program_free(struct program* program)
+{
+    free(program->mem_ptr);
+    source_code_free(&program->source);
+    sym_table_free(&program->symbols);
+    program->mem_ptr = NULL;
+}
+
+// Copies state of virtual machine, which exited with given code.
+static inline void test_vm_state(const struct virtual_machine* vm, int exit_code, struct test_state* state)
+{
+    state->exit_code = exit_code;
+    state->pc = vm->pc;
+    memcpy(state->regs, vm->regs, sizeof(state->regs));
+    state->flags = vm_get_flags(vm);
+    state->mem_sz = vm->mem_sz;
+    state->memory = malloc(vm->mem_sz);
+    memcpy(state->memory, vm->memory, vm->mem_sz);
+}
+
+// Initializes virtual machine with its own copy of program's memory, so that program itself isn't modified.
+static inline void test_init_vm(struct program program, enum vm_engine engine, struct virtual_machine* vm)
+{
+    uint8_t* memory = malloc(program.mem_sz);
+    memcpy(memory, program.mem_ptr, program.mem_sz);
+    program.mem_ptr = memory;
+
+    if(vm_init_engine(program, vm, engine) != 0)
+    {
+        fprintf(stderr, "vm_init_engine failed\n");
+        exit(1);
+    }
+}
+
+// Runs program on given engine until it exits, with verifier or without it (as --no-verify does). Registers are set
+// from init_regs, unless it's NULL.
+static inline void test_run_vm(struct program program, enum vm_engine engine, bool verify, const int32_t* init_regs,
+    struct test_state* state)
+{
+    struct virtual_machine vm;
+    test_init_vm(program, engine, &vm);
+
+    if(init_regs != NULL)
+        memcpy(vm.regs, init_regs, sizeof(state->regs));
+    if(verify)
+        vm_verify(&vm);
+
+    test_vm_state(&vm, vm_run(&vm), state);
+    vm_finalize(&vm);
+}
+
+// Copies final state of given lane of batch.
+static inline void test_lane_state(struct batch_vm* batch, uint32_t lane, struct test_state* state)
+{
+    state->exit_code = batch->exit_codes[lane];
+    state->pc = batch->pc[lane];
+    for(uint8_t reg = 0; reg < 16; ++reg)
+        state->regs[reg] = batch_get_reg(batch, lane, reg);
+    state->flags = batch_get_flags(batch, lane);
+    state->mem_sz = batch->mem_sz;
+    state->memory = malloc(batch->mem_sz);
+    memcpy(state->memory, batch_lane_memory(batch, lane), batch->mem_sz);
+}
+
+static inline void test_state_free(struct test_state* state)
+{
+    free(state->memory);
+    state->memory = NULL;
+}
+
+// Checks that two runs ended the same way. Returns whether they did, so that caller can tell which run differed.
+static inline bool test_same_state(const struct test_state* a, const struct test_state* b)
+{
+    bool same = a->exit_code == b->exit_code && a->pc == b->pc && a->flags == b->flags
+        && memcmp(a->regs, b->regs, sizeof(a->regs)) == 0 && a->mem_sz == b->mem_sz
+        && memcmp(a->memory, b->memory, a->mem_sz) == 0;
+    if(!same)
+        fprintf(stderr, "states differ: exit code %d vs %d, pc %u vs %u, flags %d vs %d\n", a->exit_code, b->exit_code,
+            a->pc, b->pc, a->flags, b->flags);
+
+    return same;
+}
+
+static inline void test_check_same_symbols(const struct sym_table* a, const struct sym_table* b)
+{
+    CHECK(sym_table_size(a) == sym_table_size(b));
+    for(uint32_t i = 0; i < sym_table_size(a) && i < sym_table_size(b); ++i)
+    {
+        const struct symbol* x = sym_table_at(a, i);
+        const struct symbol* y = sym_table_at(b, i);
+        CHECK(strcmp(x->name, y->name) == 0);
+        CHECK(x->addr == y->addr);
+    }
+}
+
+static inline void test_check_same_source(const struct source_code* a, const struct source_code* b)
+{
+    CHECK(source_code_size(a) == source_code_size(b));
+    for(uint32_t i = 0; i < source_code_size(a) && i < source_code_size(b); ++i)
+    {
+        const struct source_line* x = source_code_line(a, i);
+        const struct source_line* y = source_code_line(b, i);
+        CHECK(strcmp(source_code_text(a, i), source_code_text(b, i)) == 0);
+        CHECK(x->addr == y->addr);
+        CHECK(x->empty == y->empty);
+    }
+}
+
+// Checks that both programs have the same memory, symbols and source lines.
+static inline void test_check_same_program(const struct program* a, const struct program* b)
+{
+    CHECK(a->mem_sz == b->mem_sz);
+    CHECK(a->entry_addr == b->entry_addr);
+    CHECK(a->mem_sz == b->mem_sz && memcmp(a->mem_ptr, b->mem_ptr, a->mem_sz) == 0);
+    test_check_same_symbols(a->symbols, b->symbols);
+    test_check_same_source(a->source, b->source);
+}
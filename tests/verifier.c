@@ -0,0 +1,142 @@
+// Checks which instructions verifier proves safe and which constants it folds, that accesses it can't prove stay
+// inside memory still fail, and that program modifying its own code drops verifier's proofs.
+#include "test.h"
+#include "verifier.h"
+
+// Loads constant, stores it next to it and adds it back, skipping over NOP that is never reached.
+static const char known[] =
+    "N DC INTEGER(10)\n"
+    "X DS INTEGER\n"
+    "LOAD L 1, N\n"
+    "STORE ST 1, X\n"
+    "ADD A 1, X\n"
+    "JUMP J END\n"
+    "SKIPPED NOP\n"
+    "END LR 2, 1\n";
+
+// Stores, loads and jumps past the program, through register verifier knows the value of. Memory past the program
+// is paged, only the jump fails.
+static const char outside[] =
+    "    LI 2, 30000\n"
+    "STORE ST 2, 0(2)\n"
+    "LOAD L 1, 0(2)\n"
+    "JUMP J 0(2)\n";
+
+// Overwrites TARGET with ALT through register whose value verifier doesn't track, so the store can't be proved safe.
+static const char modifying[] =
+    "    J START\n"
+    "ALT LI 3, 9\n"
+    "START LI 2, 1\n"
+    "    MR 2, 2\n"
+    "    SI 2, 1\n"
+    "    LA 6, TARGET\n"
+    "    AR 6, 2\n"
+    "    L 5, ALT\n"
+    "PATCH ST 5, 0(6)\n"
+    "TARGET LI 3, 1\n";
+
+static const enum vm_engine engines[] = {VM_ENGINE_HANDLERS, VM_ENGINE_THREADED, VM_ENGINE_JIT};
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+// Runs verifier on program from its entry point with zeroed registers. Returns the same codes as verifier_run.
+static int verify(const struct program* program, uint8_t* flags)
+{
+    int32_t regs[16] = {0};
+    memset(flags, 0, program->mem_sz);
+    return verifier_run(program->mem_ptr, program->mem_sz, program->entry_addr, regs, flags);
+}
+
+static uint8_t label_flags(const struct program* program, const uint8_t* flags, const char* label)
+{
+    return flags[sym_table_get(program->symbols, label)];
+}
+
+static void test_known(const struct program* program)
+{
+    uint8_t flags[program->mem_sz];
+    CHECK(verify(program, flags) == 0);
+
+    CHECK(label_flags(program, flags, "LOAD") == (VERIFIER_CODE | VERIFIER_SAFE | VERIFIER_FOLDED));
+    CHECK(label_flags(program, flags, "STORE") == (VERIFIER_CODE | VERIFIER_SAFE));
+    CHECK(label_flags(program, flags, "ADD") == (VERIFIER_CODE | VERIFIER_SAFE));   // X is written, not folded.
+    CHECK(label_flags(program, flags, "JUMP") == (VERIFIER_CODE | VERIFIER_SAFE));
+    CHECK(label_flags(program, flags, "SKIPPED") == 0);
+    CHECK(label_flags(program, flags, "END") == VERIFIER_CODE);
+
+    uint16_t n = sym_table_get(program->symbols, "N");
+    uint16_t x = sym_table_get(program->symbols, "X");
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        CHECK(flags[n + i] == VERIFIER_CONST);
+        CHECK(flags[x + i] == 0);
+    }
+
+    // Verified machine ends just like one that isn't.
+    for(uint32_t i = 0; i < NUM_ENGINES; ++i)
+    {
+        struct virtual_machine vm;
+        test_init_vm(*program, engines[i], &vm);
+        CHECK(vm_verify(&vm) == 0);
+        CHECK(vm_run(&vm) == 1);
+        CHECK(vm.regs[2] == 20);
+        CHECK(vm.verified != NULL);
+        vm_finalize(&vm);
+    }
+}
+
+static void test_outside(const struct program* program)
+{
+    uint8_t flags[program->mem_sz];
+    CHECK(verify(program, flags) == 0);
+    CHECK(label_flags(program, flags, "STORE") == VERIFIER_CODE);
+    CHECK(label_flags(program, flags, "LOAD") == VERIFIER_CODE);
+    CHECK(label_flags(program, flags, "JUMP") == VERIFIER_CODE);
+
+    for(uint32_t i = 0; i < NUM_ENGINES; ++i)
+    {
+        struct virtual_machine vm;
+        test_init_vm(*program, engines[i], &vm);
+        CHECK(vm_verify(&vm) == 0);
+        CHECK(vm_run(&vm) == 2);
+        CHECK(vm.retired == 3);     // Jump fails and doesn't retire.
+        CHECK(vm.regs[1] == 30000);
+        vm_finalize(&vm);
+    }
+}
+
+static void test_modifying(const struct program* program)
+{
+    uint8_t flags[program->mem_sz];
+    CHECK(verify(program, flags) == 0);
+    CHECK(label_flags(program, flags, "PATCH") == VERIFIER_CODE);
+    CHECK(label_flags(program, flags, "TARGET") == VERIFIER_CODE);
+
+    for(uint32_t i = 0; i < NUM_ENGINES; ++i)
+    {
+        struct virtual_machine vm;
+        test_init_vm(*program, engines[i], &vm);
+        CHECK(vm_verify(&vm) == 0);
+        CHECK(vm.verified != NULL);
+        CHECK(vm_run(&vm) == 1);
+        CHECK(vm.regs[3] == 9);
+        CHECK(vm.verified == NULL);
+        vm_finalize(&vm);
+    }
+}
+
+int main(void)
+{
+    struct program known_program, outside_program, modifying_program;
+    if(test_assemble(known, &known_program) != 0 || test_assemble(outside, &outside_program) != 0
+        || test_assemble(modifying, &modifying_program) != 0)
+        return 1;
+
+    test_known(&known_program);
+    test_outside(&outside_program);
+    test_modifying(&modifying_program);
+
+    test_program_free(&modifying_program);
+    test_program_free(&outside_program);
+    test_program_free(&known_program);
+    return test_failures != 0;
+}